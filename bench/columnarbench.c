@@ -0,0 +1,153 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <time.h>
+#include "../msgpack_columnar.h"
+
+/*
+ * Metrics batches written as an array of maps
+ * (decoded with a projection) and as columnar
+ * batches (decoded into column vectors).
+ */
+
+#define ROWS 1024
+#define BATCHES 1000
+
+typedef struct {
+	uint64_t    ts;
+	mp_strref_t host;
+	mp_strref_t metric;
+	double      value;
+	int64_t     delta;
+} sample;
+
+static const mp_field_t fields[] = {
+	{ "ts", MP_FIELD_UINT64, offsetof(sample, ts) },
+	{ "host", MP_FIELD_STR, offsetof(sample, host) },
+	{ "metric", MP_FIELD_STR, offsetof(sample, metric) },
+	{ "value", MP_FIELD_DOUBLE, offsetof(sample, value) },
+	{ "delta", MP_FIELD_INT64, offsetof(sample, delta) },
+};
+#define NFIELDS 5
+
+static const char *hosts[] = { "web-01", "web-02", "db-01", "cache-01" };
+static const char *metrics[] = { "cpu.user", "cpu.system", "mem.used", "net.rx", "net.tx" };
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static void make_rows(sample *rows) {
+	for (size_t i=0; i<ROWS; ++i) {
+		const char *h = hosts[i % 4], *m = metrics[(i / 4) % 5];
+		rows[i].ts = 1700000000000 + i * 10;
+		rows[i].host.s = h;
+		rows[i].host.sz = (uint32_t)strlen(h);
+		rows[i].metric.s = m;
+		rows[i].metric.sz = (uint32_t)strlen(m);
+		rows[i].value = (double)(i % 100) * 0.25;
+		rows[i].delta = (int64_t)(i % 7) - 3;
+	}
+}
+
+static void write_maps(mp_encoder_t *e, const sample *rows) {
+	int r = mp_write_arraysize(e, ROWS);
+	for (size_t i=0; i<ROWS; ++i) {
+		const sample *s = &rows[i];
+		r |= mp_write_mapsize(e, NFIELDS);
+		r |= mp_write_str(e, "ts", 2);
+		r |= mp_write_uint(e, s->ts);
+		r |= mp_write_str(e, "host", 4);
+		r |= mp_write_str(e, s->host.s, s->host.sz);
+		r |= mp_write_str(e, "metric", 6);
+		r |= mp_write_str(e, s->metric.s, s->metric.sz);
+		r |= mp_write_str(e, "value", 5);
+		r |= mp_write_double(e, s->value);
+		r |= mp_write_str(e, "delta", 5);
+		r |= mp_write_int(e, s->delta);
+	}
+	assert(r == MSGPACK_OK);
+	(void)r;
+}
+
+int main() {
+	static sample rows[ROWS], out[ROWS];
+	static unsigned char buf[1 << 20];
+	static unsigned char wmem[1 << 20], rmem[1 << 20];
+	static mp_column_t wcols[NFIELDS], rcols[NFIELDS];
+	static mp_intern_slot_t slots[16];
+	static char strs[64];
+	mp_encoder_t enc;
+	mp_decoder_t dec;
+	mp_columnar_writer_t w;
+	mp_columnar_reader_t r;
+	mp_projection_t proj;
+	volatile double sink = 0;
+	int err;
+
+	make_rows(rows);
+	err = mp_projection_init(&proj, fields, NFIELDS, slots, 16, strs, sizeof(strs));
+	assert(err == MSGPACK_OK);
+	err = mp_columnar_writer_init(&w, fields, NFIELDS, (1 << 1) | (1 << 2), wcols, ROWS, 16 * ROWS,
+		wmem, sizeof(wmem));
+	assert(err == MSGPACK_OK);
+	err = mp_columnar_reader_init(&r, fields, NFIELDS, rcols, rmem, sizeof(rmem));
+	assert(err == MSGPACK_OK);
+	printf("Running columnar benchmarks (%d batches of %d rows)...\n", BATCHES, ROWS);
+
+	// array of maps
+	size_t size = 0;
+	uint64_t start = now_ns();
+	for (int b=0; b<BATCHES; ++b) {
+		mp_encode_mem_init(&enc, buf, sizeof(buf));
+		write_maps(&enc, rows);
+		size = mp_enc_buffered(&enc);
+	}
+	uint64_t enc_ns = now_ns() - start;
+	start = now_ns();
+	for (int b=0; b<BATCHES; ++b) {
+		uint32_t n;
+		mp_decode_mem_init(&dec, buf, size);
+		err = mp_read_arraysize(&dec, &n);
+		assert(err == MSGPACK_OK && n == ROWS);
+		for (uint32_t i=0; i<n; ++i) {
+			err = mp_decode_project(&dec, &proj, &out[i], NULL);
+			assert(err == MSGPACK_OK);
+		}
+		for (size_t i=0; i<ROWS; ++i)
+			sink += out[i].value;
+	}
+	uint64_t dec_ns = now_ns() - start;
+	printf("maps:     %6d bytes/batch, encode %5.1f us, decode %5.1f us\n", (int)size,
+		(double)enc_ns / BATCHES / 1e3, (double)dec_ns / BATCHES / 1e3);
+
+	// columnar, including copying the rows in and out
+	start = now_ns();
+	for (int b=0; b<BATCHES; ++b) {
+		for (size_t i=0; i<ROWS; ++i) {
+			err = mp_columnar_add(&w, &rows[i]);
+			assert(err == MSGPACK_OK);
+		}
+		mp_encode_mem_init(&enc, buf, sizeof(buf));
+		err = mp_columnar_write(&enc, &w);
+		assert(err == MSGPACK_OK);
+		size = mp_enc_buffered(&enc);
+	}
+	enc_ns = now_ns() - start;
+	start = now_ns();
+	for (int b=0; b<BATCHES; ++b) {
+		mp_decode_mem_init(&dec, buf, size);
+		err = mp_columnar_read(&dec, &r);
+		assert(err == MSGPACK_OK && r.rows == ROWS);
+		for (size_t i=0; i<r.rows; ++i)
+			sink += rcols[3].v.f[i];
+	}
+	dec_ns = now_ns() - start;
+	printf("columnar: %6d bytes/batch, encode %5.1f us, decode %5.1f us\n", (int)size,
+		(double)enc_ns / BATCHES / 1e3, (double)dec_ns / BATCHES / 1e3);
+	(void)err;
+	return 0;
+}
@@ -0,0 +1,103 @@
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "../msgpack_file.h"
+
+/*
+ * Scanning an on-disk archive, either by read()ing
+ * it all into a heap buffer and decoding that, or
+ * through mp_decode_file_init.
+ */
+
+#define RECORDS 2000000
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static ssize_t fd_flush(void *ctx, const void *buf, size_t amt) {
+	return write(*(int*)ctx, buf, amt);
+}
+
+static void decode_all(mp_decoder_t *d, mp_file_t *f) {
+	uint64_t n = 0;
+	while (mp_skip(d) == MSGPACK_OK) {
+		++n;
+		if (f != NULL)
+			mp_decode_file_advance(d, f);
+	}
+	assert(n == RECORDS);
+	(void)n;
+}
+
+int main() {
+	char path[] = "/tmp/msgc-filebench-XXXXXX";
+	int fd = mkstemp(path);
+	int err;
+	assert(fd >= 0);
+
+	unsigned char buf[65536];
+	mp_encoder_t e;
+	mp_encode_stream_init(&e, &fd, fd_flush, buf, sizeof(buf));
+	for (uint64_t i=0; i<RECORDS; ++i) {
+		int r = 0;
+		r |= mp_write_mapsize(&e, 3);
+		r |= mp_write_str(&e, "ts", 2);
+		r |= mp_write_uint(&e, 1500000000000 + i);
+		r |= mp_write_str(&e, "value", 5);
+		r |= mp_write_double(&e, (double)i * 0.5);
+		r |= mp_write_str(&e, "tag", 3);
+		r |= mp_write_str(&e, "sensor-0042", 11);
+		assert(r == MSGPACK_OK);
+		(void)r;
+	}
+	err = mp_flush(&e);
+	assert(err == MSGPACK_OK);
+	close(fd);
+
+	printf("Running mapped file benchmarks (%d records)...\n", RECORDS);
+	mp_decoder_t d;
+
+	uint64_t start = now_ns();
+	{
+		struct stat st;
+		fd = open(path, O_RDONLY);
+		assert(fd >= 0);
+		err = fstat(fd, &st);
+		assert(err == 0);
+		unsigned char *mem = malloc((size_t)st.st_size);
+		assert(mem != NULL);
+		size_t got = 0;
+		while (got < (size_t)st.st_size) {
+			ssize_t n = read(fd, mem + got, (size_t)st.st_size - got);
+			assert(n > 0);
+			got += (size_t)n;
+		}
+		close(fd);
+		mp_decode_mem_init(&d, mem, got);
+		decode_all(&d, NULL);
+		free(mem);
+	}
+	printf("read() into heap: %8.1f ms\n", (double)(now_ns() - start) / 1e6);
+
+	start = now_ns();
+	{
+		mp_file_t f;
+		err = mp_decode_file_init(&d, &f, path);
+		assert(err == MSGPACK_OK);
+		decode_all(&d, &f);
+		mp_decode_file_close(&d, &f);
+	}
+	printf("mapped file:      %8.1f ms\n", (double)(now_ns() - start) / 1e6);
+
+	unlink(path);
+	(void)err;
+	return 0;
+}
@@ -0,0 +1,134 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <time.h>
+#include <stdbool.h>
+#include "../msgpack.h"
+
+/*
+ * Encodes integers whose magnitudes are either
+ * random (one of 64 bit-widths per value) or
+ * all the same, so that width selection is
+ * unpredictable or perfectly predictable, and
+ * then sums encoded arrays of numbers.
+ */
+
+#define NVALS 4096
+#define ROUNDS 5000
+
+#define BUFSIZE (NVALS*9 + MP_MAXSIZE_HDR)
+
+static uint64_t rng = 0x9e3779b97f4a7c15ULL;
+
+// xorshift64*
+static uint64_t rand64(void) {
+	rng ^= rng >> 12;
+	rng ^= rng << 25;
+	rng ^= rng >> 27;
+	return rng * 0x2545f4914f6cdd1dULL;
+}
+
+static double ns_per(clock_t start, clock_t end) {
+	return (double)(end - start) / CLOCKS_PER_SEC * 1e9 / ((double)NVALS * ROUNDS);
+}
+
+static void bench_uint(const char *name, const uint64_t *vals, unsigned char *buf) {
+	mp_encoder_t enc;
+	clock_t start = clock();
+	for (int r=0; r<ROUNDS; ++r) {
+		mp_encode_mem_init(&enc, buf, BUFSIZE);
+		for (int i=0; i<NVALS; ++i)
+			mp_write_uint(&enc, vals[i]);
+	}
+	clock_t end = clock();
+	printf("mp_write_uint (%s): %.2f ns/value, %.2f bytes/value\n",
+		name, ns_per(start, end), (double)enc.off / NVALS);
+}
+
+static void bench_int(const char *name, const int64_t *vals, unsigned char *buf) {
+	mp_encoder_t enc;
+	clock_t start = clock();
+	for (int r=0; r<ROUNDS; ++r) {
+		mp_encode_mem_init(&enc, buf, BUFSIZE);
+		for (int i=0; i<NVALS; ++i)
+			mp_write_int(&enc, vals[i]);
+	}
+	clock_t end = clock();
+	printf("mp_write_int (%s): %.2f ns/value, %.2f bytes/value\n",
+		name, ns_per(start, end), (double)enc.off / NVALS);
+}
+
+// per-element reads vs. mp_array_agg over the same array
+static void bench_agg(const char *name, unsigned char *buf, size_t len, bool dbl) {
+	mp_decoder_t dec;
+	mp_agg_t agg;
+	double check = 0;
+	clock_t start = clock();
+	for (int r=0; r<ROUNDS; ++r) {
+		uint32_t n;
+		double sum = 0;
+		mp_decode_mem_init(&dec, buf, len);
+		mp_read_arraysize(&dec, &n);
+		for (uint32_t i=0; i<n; ++i) {
+			if (dbl) {
+				double f;
+				mp_read_double(&dec, &f);
+				sum += f;
+			} else {
+				int64_t v;
+				mp_read_int(&dec, &v);
+				sum += (double)v;
+			}
+		}
+		check = sum;
+	}
+	clock_t end = clock();
+	printf("sum %s (mp_read_*): %.2f ns/value\n", name, ns_per(start, end));
+
+	start = clock();
+	for (int r=0; r<ROUNDS; ++r) {
+		mp_agg_init(&agg);
+		mp_decode_mem_init(&dec, buf, len);
+		mp_array_agg(&dec, &agg);
+	}
+	end = clock();
+	assert(agg.count == NVALS && agg.sum == check);
+	printf("sum %s (mp_array_agg): %.2f ns/value\n", name, ns_per(start, end));
+}
+
+int main() {
+	printf("Running integer benchmarks...\n");
+	static unsigned char buf[BUFSIZE];
+	static uint64_t uvals[NVALS];
+	static int64_t ivals[NVALS];
+
+	for (int i=0; i<NVALS; ++i) {
+		uvals[i] = rand64() >> (rand64() % 64);
+		ivals[i] = (int64_t)uvals[i] >> 1;
+		if (rand64() & 1)
+			ivals[i] = -ivals[i];
+	}
+	bench_uint("random", uvals, buf);
+	bench_int("random", ivals, buf);
+
+	for (int i=0; i<NVALS; ++i) {
+		uvals[i] = 300;
+		ivals[i] = -300;
+	}
+	bench_uint("fixed", uvals, buf);
+	bench_int("fixed", ivals, buf);
+
+	mp_encoder_t enc;
+	mp_encode_mem_init(&enc, buf, BUFSIZE);
+	mp_write_arraysize(&enc, NVALS);
+	for (int i=0; i<NVALS; ++i)
+		mp_write_int(&enc, (int64_t)(rand64() % 160) - 32);
+	bench_agg("fixints", buf, enc.off, false);
+
+	mp_encode_mem_init(&enc, buf, BUFSIZE);
+	mp_write_arraysize(&enc, NVALS);
+	for (int i=0; i<NVALS; ++i)
+		mp_write_double(&enc, (double)(rand64() % 1000) / 8);
+	bench_agg("doubles", buf, enc.off, true);
+	return 0;
+}
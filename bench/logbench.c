@@ -0,0 +1,95 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <time.h>
+#include <unistd.h>
+#include "../msgpack_log.h"
+
+/*
+ * Finding random records in a big record log,
+ * through the block index or by skipping from
+ * the start of the file.
+ */
+
+#define RECORDS 1000000
+#define MAXBLOCKS 8192
+#define LOOKUPS 1000
+#define SCANS 20
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static ssize_t fd_flush(void *ctx, const void *buf, size_t amt) {
+	return write(*(int*)ctx, buf, amt);
+}
+
+static ssize_t fd_fill(void *ctx, void *buf, size_t max) {
+	return read(*(int*)ctx, buf, max);
+}
+
+int main() {
+	static mp_log_block_t blocks[MAXBLOCKS];
+	static unsigned char buf[65536];
+	char path[] = "/tmp/msgc-logbench-XXXXXX";
+	int fd = mkstemp(path);
+	int err;
+	assert(fd >= 0);
+	unlink(path);
+
+	mp_log_writer_t w;
+	mp_log_writer_init(&w, &fd, fd_flush, buf, sizeof(buf), blocks, MAXBLOCKS, 16384);
+	for (uint64_t i=0; i<RECORDS; ++i) {
+		int r = 0;
+		r |= mp_write_mapsize(&w.enc, 2);
+		r |= mp_write_str(&w.enc, "seq", 3);
+		r |= mp_write_uint(&w.enc, i);
+		r |= mp_write_str(&w.enc, "msg", 3);
+		r |= mp_write_str(&w.enc, "request handled", 15);
+		assert(r == MSGPACK_OK);
+		(void)r;
+		mp_log_commit(&w);
+	}
+	err = mp_log_writer_finish(&w);
+	assert(err == MSGPACK_OK);
+
+	mp_log_reader_t rd;
+	err = mp_log_reader_init(&rd, fd, blocks, MAXBLOCKS);
+	assert(err == MSGPACK_OK);
+	printf("Running log benchmarks (%d records, %d blocks)...\n", RECORDS, (int)rd.nblocks);
+
+	srand(1);
+	uint64_t start = now_ns();
+	for (int i=0; i<LOOKUPS; ++i) {
+		uint64_t n = (uint64_t)rand() % RECORDS;
+		mp_log_range_t rg;
+		mp_decoder_t d;
+		err = mp_log_seek(&rd, n, &rg, &d, buf, 4096);
+		assert(err == MSGPACK_OK);
+		err = mp_skip(&d);
+		assert(err == MSGPACK_OK);
+	}
+	printf("indexed seek:    %10.1f us/lookup\n", (double)(now_ns() - start) / 1e3 / LOOKUPS);
+
+	start = now_ns();
+	for (int i=0; i<SCANS; ++i) {
+		uint64_t n = (uint64_t)rand() % RECORDS;
+		mp_decoder_t d;
+		off_t off = lseek(fd, 0, SEEK_SET);
+		assert(off == 0);
+		(void)off;
+		mp_decode_stream_init(&d, &fd, fd_fill, buf, sizeof(buf));
+		for (uint64_t j=0; j<=n; ++j) {
+			err = mp_skip(&d);
+			assert(err == MSGPACK_OK);
+		}
+	}
+	printf("skip from start: %10.1f us/lookup\n", (double)(now_ns() - start) / 1e3 / SCANS);
+
+	close(fd);
+	(void)err;
+	return 0;
+}
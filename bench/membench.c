@@ -1,6 +1,8 @@
 #include <stdio.h>
 #include <assert.h>
 #include <time.h>
+#include <string.h>
+#include <stddef.h>
 #include "../msgpack.h"
 
 #define MILLION 1000000
@@ -12,6 +14,22 @@
 #define write_strlit(e, str) mp_write_str(e, str, sizeof(str)-1)
 #define write_binlit(e, str) mp_write_bin(e, str, sizeof(str)-1)
 
+static const mp_key_t field_label_one = MP_KEY("field_label_one");
+static const mp_key_t a_float = MP_KEY("a_float");
+static const mp_key_t an_integer = MP_KEY("an_integer");
+static const mp_key_t some_binary = MP_KEY("some_binary");
+static const mp_key_t fieldfive = MP_KEY("fieldfive");
+
+typedef struct {
+	int64_t  an_integer;
+	uint64_t fieldfive;
+} projected;
+
+static const mp_field_t projected_fields[] = {
+	{ "an_integer", MP_FIELD_INT64, offsetof(projected, an_integer) },
+	{ "fieldfive", MP_FIELD_UINT64, offsetof(projected, fieldfive) },
+};
+
 #define readstr(d) mp_read_strsize(d, &sz); mp_read(d, scratch, (size_t)sz)
 
 int main() {
@@ -41,9 +59,126 @@ int main() {
 	double mbps = (double)(((bytes*ITERS)/(end-start))*(CLOCKS_PER_SEC/MILLION));
 	printf("Encode: %g MB/sec\n", mbps);
 
+	// same body, with pre-encoded keys
+	unsigned char kbuf[BUFSIZE];
+	start = clock();
+	for(int i=0; i<ITERS; ++i) {
+		mp_encode_mem_init(&enc, kbuf, BUFSIZE);
+		mp_write_mapsize(&enc, 5);
+		mp_write_key(&enc, &field_label_one);
+		write_strlit(&enc, "field_body_one");
+		mp_write_key(&enc, &a_float);
+		mp_write_double(&enc, 3.14);
+		mp_write_key(&enc, &an_integer);
+		mp_write_int(&enc, 348);
+		mp_write_key(&enc, &some_binary);
+		write_binlit(&enc, "thisissomeopaquebinary");
+		mp_write_key(&enc, &fieldfive);
+		mp_write_uint(&enc, 5);
+	}
+	end = clock();
+	assert(enc.off == bytes && memcmp(buf, kbuf, bytes) == 0);
+	mbps = (double)(((bytes*ITERS)/(end-start))*(CLOCKS_PER_SEC/MILLION));
+	printf("Encode (mp_key_t): %g MB/sec\n", mbps);
+
+	// same body, with one bounds check
+	start = clock();
+	for(int i=0; i<ITERS; ++i) {
+		unsigned char *p;
+		mp_encode_mem_init(&enc, kbuf, BUFSIZE);
+		size_t n = mp_sizeof_mapsize(5) + 
+			mp_sizeof_key(&field_label_one) + mp_sizeof_str(sizeof("field_body_one")-1) +
+			mp_sizeof_key(&a_float) + mp_sizeof_double() +
+			mp_sizeof_key(&an_integer) + mp_sizeof_int(348) +
+			mp_sizeof_key(&some_binary) + mp_sizeof_bin(sizeof("thisissomeopaquebinary")-1) +
+			mp_sizeof_key(&fieldfive) + mp_sizeof_uint(5);
+		if (mp_reserve(&enc, n, &p) != MSGPACK_OK)
+			break;
+		p = mp_put_mapsize(p, 5);
+		p = mp_put_key(p, &field_label_one);
+		p = mp_put_str(p, "field_body_one", sizeof("field_body_one")-1);
+		p = mp_put_key(p, &a_float);
+		p = mp_put_double(p, 3.14);
+		p = mp_put_key(p, &an_integer);
+		p = mp_put_int(p, 348);
+		p = mp_put_key(p, &some_binary);
+		p = mp_put_bin(p, "thisissomeopaquebinary", sizeof("thisissomeopaquebinary")-1);
+		p = mp_put_key(p, &fieldfive);
+		p = mp_put_uint(p, 5);
+		mp_commit(&enc, p);
+	}
+	end = clock();
+	assert(enc.off == bytes && memcmp(buf, kbuf, bytes) == 0);
+	mbps = (double)(((bytes*ITERS)/(end-start))*(CLOCKS_PER_SEC/MILLION));
+	printf("Encode (mp_reserve): %g MB/sec\n", mbps);
+
+	// same body, stamped out of a template
+	mp_template_t tpl;
+	mp_slot_t slots[3];
+	unsigned char skel[BUFSIZE];
+	mp_template_begin(&tpl, skel, BUFSIZE, slots, 3);
+	mp_encoder_t *te = mp_template_encoder(&tpl);
+	mp_write_mapsize(te, 5);
+	mp_write_key(te, &field_label_one);
+	write_strlit(te, "field_body_one");
+	mp_write_key(te, &a_float);
+	mp_template_double(&tpl);
+	mp_write_key(te, &an_integer);
+	mp_template_int64(&tpl);
+	mp_write_key(te, &some_binary);
+	write_binlit(te, "thisissomeopaquebinary");
+	mp_write_key(te, &fieldfive);
+	mp_template_uint32(&tpl);
+	mp_slot_val_t vals[3];
+	mp_encoder_t tenc;
+	start = clock();
+	for(int i=0; i<ITERS; ++i) {
+		mp_encode_mem_init(&tenc, kbuf, BUFSIZE);
+		vals[0].f = 3.14;
+		vals[1].i = 348;
+		vals[2].u = 5;
+		mp_template_emit(&tenc, &tpl, vals);
+	}
+	end = clock();
+	size_t tbytes = tenc.off; // wider than the body above
+	mbps = (double)(((tbytes*ITERS)/(end-start))*(CLOCKS_PER_SEC/MILLION));
+	printf("Encode (template): %g MB/sec\n", mbps);
+	{
+		// the same fields, in fixed-width encodings
+		uint32_t n;
+		double f;
+		int64_t ix;
+		uint64_t u;
+		const char *tags[] = { "field_label_one", "field_body_one", "a_float" };
+		mp_decode_mem_init(&dec, kbuf, tbytes);
+		mp_read_mapsize(&dec, &n);
+		assert(n == 5);
+		for (int j=0; j<3; ++j) {
+			char str[16];
+			mp_read_strsize(&dec, &n);
+			assert(n == strlen(tags[j]));
+			mp_read(&dec, str, n);
+			assert(memcmp(str, tags[j], n) == 0);
+		}
+		mp_read_double(&dec, &f);
+		assert(f == 3.14);
+		mp_skip(&dec);
+		mp_read_int(&dec, &ix);
+		assert(ix == 348);
+		mp_skip(&dec);
+		mp_skip(&dec);
+		mp_skip(&dec);
+		mp_read_uint(&dec, &u);
+		assert(u == 5 && dec.off == tbytes);
+		(void)tags;
+		(void)f;
+		(void)ix;
+		(void)u;
+	}
+
 	// validation of the encoded body
 	start = clock();
-	size_t blen = enc.off;
+	size_t blen = bytes;
 	for(int i=0; i<ITERS; ++i) {
 		mp_decode_mem_init(&dec, buf, blen);
 		mp_skip(&dec);
@@ -56,7 +191,7 @@ int main() {
 	uint32_t sz;
 	char scratch[256]; // for string
 	for(int i=0; i<ITERS; ++i) {
-		mp_decode_mem_init(&dec, buf, enc.off);
+		mp_decode_mem_init(&dec, buf, bytes);
 		mp_read_mapsize(&dec, &sz);
 		assert(sz == 5);
 		readstr(&dec);
@@ -79,6 +214,130 @@ int main() {
 	end = clock();
 	mbps = (double)(((bytes*ITERS)/(end-start))*(CLOCKS_PER_SEC/MILLION));
 	printf("Decode: %g MB/sec\n", mbps);
+
+	// same body, with the numeric fields read as "any number"
+	start = clock();
+	for(int i=0; i<ITERS; ++i) {
+		mp_value_t v;
+		mp_decode_mem_init(&dec, buf, bytes);
+		mp_read_any(&dec, &v);
+		assert(v.type == MSG_MAP && v.v.size == 5);
+		readstr(&dec);
+		readstr(&dec);
+		readstr(&dec);
+		double f;
+		mp_read_number_as_double(&dec, &f);
+		readstr(&dec);
+		int64_t ix;
+		mp_read_number_as_int64(&dec, &ix);
+		assert(ix == 348);
+		readstr(&dec);
+		mp_read_any(&dec, &v);
+		mp_read(&dec, scratch, (size_t)v.v.size);
+		readstr(&dec);
+		mp_read_number_as_int64(&dec, &ix);
+		assert(ix == 5);
+	}
+	end = clock();
+	mbps = (double)(((bytes*ITERS)/(end-start))*(CLOCKS_PER_SEC/MILLION));
+	printf("Decode (mp_read_any): %g MB/sec\n", mbps);
+
+	// two of the five fields, via a projection
+	mp_projection_t proj;
+	mp_intern_slot_t pslots[8];
+	char pstrs[32];
+	mp_projection_init(&proj, projected_fields, 2, pslots, 8, pstrs, sizeof(pstrs));
+	start = clock();
+	for(int i=0; i<ITERS; ++i) {
+		projected out;
+		mp_decode_mem_init(&dec, buf, bytes);
+		mp_decode_project(&dec, &proj, &out, NULL);
+		assert(out.an_integer == 348 && out.fieldfive == 5);
+	}
+	end = clock();
+	mbps = (double)(((bytes*ITERS)/(end-start))*(CLOCKS_PER_SEC/MILLION));
+	printf("Decode (projection): %g MB/sec\n", mbps);
+
+	// predicate on one field, without decoding
+	mp_filter_t flt;
+	mp_filter_init(&flt);
+	mp_filter_int_eq(&flt, "an_integer", 348);
+	start = clock();
+	for(int i=0; i<ITERS; ++i) {
+		const unsigned char *rec;
+		size_t len;
+		mp_decode_mem_init(&dec, buf, bytes);
+		int err = mp_filter_next(&flt, &dec, &rec, &len);
+		assert(err == MSGPACK_OK && len == bytes);
+		(void)err;
+	}
+	end = clock();
+	mbps = (double)(((bytes*ITERS)/(end-start))*(CLOCKS_PER_SEC/MILLION));
+	printf("Filter: %g MB/sec\n", mbps);
+
+	start = clock();
+	for(int i=0; i<ITERS; ++i) {
+		mp_cursor_t cur;
+		mp_cursor_init(&cur, buf, bytes);
+		mp_cursor_skip(&cur);
+	}
+	end = clock();
+	mbps = (double)(((bytes*ITERS)/(end-start))*(CLOCKS_PER_SEC/MILLION));
+	printf("Skip (mp_cursor_t): %g MB/sec\n", mbps);
+
+	start = clock();
+	for(int i=0; i<ITERS; ++i) {
+		mp_cursor_t cur;
+		const char *s;
+		mp_cursor_init(&cur, buf, bytes);
+		mp_cursor_read_mapsize(&cur, &sz);
+		assert(sz == 5);
+		mp_cursor_read_str(&cur, &s, &sz);
+		mp_cursor_read_str(&cur, &s, &sz);
+		mp_cursor_read_str(&cur, &s, &sz);
+		double f;
+		mp_cursor_read_double(&cur, &f);
+		mp_cursor_read_str(&cur, &s, &sz);
+		int64_t ix;
+		mp_cursor_read_int(&cur, &ix);
+		assert(ix == 348);
+		mp_cursor_read_str(&cur, &s, &sz);
+		mp_cursor_read_bin(&cur, &s, &sz);
+		mp_cursor_read_str(&cur, &s, &sz);
+		uint64_t u;
+		mp_cursor_read_uint(&cur, &u);
+		assert(u == 5);
+	}
+	end = clock();
+	mbps = (double)(((bytes*ITERS)/(end-start))*(CLOCKS_PER_SEC/MILLION));
+	printf("Decode (mp_cursor_t): %g MB/sec\n", mbps);
+
+	// buf has far more than MP_PADDING bytes past the body
+	start = clock();
+	for(int i=0; i<ITERS; ++i) {
+		const char *s;
+		mp_decode_mem_init_padded(&dec, buf, bytes);
+		mp_read_mapsize_padded(&dec, &sz);
+		assert(sz == 5);
+		mp_read_str_padded(&dec, &s, &sz);
+		mp_read_str_padded(&dec, &s, &sz);
+		mp_read_str_padded(&dec, &s, &sz);
+		double f;
+		mp_read_double_padded(&dec, &f);
+		mp_read_str_padded(&dec, &s, &sz);
+		int64_t ix;
+		mp_read_int_padded(&dec, &ix);
+		assert(ix == 348);
+		mp_read_str_padded(&dec, &s, &sz);
+		mp_read_bin_padded(&dec, &s, &sz);
+		mp_read_str_padded(&dec, &s, &sz);
+		uint64_t u;
+		mp_read_uint_padded(&dec, &u);
+		assert(u == 5);
+	}
+	end = clock();
+	mbps = (double)(((bytes*ITERS)/(end-start))*(CLOCKS_PER_SEC/MILLION));
+	printf("Decode (padded): %g MB/sec\n", mbps);
 	
 	return 0;
 }
@@ -0,0 +1,131 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include "../msgpack_mpsc.h"
+
+/*
+ * Many threads logging small records to /dev/null,
+ * either through one stream encoder behind a mutex
+ * or through an mp_mpsc_t with a flusher thread.
+ */
+
+#define RECORDS 200000
+#define BUFSIZE 65536
+#define NSLOTS 256
+#define SLOTSIZE 4096
+
+static const int producer_counts[] = { 1, 2, 4, 8, 16, 32 };
+
+static int devnull;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static mp_encoder_t shared;
+
+static mp_mpsc_t q;
+static atomic_int running;
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static ssize_t fd_flush(void *ctx, const void *buf, size_t amt) {
+	return write(*(int*)ctx, buf, amt);
+}
+
+static int encode_rec(mp_encoder_t *e, void *arg) {
+	uint64_t i = *(uint64_t*)arg;
+	int r = 0;
+	r |= mp_write_mapsize(e, 3);
+	r |= mp_write_str(e, "seq", 3);
+	r |= mp_write_uint(e, i);
+	r |= mp_write_str(e, "level", 5);
+	r |= mp_write_str(e, "info", 4);
+	r |= mp_write_str(e, "msg", 3);
+	r |= mp_write_str(e, "request handled", 15);
+	return r;
+}
+
+static void *mutex_producer(void *arg) {
+	(void)arg;
+	for (uint64_t i=0; i<RECORDS; ++i) {
+		pthread_mutex_lock(&lock);
+		int err = encode_rec(&shared, &i);
+		pthread_mutex_unlock(&lock);
+		assert(err == MSGPACK_OK);
+		(void)err;
+	}
+	return NULL;
+}
+
+static void *mpsc_producer(void *arg) {
+	(void)arg;
+	mp_mpsc_producer_t p;
+	mp_mpsc_producer_init(&p);
+	for (uint64_t i=0; i<RECORDS; ++i) {
+		while (mp_mpsc_write(&q, &p, encode_rec, &i) == ERR_MSGPACK_EOF) {
+			mp_mpsc_publish(&q, &p);
+			sched_yield();
+		}
+	}
+	mp_mpsc_publish(&q, &p);
+	atomic_fetch_sub(&running, 1);
+	return NULL;
+}
+
+static double run(int producers, bool mpsc) {
+	pthread_t th[64];
+	uint64_t start = now_ns();
+	if (mpsc)
+		atomic_store(&running, producers);
+	for (int i=0; i<producers; ++i) {
+		int err = pthread_create(&th[i], NULL, mpsc ? mpsc_producer : mutex_producer, NULL);
+		assert(err == 0);
+		(void)err;
+	}
+	if (mpsc) {
+		for (;;) {
+			bool done = atomic_load(&running) == 0;
+			ssize_t w = mp_mpsc_drain(&q, devnull);
+			assert(w >= 0);
+			if (w == 0 && done)
+				break;
+			if (w == 0)
+				sched_yield();
+		}
+	}
+	for (int i=0; i<producers; ++i)
+		pthread_join(th[i], NULL);
+	if (!mpsc)
+		mp_flush(&shared);
+	double secs = (double)(now_ns() - start) / 1e9;
+	return (double)producers * RECORDS / secs;
+}
+
+int main() {
+	static unsigned char buf[BUFSIZE];
+	static mp_mpsc_slot_t slots[NSLOTS];
+	static unsigned char mem[NSLOTS*SLOTSIZE];
+	devnull = open("/dev/null", O_WRONLY);
+	assert(devnull >= 0);
+	mp_encode_stream_init(&shared, &devnull, fd_flush, buf, BUFSIZE);
+	mp_mpsc_init(&q, slots, NSLOTS, mem, SLOTSIZE);
+
+	printf("Running MPSC benchmarks (%d records per producer)...\n", RECORDS);
+	printf("%9s %14s %14s\n", "producers", "mutex rec/s", "mpsc rec/s");
+	for (size_t i=0; i<sizeof(producer_counts)/sizeof(producer_counts[0]); ++i) {
+		int n = producer_counts[i];
+		double m = run(n, false);
+		double s = run(n, true);
+		printf("%9d %14.0f %14.0f\n", n, m, s);
+	}
+	close(devnull);
+	return 0;
+}
@@ -0,0 +1,79 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <time.h>
+#include "../msgpack_packed.h"
+
+/*
+ * Millisecond timestamps with a little jitter, and
+ * a monotonic counter, written as plain arrays and
+ * as packed arrays.
+ */
+
+#define N 4096
+#define ROUNDS 2000
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static void bench(const char *name, const int64_t *v, int packed) {
+	static unsigned char buf[1 << 20];
+	static int64_t out[N];
+	mp_encoder_t enc;
+	mp_decoder_t dec;
+	mp_packed_reader_t p;
+	volatile int64_t sink = 0;
+	size_t size = 0;
+
+	uint64_t start = now_ns();
+	for (int i=0; i<ROUNDS; ++i) {
+		mp_encode_mem_init(&enc, buf, sizeof(buf));
+		int err = packed ? mp_write_packed(&enc, v, N) : mp_write_int_array(&enc, v, N);
+		assert(err == MSGPACK_OK);
+		(void)err;
+		size = mp_enc_buffered(&enc);
+	}
+	uint64_t enc_ns = now_ns() - start;
+	start = now_ns();
+	for (int i=0; i<ROUNDS; ++i) {
+		uint32_t n;
+		mp_decode_mem_init(&dec, buf, size);
+		int err = mp_read_packed_size(&dec, &p, &n);
+		assert(err == MSGPACK_OK && n == N);
+		err = mp_read_packed(&dec, &p, out, n);
+		assert(err == MSGPACK_OK);
+		(void)err;
+		sink += out[N-1];
+	}
+	uint64_t dec_ns = now_ns() - start;
+	for (size_t i=0; i<N; ++i)
+		assert(out[i] == v[i]);
+	printf("%-18s %6d bytes (%4.2f/value), encode %6.1f Mvalues/s, decode %6.1f Mvalues/s\n",
+		name, (int)size, (double)size / N,
+		(double)N * ROUNDS * 1e3 / (double)enc_ns, (double)N * ROUNDS * 1e3 / (double)dec_ns);
+}
+
+int main() {
+	static int64_t ts[N], ctr[N];
+	uint64_t rng = 88172645463325252u;
+	int64_t t = 1700000000000, c = 0;
+	for (size_t i=0; i<N; ++i) {
+		rng ^= rng << 13;
+		rng ^= rng >> 7;
+		rng ^= rng << 17;
+		t += 1000 + (int64_t)(rng % 7) - 3;
+		c += (int64_t)(rng % 50);
+		ts[i] = t;
+		ctr[i] = c;
+	}
+	printf("Running packed benchmarks (%d values)...\n", N);
+	bench("timestamps plain:", ts, 0);
+	bench("timestamps packed:", ts, 1);
+	bench("counter plain:", ctr, 0);
+	bench("counter packed:", ctr, 1);
+	return 0;
+}
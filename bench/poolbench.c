@@ -0,0 +1,104 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <time.h>
+#include <pthread.h>
+#include "../msgpack_pool.h"
+
+/*
+ * Many threads each "handling requests": taking a
+ * 4KB encoder buffer, encoding a small response
+ * into it, and giving the buffer back, either
+ * with malloc/free or through an mp_pool_t.
+ */
+
+#define REQUESTS 1000000
+#define BUFSIZE 4096
+
+static const int thread_counts[] = { 1, 2, 4, 8, 16 };
+
+static mp_pool_t pool;
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static int encode_resp(mp_encoder_t *e, uint64_t i) {
+	int r = 0;
+	r |= mp_write_mapsize(e, 2);
+	r |= mp_write_str(e, "id", 2);
+	r |= mp_write_uint(e, i);
+	r |= mp_write_str(e, "status", 6);
+	r |= mp_write_str(e, "ok", 2);
+	return r;
+}
+
+static void *malloc_handler(void *arg) {
+	(void)arg;
+	mp_encoder_t e;
+	for (uint64_t i=0; i<REQUESTS; ++i) {
+		unsigned char *buf = malloc(BUFSIZE);
+		assert(buf != NULL);
+		mp_encode_mem_init(&e, buf, BUFSIZE);
+		int err = encode_resp(&e, i);
+		assert(err == MSGPACK_OK);
+		(void)err;
+		free(buf);
+	}
+	return NULL;
+}
+
+static void *pool_handler(void *arg) {
+	(void)arg;
+	mp_pool_cache_t c;
+	mp_encoder_t e;
+	mp_pool_cache_init(&c, &pool);
+	for (uint64_t i=0; i<REQUESTS; ++i) {
+		int err = mp_encoder_acquire(&e, &c, BUFSIZE, NULL, NULL);
+		assert(err == MSGPACK_OK);
+		err = encode_resp(&e, i);
+		assert(err == MSGPACK_OK);
+		(void)err;
+		mp_encoder_release(&e, &c);
+	}
+	mp_pool_cache_drain(&c);
+	return NULL;
+}
+
+static double run(int threads, void *(*fn)(void*)) {
+	pthread_t th[64];
+	uint64_t start = now_ns();
+	for (int i=0; i<threads; ++i) {
+		int err = pthread_create(&th[i], NULL, fn, NULL);
+		assert(err == 0);
+		(void)err;
+	}
+	for (int i=0; i<threads; ++i)
+		pthread_join(th[i], NULL);
+	double secs = (double)(now_ns() - start) / 1e9;
+	return (double)threads * REQUESTS / secs;
+}
+
+int main() {
+	static const uint32_t counts[MP_POOL_CLASSES] = { 0, 64*MP_POOL_CACHE, 0, 0 };
+	size_t memsize = mp_pool_memsize(counts);
+	void *mem = aligned_alloc(64, memsize);
+	assert(mem != NULL);
+	int err = mp_pool_init(&pool, mem, memsize, counts);
+	assert(err == MSGPACK_OK);
+	(void)err;
+
+	printf("Running pool benchmarks (%d requests per thread)...\n", REQUESTS);
+	printf("%7s %14s %14s\n", "threads", "malloc req/s", "pool req/s");
+	for (size_t i=0; i<sizeof(thread_counts)/sizeof(thread_counts[0]); ++i) {
+		int n = thread_counts[i];
+		double m = run(n, malloc_handler);
+		double p = run(n, pool_handler);
+		printf("%7d %14.0f %14.0f\n", n, m, p);
+	}
+	free(mem);
+	return 0;
+}
@@ -0,0 +1,128 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include "../msgpack_shm.h"
+
+/*
+ * One process streaming small records to another,
+ * over a unix socket or through an mp_shm_t ring.
+ * Each record is flushed on its own, the way a
+ * request/response service would.
+ */
+
+#define RECORDS 500000
+#define RINGSIZE (1 << 20)
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static ssize_t fd_flush(void *ctx, const void *buf, size_t amt) {
+	return write(*(int*)ctx, buf, amt);
+}
+
+static ssize_t fd_fill(void *ctx, void *buf, size_t max) {
+	return read(*(int*)ctx, buf, max);
+}
+
+static void encode_rec(mp_encoder_t *e, uint64_t i) {
+	int r = 0;
+	r |= mp_write_mapsize(e, 2);
+	r |= mp_write_str(e, "id", 2);
+	r |= mp_write_uint(e, i);
+	r |= mp_write_str(e, "msg", 3);
+	r |= mp_write_str(e, "request handled", 15);
+	assert(r == MSGPACK_OK);
+	(void)r;
+}
+
+static void consume(mp_decoder_t *d) {
+	uint64_t n = 0;
+	while (mp_skip(d) == MSGPACK_OK)
+		++n;
+	assert(n == RECORDS);
+	(void)n;
+}
+
+static double run_socket(void) {
+	int sv[2];
+	unsigned char buf[4096];
+	int err = socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+	assert(err == 0);
+	uint64_t start = now_ns();
+	pid_t pid = fork();
+	assert(pid >= 0);
+	if (pid == 0) {
+		mp_decoder_t d;
+		close(sv[0]);
+		mp_decode_stream_init(&d, &sv[1], fd_fill, buf, sizeof(buf));
+		consume(&d);
+		_exit(0);
+	}
+	close(sv[1]);
+	mp_encoder_t e;
+	mp_encode_stream_init(&e, &sv[0], fd_flush, buf, sizeof(buf));
+	for (uint64_t i=0; i<RECORDS; ++i) {
+		encode_rec(&e, i);
+		err = mp_flush(&e);
+		assert(err == MSGPACK_OK);
+	}
+	(void)err;
+	close(sv[0]);
+	waitpid(pid, NULL, 0);
+	return (double)RECORDS / ((double)(now_ns() - start) / 1e9);
+}
+
+static double run_shm(bool zerocopy) {
+	mp_shm_t s;
+	unsigned char buf[4096];
+	int err = mp_shm_create(&s, RINGSIZE);
+	assert(err == MSGPACK_OK);
+	uint64_t start = now_ns();
+	pid_t pid = fork();
+	assert(pid >= 0);
+	if (pid == 0) {
+		mp_decoder_t d;
+		mp_decode_stream_init(&d, &s, mp_shm_fill, buf, sizeof(buf));
+		consume(&d);
+		_exit(0);
+	}
+	mp_encoder_t e;
+	if (!zerocopy)
+		mp_encode_stream_init(&e, &s, mp_shm_flush, buf, sizeof(buf));
+	for (uint64_t i=0; i<RECORDS; ++i) {
+		if (zerocopy) {
+			err = mp_shm_encoder_begin(&s, &e, 64);
+			assert(err == MSGPACK_OK);
+			encode_rec(&e, i);
+			mp_shm_encoder_commit(&s, &e);
+		} else {
+			encode_rec(&e, i);
+			err = mp_flush(&e);
+			assert(err == MSGPACK_OK);
+		}
+	}
+	(void)err;
+	mp_shm_close_write(&s);
+	waitpid(pid, NULL, 0);
+	mp_shm_close(&s);
+	return (double)RECORDS / ((double)(now_ns() - start) / 1e9);
+}
+
+int main() {
+	printf("Running shm benchmarks (%d records)...\n", RECORDS);
+	fflush(stdout);
+	printf("%-22s %12.0f rec/s\n", "unix socket:", run_socket());
+	fflush(stdout);
+	printf("%-22s %12.0f rec/s\n", "shm ring (flush):", run_shm(false));
+	fflush(stdout);
+	printf("%-22s %12.0f rec/s\n", "shm ring (zero-copy):", run_shm(true));
+	return 0;
+}
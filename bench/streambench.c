@@ -0,0 +1,283 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include "../msgpack.h"
+
+/*
+ * Drives stream-mode encoders and decoders
+ * over real file descriptors with a writer
+ * and a reader thread, and counts how often
+ * the mp_flush_t/mp_fill_t callbacks run.
+ */
+
+#define DEFAULT_MSGS 200000
+
+#define write_strlit(e, str) mp_write_str(e, str, sizeof(str)-1)
+#define write_binlit(e, str) mp_write_bin(e, str, sizeof(str)-1)
+
+static const size_t bufsizes[] = { 64, 256, 1024, 4096, 16384, 65536 };
+
+typedef enum {
+	T_PIPE,
+	T_SOCKETPAIR,
+	T_FILE
+} transport_t;
+
+static const char *transport_names[] = { "pipe", "socketpair", "tmpfs" };
+
+// counting wrapper around a file descriptor
+typedef struct {
+	int    fd;
+	size_t calls;
+	size_t bytes;
+} fdctx_t;
+
+typedef struct {
+	fdctx_t   io;
+	size_t    bufsize;
+	size_t    msgs;
+	bool      sync; // flush after every message
+	uint64_t *lat;  // per-message latency (ns), reader only
+	int       err;
+} side_t;
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static ssize_t fd_flush(void *ctx, const void *buf, size_t amt) {
+	fdctx_t *c = (fdctx_t*)ctx;
+	ssize_t w;
+	do {
+		w = write(c->fd, buf, amt);
+	} while (w < 0 && errno == EINTR);
+	c->calls++;
+	if (w > 0)
+		c->bytes += (size_t)w;
+	return w;
+}
+
+static ssize_t fd_fill(void *ctx, void *buf, size_t max) {
+	fdctx_t *c = (fdctx_t*)ctx;
+	ssize_t r;
+	do {
+		r = read(c->fd, buf, max);
+	} while (r < 0 && errno == EINTR);
+	c->calls++;
+	if (r > 0)
+		c->bytes += (size_t)r;
+	return r;
+}
+
+static int encode_msg(mp_encoder_t *e) {
+	int r = 0;
+	r |= mp_write_mapsize(e, 6);
+	r |= write_strlit(e, "ts");
+	r |= mp_write_uint(e, now_ns());
+	r |= write_strlit(e, "field_label_one");
+	r |= write_strlit(e, "field_body_one");
+	r |= write_strlit(e, "a_float");
+	r |= mp_write_double(e, 3.14);
+	r |= write_strlit(e, "an_integer");
+	r |= mp_write_int(e, 348);
+	r |= write_strlit(e, "some_binary");
+	r |= write_binlit(e, "thisissomeopaquebinary");
+	r |= write_strlit(e, "fieldfive");
+	r |= mp_write_uint(e, 5);
+	return r;
+}
+
+static void *writer(void *arg) {
+	side_t *s = (side_t*)arg;
+	unsigned char *mem = malloc(s->bufsize);
+	assert(mem);
+	mp_encoder_t enc;
+	mp_encode_stream_init(&enc, &s->io, fd_flush, mem, s->bufsize);
+	for (size_t i=0; i<s->msgs; ++i) {
+		s->err = encode_msg(&enc);
+		if (s->err == MSGPACK_OK && s->sync)
+			s->err = mp_flush(&enc);
+		if (s->err != MSGPACK_OK)
+			break;
+	}
+	if (s->err == MSGPACK_OK)
+		s->err = mp_flush(&enc);
+	free(mem);
+	return NULL;
+}
+
+// reads exactly 'amt' bytes, since mp_read may return short
+static int read_full(mp_decoder_t *d, char *buf, size_t amt) {
+	while (amt > 0) {
+		ssize_t r = mp_read(d, buf, amt);
+		if (r <= 0)
+			return r == 0 ? ERR_MSGPACK_EOF : ERR_MSGPACK_CHECK_ERRNO;
+		buf += r;
+		amt -= (size_t)r;
+	}
+	return MSGPACK_OK;
+}
+
+static int decode_msg(mp_decoder_t *d, uint64_t *ts) {
+	uint32_t sz;
+	char key[32];
+	int r = mp_read_mapsize(d, &sz);
+	if (r) return r;
+	for (uint32_t i=0; i<sz; ++i) {
+		uint32_t ksz;
+		r = mp_read_strsize(d, &ksz);
+		if (r) return r;
+		if (ksz > sizeof(key))
+			return ERR_MSGPACK_BAD_TYPE;
+		r = read_full(d, key, (size_t)ksz);
+		if (r) return r;
+		if (ksz == 2 && memcmp(key, "ts", 2) == 0)
+			r = mp_read_uint(d, ts);
+		else
+			r = mp_skip(d);
+		if (r) return r;
+	}
+	return MSGPACK_OK;
+}
+
+static void *reader(void *arg) {
+	side_t *s = (side_t*)arg;
+	unsigned char *mem = malloc(s->bufsize);
+	assert(mem);
+	mp_decoder_t dec;
+	mp_decode_stream_init(&dec, &s->io, fd_fill, mem, s->bufsize);
+	for (size_t i=0; i<s->msgs; ++i) {
+		uint64_t ts = 0;
+		s->err = decode_msg(&dec, &ts);
+		if (s->err != MSGPACK_OK)
+			break;
+		s->lat[i] = now_ns() - ts;
+	}
+	free(mem);
+	return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t*)a;
+	uint64_t y = *(const uint64_t*)b;
+	return (x > y) - (x < y);
+}
+
+static double pct_us(uint64_t *sorted, size_t n, double p) {
+	size_t i = (size_t)(p * (double)(n-1));
+	return (double)sorted[i] / 1000.0;
+}
+
+static void run(transport_t t, size_t bufsize, bool sync, size_t msgs) {
+	side_t w, r;
+	memset(&w, 0, sizeof(w));
+	memset(&r, 0, sizeof(r));
+	w.bufsize = r.bufsize = bufsize;
+	w.msgs = r.msgs = msgs;
+	w.sync = sync;
+	r.lat = malloc(msgs * sizeof(uint64_t));
+	assert(r.lat);
+
+	int fds[2], err;
+	char path[] = "/dev/shm/msgc-streambench-XXXXXX";
+	switch (t) {
+	case T_PIPE:
+		err = pipe(fds);
+		assert(err == 0);
+		break;
+	case T_SOCKETPAIR:
+		err = socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+		assert(err == 0);
+		break;
+	case T_FILE:
+		fds[1] = mkstemp(path);
+		assert(fds[1] >= 0);
+		fds[0] = open(path, O_RDONLY);
+		assert(fds[0] >= 0);
+		unlink(path);
+		break;
+	}
+	r.io.fd = fds[0];
+	w.io.fd = fds[1];
+
+	pthread_t wt, rt;
+	uint64_t start = now_ns();
+	if (t == T_FILE) {
+		// a file reader would see EOF before the writer finishes
+		err = pthread_create(&wt, NULL, writer, &w);
+		assert(err == 0);
+		pthread_join(wt, NULL);
+		err = pthread_create(&rt, NULL, reader, &r);
+		assert(err == 0);
+		pthread_join(rt, NULL);
+	} else {
+		err = pthread_create(&rt, NULL, reader, &r);
+		assert(err == 0);
+		err = pthread_create(&wt, NULL, writer, &w);
+		assert(err == 0);
+		pthread_join(wt, NULL);
+		pthread_join(rt, NULL);
+	}
+	(void)err;
+	uint64_t elapsed = now_ns() - start;
+	close(fds[0]);
+	close(fds[1]);
+
+	if (w.err || r.err) {
+		printf("%-10s %7zu %-5s FAILED: writer: %s, reader: %s\n",
+			transport_names[t], bufsize, sync ? "sync" : "batch",
+			mp_strerror(w.err), mp_strerror(r.err));
+		free(r.lat);
+		return;
+	}
+
+	double secs = (double)elapsed / 1e9;
+	double mmsgs = (double)msgs / secs;
+	double mbps = (double)w.io.bytes / secs / 1e6;
+	double flushes = (double)w.io.calls / (double)msgs;
+	double fills = (double)r.io.calls / (double)msgs;
+	printf("%-10s %7zu %-5s %10.0f %9.1f %9.3f %9.3f",
+		transport_names[t], bufsize, sync ? "sync" : "batch",
+		mmsgs, mbps, flushes, fills);
+	if (t == T_FILE) {
+		// latency includes the whole write phase
+		printf(" %9s %9s %9s\n", "-", "-", "-");
+	} else {
+		qsort(r.lat, msgs, sizeof(uint64_t), cmp_u64);
+		printf(" %9.1f %9.1f %9.1f\n",
+			pct_us(r.lat, msgs, 0.5),
+			pct_us(r.lat, msgs, 0.99),
+			pct_us(r.lat, msgs, 0.999));
+	}
+	free(r.lat);
+	return;
+}
+
+int main(int argc, char **argv) {
+	size_t msgs = DEFAULT_MSGS;
+	if (argc > 1)
+		msgs = (size_t)strtoul(argv[1], NULL, 10);
+	assert(msgs > 0);
+
+	printf("Running stream benchmarks (%zu messages)...\n", msgs);
+	printf("%-10s %7s %-5s %10s %9s %9s %9s %9s %9s %9s\n",
+		"transport", "bufsize", "mode", "msgs/sec", "MB/sec",
+		"flush/msg", "fill/msg", "p50(us)", "p99(us)", "p999(us)");
+	for (int t=T_PIPE; t<=T_FILE; ++t) {
+		for (size_t i=0; i<sizeof(bufsizes)/sizeof(bufsizes[0]); ++i) {
+			run((transport_t)t, bufsizes[i], true, msgs);
+			run((transport_t)t, bufsizes[i], false, msgs);
+		}
+	}
+	return 0;
+}
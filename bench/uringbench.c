@@ -0,0 +1,110 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "../msgpack_uring.h"
+
+/*
+ * Writing and then scanning a large on-disk archive
+ * of small records, with plain write/read callbacks
+ * or through an mp_uring_t.
+ */
+
+#define RECORDS 2000000
+#define BUFSIZE 65536
+
+static unsigned char stage[MP_URING_BUFS*BUFSIZE];
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static ssize_t fd_flush(void *ctx, const void *buf, size_t amt) {
+	return write(*(int*)ctx, buf, amt);
+}
+
+static ssize_t fd_fill(void *ctx, void *buf, size_t max) {
+	return read(*(int*)ctx, buf, max);
+}
+
+static double encode_all(mp_encoder_t *e) {
+	uint64_t start = now_ns();
+	for (uint64_t i=0; i<RECORDS; ++i) {
+		int r = 0;
+		r |= mp_write_mapsize(e, 3);
+		r |= mp_write_str(e, "ts", 2);
+		r |= mp_write_uint(e, 1500000000000 + i);
+		r |= mp_write_str(e, "value", 5);
+		r |= mp_write_double(e, (double)i * 0.5);
+		r |= mp_write_str(e, "tag", 3);
+		r |= mp_write_str(e, "sensor-0042", 11);
+		assert(r == MSGPACK_OK);
+		(void)r;
+	}
+	int err = mp_flush(e);
+	assert(err == MSGPACK_OK);
+	(void)err;
+	return (double)(now_ns() - start) / 1e6;
+}
+
+static double decode_all(mp_decoder_t *d) {
+	uint64_t start = now_ns();
+	uint64_t n = 0;
+	while (mp_skip(d) == MSGPACK_OK)
+		++n;
+	assert(n == RECORDS);
+	(void)n;
+	return (double)(now_ns() - start) / 1e6;
+}
+
+int main() {
+	static unsigned char buf[BUFSIZE];
+	char path[] = "/tmp/msgc-uringbench-XXXXXX";
+	int fd = mkstemp(path);
+	int err;
+	assert(fd >= 0);
+	unlink(path);
+	mp_encoder_t e;
+	mp_decoder_t d;
+	mp_uring_t u;
+
+	printf("Running io_uring benchmarks (%d records)...\n", RECORDS);
+
+	mp_encode_stream_init(&e, &fd, fd_flush, buf, BUFSIZE);
+	printf("write(2):  encode %8.1f ms\n", encode_all(&e));
+	err = ftruncate(fd, 0);
+	assert(err == 0);
+	off_t off = lseek(fd, 0, SEEK_SET);
+	assert(off == 0);
+
+	err = mp_uring_writer_init(&u, fd, 0, stage, BUFSIZE);
+	assert(err == MSGPACK_OK);
+	mp_encode_stream_init(&e, &u, mp_uring_flush, buf, BUFSIZE);
+	double ms = encode_all(&e);
+	err = mp_uring_finish(&u);
+	assert(err == MSGPACK_OK);
+	err = mp_uring_close(&u);
+	assert(err == MSGPACK_OK);
+	printf("io_uring:  encode %8.1f ms\n", ms);
+
+	off = lseek(fd, 0, SEEK_SET);
+	assert(off == 0);
+	mp_decode_stream_init(&d, &fd, fd_fill, buf, BUFSIZE);
+	printf("read(2):   decode %8.1f ms\n", decode_all(&d));
+
+	err = mp_uring_reader_init(&u, fd, 0, stage, BUFSIZE);
+	assert(err == MSGPACK_OK);
+	mp_decode_stream_init(&d, &u, mp_uring_fill, buf, BUFSIZE);
+	printf("io_uring:  decode %8.1f ms\n", decode_all(&d));
+	mp_uring_close(&u);
+
+	close(fd);
+	(void)err;
+	(void)off;
+	return 0;
+}
@@ -0,0 +1,115 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+#include "../msgpack_z.h"
+
+/*
+ * Compressing a stream of log records through
+ * mp_z_flush with each codec that was built in,
+ * and decompressing it through mp_z_fill.
+ */
+
+#define RECORDS 1000000
+#define ENCBUF 65536
+#define SINKSIZE (128 << 20)
+
+typedef struct {
+	unsigned char *mem;
+	size_t len;
+	size_t off;
+} sink_t;
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static ssize_t sink_flush(void *ctx, const void *buf, size_t amt) {
+	sink_t *s = (sink_t*)ctx;
+	assert(s->len + amt <= SINKSIZE);
+	memcpy(s->mem + s->len, buf, amt);
+	s->len += amt;
+	return (ssize_t)amt;
+}
+
+static ssize_t sink_fill(void *ctx, void *buf, size_t max) {
+	sink_t *s = (sink_t*)ctx;
+	size_t n = s->len - s->off;
+	if (n > max)
+		n = max;
+	memcpy(buf, s->mem + s->off, n);
+	s->off += n;
+	return (ssize_t)n;
+}
+
+static void encode_all(mp_encoder_t *e) {
+	static const char *levels[] = { "debug", "info", "warn", "error" };
+	for (uint64_t i=0; i<RECORDS; ++i) {
+		int r = 0;
+		r |= mp_write_mapsize(e, 4);
+		r |= mp_write_str(e, "ts", 2);
+		r |= mp_write_uint(e, 1500000000000 + i*17);
+		r |= mp_write_str(e, "level", 5);
+		r |= mp_write_str(e, levels[i & 3], (uint32_t)strlen(levels[i & 3]));
+		r |= mp_write_str(e, "status", 6);
+		r |= mp_write_uint(e, (i % 7) ? 200 : 404);
+		r |= mp_write_str(e, "path", 4);
+		r |= mp_write_str(e, "/api/v1/items", 13);
+		assert(r == MSGPACK_OK);
+		(void)r;
+	}
+	int err = mp_flush(e);
+	assert(err == MSGPACK_OK);
+	(void)err;
+}
+
+int main() {
+	static unsigned char scratch[MP_Z_BOUND(ENCBUF)];
+	static unsigned char mem[MP_Z_READER_MEM(ENCBUF)];
+	static unsigned char buf[2*ENCBUF];
+	static mp_z_writer_t zw;
+	static const struct { mp_z_codec_t codec; const char *name; } codecs[] = {
+		{ MP_Z_STORED, "stored" }, { MP_Z_LZ, "lz" }, { MP_Z_ZLIB, "zlib" }, { MP_Z_ZSTD, "zstd" },
+	};
+	sink_t s;
+	s.mem = malloc(SINKSIZE);
+	assert(s.mem != NULL);
+
+	printf("Running compression benchmarks (%d records)...\n", RECORDS);
+	printf("%-7s %12s %8s %10s %10s\n", "codec", "bytes", "ratio", "enc MB/s", "dec MB/s");
+	size_t raw = 0;
+	for (size_t c=0; c<sizeof(codecs)/sizeof(codecs[0]); ++c) {
+		s.len = s.off = 0;
+		if (mp_z_writer_init(&zw, codecs[c].codec, &s, sink_flush, scratch, sizeof(scratch)) != MSGPACK_OK) {
+			printf("%-7s (not built in)\n", codecs[c].name);
+			continue;
+		}
+		mp_encoder_t e;
+		mp_encode_stream_init(&e, &zw, mp_z_flush, buf, ENCBUF);
+		uint64_t start = now_ns();
+		encode_all(&e);
+		double enc = (double)(now_ns() - start) / 1e9;
+		if (codecs[c].codec == MP_Z_STORED)
+			raw = s.len;
+
+		mp_z_reader_t zr;
+		mp_decoder_t d;
+		mp_z_reader_init(&zr, &s, sink_fill, mem, ENCBUF);
+		mp_decode_stream_init(&d, &zr, mp_z_fill, buf, sizeof(buf));
+		start = now_ns();
+		uint64_t n = 0;
+		while (mp_skip(&d) == MSGPACK_OK)
+			++n;
+		double dec = (double)(now_ns() - start) / 1e9;
+		assert(n == RECORDS);
+
+		printf("%-7s %12zu %8.2f %10.1f %10.1f\n", codecs[c].name, s.len, (double)raw / (double)s.len,
+			(double)raw / 1e6 / enc, (double)raw / 1e6 / dec);
+	}
+	free(s.mem);
+	return 0;
+}
@@ -5,17 +5,45 @@
 #include <errno.h>
 #include <string.h>
 #include "msgpack.h"
+#include <math.h>
+#ifdef MSGPACK_STATS
+#include <stdatomic.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
-#ifdef __gcc__
-	#define unlikely(x) __builtin_expect(!!(x), 1)
-#elif __clang__
-	#define unlikely(x) __builtin_expect(!!(x), 1)
+#ifdef __GNUC__
+	#define likely(x) __builtin_expect(!!(x), 1)
+	#define unlikely(x) __builtin_expect(!!(x), 0)
 #else
+	#define likely(x) (x)
 	#define unlikely(x) (x)
 #endif
 
+/*
+ * Integers are encoded with one big-endian
+ * 8-byte store when the compiler gives us
+ * clz/bswap and the byte order is known.
+ */
+#if defined(__GNUC__) && defined(__BYTE_ORDER__)
+	#define WIDE_INTS 1
+#endif
+
 #define CHECK(r) if (unlikely(r)) return (r)
 
+#ifdef MSGPACK_STATS
+	#define STAT_INC(x, f) ((x)->stats.f++)
+	#define STAT_ADD(x, f, n) ((x)->stats.f += (uint64_t)(n))
+	#define STAT_MAX(x, f, n) do { if ((x)->stats.f < (uint64_t)(n)) (x)->stats.f = (uint64_t)(n); } while (0)
+	#define STAT_RESET(x) memset(&(x)->stats, 0, sizeof((x)->stats))
+#else
+	#define STAT_INC(x, f) ((void)0)
+	#define STAT_ADD(x, f, n) ((void)0)
+	#define STAT_MAX(x, f, n) ((void)0)
+	#define STAT_RESET(x) ((void)(x))
+#endif
+
 
 // all type byte tags
 typedef enum {
@@ -75,6 +103,8 @@ const char *mp_strerror(int i) {
 		return "msgpack type mismatch";
 	case ERR_MSGPACK_CHECK_ERRNO:
 		return strerror(errno);
+	case ERR_MSGPACK_TOO_DEEP:
+		return "msgpack object nested too deeply";
 	default:
 		return "<unknown error>";
 	}
@@ -85,9 +115,9 @@ mp_typ_t mp_type(uint8_t b) {
 	// all fixed types are less than
 	// TAG_NIL except neg. fixint
 	if (b < TAG_NIL) {
-		switch (b&0xf0) {
-		case 0:
+		if ((b&0x80) == 0)
 			return MSG_INT;
+		switch (b&0xf0) {
 		case 0x80:
 			return MSG_MAP;
 		case 0x90:
@@ -158,6 +188,7 @@ void mp_decode_stream_init(mp_decoder_t *d, void* ctx, mp_fill_t r, unsigned cha
 	d->cap = cap;
 	d->ctx = ctx;
 	d->read = r;
+	STAT_RESET(d);
 	return;
 }
 
@@ -168,6 +199,7 @@ void mp_decode_mem_init(mp_decoder_t *d, unsigned char* mem, size_t cap) {
 	d->cap = cap;
 	d->ctx = NULL;
 	d->read = NULL;
+	STAT_RESET(d);
 	return;
 }
 
@@ -177,23 +209,37 @@ size_t mp_dec_capacity(mp_decoder_t *d) { return d->cap; }
 
 static int fill(mp_decoder_t *d) {
 	if (d->read != NULL) {
+
+		/* 
+		 * move unread bytes to the front
+		 * of the buffer so that the read
+		 * callback always has room to write
+		 */
+		if (d->off > 0) {
+			d->used -= d->off;
+			memmove(d->base, d->base + d->off, d->used);
+			d->off = 0;
+		}
+
 		ssize_t c = d->read(d->ctx, (d->base + d->used), (d->cap - d->used));
+		STAT_INC(d, fills);
 		if (unlikely(c < 0)) 
 			return ERR_MSGPACK_CHECK_ERRNO;
 		 else if (unlikely(c == 0)) 
 			return ERR_MSGPACK_EOF;
 		
+		STAT_ADD(d, fill_bytes, c);
+		if ((size_t)c < d->cap - d->used)
+			STAT_INC(d, short_reads);
 		d->used += (size_t)c;
 		return MSGPACK_OK;
 	}
-	return ERR_MSGPACK_CHECK_ERRNO;
+	// mem mode: nothing more to read
+	return ERR_MSGPACK_EOF;
 }
 
-// returns a pointer to the next 'req' valid bytes
-// in the reader, and increments the read cursor by
-// the same amount. returns NULL if there aren't enough
-// bytes left, or if the readf callback returns -1.
-static int decoder_next(mp_decoder_t *d, size_t req, unsigned char **c) {
+// makes sure at least 'req' bytes are buffered
+static inline int ensure(mp_decoder_t *d, size_t req) {
 	if (unlikely(req > d->cap)) 
 		return ERR_MSGPACK_EOF;
 
@@ -201,7 +247,23 @@ static int decoder_next(mp_decoder_t *d, size_t req, unsigned char **c) {
 		int r = fill(d);
 		CHECK(r);
 	}
+	return MSGPACK_OK;
+}
+
+int mp_ensure(mp_decoder_t *d, size_t n, const unsigned char **p) {
+	int r = ensure(d, n);
+	CHECK(r);
+	*p = d->base + d->off;
+	return MSGPACK_OK;
+}
 
+// returns a pointer to the next 'req' valid bytes
+// in the reader, and increments the read cursor by
+// the same amount. returns NULL if there aren't enough
+// bytes left, or if the readf callback returns -1.
+static int decoder_next(mp_decoder_t *d, size_t req, unsigned char **c) {
+	int r = ensure(d, req);
+	CHECK(r);
 	*c = d->base + d->off;
 	d->off += req;
 	return MSGPACK_OK;
@@ -222,7 +284,9 @@ static unsigned char *readoff(mp_decoder_t *d) {
 }
 
 // warning: this is unsafe
+// (it is only used to back out of a type mismatch)
 static void unread_byte(mp_decoder_t *d) {
+	STAT_INC(d, type_mismatches);
 	d->off--;
 	return;
 }
@@ -297,7 +361,7 @@ static int read_be16(mp_decoder_t *d, uint16_t *u) {
 }
 
 
-static bool read_be32(mp_decoder_t *d, uint32_t *u) {
+static int read_be32(mp_decoder_t *d, uint32_t *u) {
 	unsigned char* nxt;
 	int r = decoder_next(d, 4, &nxt);
 	CHECK(r);
@@ -310,7 +374,7 @@ static bool read_be32(mp_decoder_t *d, uint32_t *u) {
 	return MSGPACK_OK;
 }
 
-static bool read_be64(mp_decoder_t *d, uint64_t *u) {
+static int read_be64(mp_decoder_t *d, uint64_t *u) {
 	unsigned char* nxt;
 	int r = decoder_next(d, 8, &nxt);
 	CHECK(r);
@@ -504,21 +568,292 @@ static int skipn(mp_decoder_t *d, size_t n) {
 	return MSGPACK_OK;
 }
 
-int mp_skip(mp_decoder_t *d) {
+// skip one object at nesting level 'depth'
+static int skip(mp_decoder_t *d, size_t depth) {
 	size_t pre;
 	size_t sub;
+	STAT_MAX(d, max_skip_depth, depth);
 	int r = next_size(d, &pre, &sub);
 	CHECK(r);
 	r = skipn(d, pre);
 	CHECK(r);
 	while (sub) {
-		r = mp_skip(d);
+		r = skip(d, depth+1);
 		CHECK(r);
 		--sub;
 	}
 	return MSGPACK_OK;
 }
 
+int mp_skip(mp_decoder_t *d) {
+	return skip(d, 1);
+}
+
+/* 
+ * get the size of the object at 'p', given that 'n' bytes
+ * are available; self in *this and number of children in *sub.
+ * returns ERR_MSGPACK_EOF if 'n' doesn't cover the header.
+ */
+static int span(const unsigned char *p, size_t n, size_t *this, size_t *sub) {
+	uint8_t b = *p;
+	size_t hdr = 1; // bytes needed to know the size
+	*sub = 0;
+	if (b < 0x80 || b >= 0xe0) {
+		*this = 1;
+		return MSGPACK_OK;
+	} else if (b < 0x90) {
+		*this = 1;
+		*sub = 2 * (size_t)(b&0x0f);
+		return MSGPACK_OK;
+	} else if (b < 0xa0) {
+		*this = 1;
+		*sub = (size_t)(b&0x0f);
+		return MSGPACK_OK;
+	} else if (b < 0xc0) {
+		*this = 1 + (size_t)(b&0x1f);
+		return MSGPACK_OK;
+	}
+	switch ((tag)b) {
+	case TAG_BIN8:
+	case TAG_STR8:
+	case TAG_EXT8:
+		hdr = 2;
+		break;
+	case TAG_BIN16:
+	case TAG_STR16:
+	case TAG_EXT16:
+	case TAG_ARRAY16:
+	case TAG_MAP16:
+		hdr = 3;
+		break;
+	case TAG_BIN32:
+	case TAG_STR32:
+	case TAG_EXT32:
+	case TAG_ARRAY32:
+	case TAG_MAP32:
+		hdr = 5;
+		break;
+	default:
+		break;
+	}
+	if (unlikely(n < hdr))
+		return ERR_MSGPACK_EOF;
+
+	switch ((tag)b) {
+	case TAG_NIL:
+	case TAG_FALSE:
+	case TAG_TRUE:
+		*this = 1;
+		return MSGPACK_OK;
+	case TAG_INT8:
+	case TAG_UINT8:
+		*this = 2;
+		return MSGPACK_OK;
+	case TAG_INT16:
+	case TAG_UINT16:
+		*this = 3;
+		return MSGPACK_OK;
+	case TAG_INT32:
+	case TAG_UINT32:
+	case TAG_F32:
+		*this = 5;
+		return MSGPACK_OK;
+	case TAG_INT64:
+	case TAG_UINT64:
+	case TAG_F64:
+		*this = 9;
+		return MSGPACK_OK;
+	case TAG_FIXEXT1:
+		*this = 3;
+		return MSGPACK_OK;
+	case TAG_FIXEXT2:
+		*this = 4;
+		return MSGPACK_OK;
+	case TAG_FIXEXT4:
+		*this = 6;
+		return MSGPACK_OK;
+	case TAG_FIXEXT8:
+		*this = 10;
+		return MSGPACK_OK;
+	case TAG_FIXEXT16:
+		*this = 18;
+		return MSGPACK_OK;
+	case TAG_BIN8:
+	case TAG_STR8:
+		*this = 2 + (size_t)p[1];
+		return MSGPACK_OK;
+	case TAG_BIN16:
+	case TAG_STR16:
+		*this = 3 + (size_t)mp_get_be16(p+1);
+		return MSGPACK_OK;
+	case TAG_BIN32:
+	case TAG_STR32:
+		*this = 5 + (size_t)mp_get_be32(p+1);
+		return MSGPACK_OK;
+	case TAG_EXT8:
+		*this = 3 + (size_t)p[1];
+		return MSGPACK_OK;
+	case TAG_EXT16:
+		*this = 4 + (size_t)mp_get_be16(p+1);
+		return MSGPACK_OK;
+	case TAG_EXT32:
+		*this = 6 + (size_t)mp_get_be32(p+1);
+		return MSGPACK_OK;
+	case TAG_ARRAY16:
+		*this = 3;
+		*sub = (size_t)mp_get_be16(p+1);
+		return MSGPACK_OK;
+	case TAG_ARRAY32:
+		*this = 5;
+		*sub = (size_t)mp_get_be32(p+1);
+		return MSGPACK_OK;
+	case TAG_MAP16:
+		*this = 3;
+		*sub = 2 * (size_t)mp_get_be16(p+1);
+		return MSGPACK_OK;
+	case TAG_MAP32:
+		*this = 5;
+		*sub = 2 * (size_t)mp_get_be32(p+1);
+		return MSGPACK_OK;
+	case TAG_INVALID:
+		return ERR_MSGPACK_BAD_TYPE;
+	}
+	return ERR_MSGPACK_BAD_TYPE;
+}
+
+// skip 'n' objects in [p, end); returns the end of the last one, or NULL
+static const unsigned char *skip_mem(const unsigned char *p, const unsigned char *end, size_t n, int *err) {
+	size_t this, sub;
+	while (n) {
+		if (unlikely(p == end)) {
+			*err = ERR_MSGPACK_EOF;
+			return NULL;
+		}
+		int r = span(p, (size_t)(end - p), &this, &sub);
+		if (unlikely(r)) {
+			*err = r;
+			return NULL;
+		}
+		if (unlikely(this > (size_t)(end - p))) {
+			*err = ERR_MSGPACK_EOF;
+			return NULL;
+		}
+		p += this;
+		n += sub - 1;
+	}
+	return p;
+}
+
+void mp_decode_mem_init_padded(mp_decoder_t *d, unsigned char *mem, size_t len) {
+	mp_decode_mem_init(d, mem, len);
+	return;
+}
+
+/*
+ * moves a padded decoder to 'q' (the result of an
+ * mp_get_ function run at the read offset), checking
+ * only that it hasn't run past the end of the buffer
+ */
+static inline int padded_advance(mp_decoder_t *d, const unsigned char *q) {
+	if (unlikely(d->off >= d->used))
+		return ERR_MSGPACK_EOF;
+	if (unlikely(q == NULL)) {
+		STAT_INC(d, type_mismatches);
+		return ERR_MSGPACK_BAD_TYPE;
+	}
+	size_t off = (size_t)(q - d->base);
+	if (unlikely(off > d->used))
+		return ERR_MSGPACK_EOF;
+	d->off = off;
+	return MSGPACK_OK;
+}
+
+int mp_read_nil_padded(mp_decoder_t *d) {
+	return padded_advance(d, mp_get_nil(readoff(d)));
+}
+
+int mp_read_bool_padded(mp_decoder_t *d, bool *b) {
+	return padded_advance(d, mp_get_bool(readoff(d), b));
+}
+
+int mp_read_uint_padded(mp_decoder_t *d, uint64_t *u) {
+	return padded_advance(d, mp_get_uint(readoff(d), u));
+}
+
+int mp_read_int_padded(mp_decoder_t *d, int64_t *i) {
+	return padded_advance(d, mp_get_int(readoff(d), i));
+}
+
+int mp_read_float_padded(mp_decoder_t *d, float *f) {
+	return padded_advance(d, mp_get_float(readoff(d), f));
+}
+
+int mp_read_double_padded(mp_decoder_t *d, double *f) {
+	return padded_advance(d, mp_get_double(readoff(d), f));
+}
+
+int mp_read_mapsize_padded(mp_decoder_t *d, uint32_t *sz) {
+	return padded_advance(d, mp_get_mapsize(readoff(d), sz));
+}
+
+int mp_read_arraysize_padded(mp_decoder_t *d, uint32_t *sz) {
+	return padded_advance(d, mp_get_arraysize(readoff(d), sz));
+}
+
+int mp_read_strsize_padded(mp_decoder_t *d, uint32_t *sz) {
+	return padded_advance(d, mp_get_strsize(readoff(d), sz));
+}
+
+int mp_read_binsize_padded(mp_decoder_t *d, uint32_t *sz) {
+	return padded_advance(d, mp_get_binsize(readoff(d), sz));
+}
+
+int mp_read_extsize_padded(mp_decoder_t *d, int8_t *tg, uint32_t *sz) {
+	return padded_advance(d, mp_get_extsize(readoff(d), tg, sz));
+}
+
+// the payload length is the one thing that has to be checked separately
+static inline int padded_payload(mp_decoder_t *d, const unsigned char *q, const char **c, uint32_t sz) {
+	size_t off = d->off;
+	int r = padded_advance(d, q);
+	CHECK(r);
+	if (unlikely((size_t)sz > d->used - d->off)) {
+		d->off = off;
+		return ERR_MSGPACK_EOF;
+	}
+	*c = (const char*)q;
+	d->off += sz;
+	return MSGPACK_OK;
+}
+
+int mp_read_str_padded(mp_decoder_t *d, const char **s, uint32_t *sz) {
+	const unsigned char *q = mp_get_strsize(readoff(d), sz);
+	return padded_payload(d, q, s, q ? *sz : 0);
+}
+
+int mp_read_bin_padded(mp_decoder_t *d, const char **b, uint32_t *sz) {
+	const unsigned char *q = mp_get_binsize(readoff(d), sz);
+	return padded_payload(d, q, b, q ? *sz : 0);
+}
+
+int mp_skip_padded(mp_decoder_t *d) {
+	int err;
+	const unsigned char *p = skip_mem(readoff(d), d->base + d->used, 1, &err);
+	if (unlikely(p == NULL))
+		return err;
+	d->off = (size_t)(p - d->base);
+	return MSGPACK_OK;
+}
+
+int mp_cursor_skip(mp_cursor_t *c) {
+	int err;
+	const unsigned char *p = skip_mem(c->p, c->end, 1, &err);
+	if (unlikely(p == NULL))
+		return err;
+	c->p = p;
+	return MSGPACK_OK;
+}
+
 ssize_t mp_read(mp_decoder_t *d, char *buf, size_t amt) {
 	size_t avail = mp_dec_buffered(d);
 	if (avail == 0) {
@@ -574,16 +909,19 @@ int mp_read_uint(mp_decoder_t *d, uint64_t *u) {
 	switch ((tag)b) {
 	case TAG_UINT8:
 		r = read_byte(d, &b);
+		CHECK(r);
 		*u = (uint64_t)b;
-		return r;
+		return MSGPACK_OK;
 	case TAG_UINT16:
 		r = read_be16(d, &m);
+		CHECK(r);
 		*u = (uint64_t)m;
-		return r;
+		return MSGPACK_OK;
 	case TAG_UINT32:
 		r = read_be32(d, &l);
+		CHECK(r);
 		*u = (uint64_t)l;
-		return r;
+		return MSGPACK_OK;
 	case TAG_UINT64:
 		return read_be64(d, u);
 	default:
@@ -605,20 +943,24 @@ int mp_read_int(mp_decoder_t *d, int64_t *i) {
 	switch ((tag)b) {
 	case TAG_INT8:
 		r = read_byte(d, &b);
+		CHECK(r);
 		*i = (int64_t)((int8_t)b);
-		return r;
+		return MSGPACK_OK;
 	case TAG_INT16:
 		r = read_be16(d, &m);
+		CHECK(r);
 		*i = (int64_t)((int16_t)m);
-		return r;
+		return MSGPACK_OK;
 	case TAG_INT32:
 		r = read_be32(d, &l);
+		CHECK(r);
 		*i = (int64_t)((int32_t)l);
-		return r;
+		return MSGPACK_OK;
 	case TAG_INT64:
 		r = read_be64(d, &up);
+		CHECK(r);
 		*i = (int64_t)up;
-		return r;
+		return MSGPACK_OK;
 	default:
 		unread_byte(d);
 		return ERR_MSGPACK_BAD_TYPE;
@@ -692,8 +1034,9 @@ int mp_read_mapsize(mp_decoder_t *d, uint32_t *sz) {
 	switch ((tag)t) {
 	case TAG_MAP16:
 		r = read_be16(d, &u);
+		CHECK(r);
 		*sz = (uint32_t)u;
-		return r;
+		return MSGPACK_OK;
 	case TAG_MAP32:
 		return read_be32(d, sz);
 	default:
@@ -713,8 +1056,9 @@ int mp_read_arraysize(mp_decoder_t *d, uint32_t *sz) {
 	switch ((tag)t) {
 	case TAG_ARRAY16:
 		r = read_be16(d, &u);
+		CHECK(r);
 		*sz = (uint32_t)u;
-		return r;
+		return MSGPACK_OK;
 	case TAG_ARRAY32:
 		return read_be32(d, sz);
 	default:
@@ -734,12 +1078,14 @@ int mp_read_strsize(mp_decoder_t *d, uint32_t *sz) {
 	switch ((tag)t) {
 	case TAG_STR8:
 		r = read_byte(d, &t);
+		CHECK(r);
 		*sz = (uint32_t)t;
-		return r;
+		return MSGPACK_OK;
 	case TAG_STR16:
 		r = read_be16(d, &u);
+		CHECK(r);
 		*sz = (uint32_t)u;
-		return r;
+		return MSGPACK_OK;
 	case TAG_STR32:
 		return read_be32(d, sz);
 	default:
@@ -756,12 +1102,14 @@ int mp_read_binsize(mp_decoder_t *d, uint32_t *sz) {
 	switch ((tag)t) {
 	case TAG_BIN8:
 		r = read_byte(d, &t);
+		CHECK(r);
 		*sz = (uint32_t)t;
-		return r;
+		return MSGPACK_OK;
 	case TAG_BIN16:
 		r = read_be16(d, &u);
+		CHECK(r);
 		*sz = (uint32_t)u;
-		return r;
+		return MSGPACK_OK;
 	case TAG_BIN32:
 		return read_be32(d, sz);
 	default:
@@ -813,40 +1161,1105 @@ int mp_read_extsize(mp_decoder_t *d, int8_t *tg, uint32_t *sz) {
 	}
 }
 
-void mp_encode_stream_init(mp_encoder_t *e, void *ctx, mp_flush_t w, unsigned char *mem, size_t cap) {
-	e->base = mem;
-	e->off = 0;
-	e->cap = cap;
-	e->ctx = ctx;
-	e->write = w;
-	return;
+// how mp_read_any decodes each tag
+typedef enum {
+	ANY_INVALID,
+	ANY_NIL,
+	ANY_BOOL,    // value is the low bit of the tag
+	ANY_FIXINT,  // value is the tag
+	ANY_FIXSIZE, // size is tag & 'imm'
+	ANY_UINT,    // 'len'-byte body
+	ANY_INT,
+	ANY_F32,
+	ANY_F64,
+	ANY_SIZE,    // 'len'-byte size
+	ANY_EXT,     // 'len'-byte size, then a type byte
+	ANY_FIXEXT,  // size is 'imm', then a type byte
+} any_op;
+
+typedef struct {
+	uint8_t typ; // mp_typ_t
+	uint8_t op;  // any_op
+	uint8_t len; // body bytes after the tag
+	uint8_t imm;
+} any_ent;
+
+#define A(t, o, l, i) { (uint8_t)(t), (uint8_t)(o), (l), (i) }
+#define A4(t, o, l, i) A(t, o, l, i), A(t, o, l, i), A(t, o, l, i), A(t, o, l, i)
+#define A16(t, o, l, i) A4(t, o, l, i), A4(t, o, l, i), A4(t, o, l, i), A4(t, o, l, i)
+#define A32(t, o, l, i) A16(t, o, l, i), A16(t, o, l, i)
+
+static const any_ent any_table[256] = {
+	A32(MSG_INT, ANY_FIXINT, 0, 0), // 0x00-0x7f
+	A32(MSG_INT, ANY_FIXINT, 0, 0),
+	A32(MSG_INT, ANY_FIXINT, 0, 0),
+	A32(MSG_INT, ANY_FIXINT, 0, 0),
+	A16(MSG_MAP, ANY_FIXSIZE, 0, 0x0f),   // 0x80-0x8f
+	A16(MSG_ARRAY, ANY_FIXSIZE, 0, 0x0f), // 0x90-0x9f
+	A32(MSG_STR, ANY_FIXSIZE, 0, 0x1f),   // 0xa0-0xbf
+	A(MSG_NIL, ANY_NIL, 0, 0),        // TAG_NIL
+	A(MSG_INVALID, ANY_INVALID, 0, 0),// TAG_INVALID
+	A(MSG_BOOL, ANY_BOOL, 0, 0),      // TAG_FALSE
+	A(MSG_BOOL, ANY_BOOL, 0, 0),      // TAG_TRUE
+	A(MSG_BIN, ANY_SIZE, 1, 0),       // TAG_BIN8
+	A(MSG_BIN, ANY_SIZE, 2, 0),       // TAG_BIN16
+	A(MSG_BIN, ANY_SIZE, 4, 0),       // TAG_BIN32
+	A(MSG_EXT, ANY_EXT, 2, 0),        // TAG_EXT8
+	A(MSG_EXT, ANY_EXT, 3, 0),        // TAG_EXT16
+	A(MSG_EXT, ANY_EXT, 5, 0),        // TAG_EXT32
+	A(MSG_F32, ANY_F32, 4, 0),        // TAG_F32
+	A(MSG_F64, ANY_F64, 8, 0),        // TAG_F64
+	A(MSG_UINT, ANY_UINT, 1, 0),      // TAG_UINT8
+	A(MSG_UINT, ANY_UINT, 2, 0),      // TAG_UINT16
+	A(MSG_UINT, ANY_UINT, 4, 0),      // TAG_UINT32
+	A(MSG_UINT, ANY_UINT, 8, 0),      // TAG_UINT64
+	A(MSG_INT, ANY_INT, 1, 0),        // TAG_INT8
+	A(MSG_INT, ANY_INT, 2, 0),        // TAG_INT16
+	A(MSG_INT, ANY_INT, 4, 0),        // TAG_INT32
+	A(MSG_INT, ANY_INT, 8, 0),        // TAG_INT64
+	A(MSG_EXT, ANY_FIXEXT, 1, 1),     // TAG_FIXEXT1
+	A(MSG_EXT, ANY_FIXEXT, 1, 2),     // TAG_FIXEXT2
+	A(MSG_EXT, ANY_FIXEXT, 1, 4),     // TAG_FIXEXT4
+	A(MSG_EXT, ANY_FIXEXT, 1, 8),     // TAG_FIXEXT8
+	A(MSG_EXT, ANY_FIXEXT, 1, 16),    // TAG_FIXEXT16
+	A(MSG_STR, ANY_SIZE, 1, 0),       // TAG_STR8
+	A(MSG_STR, ANY_SIZE, 2, 0),       // TAG_STR16
+	A(MSG_STR, ANY_SIZE, 4, 0),       // TAG_STR32
+	A(MSG_ARRAY, ANY_SIZE, 2, 0),     // TAG_ARRAY16
+	A(MSG_ARRAY, ANY_SIZE, 4, 0),     // TAG_ARRAY32
+	A(MSG_MAP, ANY_SIZE, 2, 0),       // TAG_MAP16
+	A(MSG_MAP, ANY_SIZE, 4, 0),       // TAG_MAP32
+	A32(MSG_INT, ANY_FIXINT, 0, 0), // 0xe0-0xff
+};
+
+#undef A
+#undef A4
+#undef A16
+#undef A32
+
+// big-endian body of 1, 2, 4 or 8 bytes
+static inline uint64_t any_body(const unsigned char *p, uint8_t len) {
+	switch (len) {
+	case 1:
+		return (uint64_t)p[0];
+	case 2:
+		return (uint64_t)mp_get_be16(p);
+	case 4:
+		return (uint64_t)mp_get_be32(p);
+	default:
+		return mp_get_be64(p);
+	}
 }
 
-void mp_encode_mem_init(mp_encoder_t *e, unsigned char *mem, size_t cap) {
-	e->base = mem;
-	e->off = 0;
-	e->cap = cap;
-	e->ctx = NULL;
-	e->write = NULL;
-	return;
-}
+/*
+ * decodes the next object into 'v' without
+ * consuming it, and puts its encoded size in 'n'
+ */
+static int peek_any(mp_decoder_t *d, mp_value_t *v, size_t *n) {
+	uint8_t t;
+	const any_ent *a;
+	// no body is longer than 8 bytes
+	if (likely(mp_dec_buffered(d) >= 9)) {
+		t = *readoff(d);
+		a = &any_table[t];
+	} else {
+		int r = ensure(d, 1);
+		CHECK(r);
+		t = *readoff(d);
+		a = &any_table[t];
+		r = ensure(d, 1 + (size_t)a->len);
+		CHECK(r);
+	}
+	const unsigned char *p = readoff(d) + 1;
+	float_pun fp;
+	double_pun dp;
+	uint64_t u;
 
-int mp_flush(mp_encoder_t *e) {
-	if (e->off == 0) return MSGPACK_OK;
-	if (e->write != NULL) {
-		size_t wrote = 0;
-		while (wrote < e->off) {
-			ssize_t w = e->write(e->ctx, e->base + wrote, e->off - wrote);
-			if (unlikely(w <= 0)) {
+	v->type = (mp_typ_t)a->typ;
+	*n = 1 + (size_t)a->len;
+	switch ((any_op)a->op) {
+	case ANY_INVALID:
+		STAT_INC(d, type_mismatches);
+		return ERR_MSGPACK_BAD_TYPE;
+	case ANY_NIL:
+		break;
+	case ANY_BOOL:
+		v->v.b = (t & 1) != 0;
+		break;
+	case ANY_FIXINT:
+		v->v.i = (int64_t)((int8_t)t);
+		break;
+	case ANY_FIXSIZE:
+		v->v.size = (uint32_t)(t & a->imm);
+		break;
+	case ANY_UINT:
+		v->v.u = any_body(p, a->len);
+		break;
+	case ANY_INT:
+		u = any_body(p, a->len);
+		switch (a->len) {
+		case 1:
+			v->v.i = (int64_t)((int8_t)u);
+			break;
+		case 2:
+			v->v.i = (int64_t)((int16_t)u);
+			break;
+		case 4:
+			v->v.i = (int64_t)((int32_t)u);
+			break;
+		default:
+			v->v.i = (int64_t)u;
+			break;
+		}
+		break;
+	case ANY_F32:
+		fp.bits = mp_get_be32(p);
+		v->v.f = fp.val;
+		break;
+	case ANY_F64:
+		dp.bits = mp_get_be64(p);
+		v->v.d = dp.val;
+		break;
+	case ANY_SIZE:
+		v->v.size = (uint32_t)any_body(p, a->len);
+		break;
+	case ANY_EXT:
+		v->v.ext.size = (uint32_t)any_body(p, a->len - 1);
+		v->v.ext.type = (int8_t)p[a->len - 1];
+		break;
+	case ANY_FIXEXT:
+		v->v.ext.size = a->imm;
+		v->v.ext.type = (int8_t)p[0];
+		break;
+	}
+	return MSGPACK_OK;
+}
 
-				/* clean up partially-written state */
+int mp_read_any(mp_decoder_t *d, mp_value_t *v) {
+	size_t n;
+	int r = peek_any(d, v, &n);
+	CHECK(r);
+	d->off += n;
+	return MSGPACK_OK;
+}
+
+int mp_read_number_as_double(mp_decoder_t *d, double *f) {
+	mp_value_t v;
+	size_t n;
+	int r = peek_any(d, &v, &n);
+	CHECK(r);
+	switch (v.type) {
+	case MSG_INT:
+		*f = (double)v.v.i;
+		break;
+	case MSG_UINT:
+		*f = (double)v.v.u;
+		break;
+	case MSG_F32:
+		*f = (double)v.v.f;
+		break;
+	case MSG_F64:
+		*f = v.v.d;
+		break;
+	default:
+		STAT_INC(d, type_mismatches);
+		return ERR_MSGPACK_BAD_TYPE;
+	}
+	d->off += n;
+	return MSGPACK_OK;
+}
+
+// true if 'f' is integral and fits in an int64
+static bool double_to_int64(double f, int64_t *i) {
+	if (!(f >= -9223372036854775808.0 && f < 9223372036854775808.0))
+		return false;
+	int64_t j = (int64_t)f;
+	if ((double)j != f)
+		return false;
+	*i = j;
+	return true;
+}
+
+int mp_read_number_as_int64(mp_decoder_t *d, int64_t *i) {
+	mp_value_t v;
+	size_t n;
+	int r = peek_any(d, &v, &n);
+	CHECK(r);
+	bool ok;
+	switch (v.type) {
+	case MSG_INT:
+		*i = v.v.i;
+		ok = true;
+		break;
+	case MSG_UINT:
+		ok = v.v.u <= (uint64_t)INT64_MAX;
+		if (ok)
+			*i = (int64_t)v.v.u;
+		break;
+	case MSG_F32:
+		ok = double_to_int64((double)v.v.f, i);
+		break;
+	case MSG_F64:
+		ok = double_to_int64(v.v.d, i);
+		break;
+	default:
+		ok = false;
+		break;
+	}
+	if (unlikely(!ok)) {
+		STAT_INC(d, type_mismatches);
+		return ERR_MSGPACK_BAD_TYPE;
+	}
+	d->off += n;
+	return MSGPACK_OK;
+}
+
+typedef struct {
+	uint64_t left; // objects left, counting keys
+	bool     map;
+} walk_frame;
+
+#define WALK_BATCH 64
+
+typedef struct {
+	const mp_visitor_t *vis;
+	void   *ctx;
+	size_t  n;
+	bool    dbl; // batch holds doubles
+	union {
+		int64_t i[WALK_BATCH];
+		double  f[WALK_BATCH];
+	} buf;
+} walk_batch;
+
+static int walk_flush(walk_batch *b) {
+	if (b->n == 0)
+		return MSGPACK_OK;
+	size_t n = b->n;
+	b->n = 0;
+	if (b->dbl)
+		return b->vis->double_run(b->ctx, b->buf.f, n);
+	return b->vis->int64_run(b->ctx, b->buf.i, n);
+}
+
+// queues a run element; returns MSGPACK_OK or a callback's error
+static int walk_batch_add(walk_batch *b, const mp_value_t *v, bool dbl) {
+	int r;
+	if (b->dbl != dbl || b->n == WALK_BATCH) {
+		r = walk_flush(b);
+		CHECK(r);
+	}
+	b->dbl = dbl;
+	switch (v->type) {
+	case MSG_INT:
+		b->buf.i[b->n++] = v->v.i;
+		break;
+	case MSG_UINT:
+		b->buf.i[b->n++] = (int64_t)v->v.u;
+		break;
+	case MSG_F32:
+		b->buf.f[b->n++] = (double)v->v.f;
+		break;
+	default:
+		b->buf.f[b->n++] = v->v.d;
+		break;
+	}
+	return MSGPACK_OK;
+}
+
+#define VISIT(vis, cb, ...) ((vis)->cb == NULL ? MSGPACK_OK : (vis)->cb(__VA_ARGS__))
+
+int mp_walk(mp_decoder_t *d, const mp_visitor_t *vis, void *ctx) {
+	walk_frame stack[MP_WALK_MAX_DEPTH];
+	size_t depth = 0;
+	walk_batch b;
+	b.vis = vis;
+	b.ctx = ctx;
+	b.n = 0;
+	b.dbl = false;
+
+	do {
+		mp_value_t v;
+		size_t n;
+		int r = peek_any(d, &v, &n);
+		CHECK(r);
+
+		walk_frame *top = depth > 0 ? &stack[depth-1] : NULL;
+		bool iskey = top != NULL && top->map && (top->left & 1) == 0;
+		if (top != NULL)
+			top->left--;
+
+		// runs of numbers in arrays
+		if (top != NULL && !top->map) {
+			bool isint = v.type == MSG_INT || (v.type == MSG_UINT && v.v.u <= (uint64_t)INT64_MAX);
+			bool isdbl = v.type == MSG_F32 || v.type == MSG_F64;
+			if ((isint && vis->int64_run != NULL) || (isdbl && vis->double_run != NULL)) {
+				r = walk_batch_add(&b, &v, isdbl);
+				CHECK(r);
+				d->off += n;
+				goto close;
+			}
+		}
+		r = walk_flush(&b);
+		CHECK(r);
+
+		// payloads are passed in place
+		const char *p = NULL;
+		uint32_t sz = 0;
+		switch (v.type) {
+		case MSG_STR:
+		case MSG_BIN:
+			sz = v.v.size;
+			break;
+		case MSG_EXT:
+			sz = v.v.ext.size;
+			break;
+		default:
+			break;
+		}
+		if (sz > 0) {
+			r = ensure(d, n + (size_t)sz);
+			CHECK(r);
+			p = (const char*)readoff(d) + n;
+		}
+		d->off += n + (size_t)sz;
+
+		switch (v.type) {
+		case MSG_MAP:
+		case MSG_ARRAY:
+			if (unlikely(depth == MP_WALK_MAX_DEPTH))
+				return ERR_MSGPACK_TOO_DEEP;
+			if (v.type == MSG_MAP)
+				r = VISIT(vis, begin_map, ctx, v.v.size);
+			else
+				r = VISIT(vis, begin_array, ctx, v.v.size);
+			CHECK(r);
+			stack[depth].map = v.type == MSG_MAP;
+			stack[depth].left = stack[depth].map ? 2*(uint64_t)v.v.size : (uint64_t)v.v.size;
+			++depth;
+			break;
+		case MSG_NIL:
+			r = VISIT(vis, nil, ctx);
+			break;
+		case MSG_BOOL:
+			r = VISIT(vis, boolean, ctx, v.v.b);
+			break;
+		case MSG_INT:
+			r = VISIT(vis, int64, ctx, v.v.i);
+			break;
+		case MSG_UINT:
+			r = VISIT(vis, uint64, ctx, v.v.u);
+			break;
+		case MSG_F32:
+			r = VISIT(vis, f32, ctx, v.v.f);
+			break;
+		case MSG_F64:
+			r = VISIT(vis, f64, ctx, v.v.d);
+			break;
+		case MSG_STR:
+			if (iskey && vis->key != NULL)
+				r = vis->key(ctx, p, sz);
+			else
+				r = VISIT(vis, str, ctx, p, sz);
+			break;
+		case MSG_BIN:
+			r = VISIT(vis, bin, ctx, p, sz);
+			break;
+		case MSG_EXT:
+			r = VISIT(vis, ext, ctx, v.v.ext.type, p, sz);
+			break;
+		default:
+			return ERR_MSGPACK_BAD_TYPE;
+		}
+		CHECK(r);
+
+	close:
+		// pop every container that just ended
+		while (depth > 0 && stack[depth-1].left == 0) {
+			--depth;
+			if (stack[depth].map) {
+				r = VISIT(vis, end_map, ctx);
+			} else {
+				r = walk_flush(&b);
+				CHECK(r);
+				r = VISIT(vis, end_array, ctx);
+			}
+			CHECK(r);
+		}
+	} while (depth > 0);
+	return MSGPACK_OK;
+}
+
+#undef VISIT
+
+// FNV-1a
+static uint64_t hash_bytes(const unsigned char *p, size_t len) {
+	uint64_t h = 0xcbf29ce484222325;
+	while (len--) {
+		h ^= (uint64_t)(*p++);
+		h *= 0x100000001b3;
+	}
+	return h;
+}
+
+void mp_intern_init(mp_intern_t *t, mp_intern_slot_t *slots, size_t nslots, char *strs, size_t strcap) {
+	assert(nslots >= 2 && (nslots&(nslots-1)) == 0);
+	memset(slots, 0, nslots * sizeof(mp_intern_slot_t));
+	t->slots = slots;
+	t->mask = nslots - 1;
+	t->strs = strs;
+	t->strcap = strcap;
+	t->stroff = 0;
+	t->count = 0;
+	t->limit = (nslots/2 < MP_KEY_UNKNOWN) ? (uint32_t)(nslots/2) : MP_KEY_UNKNOWN-1;
+	t->frozen = false;
+	return;
+}
+
+// returns the slot holding the key, or the empty slot where it belongs
+static mp_intern_slot_t *intern_probe(const mp_intern_t *t, const unsigned char *key, uint32_t len, uint64_t h) {
+	size_t i = (size_t)h & t->mask;
+	for (;;) {
+		mp_intern_slot_t *s = &t->slots[i];
+		if (s->key == NULL)
+			return s;
+		if (s->hash == h && s->len == len && memcmp(s->key, key, len) == 0)
+			return s;
+		i = (i + 1) & t->mask;
+	}
+}
+
+static int intern_insert(mp_intern_t *t, mp_intern_slot_t *s, const unsigned char *key, uint32_t len, uint64_t h) {
+	if (t->frozen || t->count == t->limit || (size_t)len > t->strcap - t->stroff)
+		return ERR_MSGPACK_EOF;
+
+	char *dst = t->strs + t->stroff;
+	memcpy(dst, key, len);
+	t->stroff += len;
+	s->hash = h;
+	s->len = len;
+	s->id = t->count++;
+	s->key = dst;
+	return MSGPACK_OK;
+}
+
+int mp_intern_add(mp_intern_t *t, const char *key, uint32_t len, uint32_t *id) {
+	const unsigned char *k = (const unsigned char*)key;
+	uint64_t h = hash_bytes(k, len);
+	mp_intern_slot_t *s = intern_probe(t, k, len, h);
+	if (s->key == NULL) {
+		int r = intern_insert(t, s, k, len, h);
+		CHECK(r);
+	}
+	*id = s->id;
+	return MSGPACK_OK;
+}
+
+uint32_t mp_intern_find(const mp_intern_t *t, const char *key, uint32_t len) {
+	const unsigned char *k = (const unsigned char*)key;
+	mp_intern_slot_t *s = intern_probe(t, k, len, hash_bytes(k, len));
+	return (s->key == NULL) ? MP_KEY_UNKNOWN : s->id;
+}
+
+void mp_intern_freeze(mp_intern_t *t) { t->frozen = true; }
+
+uint32_t mp_intern_count(const mp_intern_t *t) { return t->count; }
+
+int mp_read_key_id(mp_decoder_t *d, mp_intern_t *t, uint32_t *id) {
+	uint32_t sz;
+	unsigned char *key;
+	int r = mp_read_strsize(d, &sz);
+	CHECK(r);
+	r = decoder_next(d, (size_t)sz, &key);
+	CHECK(r);
+
+	uint64_t h = hash_bytes(key, sz);
+	mp_intern_slot_t *s = intern_probe(t, key, sz, h);
+	if (s->key == NULL && intern_insert(t, s, key, sz, h) != MSGPACK_OK) {
+		*id = MP_KEY_UNKNOWN;
+		return MSGPACK_OK;
+	}
+	*id = s->id;
+	return MSGPACK_OK;
+}
+
+int mp_projection_init(mp_projection_t *p, const mp_field_t *fields, size_t nfields,
+	mp_intern_slot_t *slots, size_t nslots, char *strs, size_t strcap) {
+	if (nfields > MP_PROJECT_MAX)
+		return ERR_MSGPACK_BAD_TYPE;
+	mp_intern_init(&p->keys, slots, nslots, strs, strcap);
+	p->fields = fields;
+	p->nfields = nfields;
+	p->maxkey = 0;
+	for (size_t i=0; i<nfields; ++i) {
+		uint32_t len = (uint32_t)strlen(fields[i].key);
+		uint32_t id;
+		int r = mp_intern_add(&p->keys, fields[i].key, len, &id);
+		CHECK(r);
+		if (id != (uint32_t)i)
+			return ERR_MSGPACK_BAD_TYPE;
+		if (len > p->maxkey)
+			p->maxkey = len;
+	}
+	mp_intern_freeze(&p->keys);
+	return MSGPACK_OK;
+}
+
+// decodes one projected value into 'dst'
+static int project_field(mp_decoder_t *d, mp_field_typ_t typ, char *dst) {
+	mp_value_t v;
+	mp_strref_t ref;
+	unsigned char *c;
+	uint32_t sz;
+	bool b;
+	int r;
+	switch (typ) {
+	case MP_FIELD_INT64:
+		r = mp_read_number_as_int64(d, &v.v.i);
+		CHECK(r);
+		memcpy(dst, &v.v.i, sizeof(int64_t));
+		return MSGPACK_OK;
+	case MP_FIELD_UINT64:
+		r = mp_read_any(d, &v);
+		CHECK(r);
+		if (v.type == MSG_INT && v.v.i >= 0) {
+			v.v.u = (uint64_t)v.v.i;
+		} else if (v.type != MSG_UINT) {
+			STAT_INC(d, type_mismatches);
+			return ERR_MSGPACK_BAD_TYPE;
+		}
+		memcpy(dst, &v.v.u, sizeof(uint64_t));
+		return MSGPACK_OK;
+	case MP_FIELD_DOUBLE:
+		r = mp_read_number_as_double(d, &v.v.d);
+		CHECK(r);
+		memcpy(dst, &v.v.d, sizeof(double));
+		return MSGPACK_OK;
+	case MP_FIELD_BOOL:
+		r = mp_read_bool(d, &b);
+		CHECK(r);
+		memcpy(dst, &b, sizeof(bool));
+		return MSGPACK_OK;
+	case MP_FIELD_STR:
+		r = mp_read_strsize(d, &sz);
+		CHECK(r);
+		r = decoder_next(d, (size_t)sz, &c);
+		CHECK(r);
+		ref.s = (const char*)c;
+		ref.sz = sz;
+		memcpy(dst, &ref, sizeof(ref));
+		return MSGPACK_OK;
+	}
+	return ERR_MSGPACK_BAD_TYPE;
+}
+
+int mp_decode_project(mp_decoder_t *d, const mp_projection_t *p, void *out, uint64_t *found) {
+	uint32_t n;
+	uint64_t set = 0;
+	int r = mp_read_mapsize(d, &n);
+	CHECK(r);
+	for (uint32_t i=0; i<n; ++i) {
+		uint32_t id = MP_KEY_UNKNOWN;
+		uint32_t sz;
+		unsigned char *key;
+
+		// non-string keys and long keys can't match
+		r = mp_read_strsize(d, &sz);
+		if (r == ERR_MSGPACK_BAD_TYPE) {
+			r = mp_skip(d);
+			CHECK(r);
+		} else {
+			CHECK(r);
+			if (sz > p->maxkey) {
+				r = skipn(d, (size_t)sz);
+				CHECK(r);
+			} else {
+				r = decoder_next(d, (size_t)sz, &key);
+				CHECK(r);
+				mp_intern_slot_t *s = intern_probe(&p->keys, key, sz, hash_bytes(key, sz));
+				if (s->key != NULL)
+					id = s->id;
+			}
+		}
+
+		if (id == MP_KEY_UNKNOWN) {
+			r = mp_skip(d);
+			CHECK(r);
+			continue;
+		}
+		unsigned char *c;
+		r = decoder_peek(d, &c);
+		CHECK(r);
+		if (*c == TAG_NIL) {
+			d->off++;
+			continue;
+		}
+		const mp_field_t *f = &p->fields[id];
+		r = project_field(d, f->typ, (char*)out + f->offset);
+		CHECK(r);
+		set |= (uint64_t)1 << id;
+	}
+	if (found != NULL)
+		*found = set;
+	return MSGPACK_OK;
+}
+
+void mp_filter_init(mp_filter_t *f) {
+	f->npreds = 0;
+	return;
+}
+
+static mp_pred_t *filter_add(mp_filter_t *f, const char *key, mp_pred_op_t op) {
+	if (f->npreds == MP_FILTER_MAX)
+		return NULL;
+	mp_pred_t *p = &f->preds[f->npreds++];
+	p->key = key;
+	p->keylen = (uint32_t)strlen(key);
+	p->op = op;
+	return p;
+}
+
+int mp_filter_exists(mp_filter_t *f, const char *key) {
+	return filter_add(f, key, MP_PRED_EXISTS) ? MSGPACK_OK : ERR_MSGPACK_EOF;
+}
+
+int mp_filter_int_eq(mp_filter_t *f, const char *key, int64_t i) {
+	return mp_filter_int_range(f, key, i, i);
+}
+
+int mp_filter_int_range(mp_filter_t *f, const char *key, int64_t lo, int64_t hi) {
+	mp_pred_t *p = filter_add(f, key, MP_PRED_INT_RANGE);
+	if (p == NULL)
+		return ERR_MSGPACK_EOF;
+	p->arg.i.lo = lo;
+	p->arg.i.hi = hi;
+	return MSGPACK_OK;
+}
+
+int mp_filter_double_range(mp_filter_t *f, const char *key, double lo, double hi) {
+	mp_pred_t *p = filter_add(f, key, MP_PRED_DOUBLE_RANGE);
+	if (p == NULL)
+		return ERR_MSGPACK_EOF;
+	p->arg.f.lo = lo;
+	p->arg.f.hi = hi;
+	return MSGPACK_OK;
+}
+
+int mp_filter_str_eq(mp_filter_t *f, const char *key, const char *s, uint32_t sz) {
+	mp_pred_t *p = filter_add(f, key, MP_PRED_STR_EQ);
+	if (p == NULL)
+		return ERR_MSGPACK_EOF;
+	p->arg.str.s = s;
+	p->arg.str.sz = sz;
+	return MSGPACK_OK;
+}
+
+int mp_filter_str_prefix(mp_filter_t *f, const char *key, const char *s, uint32_t sz) {
+	mp_pred_t *p = filter_add(f, key, MP_PRED_STR_PREFIX);
+	if (p == NULL)
+		return ERR_MSGPACK_EOF;
+	p->arg.str.s = s;
+	p->arg.str.sz = sz;
+	return MSGPACK_OK;
+}
+
+/*
+ * tests a predicate against a value that is
+ * known to lie entirely within the buffer
+ */
+static bool pred_eval(const mp_pred_t *p, const unsigned char *v) {
+	int64_t i;
+	uint64_t u;
+	double f;
+	float g;
+	const char *s;
+	uint32_t sz;
+
+	switch (p->op) {
+	case MP_PRED_EXISTS:
+		return true;
+	case MP_PRED_INT_RANGE:
+		if (mp_get_int(v, &i) != NULL)
+			return i >= p->arg.i.lo && i <= p->arg.i.hi;
+		if (mp_get_uint(v, &u) != NULL)
+			return p->arg.i.hi >= 0 && u <= (uint64_t)p->arg.i.hi &&
+				(p->arg.i.lo <= 0 || u >= (uint64_t)p->arg.i.lo);
+		return false;
+	case MP_PRED_DOUBLE_RANGE:
+		if (mp_get_double(v, &f) != NULL) {
+			// (nothing)
+		} else if (mp_get_float(v, &g) != NULL) {
+			f = (double)g;
+		} else if (mp_get_int(v, &i) != NULL) {
+			f = (double)i;
+		} else if (mp_get_uint(v, &u) != NULL) {
+			f = (double)u;
+		} else {
+			return false;
+		}
+		return f >= p->arg.f.lo && f <= p->arg.f.hi;
+	case MP_PRED_STR_EQ:
+		return mp_get_str(v, &s, &sz) != NULL && sz == p->arg.str.sz &&
+			memcmp(s, p->arg.str.s, sz) == 0;
+	case MP_PRED_STR_PREFIX:
+		return mp_get_str(v, &s, &sz) != NULL && sz >= p->arg.str.sz &&
+			memcmp(s, p->arg.str.s, p->arg.str.sz) == 0;
+	}
+	return false;
+}
+
+/*
+ * runs a filter over the record at 'p', putting the
+ * end of the record in 'rec_end' and whether it
+ * matched in 'match'
+ */
+static int filter_record(const mp_filter_t *f, const unsigned char *p, const unsigned char *end,
+	const unsigned char **rec_end, bool *match) {
+	int err;
+	size_t this, sub;
+	int r = span(p, (size_t)(end - p), &this, &sub);
+	CHECK(r);
+	if (unlikely(this > (size_t)(end - p)))
+		return ERR_MSGPACK_EOF;
+	*match = false;
+	if (mp_type(*p) != MSG_MAP) {
+		p = skip_mem(p + this, end, sub, &err);
+		if (p == NULL)
+			return err;
+		*rec_end = p;
+		return MSGPACK_OK;
+	}
+
+	uint32_t pending = (uint32_t)((1ULL << f->npreds) - 1);
+	size_t pairs = sub / 2;
+	p += this;
+	while (pairs > 0 && pending != 0) {
+		const unsigned char *k = p;
+		const unsigned char *v = skip_mem(k, end, 1, &err);
+		if (v == NULL)
+			return err;
+		p = skip_mem(v, end, 1, &err);
+		if (p == NULL)
+			return err;
+		--pairs;
+
+		const char *key;
+		uint32_t ksz;
+		if (mp_get_str(k, &key, &ksz) == NULL)
+			continue;
+		for (size_t i=0; i<f->npreds; ++i) {
+			const mp_pred_t *pr = &f->preds[i];
+			if (pr->keylen != ksz || memcmp(pr->key, key, ksz) != 0)
+				continue;
+			if (!pred_eval(pr, v))
+				goto done;
+			pending &= ~((uint32_t)1 << i);
+		}
+	}
+	*match = pending == 0;
+
+done:
+	// skip whatever is left of the record
+	p = skip_mem(p, end, 2*pairs, &err);
+	if (p == NULL)
+		return err;
+	*rec_end = p;
+	return MSGPACK_OK;
+}
+
+int mp_filter_next(const mp_filter_t *f, mp_decoder_t *d, const unsigned char **rec, size_t *len) {
+	const unsigned char *end = d->base + d->used;
+	while (d->off < d->used) {
+		const unsigned char *p = readoff(d);
+		const unsigned char *q = p;
+		bool match;
+		int r = filter_record(f, p, end, &q, &match);
+		CHECK(r);
+		d->off = (size_t)(q - d->base);
+		if (match) {
+			*rec = p;
+			*len = (size_t)(q - p);
+			return MSGPACK_OK;
+		}
+	}
+	return ERR_MSGPACK_EOF;
+}
+
+void mp_agg_init(mp_agg_t *a) {
+	a->count = 0;
+	a->sum = 0;
+	a->min = INFINITY;
+	a->max = -INFINITY;
+	return;
+}
+
+static inline void agg_add(mp_agg_t *a, double f) {
+	a->count++;
+	a->sum += f;
+	a->min = f < a->min ? f : a->min;
+	a->max = f > a->max ? f : a->max;
+}
+
+// folds a decoded value; nil is ignored
+static int agg_value(mp_agg_t *a, const mp_value_t *v) {
+	switch (v->type) {
+	case MSG_INT:
+		agg_add(a, (double)v->v.i);
+		return MSGPACK_OK;
+	case MSG_UINT:
+		agg_add(a, (double)v->v.u);
+		return MSGPACK_OK;
+	case MSG_F32:
+		agg_add(a, (double)v->v.f);
+		return MSGPACK_OK;
+	case MSG_F64:
+		agg_add(a, v->v.d);
+		return MSGPACK_OK;
+	case MSG_NIL:
+		return MSGPACK_OK;
+	default:
+		return ERR_MSGPACK_BAD_TYPE;
+	}
+}
+
+static inline bool is_fixint(uint8_t b) {
+	return (int8_t)b >= -32;
+}
+
+/*
+ * each run kernel folds up to 'max' consecutive
+ * elements at 'p' that all have one encoding,
+ * and returns how many it folded
+ */
+
+static size_t agg_fixint_run(const unsigned char *p, size_t max, mp_agg_t *a) {
+	size_t i = 0;
+	int64_t sum = 0;
+	int lo = 127, hi = -32;
+#ifdef __SSE2__
+	const __m128i lim = _mm_set1_epi8(-33);
+	const __m128i ones = _mm_set1_epi16(1);
+	const __m128i zero = _mm_setzero_si128();
+	for (;;) {
+		// int32 lanes gain at most 508 per step, so reduce often
+		__m128i vsum = zero;
+		__m128i vmin = _mm_set1_epi16(127);
+		__m128i vmax = _mm_set1_epi16(-32);
+		size_t start = i;
+		while (i + 16 <= max && i - start < ((size_t)1 << 20)) {
+			__m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+			if (_mm_movemask_epi8(_mm_cmpgt_epi8(v, lim)) != 0xffff)
+				break;
+			__m128i sign = _mm_cmpgt_epi8(zero, v);
+			__m128i lo16 = _mm_unpacklo_epi8(v, sign);
+			__m128i hi16 = _mm_unpackhi_epi8(v, sign);
+			vsum = _mm_add_epi32(vsum, _mm_madd_epi16(lo16, ones));
+			vsum = _mm_add_epi32(vsum, _mm_madd_epi16(hi16, ones));
+			vmin = _mm_min_epi16(vmin, _mm_min_epi16(lo16, hi16));
+			vmax = _mm_max_epi16(vmax, _mm_max_epi16(lo16, hi16));
+			i += 16;
+		}
+		if (i == start)
+			break;
+		int32_t s4[4];
+		int16_t mn[8], mx[8];
+		_mm_storeu_si128((__m128i *)s4, vsum);
+		_mm_storeu_si128((__m128i *)mn, vmin);
+		_mm_storeu_si128((__m128i *)mx, vmax);
+		sum += (int64_t)s4[0] + s4[1] + s4[2] + s4[3];
+		for (int j=0; j<8; ++j) {
+			lo = mn[j] < lo ? mn[j] : lo;
+			hi = mx[j] > hi ? mx[j] : hi;
+		}
+	}
+#endif
+	for (; i < max && is_fixint(p[i]); ++i) {
+		int v = (int8_t)p[i];
+		sum += v;
+		lo = v < lo ? v : lo;
+		hi = v > hi ? v : hi;
+	}
+	if (i > 0) {
+		a->count += i;
+		a->sum += (double)sum;
+		a->min = (double)lo < a->min ? (double)lo : a->min;
+		a->max = (double)hi > a->max ? (double)hi : a->max;
+	}
+	return i;
+}
+
+static size_t agg_int32_run(const unsigned char *p, size_t max, mp_agg_t *a) {
+	size_t i = 0;
+	int64_t sum = 0;
+	int32_t lo = INT32_MAX, hi = INT32_MIN;
+	for (; i < max && p[5*i] == TAG_INT32; ++i) {
+		int32_t v = (int32_t)mp_get_be32(p + 5*i + 1);
+		sum += v;
+		lo = v < lo ? v : lo;
+		hi = v > hi ? v : hi;
+	}
+	if (i > 0) {
+		a->count += i;
+		a->sum += (double)sum;
+		a->min = (double)lo < a->min ? (double)lo : a->min;
+		a->max = (double)hi > a->max ? (double)hi : a->max;
+	}
+	return i;
+}
+
+static size_t agg_f64_run(const unsigned char *p, size_t max, mp_agg_t *a) {
+	size_t i = 0;
+	double sum = 0, lo = a->min, hi = a->max;
+	for (; i < max && p[9*i] == TAG_F64; ++i) {
+		double_pun dp;
+		dp.bits = mp_get_be64(p + 9*i + 1);
+		sum += dp.val;
+		lo = dp.val < lo ? dp.val : lo;
+		hi = dp.val > hi ? dp.val : hi;
+	}
+	a->count += i;
+	a->sum += sum;
+	a->min = lo;
+	a->max = hi;
+	return i;
+}
+
+int mp_array_agg(mp_decoder_t *d, mp_agg_t *a) {
+	uint32_t n;
+	int r = mp_read_arraysize(d, &n);
+	CHECK(r);
+	while (n > 0) {
+		r = ensure(d, 1);
+		CHECK(r);
+		const unsigned char *p = readoff(d);
+		size_t avail = mp_dec_buffered(d);
+		size_t run = 0, stride = 1;
+		if (is_fixint(*p)) {
+			run = agg_fixint_run(p, n < avail ? n : avail, a);
+		} else if (*p == TAG_INT32) {
+			stride = 5;
+			run = agg_int32_run(p, n < avail/stride ? n : avail/stride, a);
+		} else if (*p == TAG_F64) {
+			stride = 9;
+			run = agg_f64_run(p, n < avail/stride ? n : avail/stride, a);
+		}
+		if (run > 0) {
+			n -= (uint32_t)run;
+			d->off += run * stride;
+			continue;
+		}
+
+		mp_value_t v;
+		r = mp_read_any(d, &v);
+		CHECK(r);
+		r = agg_value(a, &v);
+		if (unlikely(r)) {
+			STAT_INC(d, type_mismatches);
+			return r;
+		}
+		--n;
+	}
+	return MSGPACK_OK;
+}
+
+int mp_array_agg_field(mp_decoder_t *d, const char *key, mp_agg_t *a) {
+	size_t klen = strlen(key);
+	uint32_t n;
+	int r = mp_read_arraysize(d, &n);
+	CHECK(r);
+	for (uint32_t i=0; i<n; ++i) {
+		uint32_t pairs;
+		r = mp_read_mapsize(d, &pairs);
+		CHECK(r);
+		for (uint32_t j=0; j<pairs; ++j) {
+			uint32_t sz;
+			unsigned char *k;
+			bool match = false;
+			r = mp_read_strsize(d, &sz);
+			if (r == ERR_MSGPACK_BAD_TYPE) {
+				r = mp_skip(d);
+				CHECK(r);
+			} else {
+				CHECK(r);
+				if ((size_t)sz == klen) {
+					r = decoder_next(d, klen, &k);
+					CHECK(r);
+					match = memcmp(k, key, klen) == 0;
+				} else {
+					r = skipn(d, (size_t)sz);
+					CHECK(r);
+				}
+			}
+			if (!match) {
+				r = mp_skip(d);
+				CHECK(r);
+				continue;
+			}
+			mp_value_t v;
+			r = mp_read_any(d, &v);
+			CHECK(r);
+			r = agg_value(a, &v);
+			if (unlikely(r)) {
+				STAT_INC(d, type_mismatches);
+				return r;
+			}
+		}
+	}
+	return MSGPACK_OK;
+}
+
+void mp_encode_stream_init(mp_encoder_t *e, void *ctx, mp_flush_t w, unsigned char *mem, size_t cap) {
+	e->base = mem;
+	e->off = 0;
+	e->cap = cap;
+	e->ctx = ctx;
+	e->write = w;
+	e->counted = 0;
+	STAT_RESET(e);
+	return;
+}
+
+void mp_encode_mem_init(mp_encoder_t *e, unsigned char *mem, size_t cap) {
+	e->base = mem;
+	e->off = 0;
+	e->cap = cap;
+	e->ctx = NULL;
+	e->write = NULL;
+	e->counted = 0;
+	STAT_RESET(e);
+	return;
+}
+
+// the 'flush' of a counting encoder
+static ssize_t count_bytes(void *ctx, const void *buf, size_t amt) {
+	(void)buf;
+	*(size_t*)ctx += amt;
+	return (ssize_t)amt;
+}
+
+void mp_encode_count_init(mp_encoder_t *e, unsigned char *mem, size_t cap) {
+	mp_encode_stream_init(e, &e->counted, count_bytes, mem, cap);
+}
+
+int mp_flush(mp_encoder_t *e) {
+	if (e->off == 0) return MSGPACK_OK;
+	if (e->write != NULL) {
+		size_t wrote = 0;
+		while (wrote < e->off) {
+			ssize_t w = e->write(e->ctx, e->base + wrote, e->off - wrote);
+			STAT_INC(e, flushes);
+			if (unlikely(w <= 0)) {
+
+				/* clean up partially-written state */
 				if (wrote) {
+					STAT_INC(e, partial_writes);
 					e->off -= wrote;
 					memmove(e->base, e->base+wrote, e->off);
 				}
 
 				return ERR_MSGPACK_CHECK_ERRNO;
 			}
+			STAT_ADD(e, flush_bytes, w);
 			wrote += (size_t)w;
 		}
 		e->off = 0;
@@ -858,10 +2271,153 @@ size_t mp_enc_buffered(mp_encoder_t *e) { return e->off; }
 
 size_t mp_enc_capacity(mp_encoder_t *e) { return e->cap; }
 
+size_t mp_enc_count(mp_encoder_t *e) { return e->counted + e->off; }
+
+#ifdef MSGPACK_STATS
+
+// process-wide totals
+static struct {
+	_Atomic uint64_t fills;
+	_Atomic uint64_t fill_bytes;
+	_Atomic uint64_t short_reads;
+	_Atomic uint64_t type_mismatches;
+	_Atomic uint64_t max_skip_depth;
+} dec_totals;
+
+static struct {
+	_Atomic uint64_t flushes;
+	_Atomic uint64_t flush_bytes;
+	_Atomic uint64_t partial_writes;
+	_Atomic uint64_t bypass_writes;
+} enc_totals;
+
+static void atomic_max(_Atomic uint64_t *dst, uint64_t v) {
+	uint64_t cur = atomic_load_explicit(dst, memory_order_relaxed);
+	while (cur < v && !atomic_compare_exchange_weak_explicit(dst, &cur, v, 
+				memory_order_relaxed, memory_order_relaxed));
+	return;
+}
+
+#endif
+
+void mp_dec_stats(mp_decoder_t *d, mp_dec_stats_t *s) {
+#ifdef MSGPACK_STATS
+	*s = d->stats;
+#else
+	(void)d;
+	memset(s, 0, sizeof(*s));
+#endif
+	return;
+}
+
+void mp_enc_stats(mp_encoder_t *e, mp_enc_stats_t *s) {
+#ifdef MSGPACK_STATS
+	*s = e->stats;
+#else
+	(void)e;
+	memset(s, 0, sizeof(*s));
+#endif
+	return;
+}
+
+void mp_dec_stats_reset(mp_decoder_t *d) { STAT_RESET(d); }
+
+void mp_enc_stats_reset(mp_encoder_t *e) { STAT_RESET(e); }
+
+void mp_dec_stats_add(mp_dec_stats_t *dst, const mp_dec_stats_t *src) {
+	dst->fills += src->fills;
+	dst->fill_bytes += src->fill_bytes;
+	dst->short_reads += src->short_reads;
+	dst->type_mismatches += src->type_mismatches;
+	if (src->max_skip_depth > dst->max_skip_depth)
+		dst->max_skip_depth = src->max_skip_depth;
+	return;
+}
+
+void mp_enc_stats_add(mp_enc_stats_t *dst, const mp_enc_stats_t *src) {
+	dst->flushes += src->flushes;
+	dst->flush_bytes += src->flush_bytes;
+	dst->partial_writes += src->partial_writes;
+	dst->bypass_writes += src->bypass_writes;
+	return;
+}
+
+void mp_dec_stats_publish(mp_decoder_t *d) {
+#ifdef MSGPACK_STATS
+	atomic_fetch_add_explicit(&dec_totals.fills, d->stats.fills, memory_order_relaxed);
+	atomic_fetch_add_explicit(&dec_totals.fill_bytes, d->stats.fill_bytes, memory_order_relaxed);
+	atomic_fetch_add_explicit(&dec_totals.short_reads, d->stats.short_reads, memory_order_relaxed);
+	atomic_fetch_add_explicit(&dec_totals.type_mismatches, d->stats.type_mismatches, memory_order_relaxed);
+	atomic_max(&dec_totals.max_skip_depth, d->stats.max_skip_depth);
+	STAT_RESET(d);
+#else
+	(void)d;
+#endif
+	return;
+}
+
+void mp_enc_stats_publish(mp_encoder_t *e) {
+#ifdef MSGPACK_STATS
+	atomic_fetch_add_explicit(&enc_totals.flushes, e->stats.flushes, memory_order_relaxed);
+	atomic_fetch_add_explicit(&enc_totals.flush_bytes, e->stats.flush_bytes, memory_order_relaxed);
+	atomic_fetch_add_explicit(&enc_totals.partial_writes, e->stats.partial_writes, memory_order_relaxed);
+	atomic_fetch_add_explicit(&enc_totals.bypass_writes, e->stats.bypass_writes, memory_order_relaxed);
+	STAT_RESET(e);
+#else
+	(void)e;
+#endif
+	return;
+}
+
+void mp_dec_stats_global(mp_dec_stats_t *s) {
+#ifdef MSGPACK_STATS
+	s->fills = atomic_load_explicit(&dec_totals.fills, memory_order_relaxed);
+	s->fill_bytes = atomic_load_explicit(&dec_totals.fill_bytes, memory_order_relaxed);
+	s->short_reads = atomic_load_explicit(&dec_totals.short_reads, memory_order_relaxed);
+	s->type_mismatches = atomic_load_explicit(&dec_totals.type_mismatches, memory_order_relaxed);
+	s->max_skip_depth = atomic_load_explicit(&dec_totals.max_skip_depth, memory_order_relaxed);
+#else
+	memset(s, 0, sizeof(*s));
+#endif
+	return;
+}
+
+void mp_enc_stats_global(mp_enc_stats_t *s) {
+#ifdef MSGPACK_STATS
+	s->flushes = atomic_load_explicit(&enc_totals.flushes, memory_order_relaxed);
+	s->flush_bytes = atomic_load_explicit(&enc_totals.flush_bytes, memory_order_relaxed);
+	s->partial_writes = atomic_load_explicit(&enc_totals.partial_writes, memory_order_relaxed);
+	s->bypass_writes = atomic_load_explicit(&enc_totals.bypass_writes, memory_order_relaxed);
+#else
+	memset(s, 0, sizeof(*s));
+#endif
+	return;
+}
+
 static size_t avail(mp_encoder_t *e) {
 	return e->cap - e->off;
 }
 
+// makes room for 'amt' contiguous bytes in the buffer
+static int reserve_slow(mp_encoder_t *e, size_t amt) {
+	if (e->write == NULL || amt > e->cap)
+		return ERR_MSGPACK_EOF;
+	return mp_flush(e);
+}
+
+static inline int reserve(mp_encoder_t *e, size_t amt) {
+	if (amt <= avail(e))
+		return MSGPACK_OK;
+	return reserve_slow(e, amt);
+}
+
+int mp_reserve(mp_encoder_t *e, size_t n, unsigned char **p) {
+	int r = reserve(e, n);
+	CHECK(r);
+	*p = e->base + e->off;
+	return MSGPACK_OK;
+}
+
 ssize_t mp_write(mp_encoder_t *e, const char *buf, size_t amt) {
 	if (amt > avail(e)) {
 
@@ -879,8 +2435,10 @@ ssize_t mp_write(mp_encoder_t *e, const char *buf, size_t amt) {
 		 * write it directly to the
 		 * stream.
 		 */
-		if (amt > e->cap)
+		if (amt > e->cap) {
+			STAT_INC(e, bypass_writes);
 			return e->write(e->ctx, buf, amt);
+		}
 
 	}
 	memcpy(e->base + e->off, buf, amt);
@@ -889,30 +2447,24 @@ ssize_t mp_write(mp_encoder_t *e, const char *buf, size_t amt) {
 }
 
 int mp_write_byte(mp_encoder_t *e, unsigned char b) {
-	if (avail(e) == 0) {
-		int r = mp_flush(e);
-		CHECK(r);
-	}
+	int r = reserve(e, 1);
+	CHECK(r);
 	*(e->base + e->off) = b;
 	++e->off;
 	return MSGPACK_OK;
 }
 
 static inline int next(mp_encoder_t *e, size_t amt, unsigned char **c)  {
-	if (amt > avail(e)) {
-		int r = mp_flush(e);
-		CHECK(r);
-	}
+	int r = reserve(e, amt);
+	CHECK(r);
 	*c = e->base + e->off;
 	e->off += amt;
 	return MSGPACK_OK;
 }
 
 static int write_byte(mp_encoder_t *e, uint8_t b) {
-	if (avail(e) == 0) {
-		int r = mp_flush(e);
-		CHECK(r);
-	}
+	int r = reserve(e, 1);
+	CHECK(r);
 	unsigned char *c = e->base + e->off;
 	*c = b;
 	++e->off;
@@ -966,25 +2518,22 @@ static int write_prefix64(mp_encoder_t *e, tag t, uint64_t u) {
 	return MSGPACK_OK;
 }
 
-int mp_write_int(mp_encoder_t *e, int64_t i) {
-	int64_t a = (i < 0 ? -i : i);
-	if (i > -32 && i < 0) {
+static int write_int_exact(mp_encoder_t *e, int64_t i) {
+	if (i >= -32 && i < 128) {
 		int8_t j = (int8_t)i;
 		return write_byte(e, (uint8_t)j);
-	} else if (i >= 0 && i < 128) {
-		return write_byte(e, (uint8_t)i);
-	} else if (a < 128) {
+	} else if (i >= INT8_MIN && i <= INT8_MAX) {
 		return write_prefix8(e, TAG_INT8, (uint8_t)i);
-	} else if (a < (1<<16)) {
+	} else if (i >= INT16_MIN && i <= INT16_MAX) {
 		return write_prefix16(e, TAG_INT16, (uint16_t)i);
-	} else if (a < ((int64_t)1<<32)) {
+	} else if (i >= INT32_MIN && i <= INT32_MAX) {
 		return write_prefix32(e, TAG_INT32, (uint32_t)i);
 	}
 	return write_prefix64(e, TAG_INT64, (uint64_t)i);
 }
 
-int mp_write_uint(mp_encoder_t *e, uint64_t u) {
-	if (u < 127) {
+static int write_uint_exact(mp_encoder_t *e, uint64_t u) {
+	if (u < 128) {
 		return write_byte(e, (uint8_t)u);
 	} else if (u < 256) {
 		return write_prefix8(e, TAG_UINT8, (uint8_t)u);
@@ -996,6 +2545,94 @@ int mp_write_uint(mp_encoder_t *e, uint64_t u) {
 	return write_prefix64(e, TAG_UINT64, u);
 }
 
+#ifdef WIDE_INTS
+/*
+ * Integer width classes: fixint, 8, 16, 32 and 64 bits,
+ * indexed by the number of significant bits (sign excluded).
+ * Signed ints are split by sign, since fixints cover [-32, 127].
+ */
+static const uint8_t int_class[2][65] = {
+	{
+		0, 0, 0, 0, 0, 0, 0, 0,
+		2, 2, 2, 2, 2, 2, 2, 2,
+		3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3,
+		4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+		4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4
+	},
+	{
+		0, 0, 0, 0, 0, 0, 1, 1,
+		2, 2, 2, 2, 2, 2, 2, 2,
+		3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3,
+		4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+		4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4
+	}
+};
+
+static const uint8_t uint_class[65] = {
+	0, 0, 0, 0, 0, 0, 0, 0,
+	1,
+	2, 2, 2, 2, 2, 2, 2, 2,
+	3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3,
+	4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+	4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4
+};
+
+static const uint8_t class_size[5] = { 1, 2, 3, 5, 9 };
+static const uint8_t class_shift[5] = { 0, 56, 48, 32, 0 };
+static const uint8_t class_mask[5] = { 0xff, 0, 0, 0, 0 };
+static const uint8_t int_tags[5] = { 0, TAG_INT8, TAG_INT16, TAG_INT32, TAG_INT64 };
+static const uint8_t uint_tags[5] = { 0, TAG_UINT8, TAG_UINT16, TAG_UINT32, TAG_UINT64 };
+
+static inline uint64_t to_be64(uint64_t u) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	return __builtin_bswap64(u);
+#else
+	return u;
+#endif
+}
+
+/*
+ * Writes the tag byte and then all 8 body bytes,
+ * left-justified so the significant ones come first;
+ * the trailing bytes land in reserved space past
+ * the new offset. For fixints the tag is the value.
+ */
+static inline void put_wide(mp_encoder_t *e, unsigned c, uint8_t tag, uint64_t u) {
+	unsigned char *p = e->base + e->off;
+	uint64_t be = to_be64(u << class_shift[c]);
+	p[0] = (uint8_t)(tag | (u & class_mask[c]));
+	memcpy(p + 1, &be, 8);
+	e->off += class_size[c];
+}
+
+int mp_write_int(mp_encoder_t *e, int64_t i) {
+	if (unlikely(avail(e) < 9))
+		return write_int_exact(e, i);
+	uint64_t u = (uint64_t)i;
+	uint64_t neg = u >> 63;
+	unsigned bits = 64 - (unsigned)__builtin_clzll((u ^ -neg) | 1);
+	unsigned c = int_class[neg][bits];
+	put_wide(e, c, int_tags[c], u);
+	return MSGPACK_OK;
+}
+
+int mp_write_uint(mp_encoder_t *e, uint64_t u) {
+	if (unlikely(avail(e) < 9))
+		return write_uint_exact(e, u);
+	unsigned c = uint_class[64 - __builtin_clzll(u | 1)];
+	put_wide(e, c, uint_tags[c], u);
+	return MSGPACK_OK;
+}
+#else
+int mp_write_int(mp_encoder_t *e, int64_t i) {
+	return write_int_exact(e, i);
+}
+
+int mp_write_uint(mp_encoder_t *e, uint64_t u) {
+	return write_uint_exact(e, u);
+}
+#endif
+
 int mp_write_float(mp_encoder_t *e, float f) {
 	float_pun fp;
 	fp.val = f;
@@ -1031,13 +2668,22 @@ int mp_write_arraysize(mp_encoder_t *e, uint32_t sz) {
 	return write_prefix32(e, TAG_ARRAY32, sz);
 }
 
+// like mp_write, but doesn't stop short
+static int write_all(mp_encoder_t *e, const char *c, size_t amt) {
+	while (amt > 0) {
+		ssize_t w = mp_write(e, c, amt);
+		if (unlikely(w <= 0))
+			return (w == 0) ? ERR_MSGPACK_EOF : ERR_MSGPACK_CHECK_ERRNO;
+		c += w;
+		amt -= (size_t)w;
+	}
+	return MSGPACK_OK;
+}
+
 int mp_write_str(mp_encoder_t *e, const char *c, uint32_t sz) {
 	int r = mp_write_strsize(e, sz);
 	CHECK(r);
-	if (unlikely(mp_write(e, c, (size_t)sz) == -1))
-		return ERR_MSGPACK_CHECK_ERRNO;
-
-	return MSGPACK_OK;
+	return write_all(e, c, (size_t)sz);
 }
 
 int mp_write_strsize(mp_encoder_t *e, uint32_t sz) {
@@ -1051,6 +2697,27 @@ int mp_write_strsize(mp_encoder_t *e, uint32_t sz) {
 	return write_prefix32(e, TAG_STR32, sz);
 }
 
+int mp_write_key(mp_encoder_t *e, const mp_key_t *k) {
+	const unsigned char *enc = (const unsigned char*)k + offsetof(mp_key_t, hdr);
+	size_t fixed = sizeof(mp_key_t) - offsetof(mp_key_t, hdr);
+
+	/* 
+	 * copy the whole (fixed-size) key when there's room, 
+	 * since that's cheaper than a variable-length copy;
+	 * only the first k->size bytes count
+	 */
+	if (avail(e) >= fixed) {
+		memcpy(e->base + e->off, enc, fixed);
+		e->off += k->size;
+		return MSGPACK_OK;
+	}
+	int r = reserve(e, k->size);
+	CHECK(r);
+	memcpy(e->base + e->off, enc, k->size);
+	e->off += k->size;
+	return MSGPACK_OK;
+}
+
 int mp_write_binsize(mp_encoder_t *e, uint32_t sz) {
 	if (sz < (1<<8)) {
 		return write_prefix8(e, TAG_BIN8, (uint8_t)sz);
@@ -1063,10 +2730,7 @@ int mp_write_binsize(mp_encoder_t *e, uint32_t sz) {
 int mp_write_bin(mp_encoder_t *e, const char *c, uint32_t sz) {
 	int r = mp_write_binsize(e, sz);
 	CHECK(r);
-	if (unlikely(mp_write(e, c, (size_t)sz) == -1))
-		return ERR_MSGPACK_CHECK_ERRNO;
-
-	return MSGPACK_OK;
+	return write_all(e, c, (size_t)sz);
 }
 
 int mp_write_extsize(mp_encoder_t *e, int8_t tg, uint32_t sz) {
@@ -1104,16 +2768,217 @@ typ: /* type is always written at the end */
 int mp_write_ext(mp_encoder_t *e, int8_t tg, const char *c, uint32_t sz) {
 	int r = mp_write_extsize(e, tg, sz);
 	CHECK(r);
-	if (unlikely(mp_write(e, c, (size_t)sz) == -1))
-		return ERR_MSGPACK_CHECK_ERRNO;
-
-	return MSGPACK_OK;
+	return write_all(e, c, (size_t)sz);
 }
 
 int mp_write_nil(mp_encoder_t *e) {
 	return write_byte(e, TAG_NIL);
 }
 
+// the most bytes written with one mp_reserve
+#define RUN 4096
+
+#define SIZEOF_DOUBLE(f) mp_sizeof_double()
+#define SIZEOF_BOOL(b) mp_sizeof_bool()
+
+/*
+ * writes 'n' values in runs that fit one mp_reserve
+ * each. a value that fits no run at all is reserved
+ * by itself, so that mp_reserve reports the EOF.
+ */
+#define WRITE_RUNS(name, typ, size, put) \
+int name(mp_encoder_t *e, const typ *v, size_t n) { \
+	size_t run = (e->cap < RUN) ? e->cap : RUN; \
+	unsigned char *p; \
+	while (n > 0) { \
+		size_t k = 0, sz = 0; \
+		for (; k < n && sz + size(v[k]) <= run; ++k) \
+			sz += size(v[k]); \
+		if (k == 0) \
+			sz = size(v[0]), k = 1; \
+		int r = mp_reserve(e, sz, &p); \
+		CHECK(r); \
+		for (size_t i=0; i<k; ++i) \
+			p = put(p, v[i]); \
+		mp_commit(e, p); \
+		v += k; \
+		n -= k; \
+	} \
+	return MSGPACK_OK; \
+}
+
+WRITE_RUNS(mp_write_ints, int64_t, mp_sizeof_int, mp_put_int)
+WRITE_RUNS(mp_write_uints, uint64_t, mp_sizeof_uint, mp_put_uint)
+WRITE_RUNS(mp_write_doubles, double, SIZEOF_DOUBLE, mp_put_double)
+WRITE_RUNS(mp_write_bools, bool, SIZEOF_BOOL, mp_put_bool)
+
+int mp_write_int_array(mp_encoder_t *e, const int64_t *v, uint32_t n) {
+	int r = mp_write_arraysize(e, n);
+	CHECK(r);
+	return mp_write_ints(e, v, n);
+}
+
+void mp_template_begin(mp_template_t *t, unsigned char *mem, size_t cap, mp_slot_t *slots, size_t maxslots) {
+	mp_encode_mem_init(&t->enc, mem, cap);
+	t->slots = slots;
+	t->nslots = 0;
+	t->maxslots = maxslots;
+	t->nstrs = 0;
+	t->strcap = 0;
+	return;
+}
+
+mp_encoder_t *mp_template_encoder(mp_template_t *t) { return &t->enc; }
+
+// size of a string slot's header
+static size_t str_hdr_size(uint32_t cap) {
+	if (cap < (1<<8))
+		return 2;
+	else if (cap < (1<<16))
+		return 3;
+	return 5;
+}
+
+static int add_slot(mp_template_t *t, mp_slot_typ_t typ, tag tg, size_t width, uint32_t cap) {
+	if (t->nslots == t->maxslots)
+		return ERR_MSGPACK_EOF;
+
+	unsigned char *c;
+	int r = reserve(&t->enc, width+1);
+	CHECK(r);
+	c = t->enc.base + t->enc.off;
+	*c++ = tg;
+	memset(c, 0, width);
+	mp_slot_t *s = &t->slots[t->nslots++];
+	s->off = t->enc.off + ((typ == MP_SLOT_STR) ? 0 : 1);
+	s->cap = cap;
+	s->typ = typ;
+	t->enc.off += width+1;
+	return MSGPACK_OK;
+}
+
+int mp_template_int64(mp_template_t *t) { 
+	return add_slot(t, MP_SLOT_INT64, TAG_INT64, 8, 0); 
+}
+
+int mp_template_uint32(mp_template_t *t) { 
+	return add_slot(t, MP_SLOT_UINT32, TAG_UINT32, 4, 0); 
+}
+
+int mp_template_uint64(mp_template_t *t) { 
+	return add_slot(t, MP_SLOT_UINT64, TAG_UINT64, 8, 0); 
+}
+
+int mp_template_double(mp_template_t *t) { 
+	return add_slot(t, MP_SLOT_DOUBLE, TAG_F64, 8, 0); 
+}
+
+int mp_template_str(mp_template_t *t, uint32_t cap) {
+	size_t hdr = str_hdr_size(cap);
+	tag tg = (hdr == 2) ? TAG_STR8 : (hdr == 3) ? TAG_STR16 : TAG_STR32;
+	int r = add_slot(t, MP_SLOT_STR, tg, hdr-1, cap);
+	CHECK(r);
+	t->nstrs++;
+	t->strcap += cap;
+	return MSGPACK_OK;
+}
+
+// store a scalar slot value at 'c'
+static void patch_slot(unsigned char *c, const mp_slot_t *s, const mp_slot_val_t *v) {
+	double_pun dp;
+	switch (s->typ) {
+	case MP_SLOT_INT64:
+		mp_put_be64(c, (uint64_t)v->i);
+		break;
+	case MP_SLOT_UINT32:
+		mp_put_be32(c, (uint32_t)v->u);
+		break;
+	case MP_SLOT_UINT64:
+		mp_put_be64(c, v->u);
+		break;
+	case MP_SLOT_DOUBLE:
+		dp.val = v->f;
+		mp_put_be64(c, dp.bits);
+		break;
+	case MP_SLOT_STR:
+		break;
+	}
+	return;
+}
+
+int mp_template_emit(mp_encoder_t *e, const mp_template_t *t, const mp_slot_val_t *vals) {
+	const unsigned char *skel = t->enc.base;
+	size_t len = t->enc.off, need = len;
+	for (size_t i=0; i<t->nslots; ++i) {
+		const mp_slot_t *s = &t->slots[i];
+		if ((s->typ == MP_SLOT_STR && vals[i].s.len > s->cap) ||
+			(s->typ == MP_SLOT_UINT32 && vals[i].u > UINT32_MAX))
+			return ERR_MSGPACK_EOF;
+		if (s->typ == MP_SLOT_STR)
+			need += vals[i].s.len;
+	}
+
+	/*
+	 * a counting encoder doesn't need the bytes. this is
+	 * the one writer that checks for one: a template is a
+	 * single reservation, so it would otherwise have to fit
+	 * in the scratch space, and it costs one compare per
+	 * message rather than per field
+	 */
+	if (e->write == count_bytes) {
+		e->counted += need;
+		return MSGPACK_OK;
+	}
+	int r = reserve(e, need);
+	CHECK(r);
+	unsigned char *out = e->base + e->off;
+
+	/* common case: one copy, then patch the slots */
+	if (t->nstrs == 0) {
+		memcpy(out, skel, len);
+		for (size_t i=0; i<t->nslots; ++i)
+			patch_slot(out + t->slots[i].off, &t->slots[i], &vals[i]);
+		e->off += len;
+		return MSGPACK_OK;
+	}
+
+	/* 
+	 * strings shift everything after them, so
+	 * copy the skeleton one slot at a time
+	 */
+	size_t from = 0;
+	for (size_t i=0; i<t->nslots; ++i) {
+		const mp_slot_t *s = &t->slots[i];
+		if (s->typ != MP_SLOT_STR) {
+			size_t to = s->off + ((s->typ == MP_SLOT_UINT32) ? 4 : 8);
+			memcpy(out, skel + from, to - from);
+			patch_slot(out + (s->off - from), s, &vals[i]);
+			out += to - from;
+			from = to;
+			continue;
+		}
+		size_t hdr = str_hdr_size(s->cap);
+		uint32_t sl = vals[i].s.len;
+		memcpy(out, skel + from, s->off - from + 1);
+		out += s->off - from + 1;
+		if (hdr == 2)
+			*out = (uint8_t)sl;
+		else if (hdr == 3)
+			mp_put_be16(out, (uint16_t)sl);
+		else
+			mp_put_be32(out, sl);
+		out += hdr - 1;
+		if (sl > 0)
+			memcpy(out, vals[i].s.ptr, sl);
+		out += sl;
+		from = s->off + hdr;
+	}
+	memcpy(out, skel + from, len - from);
+	out += len - from;
+	e->off = (size_t)(out - e->base);
+	return MSGPACK_OK;
+}
+
 #undef CHECK
 #undef BEROLL
 #undef write_BE
@@ -2,7 +2,8 @@
 #define MSGPACK_H__
 #include <stdbool.h> /* bool */
 #include <stdint.h>  /* (u)int{8,16,32,64}_t */
-#include <stddef.h>  /* size_t */
+#include <stddef.h>  /* size_t, offsetof */
+#include <string.h>  /* memcpy */
 #include <unistd.h>  /* ssize_t */
 
 /* 
@@ -41,6 +42,7 @@ enum {
 	ERR_MSGPACK_EOF = 1,		 // buffer too small
 	ERR_MSGPACK_BAD_TYPE = 2,	 // tried to read the wrong value
 	ERR_MSGPACK_CHECK_ERRNO = 3, // check errno
+	ERR_MSGPACK_TOO_DEEP = 4,	 // nesting exceeds a fixed limit
 };
 
 /* 
@@ -69,6 +71,33 @@ typedef ssize_t (*mp_fill_t)(void *ctx, void *buf, size_t max);
  */
 typedef ssize_t (*mp_flush_t)(void *ctx, const void *buf, size_t amt);
 
+/*
+ * mp_dec_stats_t and mp_enc_stats_t hold
+ * instrumentation counters. They are only
+ * collected when the library is built with
+ * MSGPACK_STATS defined; otherwise they
+ * always read as zero and cost nothing.
+ *
+ * NOTE: MSGPACK_STATS changes the layout of
+ * mp_decoder_t and mp_encoder_t, so it must be
+ * defined (or not) the same way for the library
+ * and for everything that includes this header.
+ */
+typedef struct {
+	uint64_t fills;           // calls to the mp_fill_t callback
+	uint64_t fill_bytes;      // bytes returned by mp_fill_t
+	uint64_t short_reads;     // fills that returned less than there was room for
+	uint64_t type_mismatches; // reads that returned ERR_MSGPACK_BAD_TYPE
+	uint64_t max_skip_depth;  // deepest object seen by mp_skip (top level is 1)
+} mp_dec_stats_t;
+
+typedef struct {
+	uint64_t flushes;        // calls to the mp_flush_t callback
+	uint64_t flush_bytes;    // bytes accepted by mp_flush_t
+	uint64_t partial_writes; // failed flushes that had to shift unwritten bytes
+	uint64_t bypass_writes;  // mp_write calls that went straight to the stream
+} mp_enc_stats_t;
+
 /*
  * mp_decoder_t
  *
@@ -94,6 +123,9 @@ typedef struct {
 	size_t    used;
 	void      *ctx;
 	mp_fill_t read;
+#ifdef MSGPACK_STATS
+	mp_dec_stats_t stats;
+#endif
 } mp_decoder_t;
 
 /*
@@ -119,6 +151,10 @@ typedef struct {
 	size_t     cap;
 	void       *ctx;
 	mp_flush_t write;
+	size_t     counted;
+#ifdef MSGPACK_STATS
+	mp_enc_stats_t stats;
+#endif
 } mp_encoder_t;
 
 /* mp_decoder_t */
@@ -170,6 +206,20 @@ void mp_encode_stream_init(mp_encoder_t *d, void *ctx, mp_flush_t w, unsigned ch
 /* initializes an encoder to write to a fixed-size chunk of memory */
 void mp_encode_mem_init(mp_encoder_t *e, unsigned char *mem, size_t cap);
 
+/*
+ * initializes an encoder that only counts the
+ * bytes written to it. 'mem' is scratch space,
+ * and (as with mp_encode_stream_init) 'cap' must
+ * be at least 18 bytes. An mp_write of more than
+ * 'cap' bytes, or an mp_template_emit, is counted
+ * without being copied anywhere; anything written
+ * with a single reservation (mp_write_key, or
+ * mp_reserve itself) must fit in 'cap' bytes, as in
+ * stream mode, so 64 bytes is enough unless the
+ * caller reserves more than that itself.
+ */
+void mp_encode_count_init(mp_encoder_t *e, unsigned char *mem, size_t cap);
+
 /*
  * flushes any unwritten bytes to the stream,
  * if the encoder was initialized with a stream
@@ -183,6 +233,47 @@ size_t mp_enc_buffered(mp_encoder_t *e);
 /* returns the capacity of the encoder's buffer */
 size_t mp_enc_capacity(mp_encoder_t *e);
 
+/*
+ * returns the number of bytes written to an
+ * encoder initialized with mp_encode_count_init
+ */
+size_t mp_enc_count(mp_encoder_t *e);
+
+/* Instrumentation */
+
+/* 
+ * copy the current counters of a decoder
+ * or encoder into 's'. without MSGPACK_STATS,
+ * 's' is zeroed.
+ */
+void mp_dec_stats(mp_decoder_t *d, mp_dec_stats_t *s);
+void mp_enc_stats(mp_encoder_t *e, mp_enc_stats_t *s);
+
+/* zero the counters of a decoder or encoder */
+void mp_dec_stats_reset(mp_decoder_t *d);
+void mp_enc_stats_reset(mp_encoder_t *e);
+
+/* 
+ * add the counters in 'src' to 'dst'
+ * (max_skip_depth takes the larger value)
+ */
+void mp_dec_stats_add(mp_dec_stats_t *dst, const mp_dec_stats_t *src);
+void mp_enc_stats_add(mp_enc_stats_t *dst, const mp_enc_stats_t *src);
+
+/*
+ * atomically add the counters of a decoder or
+ * encoder to the process-wide totals, and reset
+ * them. this is the way to aggregate counters
+ * from decoders and encoders owned by different
+ * threads.
+ */
+void mp_dec_stats_publish(mp_decoder_t *d);
+void mp_enc_stats_publish(mp_encoder_t *e);
+
+/* read the process-wide totals */
+void mp_dec_stats_global(mp_dec_stats_t *s);
+void mp_enc_stats_global(mp_enc_stats_t *s);
+
 /*
 
 	----    Modes    ----
@@ -196,6 +287,25 @@ function, then they will use the chunk of memory provided to them
 as a scratch buffer, and use the provided read/write callback to
 fill/flush the buffer, respectively.
 
+An mp_encoder_t* initialized with mp_encode_count_init
+writes nothing anywhere; it only counts how many bytes
+the same calls would have written. Anything that can be
+written to a stream with the same size of buffer can be
+counted, so a message can be sized exactly with one
+pass and then encoded into a buffer (or a single
+length-prefixed frame) of exactly that size with a
+second:
+
+	mp_encode_count_init(&enc, scratch, sizeof(scratch));
+	write_message(&enc, msg);
+	size_t n = mp_enc_count(&enc);
+	unsigned char *buf = malloc(n);
+	mp_encode_mem_init(&enc, buf, n);
+	write_message(&enc, msg);
+
+For single objects, the mp_sizeof_ functions (see
+'Unchecked Writes') give the same answer directly.
+
     ---- Conventions ----
 
 For each type that is read/write-able, 
@@ -208,6 +318,7 @@ MSGPACK_OK: no error
 ERR_MSGPACK_EOF: in 'mem' mode, ran out of buffer to read/write
 ERR_MSGPACK_BAD_TYPE: (read functions only): attempted to read the wrong value
 ERR_MSGPACK_CHECK_ERRNO: mp_fill_t/mp_flush_t: check errno
+ERR_MSGPACK_TOO_DEEP: (mp_walk and friends): objects nested too deeply
 
 Variable-length types (bin, str, ext) can be written incrementally
 (by writing the size and then writing raw bytes) or all at once. However,
@@ -268,6 +379,36 @@ int mp_read_strsize(mp_decoder_t *d, uint32_t *sz);
 int mp_write_strsize(mp_encoder_t *e, uint32_t sz);
 int mp_write_str(mp_encoder_t *e, const char *c, uint32_t sz);
 
+/* Pre-encoded Keys */
+
+/*
+ * mp_key_t holds a short string (at most MP_KEY_MAX bytes)
+ * that has already been encoded as a MessagePack fixstr,
+ * so that it can be written with one bounds check and one
+ * fixed-size copy. MP_KEY() builds one at compile time
+ * from a string literal (and *only* a string literal):
+ *
+ *     static const mp_key_t label = MP_KEY("field_label_one");
+ *     mp_write_key(e, &label);
+ *
+ * Literals longer than MP_KEY_MAX do not compile.
+ */
+#define MP_KEY_MAX 31
+
+typedef struct {
+	uint8_t       size; // encoded size (header + string)
+	unsigned char hdr;
+	char          str[MP_KEY_MAX];
+} mp_key_t;
+
+#define MP_KEY(s) { \
+	(uint8_t)(sizeof(s) * sizeof(char[(sizeof(s) <= MP_KEY_MAX+1) ? 1 : -1])), \
+	(unsigned char)(0xa0|(sizeof(s)-1)), \
+	s \
+}
+
+int mp_write_key(mp_encoder_t *e, const mp_key_t *k);
+
 /* Binary */
 
 int mp_read_binsize(mp_decoder_t *d, uint32_t *sz);
@@ -285,4 +426,1276 @@ int mp_write_ext(mp_encoder_t *e, int8_t tg, const char *c, uint32_t sz);
 int mp_read_nil(mp_decoder_t *d);
 int mp_write_nil(mp_encoder_t *e);
 
+/* Runs of values */
+
+/*
+ * mp_write_ints and friends write 'n' values one
+ * after another (with no array header), making room
+ * for as many at a time as the buffer can hold.
+ * mp_write_int_array writes an array header first.
+ */
+int mp_write_ints(mp_encoder_t *e, const int64_t *v, size_t n);
+int mp_write_uints(mp_encoder_t *e, const uint64_t *v, size_t n);
+int mp_write_doubles(mp_encoder_t *e, const double *v, size_t n);
+int mp_write_bools(mp_encoder_t *e, const bool *v, size_t n);
+int mp_write_int_array(mp_encoder_t *e, const int64_t *v, uint32_t n);
+
+/*
+
+	---- Dynamic Reads ----
+
+mp_read_any decodes whatever object comes next
+(a scalar, or the header of a container, string,
+binary or extension) into an mp_value_t, using a
+single table lookup on the tag byte instead of
+trying each typed reader in turn. String, binary and
+extension payloads are *not* consumed; read them
+with mp_read (or skip them) as with mp_read_strsize.
+
+Like mp_type, positive fixints are reported as
+MSG_INT; the uint8-64 encodings are MSG_UINT.
+The invalid tag (0xc1) is ERR_MSGPACK_BAD_TYPE.
+On any error, nothing is consumed.
+
+*/
+
+typedef struct {
+	mp_typ_t type;
+	union {
+		int64_t  i;    // MSG_INT
+		uint64_t u;    // MSG_UINT
+		float    f;    // MSG_F32
+		double   d;    // MSG_F64
+		bool     b;    // MSG_BOOL
+		uint32_t size; // MSG_MAP (pairs), MSG_ARRAY, MSG_STR, MSG_BIN
+		struct {
+			int8_t   type;
+			uint32_t size;
+		} ext;         // MSG_EXT
+	} v;
+} mp_value_t;
+
+int mp_read_any(mp_decoder_t *d, mp_value_t *v);
+
+/*
+ * mp_read_number_as_double reads any int, uint, float
+ * or double as a double (ints beyond 2^53 are rounded).
+ * mp_read_number_as_int64 reads any of the same, but
+ * fails with ERR_MSGPACK_BAD_TYPE (consuming nothing)
+ * if the value is not exactly representable as an int64.
+ */
+int mp_read_number_as_double(mp_decoder_t *d, double *f);
+int mp_read_number_as_int64(mp_decoder_t *d, int64_t *i);
+
+/*
+
+	---- Visitors ----
+
+mp_walk reads one object (and everything nested
+in it) and reports it to the callbacks in an
+mp_visitor_t, in order. Containers are tracked on
+a fixed stack of MP_WALK_MAX_DEPTH levels rather
+than by recursion; deeper objects fail with
+ERR_MSGPACK_TOO_DEEP.
+
+Any callback may be NULL, in which case those
+events are dropped. A callback that returns non-zero
+stops the walk, and mp_walk returns that value,
+so callers should use values that don't collide
+with the ERR_MSGPACK_ codes.
+
+Map keys that are strings go to 'key' (or to 'str'
+if 'key' is NULL). String, binary and extension
+payloads are passed in place, so in stream mode each
+must fit in the decoder's buffer.
+
+If 'int64_run' is set, consecutive integers in an
+array (that fit in an int64) are delivered in batches
+through it instead of through 'int64'/'uint64'.
+Likewise, 'double_run' takes runs of floats and doubles
+in place of 'f32'/'f64'.
+
+*/
+
+#ifndef MP_WALK_MAX_DEPTH
+#define MP_WALK_MAX_DEPTH 32
+#endif
+
+typedef struct {
+	int (*begin_map)(void *ctx, uint32_t n);
+	int (*end_map)(void *ctx);
+	int (*begin_array)(void *ctx, uint32_t n);
+	int (*end_array)(void *ctx);
+	int (*key)(void *ctx, const char *s, uint32_t sz);
+	int (*nil)(void *ctx);
+	int (*boolean)(void *ctx, bool b);
+	int (*int64)(void *ctx, int64_t i);
+	int (*uint64)(void *ctx, uint64_t u);
+	int (*f32)(void *ctx, float f);
+	int (*f64)(void *ctx, double f);
+	int (*str)(void *ctx, const char *s, uint32_t sz);
+	int (*bin)(void *ctx, const char *b, uint32_t sz);
+	int (*ext)(void *ctx, int8_t tg, const char *b, uint32_t sz);
+	int (*int64_run)(void *ctx, const int64_t *v, size_t n);
+	int (*double_run)(void *ctx, const double *v, size_t n);
+} mp_visitor_t;
+
+int mp_walk(mp_decoder_t *d, const mp_visitor_t *v, void *ctx);
+
+/*
+
+	---- Unchecked Writes ----
+
+Each mp_write_ function checks for (and makes) room
+in the encoder's buffer. When the size of a message
+(or a run of fields) is known up front, that check
+can be done once with mp_reserve, and the fields
+written with the mp_put_ functions, which do no
+checks at all. Each mp_put_ function writes at 'p'
+and returns the position just past what it wrote;
+mp_commit then hands the written bytes back to the
+encoder:
+
+	unsigned char *p;
+	size_t n = mp_sizeof_mapsize(1) + mp_sizeof_str(2) + mp_sizeof_int(v);
+	int err = mp_reserve(e, n, &p);
+	if (err) return err;
+	p = mp_put_mapsize(p, 1);
+	p = mp_put_str(p, "id", 2);
+	p = mp_put_int(p, v);
+	mp_commit(e, p);
+
+The mp_sizeof_ functions return the exact number of
+bytes the corresponding mp_put_ or mp_write_ function
+writes. Writing more than was reserved is undefined
+behavior. The mp_put_ functions choose the same
+encodings as the mp_write_ functions.
+
+*/
+
+/* 
+ * mp_reserve makes room for 'n' contiguous bytes in
+ * the encoder's buffer (flushing at most once, in stream
+ * mode) and points 'p' at the first of them. It returns
+ * ERR_MSGPACK_EOF if 'n' bytes can never fit.
+ */
+int mp_reserve(mp_encoder_t *e, size_t n, unsigned char **p);
+
+/* marks everything before 'p' as written */
+static inline void mp_commit(mp_encoder_t *e, unsigned char *p) {
+	e->off = (size_t)(p - e->base);
+}
+
+/* Sizes */
+
+static inline size_t mp_sizeof_nil(void) { return 1; }
+static inline size_t mp_sizeof_bool(void) { return 1; }
+static inline size_t mp_sizeof_float(void) { return 5; }
+static inline size_t mp_sizeof_double(void) { return 9; }
+
+static inline size_t mp_sizeof_uint(uint64_t u) {
+	if (u < 128)
+		return 1;
+	else if (u < 256)
+		return 2;
+	else if (u < (1<<16))
+		return 3;
+	else if (u < ((uint64_t)1<<32))
+		return 5;
+	return 9;
+}
+
+static inline size_t mp_sizeof_int(int64_t i) {
+	if (i >= -32 && i < 128)
+		return 1;
+	else if (i >= INT8_MIN && i <= INT8_MAX)
+		return 2;
+	else if (i >= INT16_MIN && i <= INT16_MAX)
+		return 3;
+	else if (i >= INT32_MIN && i <= INT32_MAX)
+		return 5;
+	return 9;
+}
+
+static inline size_t mp_sizeof_mapsize(uint32_t sz) {
+	if (sz < (1<<4))
+		return 1;
+	else if (sz < (1<<16))
+		return 3;
+	return 5;
+}
+
+static inline size_t mp_sizeof_arraysize(uint32_t sz) {
+	return mp_sizeof_mapsize(sz);
+}
+
+static inline size_t mp_sizeof_strsize(uint32_t sz) {
+	if (sz < (1<<5))
+		return 1;
+	else if (sz < (1<<8))
+		return 2;
+	else if (sz < (1<<16))
+		return 3;
+	return 5;
+}
+
+static inline size_t mp_sizeof_str(uint32_t sz) {
+	return mp_sizeof_strsize(sz) + (size_t)sz;
+}
+
+static inline size_t mp_sizeof_binsize(uint32_t sz) {
+	if (sz < (1<<8))
+		return 2;
+	else if (sz < (1<<16))
+		return 3;
+	return 5;
+}
+
+static inline size_t mp_sizeof_bin(uint32_t sz) {
+	return mp_sizeof_binsize(sz) + (size_t)sz;
+}
+
+static inline size_t mp_sizeof_extsize(uint32_t sz) {
+	switch (sz) {
+	case 1:
+	case 2:
+	case 4:
+	case 8:
+	case 16:
+		return 2;
+	}
+	if (sz < (1<<8))
+		return 3;
+	else if (sz < (1<<16))
+		return 4;
+	return 6;
+}
+
+static inline size_t mp_sizeof_ext(uint32_t sz) {
+	return mp_sizeof_extsize(sz) + (size_t)sz;
+}
+
+static inline size_t mp_sizeof_key(const mp_key_t *k) { return (size_t)k->size; }
+
+/* Raw big-endian stores */
+
+static inline unsigned char *mp_put_be16(unsigned char *p, uint16_t u) {
+	*p++ = (unsigned char)(u>>8);
+	*p++ = (unsigned char)u;
+	return p;
+}
+
+static inline unsigned char *mp_put_be32(unsigned char *p, uint32_t u) {
+	*p++ = (unsigned char)(u>>24);
+	*p++ = (unsigned char)(u>>16);
+	*p++ = (unsigned char)(u>>8);
+	*p++ = (unsigned char)u;
+	return p;
+}
+
+static inline unsigned char *mp_put_be64(unsigned char *p, uint64_t u) {
+	p = mp_put_be32(p, (uint32_t)(u>>32));
+	return mp_put_be32(p, (uint32_t)u);
+}
+
+/* Values */
+
+static inline unsigned char *mp_put_nil(unsigned char *p) {
+	*p++ = 0xc0;
+	return p;
+}
+
+static inline unsigned char *mp_put_bool(unsigned char *p, bool b) {
+	*p++ = b ? 0xc3 : 0xc2;
+	return p;
+}
+
+static inline unsigned char *mp_put_uint(unsigned char *p, uint64_t u) {
+	if (u < 128) {
+		*p++ = (unsigned char)u;
+		return p;
+	} else if (u < 256) {
+		*p++ = 0xcc; // uint8
+		*p++ = (unsigned char)u;
+		return p;
+	} else if (u < (1<<16)) {
+		*p++ = 0xcd; // uint16
+		return mp_put_be16(p, (uint16_t)u);
+	} else if (u < ((uint64_t)1<<32)) {
+		*p++ = 0xce; // uint32
+		return mp_put_be32(p, (uint32_t)u);
+	}
+	*p++ = 0xcf; // uint64
+	return mp_put_be64(p, u);
+}
+
+static inline unsigned char *mp_put_int(unsigned char *p, int64_t i) {
+	if (i >= -32 && i < 128) {
+		*p++ = (unsigned char)(int8_t)i;
+		return p;
+	} else if (i >= INT8_MIN && i <= INT8_MAX) {
+		*p++ = 0xd0; // int8
+		*p++ = (unsigned char)(int8_t)i;
+		return p;
+	} else if (i >= INT16_MIN && i <= INT16_MAX) {
+		*p++ = 0xd1; // int16
+		return mp_put_be16(p, (uint16_t)i);
+	} else if (i >= INT32_MIN && i <= INT32_MAX) {
+		*p++ = 0xd2; // int32
+		return mp_put_be32(p, (uint32_t)i);
+	}
+	*p++ = 0xd3; // int64
+	return mp_put_be64(p, (uint64_t)i);
+}
+
+static inline unsigned char *mp_put_float(unsigned char *p, float f) {
+	union { float f; uint32_t u; } pun;
+	pun.f = f;
+	*p++ = 0xca;
+	return mp_put_be32(p, pun.u);
+}
+
+static inline unsigned char *mp_put_double(unsigned char *p, double f) {
+	union { double f; uint64_t u; } pun;
+	pun.f = f;
+	*p++ = 0xcb;
+	return mp_put_be64(p, pun.u);
+}
+
+/* 
+ * writes a map or array header, using 'fix'
+ * as the fixmap/fixarray tag and 'tag16' as
+ * the 16-bit tag (the 32-bit tag is one past it)
+ */
+static inline unsigned char *mp_put_container(unsigned char *p, uint8_t fix, uint8_t tag16, uint32_t sz) {
+	if (sz < (1<<4)) {
+		*p++ = (unsigned char)(fix|sz);
+		return p;
+	} else if (sz < (1<<16)) {
+		*p++ = tag16;
+		return mp_put_be16(p, (uint16_t)sz);
+	}
+	*p++ = (unsigned char)(tag16+1);
+	return mp_put_be32(p, sz);
+}
+
+static inline unsigned char *mp_put_mapsize(unsigned char *p, uint32_t sz) {
+	return mp_put_container(p, 0x80, 0xde, sz);
+}
+
+static inline unsigned char *mp_put_arraysize(unsigned char *p, uint32_t sz) {
+	return mp_put_container(p, 0x90, 0xdc, sz);
+}
+
+static inline unsigned char *mp_put_strsize(unsigned char *p, uint32_t sz) {
+	if (sz < (1<<5)) {
+		*p++ = (unsigned char)(0xa0|sz);
+		return p;
+	} else if (sz < (1<<8)) {
+		*p++ = 0xd9; // str8
+		*p++ = (unsigned char)sz;
+		return p;
+	} else if (sz < (1<<16)) {
+		*p++ = 0xda; // str16
+		return mp_put_be16(p, (uint16_t)sz);
+	}
+	*p++ = 0xdb; // str32
+	return mp_put_be32(p, sz);
+}
+
+static inline unsigned char *mp_put_binsize(unsigned char *p, uint32_t sz) {
+	if (sz < (1<<8)) {
+		*p++ = 0xc4; // bin8
+		*p++ = (unsigned char)sz;
+		return p;
+	} else if (sz < (1<<16)) {
+		*p++ = 0xc5; // bin16
+		return mp_put_be16(p, (uint16_t)sz);
+	}
+	*p++ = 0xc6; // bin32
+	return mp_put_be32(p, sz);
+}
+
+static inline unsigned char *mp_put_extsize(unsigned char *p, int8_t tg, uint32_t sz) {
+	switch (sz) {
+	case 1:  *p++ = 0xd4; goto typ; // fixext1
+	case 2:  *p++ = 0xd5; goto typ; // fixext2
+	case 4:  *p++ = 0xd6; goto typ; // fixext4
+	case 8:  *p++ = 0xd7; goto typ; // fixext8
+	case 16: *p++ = 0xd8; goto typ; // fixext16
+	}
+	if (sz < (1<<8)) {
+		*p++ = 0xc7; // ext8
+		*p++ = (unsigned char)sz;
+	} else if (sz < (1<<16)) {
+		*p++ = 0xc8; // ext16
+		p = mp_put_be16(p, (uint16_t)sz);
+	} else {
+		*p++ = 0xc9; // ext32
+		p = mp_put_be32(p, sz);
+	}
+typ:
+	*p++ = (unsigned char)tg;
+	return p;
+}
+
+/* copies 'sz' raw bytes */
+static inline unsigned char *mp_put_raw(unsigned char *p, const void *c, uint32_t sz) {
+	memcpy(p, c, (size_t)sz);
+	return p + sz;
+}
+
+static inline unsigned char *mp_put_str(unsigned char *p, const char *c, uint32_t sz) {
+	return mp_put_raw(mp_put_strsize(p, sz), c, sz);
+}
+
+static inline unsigned char *mp_put_bin(unsigned char *p, const char *c, uint32_t sz) {
+	return mp_put_raw(mp_put_binsize(p, sz), c, sz);
+}
+
+static inline unsigned char *mp_put_ext(unsigned char *p, int8_t tg, const char *c, uint32_t sz) {
+	return mp_put_raw(mp_put_extsize(p, tg, sz), c, sz);
+}
+
+static inline unsigned char *mp_put_key(unsigned char *p, const mp_key_t *k) {
+	return mp_put_raw(p, (const unsigned char *)k + offsetof(mp_key_t, hdr), k->size);
+}
+
+/*
+
+	---- Unchecked Reads ----
+
+The read-side counterpart of the unchecked writes:
+mp_ensure buffers at least 'n' bytes (calling the
+fill callback as many times as it takes), after
+which the mp_get_ functions decode straight out of
+the buffer with no length checks. Each mp_get_
+function reads at 'p' and returns the position just
+past what it read, or NULL if the object at 'p' is
+not of the requested type. mp_consume then moves the
+decoder past everything that was read:
+
+	const unsigned char *p;
+	int err = mp_ensure(d, 1 + 9 + 9, &p);
+	if (err) return err;
+	if ((p = mp_get_arraysize(p, &n)) == NULL ||
+	    (p = mp_get_int(p, &a)) == NULL ||
+	    (p = mp_get_double(p, &b)) == NULL)
+		return ERR_MSGPACK_BAD_TYPE;
+	mp_consume(d, p);
+
+Callers must ensure enough bytes for the widest
+encoding of each object they read: 9 bytes for
+numbers, 5 for map, array, str and bin headers, 
+6 for ext headers, and the header plus the payload
+for mp_get_str and mp_get_bin. In stream mode, 'n' 
+can be no more than the decoder's capacity. Note
+that mp_ensure fails with ERR_MSGPACK_EOF if fewer
+than 'n' bytes remain in the stream or buffer.
+
+*/
+
+/* the widest possible encodings of each kind of object */
+#define MP_MAXSIZE_NUM 9
+#define MP_MAXSIZE_HDR 5
+#define MP_MAXSIZE_EXTHDR 6
+
+/* 
+ * mp_ensure makes sure at least 'n' bytes are buffered
+ * and points 'p' at the first of them.
+ */
+int mp_ensure(mp_decoder_t *d, size_t n, const unsigned char **p);
+
+/* marks everything before 'p' as read */
+static inline void mp_consume(mp_decoder_t *d, const unsigned char *p) {
+	d->off = (size_t)(p - d->base);
+}
+
+/* Raw big-endian loads */
+
+static inline uint16_t mp_get_be16(const unsigned char *p) {
+	return (uint16_t)(((uint16_t)p[0] << 8) | (uint16_t)p[1]);
+}
+
+static inline uint32_t mp_get_be32(const unsigned char *p) {
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | 
+		((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static inline uint64_t mp_get_be64(const unsigned char *p) {
+	return ((uint64_t)mp_get_be32(p) << 32) | (uint64_t)mp_get_be32(p+4);
+}
+
+/* Values */
+
+static inline const unsigned char *mp_get_nil(const unsigned char *p) {
+	return (*p == 0xc0) ? p+1 : NULL;
+}
+
+static inline const unsigned char *mp_get_bool(const unsigned char *p, bool *b) {
+	if ((*p&0xfe) != 0xc2)
+		return NULL;
+	*b = (*p == 0xc3);
+	return p+1;
+}
+
+static inline const unsigned char *mp_get_uint(const unsigned char *p, uint64_t *u) {
+	switch (*p) {
+	case 0xcc: // uint8
+		*u = (uint64_t)p[1];
+		return p+2;
+	case 0xcd: // uint16
+		*u = (uint64_t)mp_get_be16(p+1);
+		return p+3;
+	case 0xce: // uint32
+		*u = (uint64_t)mp_get_be32(p+1);
+		return p+5;
+	case 0xcf: // uint64
+		*u = mp_get_be64(p+1);
+		return p+9;
+	}
+	if (*p < 0x80) {
+		*u = (uint64_t)*p;
+		return p+1;
+	}
+	return NULL;
+}
+
+static inline const unsigned char *mp_get_int(const unsigned char *p, int64_t *i) {
+	switch (*p) {
+	case 0xd0: // int8
+		*i = (int64_t)(int8_t)p[1];
+		return p+2;
+	case 0xd1: // int16
+		*i = (int64_t)(int16_t)mp_get_be16(p+1);
+		return p+3;
+	case 0xd2: // int32
+		*i = (int64_t)(int32_t)mp_get_be32(p+1);
+		return p+5;
+	case 0xd3: // int64
+		*i = (int64_t)mp_get_be64(p+1);
+		return p+9;
+	}
+	if (*p < 0x80 || *p >= 0xe0) {
+		*i = (int64_t)(int8_t)*p;
+		return p+1;
+	}
+	return NULL;
+}
+
+static inline const unsigned char *mp_get_float(const unsigned char *p, float *f) {
+	union { float f; uint32_t u; } pun;
+	if (*p != 0xca)
+		return NULL;
+	pun.u = mp_get_be32(p+1);
+	*f = pun.f;
+	return p+5;
+}
+
+static inline const unsigned char *mp_get_double(const unsigned char *p, double *f) {
+	union { double f; uint64_t u; } pun;
+	if (*p != 0xcb)
+		return NULL;
+	pun.u = mp_get_be64(p+1);
+	*f = pun.f;
+	return p+9;
+}
+
+/* 
+ * reads a map or array header, using 'fix'
+ * as the fixmap/fixarray tag and 'tag16' as
+ * the 16-bit tag (the 32-bit tag is one past it)
+ */
+static inline const unsigned char *mp_get_container(const unsigned char *p, uint8_t fix, uint8_t tag16, uint32_t *sz) {
+	if ((*p&0xf0) == fix) {
+		*sz = (uint32_t)(*p&0x0f);
+		return p+1;
+	} else if (*p == tag16) {
+		*sz = (uint32_t)mp_get_be16(p+1);
+		return p+3;
+	} else if (*p == tag16+1) {
+		*sz = mp_get_be32(p+1);
+		return p+5;
+	}
+	return NULL;
+}
+
+static inline const unsigned char *mp_get_mapsize(const unsigned char *p, uint32_t *sz) {
+	return mp_get_container(p, 0x80, 0xde, sz);
+}
+
+static inline const unsigned char *mp_get_arraysize(const unsigned char *p, uint32_t *sz) {
+	return mp_get_container(p, 0x90, 0xdc, sz);
+}
+
+static inline const unsigned char *mp_get_strsize(const unsigned char *p, uint32_t *sz) {
+	switch (*p) {
+	case 0xd9: // str8
+		*sz = (uint32_t)p[1];
+		return p+2;
+	case 0xda: // str16
+		*sz = (uint32_t)mp_get_be16(p+1);
+		return p+3;
+	case 0xdb: // str32
+		*sz = mp_get_be32(p+1);
+		return p+5;
+	}
+	if ((*p&0xe0) == 0xa0) {
+		*sz = (uint32_t)(*p&0x1f);
+		return p+1;
+	}
+	return NULL;
+}
+
+static inline const unsigned char *mp_get_binsize(const unsigned char *p, uint32_t *sz) {
+	switch (*p) {
+	case 0xc4: // bin8
+		*sz = (uint32_t)p[1];
+		return p+2;
+	case 0xc5: // bin16
+		*sz = (uint32_t)mp_get_be16(p+1);
+		return p+3;
+	case 0xc6: // bin32
+		*sz = mp_get_be32(p+1);
+		return p+5;
+	}
+	return NULL;
+}
+
+static inline const unsigned char *mp_get_extsize(const unsigned char *p, int8_t *tg, uint32_t *sz) {
+	switch (*p) {
+	case 0xd4: *sz = 1; p += 1; break;  // fixext1
+	case 0xd5: *sz = 2; p += 1; break;  // fixext2
+	case 0xd6: *sz = 4; p += 1; break;  // fixext4
+	case 0xd7: *sz = 8; p += 1; break;  // fixext8
+	case 0xd8: *sz = 16; p += 1; break; // fixext16
+	case 0xc7: // ext8
+		*sz = (uint32_t)p[1];
+		p += 2;
+		break;
+	case 0xc8: // ext16
+		*sz = (uint32_t)mp_get_be16(p+1);
+		p += 3;
+		break;
+	case 0xc9: // ext32
+		*sz = mp_get_be32(p+1);
+		p += 5;
+		break;
+	default:
+		return NULL;
+	}
+	*tg = (int8_t)*p;
+	return p+1;
+}
+
+/* 
+ * reads a string or binary header and points 'c' at
+ * the payload (in the decoder's buffer) without copying
+ */
+static inline const unsigned char *mp_get_str(const unsigned char *p, const char **c, uint32_t *sz) {
+	if ((p = mp_get_strsize(p, sz)) == NULL)
+		return NULL;
+	*c = (const char *)p;
+	return p + *sz;
+}
+
+static inline const unsigned char *mp_get_bin(const unsigned char *p, const char **c, uint32_t *sz) {
+	if ((p = mp_get_binsize(p, sz)) == NULL)
+		return NULL;
+	*c = (const char *)p;
+	return p + *sz;
+}
+
+/*
+
+	----   Cursors   ----
+
+mp_cursor_t is a decoder for MessagePack that is
+already in contiguous memory (e.g. a datagram that
+has already been received). It is just a pair of
+pointers, and its functions are all inlined, so the
+cursor can live in registers across a whole run of
+reads, with no stream-mode branches at all.
+
+The mp_cursor_ functions follow the same conventions
+as the mp_read_ functions: on ERR_MSGPACK_BAD_TYPE or
+ERR_MSGPACK_EOF, the cursor does not move. Strings,
+binary and extensions are read in place: the returned
+pointers point into the cursor's memory.
+
+*/
+
+typedef struct {
+	const unsigned char *p;
+	const unsigned char *end;
+} mp_cursor_t;
+
+static inline void mp_cursor_init(mp_cursor_t *c, const void *mem, size_t len) {
+	c->p = (const unsigned char *)mem;
+	c->end = c->p + len;
+}
+
+/* returns the number of bytes left */
+static inline size_t mp_cursor_remaining(const mp_cursor_t *c) {
+	return (size_t)(c->end - c->p);
+}
+
+/* 
+ * returns a pointer to the next MP_MAXSIZE_NUM bytes at the
+ * cursor, copying them (and padding them with invalid tags) 
+ * into 'tmp' when the cursor is closer than that to the end
+ */
+static inline const unsigned char *mp_cursor_window(const mp_cursor_t *c, unsigned char *tmp) {
+	size_t left = mp_cursor_remaining(c);
+	if (left >= MP_MAXSIZE_NUM)
+		return c->p;
+	memset(tmp, 0xc1, MP_MAXSIZE_NUM);
+	memcpy(tmp, c->p, left);
+	return tmp;
+}
+
+/* 
+ * moves the cursor past what an mp_get_ function 
+ * read out of a window ('q' is what it returned)
+ */
+static inline int mp_cursor_advance(mp_cursor_t *c, const unsigned char *win, const unsigned char *q) {
+	if (q == NULL)
+		return (c->p == c->end) ? ERR_MSGPACK_EOF : ERR_MSGPACK_BAD_TYPE;
+	size_t used = (size_t)(q - win);
+	if (used > mp_cursor_remaining(c))
+		return ERR_MSGPACK_EOF;
+	c->p += used;
+	return MSGPACK_OK;
+}
+
+static inline int mp_cursor_next_type(const mp_cursor_t *c, mp_typ_t *ty) {
+	if (c->p == c->end)
+		return ERR_MSGPACK_EOF;
+	*ty = mp_type(*c->p);
+	return MSGPACK_OK;
+}
+
+static inline int mp_cursor_read_nil(mp_cursor_t *c) {
+	unsigned char tmp[MP_MAXSIZE_NUM];
+	const unsigned char *w = mp_cursor_window(c, tmp);
+	return mp_cursor_advance(c, w, mp_get_nil(w));
+}
+
+static inline int mp_cursor_read_bool(mp_cursor_t *c, bool *b) {
+	unsigned char tmp[MP_MAXSIZE_NUM];
+	const unsigned char *w = mp_cursor_window(c, tmp);
+	return mp_cursor_advance(c, w, mp_get_bool(w, b));
+}
+
+static inline int mp_cursor_read_uint(mp_cursor_t *c, uint64_t *u) {
+	unsigned char tmp[MP_MAXSIZE_NUM];
+	const unsigned char *w = mp_cursor_window(c, tmp);
+	return mp_cursor_advance(c, w, mp_get_uint(w, u));
+}
+
+static inline int mp_cursor_read_int(mp_cursor_t *c, int64_t *i) {
+	unsigned char tmp[MP_MAXSIZE_NUM];
+	const unsigned char *w = mp_cursor_window(c, tmp);
+	return mp_cursor_advance(c, w, mp_get_int(w, i));
+}
+
+static inline int mp_cursor_read_float(mp_cursor_t *c, float *f) {
+	unsigned char tmp[MP_MAXSIZE_NUM];
+	const unsigned char *w = mp_cursor_window(c, tmp);
+	return mp_cursor_advance(c, w, mp_get_float(w, f));
+}
+
+static inline int mp_cursor_read_double(mp_cursor_t *c, double *f) {
+	unsigned char tmp[MP_MAXSIZE_NUM];
+	const unsigned char *w = mp_cursor_window(c, tmp);
+	return mp_cursor_advance(c, w, mp_get_double(w, f));
+}
+
+static inline int mp_cursor_read_mapsize(mp_cursor_t *c, uint32_t *sz) {
+	unsigned char tmp[MP_MAXSIZE_NUM];
+	const unsigned char *w = mp_cursor_window(c, tmp);
+	return mp_cursor_advance(c, w, mp_get_mapsize(w, sz));
+}
+
+static inline int mp_cursor_read_arraysize(mp_cursor_t *c, uint32_t *sz) {
+	unsigned char tmp[MP_MAXSIZE_NUM];
+	const unsigned char *w = mp_cursor_window(c, tmp);
+	return mp_cursor_advance(c, w, mp_get_arraysize(w, sz));
+}
+
+static inline int mp_cursor_read_strsize(mp_cursor_t *c, uint32_t *sz) {
+	unsigned char tmp[MP_MAXSIZE_NUM];
+	const unsigned char *w = mp_cursor_window(c, tmp);
+	return mp_cursor_advance(c, w, mp_get_strsize(w, sz));
+}
+
+static inline int mp_cursor_read_binsize(mp_cursor_t *c, uint32_t *sz) {
+	unsigned char tmp[MP_MAXSIZE_NUM];
+	const unsigned char *w = mp_cursor_window(c, tmp);
+	return mp_cursor_advance(c, w, mp_get_binsize(w, sz));
+}
+
+static inline int mp_cursor_read_extsize(mp_cursor_t *c, int8_t *tg, uint32_t *sz) {
+	unsigned char tmp[MP_MAXSIZE_NUM];
+	const unsigned char *w = mp_cursor_window(c, tmp);
+	return mp_cursor_advance(c, w, mp_get_extsize(w, tg, sz));
+}
+
+/* points 'buf' at the next 'amt' raw bytes and skips them */
+static inline int mp_cursor_read_raw(mp_cursor_t *c, const char **buf, size_t amt) {
+	if (amt > mp_cursor_remaining(c))
+		return ERR_MSGPACK_EOF;
+	*buf = (const char *)c->p;
+	c->p += amt;
+	return MSGPACK_OK;
+}
+
+/* reads a whole string, binary or extension object in place */
+static inline int mp_cursor_read_str(mp_cursor_t *c, const char **s, uint32_t *sz) {
+	mp_cursor_t save = *c;
+	int r = mp_cursor_read_strsize(c, sz);
+	if (r == MSGPACK_OK && (r = mp_cursor_read_raw(c, s, (size_t)*sz)) != MSGPACK_OK)
+		*c = save;
+	return r;
+}
+
+static inline int mp_cursor_read_bin(mp_cursor_t *c, const char **b, uint32_t *sz) {
+	mp_cursor_t save = *c;
+	int r = mp_cursor_read_binsize(c, sz);
+	if (r == MSGPACK_OK && (r = mp_cursor_read_raw(c, b, (size_t)*sz)) != MSGPACK_OK)
+		*c = save;
+	return r;
+}
+
+static inline int mp_cursor_read_ext(mp_cursor_t *c, int8_t *tg, const char **b, uint32_t *sz) {
+	mp_cursor_t save = *c;
+	int r = mp_cursor_read_extsize(c, tg, sz);
+	if (r == MSGPACK_OK && (r = mp_cursor_read_raw(c, b, (size_t)*sz)) != MSGPACK_OK)
+		*c = save;
+	return r;
+}
+
+/* skips the next object (including everything inside it) */
+int mp_cursor_skip(mp_cursor_t *c);
+
+/*
+
+	---- Padded Buffers ----
+
+If a chunk of memory is followed by at least MP_PADDING
+bytes that are safe to read (their contents don't matter),
+a decoder initialized with mp_decode_mem_init_padded can
+be read with the mp_read_*_padded functions. These load
+headers and numbers without checking whether they run
+past the end of the buffer first; only the final position
+(and the length of any payload) is checked. They have the
+same return values as the corresponding mp_read_ functions,
+and must not be used on decoders in stream mode or on 
+buffers without padding.
+
+*/
+
+#define MP_PADDING 16
+
+/* 
+ * initializes a decoder to read the first 'len' bytes of 'mem',
+ * where 'mem' points to at least len+MP_PADDING readable bytes
+ */
+void mp_decode_mem_init_padded(mp_decoder_t *d, unsigned char *mem, size_t len);
+
+int mp_read_nil_padded(mp_decoder_t *d);
+int mp_read_bool_padded(mp_decoder_t *d, bool *b);
+int mp_read_uint_padded(mp_decoder_t *d, uint64_t *u);
+int mp_read_int_padded(mp_decoder_t *d, int64_t *i);
+int mp_read_float_padded(mp_decoder_t *d, float *f);
+int mp_read_double_padded(mp_decoder_t *d, double *f);
+int mp_read_mapsize_padded(mp_decoder_t *d, uint32_t *sz);
+int mp_read_arraysize_padded(mp_decoder_t *d, uint32_t *sz);
+int mp_read_strsize_padded(mp_decoder_t *d, uint32_t *sz);
+int mp_read_binsize_padded(mp_decoder_t *d, uint32_t *sz);
+int mp_read_extsize_padded(mp_decoder_t *d, int8_t *tg, uint32_t *sz);
+
+/* reads a whole string or binary object in place */
+int mp_read_str_padded(mp_decoder_t *d, const char **s, uint32_t *sz);
+int mp_read_bin_padded(mp_decoder_t *d, const char **b, uint32_t *sz);
+
+int mp_skip_padded(mp_decoder_t *d);
+
+/*
+
+	----  Templates  ----
+
+A template is a message recorded once, with placeholder
+slots for the values that change from one message to
+the next. mp_template_emit stamps a copy of it into an
+encoder with one copy of the recorded bytes and in-place
+stores into the slots.
+
+Scalar slots always use their widest encoding (an int64
+slot is always written as a 9-byte int64, etc.) so that
+they occupy the same bytes in every copy. String slots
+have a fixed capacity, which determines the width of
+their header; the string itself is only as long as the
+value written into it.
+
+A template is recorded by writing into the encoder
+returned by mp_template_encoder, and calling the
+mp_template_ slot functions in place of the values
+that change:
+
+	mp_template_begin(&t, mem, sizeof(mem), slots, 2);
+	mp_write_mapsize(mp_template_encoder(&t), 2);
+	mp_write_str(mp_template_encoder(&t), "id", 2);
+	mp_template_int64(&t);        // slot 0
+	mp_write_str(mp_template_encoder(&t), "name", 4);
+	mp_template_str(&t, 64);      // slot 1
+
+	mp_slot_val_t vals[2];
+	vals[0].i = 42;
+	vals[1].s.ptr = "hello";
+	vals[1].s.len = 5;
+	mp_template_emit(e, &t, vals);
+
+*/
+
+typedef enum {
+	MP_SLOT_INT64,
+	MP_SLOT_UINT32,
+	MP_SLOT_UINT64,
+	MP_SLOT_DOUBLE,
+	MP_SLOT_STR
+} mp_slot_typ_t;
+
+typedef struct {
+	size_t        off; // offset of the slot's payload (or string header)
+	uint32_t      cap; // capacity of a string slot
+	mp_slot_typ_t typ;
+} mp_slot_t;
+
+/* the value written into a slot */
+typedef union {
+	int64_t  i; // MP_SLOT_INT64
+	uint64_t u; // MP_SLOT_UINT32, MP_SLOT_UINT64
+	double   f; // MP_SLOT_DOUBLE
+	struct {
+		const char *ptr;
+		uint32_t   len;
+	} s;        // MP_SLOT_STR
+} mp_slot_val_t;
+
+typedef struct {
+	/* 
+	 * NOTE: none of these fields
+	 * should be touched except by
+	 * the mp_template_ functions
+	 */
+	mp_encoder_t enc;
+	mp_slot_t    *slots;
+	size_t       nslots;
+	size_t       maxslots;
+	size_t       nstrs;
+	size_t       strcap;
+} mp_template_t;
+
+/* 
+ * starts recording a template into 'mem', with
+ * room for up to 'maxslots' slots in 'slots'
+ */
+void mp_template_begin(mp_template_t *t, unsigned char *mem, size_t cap, mp_slot_t *slots, size_t maxslots);
+
+/* returns the encoder used to record the fixed parts of a template */
+mp_encoder_t *mp_template_encoder(mp_template_t *t);
+
+/* 
+ * add a slot to a template. these return
+ * ERR_MSGPACK_EOF if the template's buffer
+ * or slot list is full.
+ */
+int mp_template_int64(mp_template_t *t);
+int mp_template_uint32(mp_template_t *t);
+int mp_template_uint64(mp_template_t *t);
+int mp_template_double(mp_template_t *t);
+int mp_template_str(mp_template_t *t, uint32_t cap);
+
+/* 
+ * writes a copy of a template, with 'vals' (one per slot,
+ * in the order the slots were added) in place of the
+ * slots. In stream mode, the message must fit in the
+ * encoder's buffer, except that a counting encoder
+ * (mp_encode_count_init) just adds up its size: this
+ * is the one writer that checks for that mode, rather
+ * than going through the scratch space. Returns ERR_MSGPACK_EOF
+ * if a uint32 slot's value or a string slot's length is 
+ * too big for the slot. (Nothing is written in that case.)
+ */
+int mp_template_emit(mp_encoder_t *e, const mp_template_t *t, const mp_slot_val_t *vals);
+
+/*
+
+	---- Key Interning ----
+
+An mp_intern_t maps map keys (strings) to small,
+stable integer IDs. IDs are handed out in insertion
+order starting at zero, so keys registered up front
+with mp_intern_add get predictable IDs that callers
+can 'switch' on instead of comparing strings.
+
+The table lives in caller-supplied memory: 'nslots'
+slots (a power of two) and 'strcap' bytes of storage
+for the key bytes themselves. At most nslots/2 keys
+can be interned.
+
+While a table is being built, it must not be shared.
+Once mp_intern_freeze has been called, it is read-only
+and can be used by any number of threads at once.
+
+*/
+
+/* returned in place of an ID for keys that are not in a table */
+#define MP_KEY_UNKNOWN UINT32_MAX
+
+typedef struct {
+	uint64_t    hash;
+	const char *key; // NULL when the slot is empty
+	uint32_t    len;
+	uint32_t    id;
+} mp_intern_slot_t;
+
+typedef struct {
+	/* 
+	 * NOTE: none of these fields
+	 * should be touched except by
+	 * the mp_intern_ functions
+	 */
+	mp_intern_slot_t *slots;
+	size_t   mask;
+	char     *strs;
+	size_t   strcap;
+	size_t   stroff;
+	uint32_t count;
+	uint32_t limit;
+	bool     frozen;
+} mp_intern_t;
+
+void mp_intern_init(mp_intern_t *t, mp_intern_slot_t *slots, size_t nslots, char *strs, size_t strcap);
+
+/* 
+ * adds a key to the table (if it isn't there
+ * already) and puts its ID in 'id'. returns 
+ * ERR_MSGPACK_EOF if the table is full or frozen.
+ */
+int mp_intern_add(mp_intern_t *t, const char *key, uint32_t len, uint32_t *id);
+
+/* returns the ID of a key, or MP_KEY_UNKNOWN */
+uint32_t mp_intern_find(const mp_intern_t *t, const char *key, uint32_t len);
+
+/* stops all further insertions */
+void mp_intern_freeze(mp_intern_t *t);
+
+/* returns the number of keys in the table */
+uint32_t mp_intern_count(const mp_intern_t *t);
+
+/*
+ * mp_read_key_id reads a string (usually a map key)
+ * and puts its ID in 'id'. The key bytes are hashed
+ * in place in the decoder's buffer, so in stream mode
+ * the key must fit in the decoder's buffer. Keys that
+ * aren't in the table are inserted if the table isn't
+ * frozen and has room; otherwise 'id' is MP_KEY_UNKNOWN.
+ * Either way, the string is consumed.
+ */
+int mp_read_key_id(mp_decoder_t *d, mp_intern_t *t, uint32_t *id);
+
+/*
+
+	---- Projections ----
+
+An mp_projection_t picks a few fields out of a map
+and decodes them straight into a struct, skipping
+all of the others without decoding them. Each field
+names a key, a type, and the offset of the member
+that receives it:
+
+	typedef struct { uint64_t ts; double load; } sample;
+	static const mp_field_t fields[] = {
+		{ "ts", MP_FIELD_UINT64, offsetof(sample, ts) },
+		{ "load", MP_FIELD_DOUBLE, offsetof(sample, load) },
+	};
+
+Keys are matched through an mp_intern_t built from
+the fields (in the caller's 'slots' and 'strs'), so
+the field at index i has key ID i. Keys longer than
+the longest field key are skipped without hashing.
+
+Numeric fields accept any numeric encoding, as with
+mp_read_number_as_int64/double. MP_FIELD_STR fields
+receive an mp_strref_t pointing into the decoder's
+buffer, which is only stable in mem mode. A nil value
+leaves a field untouched. A value of any other wrong
+type fails with ERR_MSGPACK_BAD_TYPE.
+
+*/
+
+#define MP_PROJECT_MAX 64
+
+typedef enum {
+	MP_FIELD_INT64,  // int64_t
+	MP_FIELD_UINT64, // uint64_t
+	MP_FIELD_DOUBLE, // double
+	MP_FIELD_BOOL,   // bool
+	MP_FIELD_STR,    // mp_strref_t
+} mp_field_typ_t;
+
+typedef struct {
+	const char *s;
+	uint32_t    sz;
+} mp_strref_t;
+
+typedef struct {
+	const char    *key;
+	mp_field_typ_t typ;
+	size_t         offset;
+} mp_field_t;
+
+typedef struct {
+	/* 
+	 * NOTE: none of these fields
+	 * should be touched except by
+	 * the mp_projection_ functions
+	 */
+	const mp_field_t *fields;
+	size_t      nfields;
+	uint32_t    maxkey;
+	mp_intern_t keys;
+} mp_projection_t;
+
+/*
+ * builds a projection of 'nfields' (at most MP_PROJECT_MAX)
+ * fields, using 'slots' and 'strs' for the key table as in
+ * mp_intern_init. 'fields' must outlive the projection.
+ * returns ERR_MSGPACK_EOF if the table is too small, or
+ * ERR_MSGPACK_BAD_TYPE for too many or duplicate keys.
+ * A built projection is read-only and can be shared.
+ */
+int mp_projection_init(mp_projection_t *p, const mp_field_t *fields, size_t nfields,
+	mp_intern_slot_t *slots, size_t nslots, char *strs, size_t strcap);
+
+/*
+ * reads one map, storing the projected fields in 'out'.
+ * if 'found' is not NULL, bit i is set in it for each
+ * field i that was stored.
+ */
+int mp_decode_project(mp_decoder_t *d, const mp_projection_t *p, void *out, uint64_t *found);
+
+/*
+
+	---- Filters ----
+
+An mp_filter_t is a conjunction of simple predicates
+on the fields of map records: a key is present, an
+integer or number is in a range, or a string equals
+(or starts with) a constant. mp_filter_next scans
+records laid end-to-end in a decoder's buffer and
+returns the next one that satisfies every predicate,
+as a span of its encoded bytes. Nothing is decoded:
+keys and values are compared in place, and a record
+is skipped as soon as one predicate fails (or, once
+all of them hold, without looking at the rest).
+
+Predicates on a key the record doesn't have are
+false, as is anything applied to a value of the
+wrong type. Records that aren't maps never match.
+Filters only read the bytes already in the decoder's
+buffer, so they're meant for mem mode. Keys and
+string constants must outlive the filter.
+
+*/
+
+#define MP_FILTER_MAX 16
+
+typedef enum {
+	MP_PRED_EXISTS,
+	MP_PRED_INT_RANGE,
+	MP_PRED_DOUBLE_RANGE,
+	MP_PRED_STR_EQ,
+	MP_PRED_STR_PREFIX,
+} mp_pred_op_t;
+
+typedef struct {
+	const char  *key;
+	uint32_t     keylen;
+	mp_pred_op_t op;
+	union {
+		struct { int64_t lo, hi; } i;
+		struct { double lo, hi; } f;
+		struct { const char *s; uint32_t sz; } str;
+	} arg;
+} mp_pred_t;
+
+typedef struct {
+	mp_pred_t preds[MP_FILTER_MAX];
+	size_t    npreds;
+} mp_filter_t;
+
+void mp_filter_init(mp_filter_t *f);
+
+/*
+ * each of these adds a predicate on the field 'key',
+ * returning ERR_MSGPACK_EOF if the filter is full.
+ * ranges are inclusive; mp_filter_double_range
+ * accepts any numeric encoding.
+ */
+int mp_filter_exists(mp_filter_t *f, const char *key);
+int mp_filter_int_eq(mp_filter_t *f, const char *key, int64_t i);
+int mp_filter_int_range(mp_filter_t *f, const char *key, int64_t lo, int64_t hi);
+int mp_filter_double_range(mp_filter_t *f, const char *key, double lo, double hi);
+int mp_filter_str_eq(mp_filter_t *f, const char *key, const char *s, uint32_t sz);
+int mp_filter_str_prefix(mp_filter_t *f, const char *key, const char *s, uint32_t sz);
+
+/*
+ * finds the next matching record at or after the read
+ * offset, points 'rec' and 'len' at it, and moves the
+ * read offset past it. returns ERR_MSGPACK_EOF when the
+ * buffer has no more records, or an error for a
+ * malformed (or truncated) record.
+ */
+int mp_filter_next(const mp_filter_t *f, mp_decoder_t *d, const unsigned char **rec, size_t *len);
+
+/*
+
+	---- Aggregation ----
+
+mp_array_agg reads an array of numbers and folds
+every element into an mp_agg_t (count, sum, min
+and max, all as doubles) in one pass. Runs of
+elements with the same encoding (fixints, int32s
+or float64s) that are already buffered are handled
+by a tight loop for that encoding (16 fixints at a
+time with SSE2), rather than one read call per
+element; other elements fall back to the generic
+reader.
+
+mp_array_agg_field reads an array of maps and folds
+the value of the field 'key' in each map, skipping
+maps that don't have it.
+
+Nil elements (or field values) are ignored. Any other
+non-number fails with ERR_MSGPACK_BAD_TYPE, which
+leaves the decoder somewhere inside the array. An
+mp_agg_t can be carried across several calls; set
+it up with mp_agg_init first.
+
+*/
+
+typedef struct {
+	uint64_t count;
+	double   sum;
+	double   min; // +inf when count == 0
+	double   max; // -inf when count == 0
+} mp_agg_t;
+
+void mp_agg_init(mp_agg_t *a);
+int mp_array_agg(mp_decoder_t *d, mp_agg_t *a);
+int mp_array_agg_field(mp_decoder_t *d, const char *key, mp_agg_t *a);
+
 #endif
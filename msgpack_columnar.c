@@ -0,0 +1,470 @@
+#include "msgpack_columnar.h"
+
+#define CHECK(r) do { int _r = (r); if (_r) return _r; } while (0)
+#define ALIGN(n) (((n) + 7) & ~(size_t)7)
+
+static size_t elem_size(mp_field_typ_t t) {
+	switch (t) {
+	case MP_FIELD_BOOL:
+		return sizeof(bool);
+	case MP_FIELD_STR:
+		return sizeof(mp_strref_t);
+	default:
+		return sizeof(uint64_t);
+	}
+}
+
+// dictionary tables are at most half full
+static size_t dict_slots(size_t maxrows) {
+	size_t n = 2;
+	while (n < 2*maxrows)
+		n <<= 1;
+	return n;
+}
+
+static size_t column_memsize(const mp_field_t *f, bool coded, size_t maxrows, size_t strcap) {
+	if (coded)
+		return ALIGN(maxrows * sizeof(uint32_t)) + ALIGN(maxrows * sizeof(mp_strref_t)) +
+			ALIGN(dict_slots(maxrows) * sizeof(uint32_t)) + ALIGN(strcap);
+	size_t n = ALIGN(maxrows * elem_size(f->typ));
+	if (f->typ == MP_FIELD_STR)
+		n += ALIGN(strcap);
+	return n;
+}
+
+size_t mp_columnar_memsize(const mp_field_t *fields, size_t nfields, uint64_t dict, size_t maxrows, size_t strcap) {
+	size_t n = 0;
+	for (size_t i=0; i<nfields && i<MP_COLUMNAR_MAX; ++i)
+		n += column_memsize(&fields[i], (dict >> i) & 1, maxrows, strcap);
+	return n;
+}
+
+int mp_columnar_writer_init(mp_columnar_writer_t *w, const mp_field_t *fields, size_t nfields, uint64_t dict,
+	mp_column_t *cols, size_t maxrows, size_t strcap, void *mem, size_t len) {
+	if (nfields > MP_COLUMNAR_MAX || (nfields < MP_COLUMNAR_MAX && (dict >> nfields) != 0))
+		return ERR_MSGPACK_BAD_TYPE;
+	for (size_t i=0; i<nfields; ++i) {
+		if (((dict >> i) & 1) && fields[i].typ != MP_FIELD_STR)
+			return ERR_MSGPACK_BAD_TYPE;
+	}
+	if (mp_columnar_memsize(fields, nfields, dict, maxrows, strcap) > len)
+		return ERR_MSGPACK_EOF;
+
+	unsigned char *p = (unsigned char*)mem;
+	for (size_t i=0; i<nfields; ++i) {
+		mp_column_t *c = &cols[i];
+		c->coded = (dict >> i) & 1;
+		c->dict = NULL;
+		c->ndict = 0;
+		c->strs = NULL;
+		c->strcap = 0;
+		c->stroff = 0;
+		c->slots = NULL;
+		c->mask = 0;
+		if (c->coded) {
+			c->v.codes = (uint32_t*)p;
+			p += ALIGN(maxrows * sizeof(uint32_t));
+			c->dict = (mp_strref_t*)p;
+			p += ALIGN(maxrows * sizeof(mp_strref_t));
+			c->slots = (uint32_t*)p;
+			c->mask = dict_slots(maxrows) - 1;
+			p += ALIGN((c->mask + 1) * sizeof(uint32_t));
+		} else {
+			c->v.i = (int64_t*)p;
+			p += ALIGN(maxrows * elem_size(fields[i].typ));
+		}
+		if (fields[i].typ == MP_FIELD_STR) {
+			c->strs = (char*)p;
+			c->strcap = strcap;
+			p += ALIGN(strcap);
+		}
+	}
+	w->fields = fields;
+	w->nfields = nfields;
+	w->cols = cols;
+	w->maxrows = maxrows;
+	mp_columnar_reset(w);
+	return MSGPACK_OK;
+}
+
+void mp_columnar_reset(mp_columnar_writer_t *w) {
+	for (size_t i=0; i<w->nfields; ++i) {
+		mp_column_t *c = &w->cols[i];
+		c->stroff = 0;
+		if (c->coded) {
+			c->ndict = 0;
+			memset(c->slots, 0, (c->mask + 1) * sizeof(uint32_t));
+		}
+	}
+	w->rows = 0;
+	return;
+}
+
+size_t mp_columnar_rows(const mp_columnar_writer_t *w) { return w->rows; }
+
+static uint64_t hash_str(const char *s, uint32_t sz) {
+	uint64_t h = UINT64_C(14695981039346656037);
+	for (uint32_t i=0; i<sz; ++i) {
+		h ^= (unsigned char)s[i];
+		h *= UINT64_C(1099511628211);
+	}
+	return h;
+}
+
+// returns the code of 's', or UINT32_MAX and the empty slot where it belongs
+static uint32_t dict_find(const mp_column_t *c, mp_strref_t s, size_t *slot) {
+	size_t i = (size_t)hash_str(s.s, s.sz) & c->mask;
+	for (;;) {
+		uint32_t k = c->slots[i];
+		if (k == 0) {
+			*slot = i;
+			return UINT32_MAX;
+		}
+		const mp_strref_t *d = &c->dict[k-1];
+		if (d->sz == s.sz && (s.sz == 0 || memcmp(d->s, s.s, s.sz) == 0))
+			return k-1;
+		i = (i + 1) & c->mask;
+	}
+}
+
+// copies a string into the column's storage (which must have room)
+static mp_strref_t copy_str(mp_column_t *c, mp_strref_t s) {
+	mp_strref_t out;
+	out.s = c->strs + c->stroff;
+	out.sz = s.sz;
+	if (s.sz > 0)
+		memcpy(c->strs + c->stroff, s.s, s.sz);
+	c->stroff += s.sz;
+	return out;
+}
+
+int mp_columnar_add(mp_columnar_writer_t *w, const void *row) {
+	const unsigned char *src = (const unsigned char*)row;
+	uint32_t codes[MP_COLUMNAR_MAX];
+	size_t slots[MP_COLUMNAR_MAX];
+	size_t n = w->rows;
+	if (n == w->maxrows)
+		return ERR_MSGPACK_EOF;
+
+	// check every string column for room before changing any of them
+	for (size_t i=0; i<w->nfields; ++i) {
+		mp_column_t *c = &w->cols[i];
+		mp_strref_t s;
+		if (w->fields[i].typ != MP_FIELD_STR)
+			continue;
+		memcpy(&s, src + w->fields[i].offset, sizeof(s));
+		if (c->coded) {
+			codes[i] = dict_find(c, s, &slots[i]);
+			if (codes[i] != UINT32_MAX)
+				continue;
+		}
+		if (s.sz > c->strcap - c->stroff)
+			return ERR_MSGPACK_EOF;
+	}
+
+	for (size_t i=0; i<w->nfields; ++i) {
+		const mp_field_t *f = &w->fields[i];
+		mp_column_t *c = &w->cols[i];
+		const unsigned char *v = src + f->offset;
+		switch (f->typ) {
+		case MP_FIELD_INT64:
+			memcpy(&c->v.i[n], v, sizeof(int64_t));
+			break;
+		case MP_FIELD_UINT64:
+			memcpy(&c->v.u[n], v, sizeof(uint64_t));
+			break;
+		case MP_FIELD_DOUBLE:
+			memcpy(&c->v.f[n], v, sizeof(double));
+			break;
+		case MP_FIELD_BOOL:
+			memcpy(&c->v.b[n], v, sizeof(bool));
+			break;
+		case MP_FIELD_STR: {
+			mp_strref_t s;
+			memcpy(&s, v, sizeof(s));
+			if (!c->coded) {
+				c->v.s[n] = copy_str(c, s);
+				break;
+			}
+			if (codes[i] == UINT32_MAX) {
+				codes[i] = c->ndict;
+				c->dict[c->ndict++] = copy_str(c, s);
+				c->slots[slots[i]] = c->ndict;
+			}
+			c->v.codes[n] = codes[i];
+			break;
+		}
+		}
+	}
+	w->rows++;
+	return MSGPACK_OK;
+}
+
+// dictionary codes are written as uints, a chunk at a time
+static int write_codes(mp_encoder_t *e, const uint32_t *v, size_t n) {
+	uint64_t u[256];
+	while (n > 0) {
+		size_t k = (n < 256) ? n : 256;
+		for (size_t i=0; i<k; ++i)
+			u[i] = v[i];
+		CHECK(mp_write_uints(e, u, k));
+		v += k;
+		n -= k;
+	}
+	return MSGPACK_OK;
+}
+
+static int write_strs(mp_encoder_t *e, const mp_strref_t *v, size_t n) {
+	for (size_t i=0; i<n; ++i)
+		CHECK(mp_write_str(e, v[i].s, v[i].sz));
+	return MSGPACK_OK;
+}
+
+int mp_columnar_write(mp_encoder_t *e, mp_columnar_writer_t *w) {
+	size_t n = w->rows;
+	CHECK(mp_write_mapsize(e, (uint32_t)w->nfields));
+	for (size_t i=0; i<w->nfields; ++i) {
+		const mp_field_t *f = &w->fields[i];
+		const mp_column_t *c = &w->cols[i];
+		CHECK(mp_write_str(e, f->key, (uint32_t)strlen(f->key)));
+		if (c->coded) {
+			CHECK(mp_write_arraysize(e, 2));
+			CHECK(mp_write_arraysize(e, c->ndict));
+			CHECK(write_strs(e, c->dict, c->ndict));
+			CHECK(mp_write_arraysize(e, (uint32_t)n));
+			CHECK(write_codes(e, c->v.codes, n));
+			continue;
+		}
+		CHECK(mp_write_arraysize(e, (uint32_t)n));
+		switch (f->typ) {
+		case MP_FIELD_INT64:
+			CHECK(mp_write_ints(e, c->v.i, n));
+			break;
+		case MP_FIELD_UINT64:
+			CHECK(mp_write_uints(e, c->v.u, n));
+			break;
+		case MP_FIELD_DOUBLE:
+			CHECK(mp_write_doubles(e, c->v.f, n));
+			break;
+		case MP_FIELD_BOOL:
+			CHECK(mp_write_bools(e, c->v.b, n));
+			break;
+		case MP_FIELD_STR:
+			CHECK(write_strs(e, c->v.s, n));
+			break;
+		}
+	}
+	mp_columnar_reset(w);
+	return MSGPACK_OK;
+}
+
+int mp_columnar_reader_init(mp_columnar_reader_t *r, const mp_field_t *fields, size_t nfields,
+	mp_column_t *cols, void *mem, size_t len) {
+	if (nfields > MP_COLUMNAR_MAX)
+		return ERR_MSGPACK_BAD_TYPE;
+	r->rows = 0;
+	r->present = 0;
+	r->fields = fields;
+	r->nfields = nfields;
+	r->cols = cols;
+	r->mem = (unsigned char*)mem;
+	r->len = len;
+	r->used = 0;
+	return MSGPACK_OK;
+}
+
+// takes 'n' bytes of the arena, aligned if 'align' is set
+static void *arena_take(mp_columnar_reader_t *r, size_t n, bool align) {
+	size_t at = align ? ALIGN(r->used) : r->used;
+	if (at > r->len || n > r->len - at)
+		return NULL;
+	r->used = at + n;
+	return r->mem + at;
+}
+
+static int take_vec(mp_columnar_reader_t *r, size_t n, size_t elem, void **p) {
+	if (n > SIZE_MAX / elem)
+		return ERR_MSGPACK_EOF;
+	*p = arena_take(r, n * elem, true);
+	return (*p == NULL) ? ERR_MSGPACK_EOF : MSGPACK_OK;
+}
+
+// reads a string into the arena
+static int read_str(mp_decoder_t *d, mp_columnar_reader_t *r, mp_strref_t *s) {
+	uint32_t sz;
+	CHECK(mp_read_strsize(d, &sz));
+	char *p = (char*)arena_take(r, sz, false);
+	if (p == NULL)
+		return ERR_MSGPACK_EOF;
+	s->s = p;
+	s->sz = sz;
+	while (sz > 0) {
+		ssize_t n = mp_read(d, p, sz);
+		if (n <= 0)
+			return (n < 0) ? ERR_MSGPACK_CHECK_ERRNO : ERR_MSGPACK_EOF;
+		p += n;
+		sz -= (uint32_t)n;
+	}
+	return MSGPACK_OK;
+}
+
+// reads any non-negative integer
+static int read_uint(mp_decoder_t *d, uint64_t *u) {
+	mp_value_t v;
+	mp_typ_t t;
+	CHECK(mp_next_type(d, &t));
+	if (t != MSG_INT && t != MSG_UINT)
+		return ERR_MSGPACK_BAD_TYPE;
+	CHECK(mp_read_any(d, &v));
+	if (v.type == MSG_UINT) {
+		*u = v.v.u;
+		return MSGPACK_OK;
+	}
+	if (v.v.i < 0)
+		return ERR_MSGPACK_BAD_TYPE;
+	*u = (uint64_t)v.v.i;
+	return MSGPACK_OK;
+}
+
+// returns the index of the field named by the next string, or nfields
+static int read_name(mp_decoder_t *d, const mp_columnar_reader_t *r, size_t *idx) {
+	uint32_t sz;
+	const unsigned char *p;
+	CHECK(mp_read_strsize(d, &sz));
+	CHECK(mp_ensure(d, sz, &p));
+	*idx = r->nfields;
+	for (size_t i=0; i<r->nfields; ++i) {
+		const char *key = r->fields[i].key;
+		if (strlen(key) == sz && memcmp(key, p, sz) == 0) {
+			*idx = i;
+			break;
+		}
+	}
+	mp_consume(d, p + sz);
+	return MSGPACK_OK;
+}
+
+static int read_dict(mp_decoder_t *d, mp_columnar_reader_t *r, mp_column_t *c, size_t *rows) {
+	uint32_t n;
+	void *p;
+	CHECK(mp_read_arraysize(d, &n));
+	CHECK(take_vec(r, n, sizeof(mp_strref_t), &p));
+	c->dict = (mp_strref_t*)p;
+	for (uint32_t i=0; i<n; ++i)
+		CHECK(read_str(d, r, &c->dict[i]));
+	c->ndict = n;
+
+	CHECK(mp_read_arraysize(d, &n));
+	CHECK(take_vec(r, n, sizeof(uint32_t), &p));
+	c->v.codes = (uint32_t*)p;
+	for (uint32_t i=0; i<n; ++i) {
+		uint64_t u;
+		CHECK(read_uint(d, &u));
+		if (u >= c->ndict)
+			return ERR_MSGPACK_BAD_TYPE;
+		c->v.codes[i] = (uint32_t)u;
+	}
+	c->coded = true;
+	*rows = n;
+	return MSGPACK_OK;
+}
+
+static int read_column(mp_decoder_t *d, mp_columnar_reader_t *r, size_t idx, size_t *rows) {
+	const mp_field_t *f = &r->fields[idx];
+	mp_column_t *c = &r->cols[idx];
+	uint32_t n;
+	void *p;
+	CHECK(mp_read_arraysize(d, &n));
+	c->coded = false;
+	c->dict = NULL;
+	c->ndict = 0;
+
+	// plain string columns never hold arrays
+	if (f->typ == MP_FIELD_STR && n == 2) {
+		mp_typ_t t;
+		CHECK(mp_next_type(d, &t));
+		if (t == MSG_ARRAY)
+			return read_dict(d, r, c, rows);
+	}
+
+	CHECK(take_vec(r, n, elem_size(f->typ), &p));
+	c->v.i = (int64_t*)p;
+	for (uint32_t i=0; i<n; ++i) {
+		switch (f->typ) {
+		case MP_FIELD_INT64:
+			CHECK(mp_read_number_as_int64(d, &c->v.i[i]));
+			break;
+		case MP_FIELD_UINT64:
+			CHECK(read_uint(d, &c->v.u[i]));
+			break;
+		case MP_FIELD_DOUBLE:
+			CHECK(mp_read_number_as_double(d, &c->v.f[i]));
+			break;
+		case MP_FIELD_BOOL:
+			CHECK(mp_read_bool(d, &c->v.b[i]));
+			break;
+		case MP_FIELD_STR:
+			CHECK(read_str(d, r, &c->v.s[i]));
+			break;
+		}
+	}
+	*rows = n;
+	return MSGPACK_OK;
+}
+
+int mp_columnar_read(mp_decoder_t *d, mp_columnar_reader_t *r) {
+	uint32_t n;
+	r->rows = 0;
+	r->present = 0;
+	r->used = 0;
+	CHECK(mp_read_mapsize(d, &n));
+	for (uint32_t k=0; k<n; ++k) {
+		size_t idx, rows;
+		CHECK(read_name(d, r, &idx));
+		// unknown (or repeated) columns are skipped
+		if (idx == r->nfields || ((r->present >> idx) & 1)) {
+			CHECK(mp_skip(d));
+			continue;
+		}
+		CHECK(read_column(d, r, idx, &rows));
+		if (r->present != 0 && rows != r->rows)
+			return ERR_MSGPACK_BAD_TYPE;
+		r->rows = rows;
+		r->present |= (uint64_t)1 << idx;
+	}
+	return MSGPACK_OK;
+}
+
+int mp_columnar_row(const mp_columnar_reader_t *r, size_t row, void *out) {
+	unsigned char *dst = (unsigned char*)out;
+	if (row >= r->rows)
+		return ERR_MSGPACK_EOF;
+	for (size_t i=0; i<r->nfields; ++i) {
+		const mp_field_t *f = &r->fields[i];
+		const mp_column_t *c = &r->cols[i];
+		unsigned char *v = dst + f->offset;
+		if (((r->present >> i) & 1) == 0)
+			continue;
+		switch (f->typ) {
+		case MP_FIELD_INT64:
+			memcpy(v, &c->v.i[row], sizeof(int64_t));
+			break;
+		case MP_FIELD_UINT64:
+			memcpy(v, &c->v.u[row], sizeof(uint64_t));
+			break;
+		case MP_FIELD_DOUBLE:
+			memcpy(v, &c->v.f[row], sizeof(double));
+			break;
+		case MP_FIELD_BOOL:
+			memcpy(v, &c->v.b[row], sizeof(bool));
+			break;
+		case MP_FIELD_STR:
+			if (c->coded)
+				memcpy(v, &c->dict[c->v.codes[row]], sizeof(mp_strref_t));
+			else
+				memcpy(v, &c->v.s[row], sizeof(mp_strref_t));
+			break;
+		}
+	}
+	return MSGPACK_OK;
+}
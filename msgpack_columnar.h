@@ -0,0 +1,181 @@
+#ifndef MSGPACK_COLUMNAR_H__
+#define MSGPACK_COLUMNAR_H__
+#include "msgpack.h"
+
+/*
+
+	---- Columnar Batches ----
+
+An array of maps that all have the same keys spends
+most of its bytes repeating the keys, and scatters
+the values of each field across the whole message.
+A columnar batch is instead a map from each field's
+name to an array of that field's values, one per
+row:
+
+	{ "ts": [1, 2, 3], "load": [0.5, 0.25, 1.0] }
+
+Every column array holds values of one type, so a
+reader can decode a column straight into a contiguous
+vector. A string column can also be dictionary-encoded,
+in which case its value is a two-element array: the
+distinct strings, and then each row's index into them:
+
+	{ "host": [["a", "b"], [0, 1, 1, 0]] }
+
+Both are plain messagepack, so any decoder can read
+a batch. Columns are described with the same
+mp_field_t as projections (a name, a type, and the
+offset of the member of a row struct that holds it),
+so a batch is written from, and read back into, the
+same structs:
+
+	typedef struct { uint64_t ts; mp_strref_t host; double load; } sample;
+	static const mp_field_t fields[] = {
+		{ "ts", MP_FIELD_UINT64, offsetof(sample, ts) },
+		{ "host", MP_FIELD_STR, offsetof(sample, host) },
+		{ "load", MP_FIELD_DOUBLE, offsetof(sample, load) },
+	};
+	mp_column_t cols[3];
+
+	mp_columnar_writer_init(&w, fields, 3, 1<<1, cols, 1024, 64*1024, mem, memsize);
+	while (mp_columnar_add(&w, &s) == MSGPACK_OK)
+		...
+	mp_columnar_write(&enc, &w);
+
+	mp_columnar_reader_init(&r, fields, 3, cols, mem, memsize);
+	mp_columnar_read(&dec, &r);
+	agg(cols[2].v.f, r.rows); // the whole "load" column
+	mp_columnar_row(&r, 7, &s);
+
+Writers and readers keep their columns in the caller's
+mp_column_t array (one per field), and everything else
+(column vectors, dictionaries and copies of strings)
+in one caller-supplied arena.
+
+*/
+
+#define MP_COLUMNAR_MAX 64
+
+typedef struct {
+	bool coded; // dictionary-encoded (v.codes and dict)
+	union {
+		int64_t     *i;     // MP_FIELD_INT64
+		uint64_t    *u;     // MP_FIELD_UINT64
+		double      *f;     // MP_FIELD_DOUBLE
+		bool        *b;     // MP_FIELD_BOOL
+		mp_strref_t *s;     // MP_FIELD_STR
+		uint32_t    *codes; // MP_FIELD_STR, dictionary-encoded
+	} v;
+	mp_strref_t *dict;  // the distinct strings, by code
+	uint32_t     ndict;
+	/*
+	 * NOTE: the fields below
+	 * should not be touched except
+	 * by the mp_columnar_ functions
+	 */
+	char        *strs;   // copies of the column's strings
+	size_t       strcap;
+	size_t       stroff;
+	uint32_t    *slots;  // dictionary hash table (code+1, or 0)
+	size_t       mask;
+} mp_column_t;
+
+typedef struct {
+	/*
+	 * NOTE: none of these fields
+	 * should be touched except by
+	 * the mp_columnar_ functions
+	 */
+	const mp_field_t *fields;
+	size_t       nfields;
+	mp_column_t *cols;
+	size_t       rows;
+	size_t       maxrows;
+} mp_columnar_writer_t;
+
+/*
+ * returns the number of bytes of arena a writer needs
+ * for batches of up to 'maxrows' rows of 'fields', with
+ * room for 'strcap' bytes of strings in each string
+ * column, dictionary-encoding the columns whose bits
+ * are set in 'dict'
+ */
+size_t mp_columnar_memsize(const mp_field_t *fields, size_t nfields, uint64_t dict, size_t maxrows, size_t strcap);
+
+/*
+ * initializes a writer with one column in 'cols' for each
+ * of the 'nfields' (at most MP_COLUMNAR_MAX) fields, and
+ * 'mem' as its arena. 'fields' must outlive the writer.
+ * returns ERR_MSGPACK_EOF if 'len' is too small, and
+ * ERR_MSGPACK_BAD_TYPE for too many fields or a 'dict'
+ * bit on a column that isn't a string.
+ */
+int mp_columnar_writer_init(mp_columnar_writer_t *w, const mp_field_t *fields, size_t nfields, uint64_t dict,
+	mp_column_t *cols, size_t maxrows, size_t strcap, void *mem, size_t len);
+
+/*
+ * appends one row, read from the struct at 'row'. strings
+ * are copied. returns ERR_MSGPACK_EOF (adding nothing) if
+ * the batch already has 'maxrows' rows or a string column
+ * is out of room.
+ */
+int mp_columnar_add(mp_columnar_writer_t *w, const void *row);
+
+/* returns the number of rows in the batch */
+size_t mp_columnar_rows(const mp_columnar_writer_t *w);
+
+/* empties the batch */
+void mp_columnar_reset(mp_columnar_writer_t *w);
+
+/*
+ * writes the batch as one map, and (if that succeeds)
+ * empties it. numeric columns are written in runs of
+ * up to 4KB, so they also stay fast in stream mode.
+ */
+int mp_columnar_write(mp_encoder_t *e, mp_columnar_writer_t *w);
+
+typedef struct {
+	size_t   rows;    // the number of rows in the last batch read
+	uint64_t present; // bit i is set if field i's column was in it
+	/*
+	 * NOTE: the fields below
+	 * should not be touched except
+	 * by the mp_columnar_ functions
+	 */
+	const mp_field_t *fields;
+	size_t         nfields;
+	mp_column_t   *cols;
+	unsigned char *mem;
+	size_t         len;
+	size_t         used;
+} mp_columnar_reader_t;
+
+/*
+ * initializes a reader of batches of 'fields' (at most
+ * MP_COLUMNAR_MAX), which decodes each column into
+ * 'cols' and the arena 'mem'. returns ERR_MSGPACK_BAD_TYPE
+ * for too many fields.
+ */
+int mp_columnar_reader_init(mp_columnar_reader_t *r, const mp_field_t *fields, size_t nfields,
+	mp_column_t *cols, void *mem, size_t len);
+
+/*
+ * reads one batch, replacing the last one. columns that
+ * aren't in 'fields' are skipped. numeric columns accept
+ * any numeric encoding, as with mp_read_number_as_int64/double,
+ * and string columns either encoding. returns ERR_MSGPACK_EOF
+ * if the arena is too small, and ERR_MSGPACK_BAD_TYPE if a
+ * column has the wrong type or a different number of rows.
+ */
+int mp_columnar_read(mp_decoder_t *d, mp_columnar_reader_t *r);
+
+/*
+ * stores row 'row' of the last batch in the struct at 'out';
+ * members of missing columns are left untouched. strings
+ * point into the arena. returns ERR_MSGPACK_EOF if there
+ * is no such row.
+ */
+int mp_columnar_row(const mp_columnar_reader_t *r, size_t row, void *out);
+
+#endif
@@ -0,0 +1,79 @@
+#define _DEFAULT_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "msgpack_file.h"
+
+static size_t page_size(void) {
+	return (size_t)sysconf(_SC_PAGESIZE);
+}
+
+int mp_decode_file_init(mp_decoder_t *d, mp_file_t *f, const char *path) {
+	struct stat st;
+	int fd = open(path, O_RDONLY|O_CLOEXEC);
+	if (fd < 0)
+		return ERR_MSGPACK_CHECK_ERRNO;
+	if (fstat(fd, &st) < 0) {
+		int e = errno;
+		close(fd);
+		errno = e;
+		return ERR_MSGPACK_CHECK_ERRNO;
+	}
+	f->map = NULL;
+	f->len = (size_t)st.st_size;
+	f->ahead = 0;
+	f->released = 0;
+
+	// mmap can't map nothing
+	if (f->len > 0) {
+		void *m = mmap(NULL, f->len, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (m == MAP_FAILED) {
+			int e = errno;
+			close(fd);
+			errno = e;
+			return ERR_MSGPACK_CHECK_ERRNO;
+		}
+		f->map = (unsigned char*)m;
+		madvise(f->map, f->len, MADV_SEQUENTIAL);
+	}
+	// the mapping outlives the descriptor
+	close(fd);
+
+	mp_decode_mem_init(d, f->map, f->len);
+	mp_decode_file_advance(d, f);
+	return MSGPACK_OK;
+}
+
+void mp_decode_file_advance(mp_decoder_t *d, mp_file_t *f) {
+	size_t pos = d->off;
+
+	// keep at least half a window of readahead queued
+	if (f->ahead < f->len && pos + MP_FILE_WINDOW/2 >= f->ahead) {
+		size_t from = f->ahead;
+		size_t to = pos + MP_FILE_WINDOW;
+		if (to > f->len)
+			to = f->len;
+		from &= ~(page_size() - 1);
+		madvise(f->map + from, to - from, MADV_WILLNEED);
+		f->ahead = to;
+	}
+
+	// drop whole pages more than a window behind
+	if (pos > f->released + 2*MP_FILE_WINDOW) {
+		size_t to = (pos - MP_FILE_WINDOW) & ~(page_size() - 1);
+		madvise(f->map + f->released, to - f->released, MADV_DONTNEED);
+		f->released = to;
+	}
+	return;
+}
+
+void mp_decode_file_close(mp_decoder_t *d, mp_file_t *f) {
+	if (f->map != NULL)
+		munmap(f->map, f->len);
+	f->map = NULL;
+	f->len = 0;
+	mp_decode_mem_init(d, NULL, 0);
+	return;
+}
@@ -0,0 +1,64 @@
+#ifndef MSGPACK_FILE_H__
+#define MSGPACK_FILE_H__
+#include "msgpack.h"
+
+/*
+
+	---- Mapped Files ----
+
+mp_decode_file_init maps a whole file read-only and
+sets up a mem-mode decoder over it, so decoding never
+goes through fill() or copies into a buffer.
+
+The mapping is advised MADV_SEQUENTIAL, and the
+kernel is asked to read one MP_FILE_WINDOW ahead
+of the decoder with MADV_WILLNEED. Pages more
+than a window behind the decoder are released with
+MADV_DONTNEED, so scanning a file that is larger
+than RAM doesn't push everything else out of memory.
+Since a mem-mode decoder has no hook for this, the
+caller moves the windows along by calling
+mp_decode_file_advance every so often (e.g. after
+each record); it is cheap when there is nothing to do.
+
+	mp_file_t f;
+	mp_decoder_t dec;
+	mp_decode_file_init(&dec, &f, "archive.mp");
+	while (mp_skip(&dec) == MSGPACK_OK)
+		mp_decode_file_advance(&dec, &f);
+	mp_decode_file_close(&dec, &f);
+
+The whole file is mapped at once, which is only
+a problem where the address space is smaller
+than the file (i.e. big files on 32-bit systems).
+
+*/
+
+#ifndef MP_FILE_WINDOW
+#define MP_FILE_WINDOW (8u << 20)
+#endif
+
+typedef struct {
+	/*
+	 * NOTE: none of these fields
+	 * should be touched except by
+	 * the mp_decode_file_ functions
+	 */
+	unsigned char *map;
+	size_t len;
+	size_t ahead;    // advised WILLNEED up to here
+	size_t released; // advised DONTNEED up to here
+} mp_file_t;
+
+/*
+ * maps 'path' and initializes a mem-mode decoder over
+ * it. returns ERR_MSGPACK_CHECK_ERRNO if a syscall fails.
+ */
+int mp_decode_file_init(mp_decoder_t *d, mp_file_t *f, const char *path);
+
+/* moves the readahead and release windows to the decoder's offset */
+void mp_decode_file_advance(mp_decoder_t *d, mp_file_t *f);
+
+void mp_decode_file_close(mp_decoder_t *d, mp_file_t *f);
+
+#endif
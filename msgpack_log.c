@@ -0,0 +1,232 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "msgpack_log.h"
+
+#define ENTRY 24
+#define TRAILER 18 // fixext 16
+#define CHECK(r) do { int _r = (r); if (_r) return _r; } while (0)
+
+static const char magic[8] = { 'm', 's', 'g', 'c', 'l', 'o', 'g', '1' };
+
+static void put_be64(unsigned char *p, uint64_t v) {
+	for (int i=7; i>=0; --i) {
+		p[i] = (unsigned char)v;
+		v >>= 8;
+	}
+}
+
+static uint64_t get_be64(const unsigned char *p) {
+	uint64_t v = 0;
+	for (int i=0; i<8; ++i)
+		v = (v << 8) | p[i];
+	return v;
+}
+
+// counts every byte on its way to the real flush
+static ssize_t log_flush(void *ctx, const void *buf, size_t amt) {
+	mp_log_writer_t *w = (mp_log_writer_t*)ctx;
+	ssize_t n = w->write(w->ctx, buf, amt);
+	if (n > 0)
+		w->flushed += (uint64_t)n;
+	return n;
+}
+
+void mp_log_writer_init(mp_log_writer_t *w, void *ctx, mp_flush_t write, unsigned char *buf, size_t bufsize,
+	mp_log_block_t *blocks, size_t maxblocks, size_t blocksize) {
+	mp_encode_stream_init(&w->enc, w, log_flush, buf, bufsize);
+	w->ctx = ctx;
+	w->write = write;
+	w->blocks = blocks;
+	w->maxblocks = maxblocks;
+	w->nblocks = 0;
+	w->blocksize = blocksize;
+	w->flushed = 0;
+	w->last = 0;
+	w->records = 0;
+	w->open = false;
+	return;
+}
+
+void mp_log_commit(mp_log_writer_t *w) {
+	uint64_t pos = w->flushed + mp_enc_buffered(&w->enc);
+	if (!w->open && w->nblocks < w->maxblocks) {
+		mp_log_block_t *b = &w->blocks[w->nblocks++];
+		b->first = w->records;
+		b->offset = w->last;
+		b->count = 0;
+		w->open = true;
+	}
+	mp_log_block_t *b = &w->blocks[w->nblocks-1];
+	b->count++;
+	w->records++;
+	w->last = pos;
+	if (pos - b->offset >= w->blocksize)
+		w->open = false;
+	return;
+}
+
+int mp_log_writer_finish(mp_log_writer_t *w) {
+	unsigned char ent[ENTRY];
+	unsigned char trailer[16];
+	uint64_t index = w->flushed + mp_enc_buffered(&w->enc);
+
+	CHECK(mp_write_extsize(&w->enc, MP_LOG_EXT, (uint32_t)(w->nblocks * ENTRY)));
+	for (size_t i=0; i<w->nblocks; ++i) {
+		put_be64(ent, w->blocks[i].first);
+		put_be64(ent + 8, w->blocks[i].offset);
+		put_be64(ent + 16, w->blocks[i].count);
+		// mp_write only comes up short on a failed flush
+		if (mp_write(&w->enc, (const char*)ent, ENTRY) != ENTRY)
+			return ERR_MSGPACK_CHECK_ERRNO;
+	}
+	memcpy(trailer, magic, 8);
+	put_be64(trailer + 8, index);
+	CHECK(mp_write_ext(&w->enc, MP_LOG_EXT, (const char*)trailer, 16));
+	return mp_flush(&w->enc);
+}
+
+// reads exactly 'n' bytes at 'off'
+static int read_at(int fd, void *buf, size_t n, uint64_t off) {
+	unsigned char *p = (unsigned char*)buf;
+	while (n > 0) {
+		ssize_t c = pread(fd, p, n, (off_t)off);
+		if (c < 0) {
+			if (errno == EINTR)
+				continue;
+			return ERR_MSGPACK_CHECK_ERRNO;
+		}
+		if (c == 0)
+			return ERR_MSGPACK_BAD_TYPE; // truncated
+		p += c;
+		n -= (size_t)c;
+		off += (uint64_t)c;
+	}
+	return MSGPACK_OK;
+}
+
+int mp_log_reader_init(mp_log_reader_t *r, int fd, mp_log_block_t *blocks, size_t maxblocks) {
+	unsigned char buf[TRAILER];
+	mp_decoder_t d;
+	int8_t tg;
+	uint32_t sz;
+	struct stat st;
+
+	// (fstat, unlike lseek, leaves the caller's file offset alone)
+	if (fstat(fd, &st) != 0)
+		return ERR_MSGPACK_CHECK_ERRNO;
+	off_t size = st.st_size;
+	if (size < TRAILER)
+		return ERR_MSGPACK_BAD_TYPE;
+	CHECK(read_at(fd, buf, TRAILER, (uint64_t)size - TRAILER));
+	mp_decode_mem_init(&d, buf, TRAILER);
+	if (mp_read_extsize(&d, &tg, &sz) != MSGPACK_OK || tg != MP_LOG_EXT || sz != 16 ||
+	    memcmp(buf + 2, magic, 8) != 0)
+		return ERR_MSGPACK_BAD_TYPE;
+	uint64_t index = get_be64(buf + 10);
+
+	// the index header is at most 6 bytes (ext 32)
+	unsigned char hdr[6];
+	if (index >= (uint64_t)size - TRAILER)
+		return ERR_MSGPACK_BAD_TYPE;
+	size_t hlen = (size_t)((uint64_t)size - TRAILER - index);
+	CHECK(read_at(fd, hdr, hlen < sizeof(hdr) ? hlen : sizeof(hdr), index));
+	mp_decode_mem_init(&d, hdr, hlen < sizeof(hdr) ? hlen : sizeof(hdr));
+	if (mp_read_extsize(&d, &tg, &sz) != MSGPACK_OK || tg != MP_LOG_EXT || sz % ENTRY != 0 ||
+	    d.off + sz != hlen)
+		return ERR_MSGPACK_BAD_TYPE;
+	size_t n = sz / ENTRY;
+	if (n > maxblocks)
+		return ERR_MSGPACK_EOF;
+
+	/*
+	 * the searches and ranges depend on the blocks
+	 * being in order and inside the records, so a
+	 * corrupt index is rejected here
+	 */
+	uint64_t off = index + d.off;
+	uint64_t prev = 0;
+	r->records = 0;
+	for (size_t i=0; i<n; ++i) {
+		unsigned char ent[ENTRY];
+		CHECK(read_at(fd, ent, ENTRY, off));
+		off += ENTRY;
+		blocks[i].first = get_be64(ent);
+		blocks[i].offset = get_be64(ent + 8);
+		blocks[i].count = get_be64(ent + 16);
+		if (blocks[i].first != r->records || blocks[i].offset < prev || blocks[i].offset > index ||
+		    blocks[i].count > UINT64_MAX - r->records)
+			return ERR_MSGPACK_BAD_TYPE;
+		prev = blocks[i].offset;
+		r->records += blocks[i].count;
+	}
+	r->fd = fd;
+	r->blocks = blocks;
+	r->nblocks = n;
+	r->end = index;
+	return MSGPACK_OK;
+}
+
+size_t mp_log_find_record(mp_log_reader_t *r, uint64_t n) {
+	if (n >= r->records)
+		return r->nblocks;
+	// the last block with first <= n
+	size_t lo = 0, hi = r->nblocks;
+	while (hi - lo > 1) {
+		size_t mid = lo + (hi - lo)/2;
+		if (r->blocks[mid].first <= n)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+size_t mp_log_find_offset(mp_log_reader_t *r, uint64_t off) {
+	if (off >= r->end || r->nblocks == 0)
+		return r->nblocks;
+	size_t lo = 0, hi = r->nblocks;
+	while (hi - lo > 1) {
+		size_t mid = lo + (hi - lo)/2;
+		if (r->blocks[mid].offset <= off)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+void mp_log_range(mp_log_reader_t *r, size_t from, size_t to, mp_log_range_t *rg) {
+	rg->fd = r->fd;
+	rg->pos = (from < r->nblocks) ? r->blocks[from].offset : r->end;
+	rg->end = (to < r->nblocks) ? r->blocks[to].offset : r->end;
+	return;
+}
+
+ssize_t mp_log_fill(void *ctx, void *buf, size_t max) {
+	mp_log_range_t *rg = (mp_log_range_t*)ctx;
+	if (rg->pos >= rg->end)
+		return 0;
+	if (max > rg->end - rg->pos)
+		max = (size_t)(rg->end - rg->pos);
+	ssize_t n;
+	do {
+		n = pread(rg->fd, buf, max, (off_t)rg->pos);
+	} while (n < 0 && errno == EINTR);
+	if (n > 0)
+		rg->pos += (uint64_t)n;
+	return n;
+}
+
+int mp_log_seek(mp_log_reader_t *r, uint64_t n, mp_log_range_t *rg, mp_decoder_t *d, unsigned char *buf, size_t bufsize) {
+	size_t b = mp_log_find_record(r, n);
+	if (b == r->nblocks)
+		return ERR_MSGPACK_EOF;
+	mp_log_range(r, b, r->nblocks, rg);
+	mp_decode_stream_init(d, rg, mp_log_fill, buf, bufsize);
+	for (uint64_t i=r->blocks[b].first; i<n; ++i)
+		CHECK(mp_skip(d));
+	return MSGPACK_OK;
+}
@@ -0,0 +1,133 @@
+#ifndef MSGPACK_LOG_H__
+#define MSGPACK_LOG_H__
+#include "msgpack.h"
+
+/*
+
+	---- Record Logs ----
+
+A record log is a file of plain messagepack records,
+grouped into blocks of roughly 'blocksize' bytes and
+followed by an index of the blocks, so that a reader
+can find record N (or the records after some byte
+offset) with a binary search instead of skipping
+over everything before it.
+
+The index is an ext object (of type MP_LOG_EXT)
+holding, for each block, its first record number,
+byte offset and record count as big-endian 64-bit
+integers. It is followed by a fixext 16 trailer
+(also MP_LOG_EXT) holding the magic bytes "msgclog1"
+and the index's offset. So the whole file is still
+a valid messagepack stream; a plain decoder sees
+the records and then two ext objects.
+
+The writer owns a stream encoder, which the caller
+writes records to, marking the end of each one:
+
+	mp_log_writer_init(&w, &fd, my_flush, buf, sizeof(buf), blocks, 1024, 64*1024);
+	for (...) {
+		mp_write_mapsize(&w.enc, 2);
+		...
+		mp_log_commit(&w);
+	}
+	mp_log_writer_finish(&w);
+
+The reader loads the index, and then sets up stream
+decoders (through mp_log_fill, which uses pread) over
+ranges of blocks. Ranges are independent, so separate
+threads can decode separate ranges of the same file:
+
+	mp_log_reader_init(&r, fd, blocks, 1024);
+	mp_log_seek(&r, 1000000, &rg, &dec, buf, sizeof(buf));
+	mp_read_mapsize(&dec, &sz); // record 1000000
+
+*/
+
+#define MP_LOG_EXT 0x4c
+
+typedef struct {
+	uint64_t first;  // number of the block's first record
+	uint64_t offset; // byte offset of the block
+	uint64_t count;  // number of records in the block
+} mp_log_block_t;
+
+typedef struct {
+	mp_encoder_t    enc; // records are written here
+	/*
+	 * NOTE: the fields below
+	 * should not be touched except
+	 * by the mp_log_ functions
+	 */
+	void           *ctx;
+	mp_flush_t      write;
+	mp_log_block_t *blocks;
+	size_t          maxblocks;
+	size_t          nblocks;
+	size_t          blocksize;
+	uint64_t        flushed; // bytes handed to 'write'
+	uint64_t        last;    // offset of the end of the last record
+	uint64_t        records;
+	bool            open;    // blocks[nblocks-1] takes more records
+} mp_log_writer_t;
+
+/*
+ * initializes a writer that flushes through 'write'
+ * and indexes up to 'maxblocks' (at least 1) blocks
+ * of roughly 'blocksize' bytes. if 'blocks' fills up,
+ * the last block just grows to hold the rest of the
+ * records.
+ */
+void mp_log_writer_init(mp_log_writer_t *w, void *ctx, mp_flush_t write, unsigned char *buf, size_t bufsize,
+	mp_log_block_t *blocks, size_t maxblocks, size_t blocksize);
+
+/* marks the end of a record written to w->enc */
+void mp_log_commit(mp_log_writer_t *w);
+
+/* writes the index and trailer, and flushes */
+int mp_log_writer_finish(mp_log_writer_t *w);
+
+typedef struct {
+	int             fd;
+	mp_log_block_t *blocks;
+	size_t          nblocks;
+	uint64_t        records; // total number of records
+	uint64_t        end;     // offset of the end of the records
+} mp_log_reader_t;
+
+/*
+ * reads the index of the log in 'fd' into 'blocks'.
+ * returns ERR_MSGPACK_BAD_TYPE if the file isn't a log
+ * (or its index is out of order or past the records),
+ * ERR_MSGPACK_EOF if it has more than 'maxblocks' blocks,
+ * and ERR_MSGPACK_CHECK_ERRNO if a read fails.
+ */
+int mp_log_reader_init(mp_log_reader_t *r, int fd, mp_log_block_t *blocks, size_t maxblocks);
+
+/*
+ * return the block holding record 'n', or the block
+ * holding byte offset 'off' (nblocks if there is none)
+ */
+size_t mp_log_find_record(mp_log_reader_t *r, uint64_t n);
+size_t mp_log_find_offset(mp_log_reader_t *r, uint64_t off);
+
+/*
+ * an mp_log_range_t is the 'ctx' for mp_log_fill,
+ * which reads only the bytes of blocks [from, to)
+ */
+typedef struct {
+	int      fd;
+	uint64_t pos;
+	uint64_t end;
+} mp_log_range_t;
+
+void mp_log_range(mp_log_reader_t *r, size_t from, size_t to, mp_log_range_t *rg);
+ssize_t mp_log_fill(void *ctx, void *buf, size_t max);
+
+/*
+ * sets up 'd' to read from record 'n' to the end of
+ * the log. returns ERR_MSGPACK_EOF if there is no record 'n'.
+ */
+int mp_log_seek(mp_log_reader_t *r, uint64_t n, mp_log_range_t *rg, mp_decoder_t *d, unsigned char *buf, size_t bufsize);
+
+#endif
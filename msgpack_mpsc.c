@@ -0,0 +1,168 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include "msgpack_mpsc.h"
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+/*
+ * This is Vyukov's bounded queue. Slot i's 'seq'
+ * is i while it is free for the claim at position i
+ * (or, once head has passed i, claimed), and
+ * i+nslots once it has been drained (i.e. free again
+ * for the claim one lap later).
+ *
+ * A claimed slot's 'state' holds the low 32 bits of
+ * its position (so a producer can't mistake the slot
+ * for its own after it has been drained and claimed
+ * again), the bytes committed so far, and two flags:
+ * BUSY while the producer is encoding a record, and
+ * DONE once the slot belongs to the flusher, whether
+ * the producer published it or the flusher took it.
+ * Both sides only change the state with a CAS, so
+ * the flusher never takes a slot mid-record, and a
+ * producer never writes to a slot that was taken.
+ */
+
+#define BUSY ((uint64_t)1 << 30)
+#define DONE ((uint64_t)1 << 31)
+#define LEN  (BUSY - 1)
+
+static uint64_t lap(size_t pos) {
+	return (uint64_t)(uint32_t)pos << 32;
+}
+
+void mp_mpsc_init(mp_mpsc_t *q, mp_mpsc_slot_t *slots, size_t nslots, unsigned char *mem, size_t slotsize) {
+	for (size_t i=0; i<nslots; ++i) {
+		atomic_init(&slots[i].seq, i);
+		atomic_init(&slots[i].state, lap(i));
+	}
+	q->slots = slots;
+	q->mem = mem;
+	q->mask = nslots - 1;
+	q->slotsize = slotsize;
+	atomic_init(&q->head, 0);
+	q->tail = 0;
+	q->partial = 0;
+	return;
+}
+
+void mp_mpsc_producer_init(mp_mpsc_producer_t *p) {
+	p->pos = 0;
+	p->active = false;
+	return;
+}
+
+int mp_mpsc_claim(mp_mpsc_t *q, mp_mpsc_producer_t *p) {
+	size_t pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+	for (;;) {
+		mp_mpsc_slot_t *s = &q->slots[pos & q->mask];
+		size_t seq = atomic_load_explicit(&s->seq, memory_order_acquire);
+		if (seq == pos) {
+			// on failure, 'pos' is reloaded
+			if (atomic_compare_exchange_weak_explicit(&q->head, &pos, pos + 1,
+				memory_order_relaxed, memory_order_relaxed))
+				break;
+		} else if (seq < pos) {
+			// the slot from the last lap hasn't been drained
+			return ERR_MSGPACK_EOF;
+		} else {
+			pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+		}
+	}
+	mp_encode_mem_init(&p->enc, q->mem + (pos & q->mask) * q->slotsize, q->slotsize);
+	p->pos = pos;
+	p->active = true;
+	return MSGPACK_OK;
+}
+
+void mp_mpsc_publish(mp_mpsc_t *q, mp_mpsc_producer_t *p) {
+	if (!p->active)
+		return;
+	mp_mpsc_slot_t *s = &q->slots[p->pos & q->mask];
+	uint64_t want = lap(p->pos) | mp_enc_buffered(&p->enc);
+	// this only fails if the flusher has taken the slot already
+	atomic_compare_exchange_strong_explicit(&s->state, &want, want | DONE,
+		memory_order_release, memory_order_relaxed);
+	p->active = false;
+	return;
+}
+
+int mp_mpsc_write(mp_mpsc_t *q, mp_mpsc_producer_t *p, int (*encode)(mp_encoder_t *e, void *arg), void *arg) {
+	for (;;) {
+		int r;
+		if (!p->active) {
+			r = mp_mpsc_claim(q, p);
+			if (r) return r;
+		}
+		mp_mpsc_slot_t *s = &q->slots[p->pos & q->mask];
+		size_t mark = mp_enc_buffered(&p->enc);
+		uint64_t want = lap(p->pos) | mark;
+		if (!atomic_compare_exchange_strong_explicit(&s->state, &want, want | BUSY,
+			memory_order_acquire, memory_order_relaxed)) {
+			// the flusher took the slot
+			p->active = false;
+			continue;
+		}
+		r = encode(&p->enc, arg);
+		if (r != MSGPACK_OK)
+			p->enc.off = mark;
+		atomic_store_explicit(&s->state, lap(p->pos) | mp_enc_buffered(&p->enc), memory_order_release);
+		if (r != ERR_MSGPACK_EOF || mark == 0)
+			return r;
+
+		// try again in an empty slot
+		mp_mpsc_publish(q, p);
+	}
+}
+
+ssize_t mp_mpsc_drain(mp_mpsc_t *q, int fd) {
+	struct iovec iov[IOV_MAX < 64 ? IOV_MAX : 64];
+	size_t n = 0;
+	size_t pos = q->tail;
+	size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+	while (n < sizeof(iov)/sizeof(iov[0]) && pos != head) {
+		mp_mpsc_slot_t *s = &q->slots[pos & q->mask];
+		uint64_t st = atomic_load_explicit(&s->state, memory_order_acquire);
+		if (!(st & DONE)) {
+			// take an open slot, unless a record is half-written
+			if ((st & BUSY) || !atomic_compare_exchange_strong_explicit(&s->state, &st, st | DONE,
+				memory_order_acquire, memory_order_relaxed))
+				break;
+		}
+		size_t skip = (n == 0) ? q->partial : 0;
+		iov[n].iov_base = q->mem + (pos & q->mask) * q->slotsize + skip;
+		iov[n].iov_len = (size_t)(st & LEN) - skip;
+		++n;
+		++pos;
+	}
+	if (n == 0)
+		return 0;
+
+	ssize_t w;
+	do {
+		w = writev(fd, iov, (int)n);
+	} while (w < 0 && errno == EINTR);
+	if (w < 0)
+		return -1;
+
+	// free every slot that was written in full
+	size_t left = (size_t)w;
+	for (size_t i=0; i<n; ++i) {
+		if (left < iov[i].iov_len) {
+			q->partial += left;
+			return w;
+		}
+		left -= iov[i].iov_len;
+		size_t next = q->tail + q->mask + 1;
+		mp_mpsc_slot_t *s = &q->slots[q->tail & q->mask];
+		atomic_store_explicit(&s->state, lap(next), memory_order_relaxed);
+		atomic_store_explicit(&s->seq, next, memory_order_release);
+		q->tail++;
+		q->partial = 0;
+	}
+	return w;
+}
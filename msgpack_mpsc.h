@@ -0,0 +1,110 @@
+#ifndef MSGPACK_MPSC_H__
+#define MSGPACK_MPSC_H__
+#include <stdatomic.h>
+#include "msgpack.h"
+
+/*
+
+	---- Multi-Producer Log Writer ----
+
+An mp_mpsc_t lets any number of threads emit
+MessagePack records to one file descriptor
+without a lock. It is a bounded ring of
+fixed-size slots (in caller-supplied memory):
+
+ - Each producer claims a free slot and encodes
+   records straight into it with mp_mpsc_write,
+   committing each record as it is finished.
+ - When the slot is full (or the producer is done
+   with a burst), it publishes the slot.
+ - A single flusher thread calls mp_mpsc_drain,
+   which hands every slot, in ring order, to one
+   writev(2) call. A slot that is still open is
+   taken over as it stands (its finished records
+   are written; the producer moves on to a fresh
+   slot), so an idle producer never holds up the
+   flusher or the other producers. The flusher only
+   waits for a record that is being encoded.
+
+Producers never wait for I/O: if every slot is
+taken, the producer gets ERR_MSGPACK_EOF and can
+drop or retry the record.
+
+Records never span slots, so records can be at
+most 'slotsize' bytes long (and 'slotsize' must
+be less than 1GB).
+
+*/
+
+typedef struct {
+	_Atomic size_t   seq;
+	_Atomic uint64_t state; // lap, flags, and committed bytes
+} mp_mpsc_slot_t;
+
+typedef struct {
+	/*
+	 * NOTE: none of these fields
+	 * should be touched except by
+	 * the mp_mpsc_ functions
+	 */
+	mp_mpsc_slot_t *slots;
+	unsigned char  *mem;
+	size_t          mask;
+	size_t          slotsize;
+	_Atomic size_t  head;    // next slot to claim
+	size_t          tail;    // next slot to drain (flusher only)
+	size_t          partial; // bytes of the tail slot already written
+} mp_mpsc_t;
+
+typedef struct {
+	mp_encoder_t enc; // encodes into the claimed slot
+	size_t       pos; // ring position of the claimed slot
+	bool         active;
+} mp_mpsc_producer_t;
+
+/*
+ * initializes a ring of 'nslots' (a power of two)
+ * slots of 'slotsize' bytes each; 'mem' must hold
+ * nslots*slotsize bytes
+ */
+void mp_mpsc_init(mp_mpsc_t *q, mp_mpsc_slot_t *slots, size_t nslots, unsigned char *mem, size_t slotsize);
+
+/* initializes a producer (one per thread) */
+void mp_mpsc_producer_init(mp_mpsc_producer_t *p);
+
+/*
+ * claims a free slot and points p->enc at it.
+ * returns ERR_MSGPACK_EOF if every slot is in use.
+ * (the flusher can take the slot over at any time,
+ * so records should only be written to it with
+ * mp_mpsc_write.)
+ */
+int mp_mpsc_claim(mp_mpsc_t *q, mp_mpsc_producer_t *p);
+
+/* hands the producer's slot (if it still has one) to the flusher */
+void mp_mpsc_publish(mp_mpsc_t *q, mp_mpsc_producer_t *p);
+
+/*
+ * mp_mpsc_write runs 'encode' to write one record
+ * through the producer, claiming a slot first if
+ * need be. If the record doesn't fit in what's left
+ * of the slot, the slot is published and the record
+ * is encoded again into a fresh one. Returns
+ * ERR_MSGPACK_EOF if there are no free slots or the
+ * record is larger than a slot, or whatever other
+ * error 'encode' returns; either way, no part of
+ * the record is published.
+ */
+int mp_mpsc_write(mp_mpsc_t *q, mp_mpsc_producer_t *p, int (*encode)(mp_encoder_t *e, void *arg), void *arg);
+
+/*
+ * writes every claimed slot to 'fd' with writev(2)
+ * (flusher thread only), up to the first one with a
+ * record half-written. Returns the number of bytes
+ * written, 0 if nothing was ready, or -1 (check errno).
+ * A short write is picked up where it left off by the
+ * next call.
+ */
+ssize_t mp_mpsc_drain(mp_mpsc_t *q, int fd);
+
+#endif
@@ -0,0 +1,436 @@
+#include "msgpack_packed.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define CHECK(r) do { int _r = (r); if (_r) return _r; } while (0)
+
+#define LANES 4
+#define LANE_VALUES (MP_PACKED_BLOCK / LANES)
+
+// width, smallest difference, and 64-bit values
+#define BLOCK_MAX (1 + 10 + 8*MP_PACKED_BLOCK)
+
+static uint64_t zigzag(int64_t i) {
+	return (i < 0) ? ~((uint64_t)i << 1) : (uint64_t)i << 1;
+}
+
+static uint64_t unzigzag(uint64_t u) {
+	return (u >> 1) ^ (0 - (u & 1));
+}
+
+static size_t varint_size(uint64_t u) {
+	size_t n = 1;
+	for (; u >= 0x80; u >>= 7)
+		n++;
+	return n;
+}
+
+static unsigned char *put_varint(unsigned char *p, uint64_t u) {
+	for (; u >= 0x80; u >>= 7)
+		*p++ = (unsigned char)(u | 0x80);
+	*p++ = (unsigned char)u;
+	return p;
+}
+
+static size_t packed_bytes(size_t cnt, unsigned w) {
+	return (cnt * w + 7) / 8;
+}
+
+// full blocks of narrow values are laid out in lanes
+static bool lanes(size_t cnt, unsigned w) {
+	return cnt == MP_PACKED_BLOCK && w <= 32;
+}
+
+/*
+ * finds the smallest of the 'cnt' differences between
+ * consecutive values starting at 'v', and returns the
+ * number of bits the others need on top of it
+ */
+static unsigned block_info(const int64_t *v, size_t cnt, uint64_t *min) {
+	int64_t lo = (int64_t)((uint64_t)v[1] - (uint64_t)v[0]);
+	int64_t hi = lo;
+	for (size_t i=1; i<cnt; ++i) {
+		int64_t d = (int64_t)((uint64_t)v[i+1] - (uint64_t)v[i]);
+		lo = d < lo ? d : lo;
+		hi = d > hi ? d : hi;
+	}
+	*min = (uint64_t)lo;
+	uint64_t range = (uint64_t)hi - (uint64_t)lo;
+	return (range == 0) ? 0 : 64 - (unsigned)__builtin_clzll(range);
+}
+
+static size_t block_size(uint64_t min, size_t cnt, unsigned w) {
+	return 1 + varint_size(zigzag((int64_t)min)) + packed_bytes(cnt, w);
+}
+
+#ifndef __SSE2__
+static void put_le32(unsigned char *p, uint32_t u) {
+	p[0] = (unsigned char)u;
+	p[1] = (unsigned char)(u >> 8);
+	p[2] = (unsigned char)(u >> 16);
+	p[3] = (unsigned char)(u >> 24);
+}
+
+static uint32_t get_le32(const unsigned char *p) {
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+#endif
+
+/*
+ * Lanes: value i goes to lane i%4, and each lane
+ * packs its values into 32-bit little-endian words,
+ * least significant bit first. Word k of lane l is
+ * at byte 16k+4l, so each group of 16 bytes holds
+ * the same word of all four lanes.
+ */
+
+static void pack_lanes(unsigned char *p, const uint32_t *u, unsigned w) {
+#ifdef __SSE2__
+	__m128i cur = _mm_setzero_si128();
+	for (unsigned j=0; j<LANE_VALUES; ++j) {
+		unsigned bit = j*w, off = bit & 31;
+		__m128i x = _mm_loadu_si128((const __m128i *)(u + LANES*j));
+		cur = _mm_or_si128(cur, _mm_sll_epi32(x, _mm_cvtsi32_si128((int)off)));
+		if (off + w >= 32) {
+			_mm_storeu_si128((__m128i *)(p + 16*(bit >> 5)), cur);
+			cur = (off + w > 32) ? _mm_srl_epi32(x, _mm_cvtsi32_si128((int)(32 - off))) : _mm_setzero_si128();
+		}
+	}
+#else
+	for (unsigned l=0; l<LANES; ++l) {
+		unsigned char *q = p + 4*l;
+		uint64_t acc = 0;
+		unsigned n = 0;
+		for (unsigned j=0; j<LANE_VALUES; ++j) {
+			acc |= (uint64_t)u[LANES*j + l] << n;
+			n += w;
+			if (n >= 32) {
+				put_le32(q, (uint32_t)acc);
+				q += 16;
+				acc >>= 32;
+				n -= 32;
+			}
+		}
+	}
+#endif
+}
+
+static void unpack_lanes(const unsigned char *p, uint32_t *u, unsigned w) {
+#ifdef __SSE2__
+	const __m128i mask = _mm_srl_epi32(_mm_set1_epi32(-1), _mm_cvtsi32_si128((int)(32 - w)));
+	for (unsigned j=0; j<LANE_VALUES; ++j) {
+		unsigned bit = j*w, k = bit >> 5, off = bit & 31;
+		__m128i x = _mm_srl_epi32(_mm_loadu_si128((const __m128i *)(p + 16*k)), _mm_cvtsi32_si128((int)off));
+		if (off + w > 32) {
+			__m128i hi = _mm_loadu_si128((const __m128i *)(p + 16*(k+1)));
+			x = _mm_or_si128(x, _mm_sll_epi32(hi, _mm_cvtsi32_si128((int)(32 - off))));
+		}
+		_mm_storeu_si128((__m128i *)(u + LANES*j), _mm_and_si128(x, mask));
+	}
+#else
+	const uint64_t mask = ((uint64_t)1 << w) - 1;
+	for (unsigned l=0; l<LANES; ++l) {
+		const unsigned char *q = p + 4*l;
+		uint64_t acc = 0;
+		unsigned n = 0;
+		for (unsigned j=0; j<LANE_VALUES; ++j) {
+			if (n < w) {
+				acc |= (uint64_t)get_le32(q) << n;
+				q += 16;
+				n += 32;
+			}
+			u[LANES*j + l] = (uint32_t)(acc & mask);
+			acc >>= w;
+			n -= w;
+		}
+	}
+#endif
+}
+
+// packs 'cnt' values of 'w' bits in order, least significant bit first
+static unsigned char *pack_seq(unsigned char *p, const uint64_t *u, size_t cnt, unsigned w) {
+	uint64_t acc = 0;
+	unsigned n = 0;
+	for (size_t i=0; i<cnt; ++i) {
+		uint64_t x = u[i];
+		for (unsigned left = w; left > 0; ) {
+			unsigned take = left < 32 ? left : 32;
+			acc |= (x & (((uint64_t)1 << take) - 1)) << n;
+			x >>= take;
+			n += take;
+			left -= take;
+			for (; n >= 8; n -= 8) {
+				*p++ = (unsigned char)acc;
+				acc >>= 8;
+			}
+		}
+	}
+	if (n > 0)
+		*p++ = (unsigned char)acc;
+	return p;
+}
+
+static void unpack_seq(const unsigned char *p, uint64_t *u, size_t cnt, unsigned w) {
+	uint64_t acc = 0;
+	unsigned n = 0;
+	for (size_t i=0; i<cnt; ++i) {
+		uint64_t x = 0;
+		for (unsigned got = 0; got < w; ) {
+			unsigned take = (w - got) < 32 ? (w - got) : 32;
+			for (; n < take; n += 8)
+				acc |= (uint64_t)*p++ << n;
+			x |= (acc & (((uint64_t)1 << take) - 1)) << got;
+			acc >>= take;
+			n -= take;
+			got += take;
+		}
+		u[i] = x;
+	}
+}
+
+// packs the block of 'cnt' differences after v[0] at 'p'
+static unsigned char *pack_block(unsigned char *p, const int64_t *v, size_t cnt, uint64_t min, unsigned w) {
+	*p++ = (unsigned char)w;
+	p = put_varint(p, zigzag((int64_t)min));
+	if (lanes(cnt, w)) {
+		uint32_t u[MP_PACKED_BLOCK];
+		if (w == 0)
+			return p;
+		for (size_t i=0; i<cnt; ++i)
+			u[i] = (uint32_t)((uint64_t)v[i+1] - (uint64_t)v[i] - min);
+		pack_lanes(p, u, w);
+		return p + packed_bytes(cnt, w);
+	}
+	uint64_t u[MP_PACKED_BLOCK];
+	for (size_t i=0; i<cnt; ++i)
+		u[i] = (uint64_t)v[i+1] - (uint64_t)v[i] - min;
+	return pack_seq(p, u, cnt, w);
+}
+
+static size_t payload_size(const int64_t *v, uint32_t n) {
+	size_t sz = varint_size(n);
+	if (n == 0)
+		return sz;
+	sz += varint_size(zigzag(v[0]));
+	for (size_t i=0; i+1<n; i+=MP_PACKED_BLOCK) {
+		size_t cnt = (n-1-i < MP_PACKED_BLOCK) ? n-1-i : MP_PACKED_BLOCK;
+		uint64_t min;
+		unsigned w = block_info(v + i, cnt, &min);
+		sz += block_size(min, cnt, w);
+	}
+	return sz;
+}
+
+size_t mp_sizeof_packed(const int64_t *v, uint32_t n) {
+	size_t sz = payload_size(v, n);
+	return mp_sizeof_extsize(sz > UINT32_MAX ? UINT32_MAX : (uint32_t)sz) + sz;
+}
+
+static int write_raw(mp_encoder_t *e, const unsigned char *buf, size_t len) {
+	ssize_t n = mp_write(e, (const char*)buf, len);
+	if (n == (ssize_t)len)
+		return MSGPACK_OK;
+	return (n < 0) ? ERR_MSGPACK_CHECK_ERRNO : ERR_MSGPACK_EOF;
+}
+
+int mp_write_packed(mp_encoder_t *e, const int64_t *v, uint32_t n) {
+	unsigned char hdr[20];
+	size_t sz = payload_size(v, n);
+	if (sz > UINT32_MAX)
+		return ERR_MSGPACK_EOF;
+	CHECK(mp_write_extsize(e, MP_PACKED_EXT, (uint32_t)sz));
+	unsigned char *p = put_varint(hdr, n);
+	if (n > 0)
+		p = put_varint(p, zigzag(v[0]));
+	CHECK(write_raw(e, hdr, (size_t)(p - hdr)));
+
+	for (size_t i=0; i+1<n; i+=MP_PACKED_BLOCK) {
+		size_t cnt = (n-1-i < MP_PACKED_BLOCK) ? n-1-i : MP_PACKED_BLOCK;
+		uint64_t min;
+		unsigned w = block_info(v + i, cnt, &min);
+		size_t len = block_size(min, cnt, w);
+		// straight into the encoder's buffer, if it's big enough
+		if (len <= mp_enc_capacity(e)) {
+			CHECK(mp_reserve(e, len, &p));
+			mp_commit(e, pack_block(p, v + i, cnt, min, w));
+		} else {
+			unsigned char buf[BLOCK_MAX];
+			pack_block(buf, v + i, cnt, min, w);
+			CHECK(write_raw(e, buf, len));
+		}
+	}
+	return MSGPACK_OK;
+}
+
+// reads payload bytes, which must not run past the ext object
+
+static int get_byte(mp_decoder_t *d, mp_packed_reader_t *p, unsigned char *b) {
+	if (p->bytes == 0)
+		return ERR_MSGPACK_BAD_TYPE;
+	CHECK(mp_read_byte(d, b));
+	p->bytes--;
+	return MSGPACK_OK;
+}
+
+static int get_varint(mp_decoder_t *d, mp_packed_reader_t *p, uint64_t *u) {
+	*u = 0;
+	for (unsigned shift=0; shift<64; shift+=7) {
+		unsigned char b;
+		CHECK(get_byte(d, p, &b));
+		*u |= (uint64_t)(b & 0x7f) << shift;
+		if ((b & 0x80) == 0)
+			return MSGPACK_OK;
+	}
+	return ERR_MSGPACK_BAD_TYPE;
+}
+
+static int read_full(mp_decoder_t *d, unsigned char *buf, size_t n) {
+	while (n > 0) {
+		ssize_t c = mp_read(d, (char*)buf, n);
+		if (c <= 0)
+			return (c < 0) ? ERR_MSGPACK_CHECK_ERRNO : ERR_MSGPACK_EOF;
+		buf += c;
+		n -= (size_t)c;
+	}
+	return MSGPACK_OK;
+}
+
+// decodes the next block of 'cnt' values into 'out'
+static int read_block(mp_decoder_t *d, mp_packed_reader_t *p, int64_t *out, size_t cnt) {
+	unsigned char w;
+	uint64_t zz;
+	CHECK(get_byte(d, p, &w));
+	if (w > 64)
+		return ERR_MSGPACK_BAD_TYPE;
+	CHECK(get_varint(d, p, &zz));
+	uint64_t min = unzigzag(zz);
+	size_t nbytes = packed_bytes(cnt, w);
+	if (nbytes > p->bytes)
+		return ERR_MSGPACK_BAD_TYPE;
+
+	// unpack in place if the block is already buffered
+	unsigned char tmp[8*MP_PACKED_BLOCK];
+	const unsigned char *src = tmp;
+	bool inplace = mp_dec_buffered(d) >= nbytes;
+	if (inplace)
+		CHECK(mp_ensure(d, nbytes, &src));
+	else
+		CHECK(read_full(d, tmp, nbytes));
+
+	uint64_t prev = (uint64_t)p->prev;
+	if (lanes(cnt, w)) {
+		uint32_t u[MP_PACKED_BLOCK];
+		if (w > 0)
+			unpack_lanes(src, u, w);
+		else
+			memset(u, 0, sizeof(u));
+		for (size_t i=0; i<cnt; ++i) {
+			prev += min + u[i];
+			out[i] = (int64_t)prev;
+		}
+	} else {
+		uint64_t u[MP_PACKED_BLOCK];
+		unpack_seq(src, u, cnt, w);
+		for (size_t i=0; i<cnt; ++i) {
+			prev += min + u[i];
+			out[i] = (int64_t)prev;
+		}
+	}
+	if (inplace)
+		mp_consume(d, src + nbytes);
+	p->bytes -= (uint32_t)nbytes;
+	p->prev = (int64_t)prev;
+	p->left -= (uint32_t)cnt;
+	// the last block must end the payload
+	if (p->left == 0 && p->bytes != 0)
+		return ERR_MSGPACK_BAD_TYPE;
+	return MSGPACK_OK;
+}
+
+int mp_read_packed_size(mp_decoder_t *d, mp_packed_reader_t *p, uint32_t *n) {
+	mp_typ_t t;
+	int8_t tg;
+	uint32_t sz;
+	uint64_t cnt, zz;
+	CHECK(mp_next_type(d, &t));
+	p->prev = 0;
+	p->blkoff = 0;
+	p->blklen = 0;
+	if (t == MSG_ARRAY) {
+		CHECK(mp_read_arraysize(d, n));
+		p->packed = false;
+		p->left = *n;
+		p->bytes = 0;
+		return MSGPACK_OK;
+	}
+	if (t != MSG_EXT)
+		return ERR_MSGPACK_BAD_TYPE;
+	CHECK(mp_read_extsize(d, &tg, &sz));
+	if (tg != MP_PACKED_EXT)
+		return ERR_MSGPACK_BAD_TYPE;
+	p->packed = true;
+	p->bytes = sz;
+	CHECK(get_varint(d, p, &cnt));
+	if (cnt > UINT32_MAX)
+		return ERR_MSGPACK_BAD_TYPE;
+	p->left = (uint32_t)cnt;
+	if (cnt > 0) {
+		CHECK(get_varint(d, p, &zz));
+		p->prev = (int64_t)unzigzag(zz);
+		p->blk[0] = p->prev;
+		p->blklen = 1;
+		p->left--;
+	}
+	if (p->left == 0 && p->bytes != 0)
+		return ERR_MSGPACK_BAD_TYPE;
+	*n = (uint32_t)cnt;
+	return MSGPACK_OK;
+}
+
+int mp_read_packed(mp_decoder_t *d, mp_packed_reader_t *p, int64_t *v, uint32_t n) {
+	if (n > (uint64_t)p->left + (p->blklen - p->blkoff))
+		return ERR_MSGPACK_EOF;
+	while (n > 0) {
+		if (p->blkoff < p->blklen) {
+			uint32_t k = p->blklen - p->blkoff;
+			k = (n < k) ? n : k;
+			memcpy(v, p->blk + p->blkoff, k * sizeof(int64_t));
+			p->blkoff += k;
+			v += k;
+			n -= k;
+			continue;
+		}
+		if (!p->packed) {
+			for (; n > 0; --n, --p->left)
+				CHECK(mp_read_number_as_int64(d, v++));
+			return MSGPACK_OK;
+		}
+		uint32_t cnt = (p->left < MP_PACKED_BLOCK) ? p->left : MP_PACKED_BLOCK;
+		if (n >= cnt) {
+			CHECK(read_block(d, p, v, cnt));
+			v += cnt;
+			n -= cnt;
+		} else {
+			CHECK(read_block(d, p, p->blk, cnt));
+			p->blkoff = 0;
+			p->blklen = cnt;
+		}
+	}
+	return MSGPACK_OK;
+}
+
+int mp_packed_expand(mp_decoder_t *d, mp_encoder_t *e) {
+	mp_packed_reader_t p;
+	int64_t v[MP_PACKED_BLOCK];
+	uint32_t n;
+	CHECK(mp_read_packed_size(d, &p, &n));
+	CHECK(mp_write_arraysize(e, n));
+	while (n > 0) {
+		uint32_t k = (n < MP_PACKED_BLOCK) ? n : MP_PACKED_BLOCK;
+		CHECK(mp_read_packed(d, &p, v, k));
+		CHECK(mp_write_ints(e, v, k));
+		n -= k;
+	}
+	return MSGPACK_OK;
+}
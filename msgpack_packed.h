@@ -0,0 +1,96 @@
+#ifndef MSGPACK_PACKED_H__
+#define MSGPACK_PACKED_H__
+#include "msgpack.h"
+
+/*
+
+	---- Packed Integer Arrays ----
+
+Timestamps and counters tend to change by small,
+similar amounts from one value to the next, but
+an array of them still costs up to 9 bytes a value.
+mp_write_packed instead writes an array of int64s
+as one ext object (of type MP_PACKED_EXT) holding
+the differences between consecutive values, packed
+into as few bits as they need:
+
+	count (varint), first value (zigzag varint),
+	then blocks of up to MP_PACKED_BLOCK differences:
+		bit width (1 byte), smallest difference
+		(zigzag varint), and then each difference
+		minus the smallest, in 'width' bits
+
+So a run of timestamps exactly 10ms apart packs to
+0 bits per value, and one with a few ms of jitter
+to 2 or 3. Full blocks of up to 32-bit widths are
+laid out in four interleaved lanes (value i is in
+lane i%4), so that they are packed and unpacked
+four at a time with SSE2 where it's available; the
+layout is the same either way. Other blocks are
+packed in order, least significant bit first.
+
+mp_read_packed_size and mp_read_packed read either
+a packed array or a plain array of integers, so a
+writer can fall back to mp_write_int_array for
+peers that don't know the ext type without readers
+noticing. mp_packed_expand rewrites a packed array
+as a plain one:
+
+	mp_write_packed(enc, ts, n);
+
+	mp_packed_reader_t p;
+	mp_read_packed_size(dec, &p, &n);
+	mp_read_packed(dec, &p, ts, n);
+
+*/
+
+#define MP_PACKED_EXT 0x50
+#define MP_PACKED_BLOCK 128
+
+typedef struct {
+	/*
+	 * NOTE: none of these fields
+	 * should be touched except by
+	 * the mp_packed_ functions
+	 */
+	uint32_t left;    // values not decoded yet
+	uint32_t bytes;   // payload bytes not read yet
+	bool     packed;
+	int64_t  prev;    // the last value decoded
+	uint32_t blkoff;
+	uint32_t blklen;
+	int64_t  blk[MP_PACKED_BLOCK]; // decoded values not returned yet
+} mp_packed_reader_t;
+
+/* returns the encoded size of mp_write_packed(e, v, n) */
+size_t mp_sizeof_packed(const int64_t *v, uint32_t n);
+
+/*
+ * writes 'n' values as a packed array. returns
+ * ERR_MSGPACK_EOF if the packed values would take
+ * more than 4GB.
+ */
+int mp_write_packed(mp_encoder_t *e, const int64_t *v, uint32_t n);
+
+/*
+ * reads the header of a packed array, or of a plain
+ * array, and puts its length in 'n'. returns
+ * ERR_MSGPACK_BAD_TYPE for anything else (including
+ * other ext types, after reading their header).
+ */
+int mp_read_packed_size(mp_decoder_t *d, mp_packed_reader_t *p, uint32_t *n);
+
+/*
+ * reads the next 'n' values of the array, which can
+ * be read in any number of pieces. returns
+ * ERR_MSGPACK_EOF if fewer than 'n' are left, and
+ * ERR_MSGPACK_BAD_TYPE if the array is corrupt (or,
+ * for a plain array, holds something other than
+ * integers).
+ */
+int mp_read_packed(mp_decoder_t *d, mp_packed_reader_t *p, int64_t *v, uint32_t n);
+
+/* reads a packed (or plain) array, and writes it as a plain array */
+int mp_packed_expand(mp_decoder_t *d, mp_encoder_t *e);
+
+#endif
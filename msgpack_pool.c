@@ -0,0 +1,171 @@
+#include "msgpack_pool.h"
+
+// the free lists are Treiber stacks; the tag stops ABA
+#define TOP(h) ((uint32_t)(h))
+#define TAG(h) ((h) >> 32)
+#define HEAD(tag, top) (((uint64_t)(tag) << 32) | (uint64_t)(top))
+
+#define ALIGN 64
+
+static size_t align_up(size_t n) {
+	return (n + ALIGN - 1) & ~(size_t)(ALIGN - 1);
+}
+
+size_t mp_pool_memsize(const uint32_t counts[MP_POOL_CLASSES]) {
+	size_t n = 0;
+	for (int i=0; i<MP_POOL_CLASSES; ++i) {
+		n += align_up((size_t)counts[i] * sizeof(_Atomic uint32_t));
+		n += (size_t)counts[i] * MP_POOL_CLASS_SIZE(i);
+	}
+	return n;
+}
+
+int mp_pool_init(mp_pool_t *p, void *mem, size_t len, const uint32_t counts[MP_POOL_CLASSES]) {
+	if (len < mp_pool_memsize(counts))
+		return ERR_MSGPACK_EOF;
+	unsigned char *m = (unsigned char*)mem;
+	for (int i=0; i<MP_POOL_CLASSES; ++i) {
+		p->links[i] = (_Atomic uint32_t*)m;
+		m += align_up((size_t)counts[i] * sizeof(_Atomic uint32_t));
+		p->bufs[i] = m;
+		m += (size_t)counts[i] * MP_POOL_CLASS_SIZE(i);
+		p->count[i] = counts[i];
+
+		// every buffer starts out free, in order
+		for (uint32_t j=0; j<counts[i]; ++j)
+			atomic_init(&p->links[i][j], j+1 < counts[i] ? j+2 : 0);
+		atomic_init(&p->free[i], HEAD(0, counts[i] > 0 ? 1 : 0));
+	}
+	return MSGPACK_OK;
+}
+
+// pops one buffer index from a shared free list, or returns false
+static bool pool_pop(mp_pool_t *p, int cls, uint32_t *idx) {
+	uint64_t h = atomic_load_explicit(&p->free[cls], memory_order_acquire);
+	for (;;) {
+		if (TOP(h) == 0)
+			return false;
+		uint32_t next = atomic_load_explicit(&p->links[cls][TOP(h)-1], memory_order_relaxed);
+		if (atomic_compare_exchange_weak_explicit(&p->free[cls], &h, HEAD(TAG(h)+1, next),
+			memory_order_acquire, memory_order_acquire)) {
+			*idx = TOP(h) - 1;
+			return true;
+		}
+	}
+}
+
+static void pool_push(mp_pool_t *p, int cls, uint32_t idx) {
+	uint64_t h = atomic_load_explicit(&p->free[cls], memory_order_relaxed);
+	do {
+		atomic_store_explicit(&p->links[cls][idx], TOP(h), memory_order_relaxed);
+	} while (!atomic_compare_exchange_weak_explicit(&p->free[cls], &h, HEAD(TAG(h)+1, idx+1),
+		memory_order_release, memory_order_relaxed));
+}
+
+void mp_pool_cache_init(mp_pool_cache_t *c, mp_pool_t *p) {
+	c->pool = p;
+	for (int i=0; i<MP_POOL_CLASSES; ++i)
+		c->n[i] = 0;
+	return;
+}
+
+void mp_pool_cache_drain(mp_pool_cache_t *c) {
+	for (int i=0; i<MP_POOL_CLASSES; ++i) {
+		while (c->n[i] > 0)
+			pool_push(c->pool, i, c->idx[i][--c->n[i]]);
+	}
+	return;
+}
+
+int mp_pool_get(mp_pool_cache_t *c, size_t size, unsigned char **buf, size_t *cap) {
+	int cls = 0;
+	while (cls < MP_POOL_CLASSES && MP_POOL_CLASS_SIZE(cls) < size)
+		++cls;
+	if (cls == MP_POOL_CLASSES)
+		return ERR_MSGPACK_EOF;
+
+	if (c->n[cls] == 0) {
+		// refill half the cache
+		uint32_t idx;
+		while (c->n[cls] < MP_POOL_CACHE/2 && pool_pop(c->pool, cls, &idx))
+			c->idx[cls][c->n[cls]++] = idx;
+		if (c->n[cls] == 0)
+			return ERR_MSGPACK_EOF;
+	}
+	uint32_t idx = c->idx[cls][--c->n[cls]];
+	*buf = c->pool->bufs[cls] + (size_t)idx * MP_POOL_CLASS_SIZE(cls);
+	*cap = MP_POOL_CLASS_SIZE(cls);
+	return MSGPACK_OK;
+}
+
+// finds the class and index of a pooled buffer, or returns false
+static bool pool_find(mp_pool_t *p, const unsigned char *buf, int *cls, uint32_t *idx) {
+	for (int i=0; i<MP_POOL_CLASSES; ++i) {
+		size_t sz = MP_POOL_CLASS_SIZE(i);
+		if (buf < p->bufs[i] || buf >= p->bufs[i] + (size_t)p->count[i] * sz)
+			continue;
+		size_t off = (size_t)(buf - p->bufs[i]);
+		if (off % sz != 0)
+			return false;
+		*cls = i;
+		*idx = (uint32_t)(off / sz);
+		return true;
+	}
+	return false;
+}
+
+int mp_pool_put(mp_pool_cache_t *c, unsigned char *buf) {
+	mp_pool_t *p = c->pool;
+	int cls;
+	uint32_t idx;
+	if (!pool_find(p, buf, &cls, &idx))
+		return ERR_MSGPACK_BAD_TYPE;
+
+	if (c->n[cls] == MP_POOL_CACHE) {
+		// spill half the cache
+		while (c->n[cls] > MP_POOL_CACHE/2)
+			pool_push(p, cls, c->idx[cls][--c->n[cls]]);
+	}
+	c->idx[cls][c->n[cls]++] = idx;
+	return MSGPACK_OK;
+}
+
+int mp_encoder_acquire(mp_encoder_t *e, mp_pool_cache_t *c, size_t size, void *ctx, mp_flush_t w) {
+	unsigned char *buf;
+	size_t cap;
+	int r = mp_pool_get(c, size, &buf, &cap);
+	if (r) return r;
+	if (w != NULL)
+		mp_encode_stream_init(e, ctx, w, buf, cap);
+	else
+		mp_encode_mem_init(e, buf, cap);
+	return MSGPACK_OK;
+}
+
+int mp_encoder_release(mp_encoder_t *e, mp_pool_cache_t *c) {
+	int r = mp_pool_put(c, e->base);
+	e->base = NULL;
+	e->off = 0;
+	e->cap = 0;
+	return r;
+}
+
+int mp_decoder_acquire(mp_decoder_t *d, mp_pool_cache_t *c, size_t size, void *ctx, mp_fill_t r) {
+	unsigned char *buf;
+	size_t cap;
+	if (r == NULL)
+		return ERR_MSGPACK_BAD_TYPE;
+	int err = mp_pool_get(c, size, &buf, &cap);
+	if (err) return err;
+	mp_decode_stream_init(d, ctx, r, buf, cap);
+	return MSGPACK_OK;
+}
+
+int mp_decoder_release(mp_decoder_t *d, mp_pool_cache_t *c) {
+	int r = mp_pool_put(c, d->base);
+	d->base = NULL;
+	d->off = 0;
+	d->used = 0;
+	d->cap = 0;
+	return r;
+}
@@ -0,0 +1,111 @@
+#ifndef MSGPACK_POOL_H__
+#define MSGPACK_POOL_H__
+#include <stdatomic.h>
+#include "msgpack.h"
+
+/*
+
+	---- Buffer Pools ----
+
+An mp_pool_t hands out encoder and decoder buffers
+from one caller-supplied arena, in four size classes
+(1KB, 4KB, 16KB and 64KB), so that connection
+handlers don't malloc and free a buffer each time.
+
+Each thread gets buffers through its own
+mp_pool_cache_t, which holds up to MP_POOL_CACHE
+free buffers per class and needs no atomics at all.
+Only when a thread's cache runs dry (or fills up)
+does it move MP_POOL_CACHE/2 buffers from (or to)
+the pool's shared, lock-free free lists; so buffers
+that are released on a different thread than they
+were acquired on flow back to the rest of the
+pool in bounded batches.
+
+	static _Thread_local mp_pool_cache_t cache;
+	...
+	mp_pool_cache_init(&cache, &pool);
+	...
+	mp_encoder_acquire(&enc, &cache, 4096, &fd, my_flush);
+	...
+	mp_flush(&enc);
+	mp_encoder_release(&enc, &cache);
+
+A thread's cache must be drained back into the pool
+with mp_pool_cache_drain before the thread exits.
+
+*/
+
+#define MP_POOL_CLASSES 4
+#define MP_POOL_CLASS_SIZE(i) ((size_t)1024 << (2*(i)))
+#define MP_POOL_CACHE 16
+
+typedef struct {
+	/*
+	 * NOTE: none of these fields
+	 * should be touched except by
+	 * the mp_pool_ functions
+	 */
+	unsigned char    *bufs[MP_POOL_CLASSES];  // first buffer of each class
+	_Atomic uint32_t *links[MP_POOL_CLASSES]; // free list links, by buffer index
+	uint32_t          count[MP_POOL_CLASSES];
+	_Atomic uint64_t  free[MP_POOL_CLASSES];  // (tag << 32) | (index+1) of the top buffer
+} mp_pool_t;
+
+typedef struct {
+	mp_pool_t *pool;
+	uint32_t   n[MP_POOL_CLASSES];
+	uint32_t   idx[MP_POOL_CLASSES][MP_POOL_CACHE];
+} mp_pool_cache_t;
+
+/*
+ * returns the number of bytes of arena needed
+ * for 'counts[i]' buffers of each class i
+ */
+size_t mp_pool_memsize(const uint32_t counts[MP_POOL_CLASSES]);
+
+/*
+ * initializes a pool in 'mem', which must hold
+ * at least mp_pool_memsize(counts) bytes and be
+ * aligned for atomic uint32_t. returns
+ * ERR_MSGPACK_EOF if 'len' is too small.
+ */
+int mp_pool_init(mp_pool_t *p, void *mem, size_t len, const uint32_t counts[MP_POOL_CLASSES]);
+
+void mp_pool_cache_init(mp_pool_cache_t *c, mp_pool_t *p);
+
+/* returns every buffer in the cache to the pool */
+void mp_pool_cache_drain(mp_pool_cache_t *c);
+
+/*
+ * takes a buffer of at least 'size' bytes (from the
+ * smallest class that fits), putting its address in
+ * 'buf' and its true size in 'cap'. returns
+ * ERR_MSGPACK_EOF if no buffer is free.
+ */
+int mp_pool_get(mp_pool_cache_t *c, size_t size, unsigned char **buf, size_t *cap);
+
+/*
+ * returns a buffer from mp_pool_get (to any thread's
+ * cache). returns ERR_MSGPACK_BAD_TYPE, and does
+ * nothing, if 'buf' isn't one of the pool's buffers.
+ */
+int mp_pool_put(mp_pool_cache_t *c, unsigned char *buf);
+
+/*
+ * mp_encoder_acquire initializes an encoder on a
+ * pooled buffer of at least 'size' bytes, in stream
+ * mode if 'w' is set and mem mode otherwise.
+ * mp_decoder_acquire does the same for a decoder,
+ * which is always in stream mode (a pooled buffer
+ * has nothing in it to decode); it returns
+ * ERR_MSGPACK_BAD_TYPE if 'r' isn't set. The release
+ * functions give the buffer back (an encoder should
+ * be flushed first), and return what mp_pool_put does.
+ */
+int mp_encoder_acquire(mp_encoder_t *e, mp_pool_cache_t *c, size_t size, void *ctx, mp_flush_t w);
+int mp_encoder_release(mp_encoder_t *e, mp_pool_cache_t *c);
+int mp_decoder_acquire(mp_decoder_t *d, mp_pool_cache_t *c, size_t size, void *ctx, mp_fill_t r);
+int mp_decoder_release(mp_decoder_t *d, mp_pool_cache_t *c);
+
+#endif
@@ -0,0 +1,222 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "msgpack_shm.h"
+
+#define SPINS 256
+
+/*
+ * The first page of the segment. 'head' and 'tail'
+ * count every byte ever written and read. Each side
+ * sleeps on its own futex word ('rseq' or 'wseq'),
+ * after setting its 'wait' flag, and the other side
+ * only bumps the word and calls futex_wake if it
+ * sees the flag.
+ */
+struct mp_shm_hdr {
+	_Atomic uint64_t head;
+	_Atomic uint32_t rseq;
+	_Atomic uint32_t rwait;
+	_Atomic uint32_t closed;
+	unsigned char    pad0[64 - 20];
+	_Atomic uint64_t tail;
+	_Atomic uint32_t wseq;
+	_Atomic uint32_t wwait;
+	unsigned char    pad1[64 - 16];
+};
+
+static size_t page_size(void) {
+	return (size_t)sysconf(_SC_PAGESIZE);
+}
+
+static void futex_wait(_Atomic uint32_t *word, uint32_t val) {
+	syscall(SYS_futex, (uint32_t*)word, FUTEX_WAIT, val, NULL, NULL, 0);
+}
+
+static void futex_wake(_Atomic uint32_t *word) {
+	syscall(SYS_futex, (uint32_t*)word, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+static void wake(_Atomic uint32_t *wait, _Atomic uint32_t *seq) {
+	// pairs with the fence in park()
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(wait, memory_order_relaxed)) {
+		atomic_fetch_add_explicit(seq, 1, memory_order_relaxed);
+		futex_wake(seq);
+	}
+}
+
+/*
+ * sleeps unless 'pos' has moved past 'old' (or the
+ * ring was closed) once the wait flag is visible
+ */
+static void park(_Atomic uint32_t *wait, _Atomic uint32_t *seq, _Atomic uint64_t *pos, uint64_t old, _Atomic uint32_t *closed) {
+	uint32_t v = atomic_load_explicit(seq, memory_order_relaxed);
+	atomic_store_explicit(wait, 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(pos, memory_order_relaxed) == old &&
+	    (closed == NULL || !atomic_load_explicit(closed, memory_order_relaxed)))
+		futex_wait(seq, v);
+	atomic_store_explicit(wait, 0, memory_order_relaxed);
+}
+
+// maps the header page and the data pages twice
+static int map(mp_shm_t *s, int fd, size_t cap) {
+	size_t pg = page_size();
+	size_t len = pg + 2*cap;
+	unsigned char *base = mmap(NULL, len, PROT_NONE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (base == MAP_FAILED)
+		return ERR_MSGPACK_CHECK_ERRNO;
+	if (mmap(base, pg + cap, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_FIXED, fd, 0) == MAP_FAILED ||
+	    mmap(base + pg + cap, cap, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_FIXED, fd, (off_t)pg) == MAP_FAILED) {
+		int e = errno;
+		munmap(base, len);
+		errno = e;
+		return ERR_MSGPACK_CHECK_ERRNO;
+	}
+	s->hdr = (struct mp_shm_hdr*)base;
+	s->data = base + pg;
+	s->cap = cap;
+	s->maplen = len;
+	s->fd = fd;
+	return MSGPACK_OK;
+}
+
+int mp_shm_create(mp_shm_t *s, size_t cap) {
+	size_t pg = page_size();
+	size_t c = pg;
+	while (c < cap)
+		c <<= 1;
+	_Static_assert(sizeof(struct mp_shm_hdr) <= 4096, "header must fit in a page");
+
+	int fd = memfd_create("msgpack-shm", MFD_CLOEXEC);
+	if (fd < 0)
+		return ERR_MSGPACK_CHECK_ERRNO;
+	if (ftruncate(fd, (off_t)(pg + c)) < 0 || map(s, fd, c) != MSGPACK_OK) {
+		int e = errno;
+		close(fd);
+		errno = e;
+		return ERR_MSGPACK_CHECK_ERRNO;
+	}
+	struct mp_shm_hdr *h = s->hdr;
+	atomic_init(&h->head, 0);
+	atomic_init(&h->rseq, 0);
+	atomic_init(&h->rwait, 0);
+	atomic_init(&h->closed, 0);
+	atomic_init(&h->tail, 0);
+	atomic_init(&h->wseq, 0);
+	atomic_init(&h->wwait, 0);
+	return MSGPACK_OK;
+}
+
+int mp_shm_open(mp_shm_t *s, int fd) {
+	struct stat st;
+	size_t pg = page_size();
+	if (fstat(fd, &st) < 0)
+		return ERR_MSGPACK_CHECK_ERRNO;
+	// every index is masked with cap-1, so the ring
+	// must be a power of two (and whole pages) in size
+	size_t cap = st.st_size > (off_t)pg ? (size_t)st.st_size - pg : 0;
+	if (cap < pg || (cap & (cap - 1)) != 0) {
+		errno = EINVAL;
+		return ERR_MSGPACK_CHECK_ERRNO;
+	}
+	return map(s, fd, cap);
+}
+
+void mp_shm_close(mp_shm_t *s) {
+	munmap(s->hdr, s->maplen);
+	close(s->fd);
+	return;
+}
+
+void mp_shm_close_write(mp_shm_t *s) {
+	struct mp_shm_hdr *h = s->hdr;
+	atomic_store_explicit(&h->closed, 1, memory_order_release);
+	wake(&h->rwait, &h->rseq);
+	return;
+}
+
+// waits for 'min' free bytes; returns the number free
+static size_t writable(mp_shm_t *s, size_t min) {
+	struct mp_shm_hdr *h = s->hdr;
+	uint64_t head = atomic_load_explicit(&h->head, memory_order_relaxed);
+	for (int spin=0;; ++spin) {
+		uint64_t tail = atomic_load_explicit(&h->tail, memory_order_acquire);
+		size_t free = s->cap - (size_t)(head - tail);
+		if (free >= min)
+			return free;
+		if (spin >= SPINS)
+			park(&h->wwait, &h->wseq, &h->tail, tail, NULL);
+	}
+}
+
+// waits for data; returns the number of readable bytes, or 0 if closed
+static size_t readable(mp_shm_t *s) {
+	struct mp_shm_hdr *h = s->hdr;
+	uint64_t tail = atomic_load_explicit(&h->tail, memory_order_relaxed);
+	for (int spin=0;; ++spin) {
+		// 'closed' first, so that no write before the close is missed
+		bool closed = atomic_load_explicit(&h->closed, memory_order_acquire);
+		uint64_t head = atomic_load_explicit(&h->head, memory_order_acquire);
+		if (head != tail)
+			return (size_t)(head - tail);
+		if (closed)
+			return 0;
+		if (spin >= SPINS)
+			park(&h->rwait, &h->rseq, &h->head, head, &h->closed);
+	}
+}
+
+static void publish(mp_shm_t *s, size_t n) {
+	struct mp_shm_hdr *h = s->hdr;
+	uint64_t head = atomic_load_explicit(&h->head, memory_order_relaxed);
+	atomic_store_explicit(&h->head, head + n, memory_order_release);
+	wake(&h->rwait, &h->rseq);
+}
+
+ssize_t mp_shm_flush(void *ctx, const void *buf, size_t amt) {
+	mp_shm_t *s = (mp_shm_t*)ctx;
+	if (amt == 0)
+		return 0;
+	size_t n = writable(s, 1);
+	if (n > amt)
+		n = amt;
+	uint64_t head = atomic_load_explicit(&s->hdr->head, memory_order_relaxed);
+	memcpy(s->data + (head & (s->cap - 1)), buf, n);
+	publish(s, n);
+	return (ssize_t)n;
+}
+
+ssize_t mp_shm_fill(void *ctx, void *buf, size_t max) {
+	mp_shm_t *s = (mp_shm_t*)ctx;
+	struct mp_shm_hdr *h = s->hdr;
+	size_t n = readable(s);
+	if (n > max)
+		n = max;
+	uint64_t tail = atomic_load_explicit(&h->tail, memory_order_relaxed);
+	memcpy(buf, s->data + (tail & (s->cap - 1)), n);
+	atomic_store_explicit(&h->tail, tail + n, memory_order_release);
+	wake(&h->wwait, &h->wseq);
+	return (ssize_t)n;
+}
+
+int mp_shm_encoder_begin(mp_shm_t *s, mp_encoder_t *e, size_t min) {
+	if (min > s->cap)
+		return ERR_MSGPACK_EOF;
+	size_t n = writable(s, min);
+	uint64_t head = atomic_load_explicit(&s->hdr->head, memory_order_relaxed);
+	mp_encode_mem_init(e, s->data + (head & (s->cap - 1)), n);
+	return MSGPACK_OK;
+}
+
+void mp_shm_encoder_commit(mp_shm_t *s, mp_encoder_t *e) {
+	publish(s, mp_enc_buffered(e));
+	return;
+}
@@ -0,0 +1,97 @@
+#ifndef MSGPACK_SHM_H__
+#define MSGPACK_SHM_H__
+#include "msgpack.h"
+
+/*
+
+	---- Shared-Memory Rings ----
+
+An mp_shm_t is a single-producer, single-consumer
+byte ring in a shared memory segment, for passing
+messagepack between two processes on one (Linux)
+host without a syscall per message.
+
+The segment is a memfd; its data pages are mapped
+twice, back to back, so that the readable (and
+writable) part of the ring is always one contiguous
+run of memory. A process that is waiting spins
+briefly and then sleeps on a futex, and its peer
+only makes the wake-up syscall if it is asleep.
+
+One process calls mp_shm_create and hands the other
+the descriptor (by fork, or over a unix socket)
+for mp_shm_open; anything else that can be mmap'd
+(e.g. shm_open) works as long as it was set up
+by mp_shm_create's layout.
+
+The writer can encode through mp_shm_flush, or
+straight into the ring with mp_shm_encoder_begin
+and mp_shm_encoder_commit:
+
+	mp_encoder_t enc;
+	mp_shm_encoder_begin(&ring, &enc, 64);
+	mp_write_mapsize(&enc, 1);
+	...
+	mp_shm_encoder_commit(&ring, &enc);
+
+The reader decodes through mp_shm_fill, which
+returns 0 (i.e. EOF) once the writer has called
+mp_shm_close_write and the ring is empty.
+
+*/
+
+struct mp_shm_hdr;
+
+typedef struct {
+	/*
+	 * NOTE: none of these fields
+	 * should be touched except by
+	 * the mp_shm_ functions
+	 */
+	struct mp_shm_hdr *hdr;
+	unsigned char     *data;
+	size_t             cap;
+	size_t             maplen;
+	int                fd;
+} mp_shm_t;
+
+/*
+ * creates a ring with room for at least 'cap' bytes
+ * (rounded up to a power of two, and at least a page)
+ * and maps it. returns ERR_MSGPACK_CHECK_ERRNO
+ * if a syscall fails.
+ */
+int mp_shm_create(mp_shm_t *s, size_t cap);
+
+/*
+ * maps the ring in 'fd' (which mp_shm_close will close).
+ * fails with errno set to EINVAL if the file isn't the
+ * size of a ring made by mp_shm_create.
+ */
+int mp_shm_open(mp_shm_t *s, int fd);
+
+void mp_shm_close(mp_shm_t *s);
+
+/* tells the reader that nothing more will be written */
+void mp_shm_close_write(mp_shm_t *s);
+
+/*
+ * mp_shm_flush and mp_shm_fill are mp_flush_t and mp_fill_t
+ * callbacks; 'ctx' is the mp_shm_t. each blocks until it
+ * can move at least one byte (or, for mp_shm_fill, until
+ * the writer has closed an empty ring).
+ */
+ssize_t mp_shm_flush(void *ctx, const void *buf, size_t amt);
+ssize_t mp_shm_fill(void *ctx, void *buf, size_t max);
+
+/*
+ * mp_shm_encoder_begin waits for at least 'min' free bytes
+ * and points a mem-mode encoder at all of the free space;
+ * mp_shm_encoder_commit publishes what was encoded.
+ * mp_shm_encoder_begin returns ERR_MSGPACK_EOF if 'min'
+ * is larger than the ring.
+ */
+int mp_shm_encoder_begin(mp_shm_t *s, mp_encoder_t *e, size_t min);
+void mp_shm_encoder_commit(mp_shm_t *s, mp_encoder_t *e);
+
+#endif
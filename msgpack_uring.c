@@ -0,0 +1,306 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "msgpack_uring.h"
+
+#define ENTRIES 8
+
+/*
+ * The ring is driven with raw syscalls. Each
+ * staging buffer has at most one request in
+ * flight, tagged with the buffer's index.
+ */
+
+static int uring_setup(mp_uring_t *u) {
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	u->ring = (int)syscall(__NR_io_uring_setup, ENTRIES, &p);
+	if (u->ring < 0) {
+		u->ring = -1;
+		return MSGPACK_OK; // fall back to pread/pwrite
+	}
+
+	u->sqlen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	u->cqlen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (u->cqlen > u->sqlen)
+			u->sqlen = u->cqlen;
+		u->cqlen = 0;
+	}
+	u->sqeslen = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	u->sq = mmap(NULL, u->sqlen, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, u->ring, IORING_OFF_SQ_RING);
+	u->cq = u->cqlen ? mmap(NULL, u->cqlen, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, u->ring, IORING_OFF_CQ_RING) : u->sq;
+	u->sqes = mmap(NULL, u->sqeslen, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, u->ring, IORING_OFF_SQES);
+	if (u->sq == MAP_FAILED || u->cq == MAP_FAILED || u->sqes == MAP_FAILED) {
+		int e = errno;
+		if (u->sq != MAP_FAILED) munmap(u->sq, u->sqlen);
+		if (u->cqlen && u->cq != MAP_FAILED) munmap(u->cq, u->cqlen);
+		if (u->sqes != MAP_FAILED) munmap(u->sqes, u->sqeslen);
+		close(u->ring);
+		errno = e;
+		return ERR_MSGPACK_CHECK_ERRNO;
+	}
+
+	unsigned char *sq = (unsigned char*)u->sq;
+	unsigned char *cq = (unsigned char*)u->cq;
+	u->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+	u->sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+	u->sq_array = (unsigned*)(sq + p.sq_off.array);
+	u->cq_head = (unsigned*)(cq + p.cq_off.head);
+	u->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+	u->cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+	u->cqes = cq + p.cq_off.cqes;
+	return MSGPACK_OK;
+}
+
+static int enter(mp_uring_t *u, unsigned submit, unsigned wait) {
+	for (;;) {
+		long r = syscall(__NR_io_uring_enter, u->ring, submit, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+		if (r >= 0)
+			return MSGPACK_OK;
+		if (errno != EINTR)
+			return ERR_MSGPACK_CHECK_ERRNO;
+	}
+}
+
+// queues the rest of buffer 'i' (from 'done' up to 'len' for writes, or 'bufsize' for reads)
+static int queue(mp_uring_t *u, unsigned i) {
+	mp_uring_buf_t *b = &u->bufs[i];
+	bool write = u->write;
+	size_t from = write ? b->done : b->len;
+	size_t to = write ? b->len : u->bufsize;
+
+	unsigned tail = *u->sq_tail;
+	unsigned idx = tail & *u->sq_mask;
+	struct io_uring_sqe *sqe = (struct io_uring_sqe*)u->sqes + idx;
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+	sqe->fd = u->fd;
+	sqe->off = (uint64_t)(b->off + (off_t)from);
+	sqe->addr = (uint64_t)(uintptr_t)(b->buf + from);
+	sqe->len = (uint32_t)(to - from);
+	sqe->user_data = i;
+	u->sq_array[idx] = idx;
+	atomic_store_explicit((_Atomic unsigned*)u->sq_tail, tail + 1, memory_order_release);
+	int r = enter(u, 1, 0);
+	if (r == MSGPACK_OK) {
+		b->busy = true;
+	} else {
+		// the kernel took nothing, so take the entry back
+		// (otherwise the next submit would send it)
+		atomic_store_explicit((_Atomic unsigned*)u->sq_tail, tail, memory_order_release);
+	}
+	return r;
+}
+
+/*
+ * waits for at least one completion and handles
+ * all that are ready; short transfers are queued
+ * again for the rest of the buffer
+ */
+static int reap(mp_uring_t *u) {
+	int r = enter(u, 0, 1);
+	if (r) return r;
+	unsigned head = *u->cq_head;
+	while (head != atomic_load_explicit((_Atomic unsigned*)u->cq_tail, memory_order_acquire)) {
+		struct io_uring_cqe *cqe = (struct io_uring_cqe*)u->cqes + (head & *u->cq_mask);
+		mp_uring_buf_t *b = &u->bufs[cqe->user_data];
+		int res = cqe->res;
+		atomic_store_explicit((_Atomic unsigned*)u->cq_head, ++head, memory_order_release);
+
+		b->busy = false;
+		if (res < 0) {
+			u->err = -res;
+			continue;
+		}
+		if (u->write) {
+			b->done += (size_t)res;
+			if (res == 0)
+				u->err = EIO;
+			else if (b->done < b->len)
+				r = queue(u, (unsigned)(b - u->bufs));
+		} else {
+			// a read of 0 is the end of the file
+			b->len += (size_t)res;
+			if (res > 0 && b->len < u->bufsize)
+				r = queue(u, (unsigned)(b - u->bufs));
+		}
+		if (r) return r;
+	}
+	return MSGPACK_OK;
+}
+
+static int init(mp_uring_t *u, int fd, off_t off, unsigned char *mem, size_t bufsize, bool write) {
+	u->fd = fd;
+	u->write = write;
+	u->bufsize = bufsize;
+	u->pos = off;
+	u->cur = 0;
+	u->err = 0;
+	for (unsigned i=0; i<MP_URING_BUFS; ++i) {
+		u->bufs[i].buf = mem + i*bufsize;
+		u->bufs[i].len = 0;
+		u->bufs[i].done = 0;
+		u->bufs[i].off = off;
+		u->bufs[i].busy = false;
+	}
+	return uring_setup(u);
+}
+
+// starts reading the next chunk of the file into buffer 'i'
+static int read_ahead(mp_uring_t *u, unsigned i) {
+	mp_uring_buf_t *b = &u->bufs[i];
+	b->len = 0;
+	b->done = 0;
+	b->off = u->pos;
+	u->pos += (off_t)u->bufsize;
+	return queue(u, i);
+}
+
+int mp_uring_reader_init(mp_uring_t *u, int fd, off_t off, unsigned char *mem, size_t bufsize) {
+	int r = init(u, fd, off, mem, bufsize, false);
+	if (r || u->ring < 0)
+		return r;
+	for (unsigned i=0; i<MP_URING_BUFS; ++i) {
+		r = read_ahead(u, i);
+		if (r) {
+			mp_uring_close(u);
+			return r;
+		}
+	}
+	return MSGPACK_OK;
+}
+
+int mp_uring_writer_init(mp_uring_t *u, int fd, off_t off, unsigned char *mem, size_t bufsize) {
+	return init(u, fd, off, mem, bufsize, true);
+}
+
+ssize_t mp_uring_fill(void *ctx, void *buf, size_t max) {
+	mp_uring_t *u = (mp_uring_t*)ctx;
+	if (u->ring < 0) {
+		ssize_t n;
+		do {
+			n = pread(u->fd, buf, max, u->pos);
+		} while (n < 0 && errno == EINTR);
+		if (n > 0)
+			u->pos += n;
+		return n;
+	}
+
+	for (;;) {
+		mp_uring_buf_t *b = &u->bufs[u->cur];
+		while (b->busy) {
+			if (reap(u))
+				return -1;
+		}
+		if (u->err) {
+			errno = u->err;
+			return -1;
+		}
+		if (b->done < b->len) {
+			size_t n = b->len - b->done;
+			if (n > max)
+				n = max;
+			memcpy(buf, b->buf + b->done, n);
+			b->done += n;
+			return (ssize_t)n;
+		}
+		// a buffer that isn't full ended at EOF
+		if (b->len < u->bufsize)
+			return 0;
+		if (read_ahead(u, u->cur))
+			return -1;
+		u->cur = (u->cur + 1) % MP_URING_BUFS;
+	}
+}
+
+ssize_t mp_uring_flush(void *ctx, const void *buf, size_t amt) {
+	mp_uring_t *u = (mp_uring_t*)ctx;
+	if (u->ring < 0) {
+		ssize_t n;
+		do {
+			n = pwrite(u->fd, buf, amt, u->pos);
+		} while (n < 0 && errno == EINTR);
+		if (n > 0)
+			u->pos += n;
+		return n;
+	}
+
+	mp_uring_buf_t *b = &u->bufs[u->cur];
+	while (b->busy) {
+		if (reap(u))
+			return -1;
+	}
+	if (u->err) {
+		errno = u->err;
+		return -1;
+	}
+	size_t n = (amt < u->bufsize) ? amt : u->bufsize;
+	memcpy(b->buf, buf, n);
+	b->len = n;
+	b->done = 0;
+	b->off = u->pos;
+	u->pos += (off_t)n;
+	if (queue(u, u->cur))
+		return -1;
+	u->cur = (u->cur + 1) % MP_URING_BUFS;
+	return (ssize_t)n;
+}
+
+static bool in_flight(mp_uring_t *u) {
+	for (unsigned i=0; i<MP_URING_BUFS; ++i) {
+		if (u->bufs[i].busy)
+			return true;
+	}
+	return false;
+}
+
+int mp_uring_finish(mp_uring_t *u) {
+	if (u->ring < 0)
+		return MSGPACK_OK;
+	while (in_flight(u)) {
+		int r = reap(u);
+		if (r) return r;
+	}
+	if (u->err) {
+		errno = u->err;
+		return ERR_MSGPACK_CHECK_ERRNO;
+	}
+	return MSGPACK_OK;
+}
+
+int mp_uring_close(mp_uring_t *u) {
+	if (u->ring < 0)
+		return MSGPACK_OK;
+	// a writer completes its writes (short ones included)
+	int r = u->write ? mp_uring_finish(u) : MSGPACK_OK;
+	int e = errno;
+	// the kernel may still be using the buffers
+	while (in_flight(u)) {
+		unsigned head = *u->cq_head;
+		if (enter(u, 0, 1))
+			break;
+		while (head != atomic_load_explicit((_Atomic unsigned*)u->cq_tail, memory_order_acquire)) {
+			struct io_uring_cqe *cqe = (struct io_uring_cqe*)u->cqes + (head & *u->cq_mask);
+			u->bufs[cqe->user_data].busy = false;
+			atomic_store_explicit((_Atomic unsigned*)u->cq_head, ++head, memory_order_release);
+		}
+	}
+	// carry on (with pread) from the first unconsumed byte
+	if (!u->write)
+		u->pos = u->bufs[u->cur].off + (off_t)u->bufs[u->cur].done;
+	munmap(u->sqes, u->sqeslen);
+	if (u->cqlen)
+		munmap(u->cq, u->cqlen);
+	munmap(u->sq, u->sqlen);
+	close(u->ring);
+	u->ring = -1;
+	errno = e;
+	return r;
+}
@@ -0,0 +1,104 @@
+#ifndef MSGPACK_URING_H__
+#define MSGPACK_URING_H__
+#include <sys/types.h>
+#include "msgpack.h"
+
+/*
+
+	---- io_uring Streams ----
+
+An mp_uring_t reads or writes a regular file through
+io_uring, using MP_URING_BUFS staging buffers so that
+I/O overlaps with decoding or encoding.
+
+A reader keeps a read queued into every buffer that
+the decoder isn't consuming, so when mp_uring_fill
+moves on to the next buffer its data is usually
+already there:
+
+	static unsigned char stage[MP_URING_BUFS*65536];
+	mp_uring_t u;
+	mp_uring_reader_init(&u, fd, 0, stage, 65536);
+	mp_decode_stream_init(&dec, &u, mp_uring_fill, buf, sizeof(buf));
+	...
+	mp_uring_close(&u);
+
+A writer copies each flush into a free buffer, queues
+the write, and returns, so the encoder keeps going
+while the write is in flight. mp_uring_finish waits
+for every queued write and reports any error:
+
+	mp_uring_writer_init(&u, fd, 0, stage, 65536);
+	mp_encode_stream_init(&enc, &u, mp_uring_flush, buf, sizeof(buf));
+	...
+	mp_flush(&enc);
+	mp_uring_finish(&u);
+	mp_uring_close(&u);
+
+If io_uring isn't available (old kernels, or it is
+disabled), the same calls fall back to pread and
+pwrite.
+
+*/
+
+#define MP_URING_BUFS 2
+
+typedef struct {
+	unsigned char *buf;
+	size_t len;  // bytes read, or bytes to write
+	size_t done; // bytes consumed, or bytes written
+	off_t  off;  // file offset of buf[0]
+	bool   busy; // I/O is in flight
+} mp_uring_buf_t;
+
+typedef struct {
+	/*
+	 * NOTE: none of these fields
+	 * should be touched except by
+	 * the mp_uring_ functions
+	 */
+	int   ring; // -1 when falling back to pread/pwrite
+	int   fd;
+	bool  write;
+	void *sq, *cq, *sqes;
+	size_t sqlen, cqlen, sqeslen;
+	unsigned *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	void     *cqes;
+
+	mp_uring_buf_t bufs[MP_URING_BUFS];
+	size_t   bufsize;
+	off_t    pos;  // next file offset to queue
+	unsigned cur;  // buffer being consumed, or next to fill
+	int      err;  // errno of a failed read or write
+} mp_uring_t;
+
+/*
+ * mp_uring_reader_init and mp_uring_writer_init set up
+ * I/O on 'fd' from file offset 'off', staging through
+ * 'mem', which must hold MP_URING_BUFS*bufsize bytes.
+ * they return ERR_MSGPACK_CHECK_ERRNO if a syscall fails.
+ */
+int mp_uring_reader_init(mp_uring_t *u, int fd, off_t off, unsigned char *mem, size_t bufsize);
+int mp_uring_writer_init(mp_uring_t *u, int fd, off_t off, unsigned char *mem, size_t bufsize);
+
+/* mp_fill_t and mp_flush_t callbacks; 'ctx' is the mp_uring_t */
+ssize_t mp_uring_fill(void *ctx, void *buf, size_t max);
+ssize_t mp_uring_flush(void *ctx, const void *buf, size_t amt);
+
+/*
+ * waits for every queued write; returns
+ * ERR_MSGPACK_CHECK_ERRNO if any of them failed
+ */
+int mp_uring_finish(mp_uring_t *u);
+
+/*
+ * waits for in-flight I/O and tears down the ring (but not
+ * 'fd'); any later mp_uring_fill or mp_uring_flush carries
+ * on from the same place with pread or pwrite. a writer's
+ * queued writes are finished first, and close returns
+ * what mp_uring_finish does.
+ */
+int mp_uring_close(mp_uring_t *u);
+
+#endif
@@ -0,0 +1,384 @@
+#include <errno.h>
+#include <string.h>
+#include "msgpack_z.h"
+#ifdef MSGPACK_ZLIB
+#include <zlib.h>
+#endif
+#ifdef MSGPACK_ZSTD
+#include <zstd.h>
+#endif
+
+/*
+ * The built-in codec is LZ4-like. A block is a
+ * series of sequences, each of which is:
+ *
+ *   token: literal count (high 4 bits) and match length - 4 (low 4 bits)
+ *   [more literal count: 255s and a final byte < 255, if the nibble was 15]
+ *   literals
+ *   match offset (2 bytes, little-endian)
+ *   [more match length, as for the literal count]
+ *
+ * except that the last sequence stops after its literals.
+ * Matches are at least 4 bytes, at most 64KB back, and
+ * the last 5 bytes of a block are always literals.
+ */
+
+#define MINMATCH 4
+#define LASTLITERALS 5
+#define MFLIMIT 12
+#define MAXOFFSET 65535
+
+static inline uint32_t read32(const unsigned char *p) {
+	uint32_t v;
+	memcpy(&v, p, 4);
+	return v;
+}
+
+static inline uint32_t hash32(uint32_t v) {
+	return (v * 2654435761u) >> (32 - MP_Z_HASH_BITS);
+}
+
+static unsigned char *put_len(unsigned char *op, size_t n) {
+	for (; n >= 255; n -= 255)
+		*op++ = 255;
+	*op++ = (unsigned char)n;
+	return op;
+}
+
+static unsigned char *put_seq(unsigned char *op, const unsigned char *lit, size_t nlit, size_t off, size_t mlen) {
+	unsigned char *token = op++;
+	*token = (unsigned char)((nlit >= 15 ? 15 : nlit) << 4);
+	if (nlit >= 15)
+		op = put_len(op, nlit - 15);
+	memcpy(op, lit, nlit);
+	op += nlit;
+	if (mlen == 0)
+		return op;
+	*op++ = (unsigned char)off;
+	*op++ = (unsigned char)(off >> 8);
+	mlen -= MINMATCH;
+	*token |= (unsigned char)(mlen >= 15 ? 15 : mlen);
+	if (mlen >= 15)
+		op = put_len(op, mlen - 15);
+	return op;
+}
+
+// returns the compressed size; 'dst' must hold MP_Z_BOUND(n) - MP_Z_HDR bytes
+static size_t lz_compress(mp_z_writer_t *z, const unsigned char *src, size_t n, unsigned char *dst) {
+	// positions are stored relative to 'base', so the table never needs clearing
+	if (z->base > UINT32_MAX - n - 1) {
+		memset(z->table, 0, sizeof(z->table));
+		z->base = 1;
+	}
+	uint32_t base = z->base;
+	z->base += (uint32_t)n;
+
+	unsigned char *op = dst;
+	size_t ip = 0, anchor = 0;
+	size_t limit = (n > MFLIMIT) ? n - MFLIMIT : 0;
+	while (ip < limit) {
+		uint32_t seq = read32(src + ip);
+		uint32_t h = hash32(seq);
+		uint32_t cand = z->table[h];
+		z->table[h] = base + (uint32_t)ip;
+		if (cand < base || ip - (cand - base) > MAXOFFSET || read32(src + (cand - base)) != seq) {
+			// step faster through data that doesn't compress
+			ip += 1 + ((ip - anchor) >> 6);
+			continue;
+		}
+		size_t c = cand - base;
+		size_t len = MINMATCH;
+		while (ip + len < n - LASTLITERALS && src[c + len] == src[ip + len])
+			++len;
+		op = put_seq(op, src + anchor, ip - anchor, ip - c, len);
+		ip += len;
+		anchor = ip;
+	}
+	return (size_t)(put_seq(op, src + anchor, n - anchor, 0, 0) - dst);
+}
+
+static int get_len(const unsigned char **ip, const unsigned char *end, size_t *n) {
+	unsigned char b;
+	do {
+		if (*ip >= end)
+			return ERR_MSGPACK_BAD_TYPE;
+		b = *(*ip)++;
+		*n += b;
+	} while (b == 255);
+	return MSGPACK_OK;
+}
+
+static int lz_decompress(const unsigned char *in, size_t inlen, unsigned char *out, size_t outcap, size_t *outlen) {
+	const unsigned char *ip = in, *end = in + inlen;
+	size_t op = 0;
+	for (;;) {
+		if (ip >= end)
+			return ERR_MSGPACK_BAD_TYPE;
+		unsigned token = *ip++;
+		size_t nlit = token >> 4;
+		if (nlit == 15 && get_len(&ip, end, &nlit))
+			return ERR_MSGPACK_BAD_TYPE;
+		if (nlit > (size_t)(end - ip) || nlit > outcap - op)
+			return ERR_MSGPACK_BAD_TYPE;
+		memcpy(out + op, ip, nlit);
+		ip += nlit;
+		op += nlit;
+		if (ip == end)
+			break;
+
+		if (end - ip < 2)
+			return ERR_MSGPACK_BAD_TYPE;
+		size_t off = (size_t)ip[0] | ((size_t)ip[1] << 8);
+		ip += 2;
+		size_t mlen = token & 15;
+		if (mlen == 15 && get_len(&ip, end, &mlen))
+			return ERR_MSGPACK_BAD_TYPE;
+		mlen += MINMATCH;
+		if (off == 0 || off > op || mlen > outcap - op)
+			return ERR_MSGPACK_BAD_TYPE;
+		// matches may overlap what they produce
+		unsigned char *d = out + op;
+		const unsigned char *s = d - off;
+		if (off >= mlen) {
+			memcpy(d, s, mlen);
+		} else {
+			for (size_t i=0; i<mlen; ++i)
+				d[i] = s[i];
+		}
+		op += mlen;
+	}
+	*outlen = op;
+	return MSGPACK_OK;
+}
+
+static void put_be32(unsigned char *p, uint32_t v) {
+	p[0] = (unsigned char)(v >> 24);
+	p[1] = (unsigned char)(v >> 16);
+	p[2] = (unsigned char)(v >> 8);
+	p[3] = (unsigned char)v;
+}
+
+static uint32_t get_be32(const unsigned char *p) {
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+int mp_z_writer_init(mp_z_writer_t *z, mp_z_codec_t codec, void *ctx, mp_flush_t write,
+	unsigned char *scratch, size_t scratchsize) {
+	switch (codec) {
+	case MP_Z_STORED:
+	case MP_Z_LZ:
+		break;
+#ifdef MSGPACK_ZLIB
+	case MP_Z_ZLIB:
+		break;
+#endif
+#ifdef MSGPACK_ZSTD
+	case MP_Z_ZSTD:
+		break;
+#endif
+	default:
+		return ERR_MSGPACK_BAD_TYPE;
+	}
+	z->codec = codec;
+	z->ctx = ctx;
+	z->write = write;
+	z->scratch = scratch;
+	z->scratchsize = scratchsize;
+	z->base = 1;
+	memset(z->table, 0, sizeof(z->table));
+	return MSGPACK_OK;
+}
+
+ssize_t mp_z_flush(void *ctx, const void *buf, size_t amt) {
+	mp_z_writer_t *z = (mp_z_writer_t*)ctx;
+	const unsigned char *src = (const unsigned char*)buf;
+
+	// take no more than fits in the scratch space
+	size_t room = z->scratchsize - MP_Z_HDR - 16;
+	size_t max = room - room/256;
+	while (max + max/255 > room)
+		--max;
+	if (max > UINT32_MAX)
+		max = UINT32_MAX;
+	if (amt > max)
+		amt = max;
+	if (amt == 0)
+		return 0;
+
+	unsigned char *payload = z->scratch + MP_Z_HDR;
+	mp_z_codec_t codec = z->codec;
+	size_t plen = 0;
+	switch (codec) {
+	case MP_Z_LZ:
+		plen = lz_compress(z, src, amt, payload);
+		break;
+#ifdef MSGPACK_ZLIB
+	case MP_Z_ZLIB: {
+		uLongf dl = (uLongf)amt;
+		if (compress2(payload, &dl, src, (uLong)amt, 1) == Z_OK)
+			plen = (size_t)dl;
+		else
+			plen = amt;
+		break;
+	}
+#endif
+#ifdef MSGPACK_ZSTD
+	case MP_Z_ZSTD: {
+		size_t r = ZSTD_compress(payload, amt, src, amt, 1);
+		plen = ZSTD_isError(r) ? amt : r;
+		break;
+	}
+#endif
+	default:
+		plen = amt;
+		break;
+	}
+	if (plen >= amt) {
+		codec = MP_Z_STORED;
+		memcpy(payload, src, amt);
+		plen = amt;
+	}
+
+	z->scratch[0] = (unsigned char)codec;
+	put_be32(z->scratch + 1, (uint32_t)amt);
+	put_be32(z->scratch + 5, (uint32_t)plen);
+
+	// a frame is all or nothing; a failure here ends the stream
+	size_t len = MP_Z_HDR + plen, wrote = 0;
+	while (wrote < len) {
+		ssize_t w = z->write(z->ctx, z->scratch + wrote, len - wrote);
+		if (w <= 0)
+			return -1;
+		wrote += (size_t)w;
+	}
+	return (ssize_t)amt;
+}
+
+int mp_z_decode_frame(const unsigned char *in, size_t inlen, unsigned char *out, size_t outcap,
+	size_t *used, size_t *len) {
+	if (inlen < MP_Z_HDR)
+		return ERR_MSGPACK_EOF;
+	unsigned codec = in[0];
+	size_t raw = get_be32(in + 1);
+	size_t plen = get_be32(in + 5);
+	if (plen > inlen - MP_Z_HDR || raw > outcap)
+		return ERR_MSGPACK_EOF;
+	const unsigned char *payload = in + MP_Z_HDR;
+
+	size_t got = 0;
+	switch (codec) {
+	case MP_Z_STORED:
+		if (plen != raw)
+			return ERR_MSGPACK_BAD_TYPE;
+		memcpy(out, payload, plen);
+		got = plen;
+		break;
+	case MP_Z_LZ:
+		if (lz_decompress(payload, plen, out, raw, &got))
+			return ERR_MSGPACK_BAD_TYPE;
+		break;
+#ifdef MSGPACK_ZLIB
+	case MP_Z_ZLIB: {
+		uLongf dl = (uLongf)raw;
+		if (uncompress(out, &dl, payload, (uLong)plen) != Z_OK)
+			return ERR_MSGPACK_BAD_TYPE;
+		got = (size_t)dl;
+		break;
+	}
+#endif
+#ifdef MSGPACK_ZSTD
+	case MP_Z_ZSTD: {
+		size_t r = ZSTD_decompress(out, raw, payload, plen);
+		if (ZSTD_isError(r))
+			return ERR_MSGPACK_BAD_TYPE;
+		got = r;
+		break;
+	}
+#endif
+	default:
+		return ERR_MSGPACK_BAD_TYPE;
+	}
+	if (got != raw)
+		return ERR_MSGPACK_BAD_TYPE;
+	*used = MP_Z_HDR + plen;
+	*len = raw;
+	return MSGPACK_OK;
+}
+
+void mp_z_reader_init(mp_z_reader_t *z, void *ctx, mp_fill_t read, unsigned char *mem, size_t maxframe) {
+	z->ctx = ctx;
+	z->read = read;
+	z->in = mem;
+	z->insize = MP_Z_BOUND(maxframe);
+	z->out = mem + z->insize;
+	z->outsize = maxframe;
+	z->outlen = 0;
+	z->outoff = 0;
+	return;
+}
+
+/*
+ * reads exactly 'n' bytes; returns 0 at a clean EOF
+ * (nothing read), n on success, and -1 otherwise
+ */
+static ssize_t read_exact(mp_z_reader_t *z, unsigned char *p, size_t n) {
+	size_t got = 0;
+	while (got < n) {
+		ssize_t c = z->read(z->ctx, p + got, n - got);
+		if (c < 0)
+			return -1;
+		if (c == 0) {
+			if (got == 0)
+				return 0;
+			errno = EIO; // truncated frame
+			return -1;
+		}
+		got += (size_t)c;
+	}
+	return (ssize_t)n;
+}
+
+ssize_t mp_z_fill(void *ctx, void *buf, size_t max) {
+	mp_z_reader_t *z = (mp_z_reader_t*)ctx;
+	if (z->outoff == z->outlen) {
+		ssize_t c = read_exact(z, z->in, MP_Z_HDR);
+		if (c <= 0)
+			return c;
+		size_t raw = get_be32(z->in + 1);
+		size_t plen = get_be32(z->in + 5);
+		if (plen > z->insize - MP_Z_HDR || raw > z->outsize || raw == 0) {
+			errno = EMSGSIZE;
+			return -1;
+		}
+		c = read_exact(z, z->in + MP_Z_HDR, plen);
+		if (c != (ssize_t)plen) {
+			if (c == 0)
+				errno = EIO; // truncated frame
+			return -1;
+		}
+
+		size_t used, len;
+		int r;
+		if (raw <= max) {
+			// straight into the decoder
+			r = mp_z_decode_frame(z->in, MP_Z_HDR + plen, (unsigned char*)buf, max, &used, &len);
+			if (r == MSGPACK_OK)
+				return (ssize_t)len;
+		} else {
+			r = mp_z_decode_frame(z->in, MP_Z_HDR + plen, z->out, z->outsize, &used, &len);
+			z->outlen = len;
+			z->outoff = 0;
+		}
+		if (r) {
+			errno = EILSEQ;
+			z->outlen = z->outoff = 0;
+			return -1;
+		}
+	}
+	size_t n = z->outlen - z->outoff;
+	if (n > max)
+		n = max;
+	memcpy(buf, z->out + z->outoff, n);
+	z->outoff += n;
+	return (ssize_t)n;
+}
@@ -0,0 +1,123 @@
+#ifndef MSGPACK_Z_H__
+#define MSGPACK_Z_H__
+#include "msgpack.h"
+
+/*
+
+	---- Compressed Streams ----
+
+mp_z_flush and mp_z_fill wrap another mp_flush_t
+and mp_fill_t, compressing each flush of an encoder
+into one self-contained frame:
+
+	codec (1 byte), raw size (4 bytes), payload size
+	(4 bytes, both big-endian), payload
+
+So frames follow the encoder's buffer size, and any
+frame can be decoded on its own (by mp_z_decode_frame)
+given only its bytes, e.g. from several threads.
+
+MP_Z_LZ is a small built-in LZ77 codec, which is
+always available. MP_Z_ZLIB and MP_Z_ZSTD need the
+library at build time (-DMSGPACK_ZLIB and -lz, or
+-DMSGPACK_ZSTD and -lzstd, which the Makefile adds
+when it finds zlib.h or zstd.h); without it,
+mp_z_writer_init and mp_z_decode_frame reject the
+codec. A frame that doesn't
+get smaller is stored as-is (MP_Z_STORED).
+
+	mp_z_writer_t zw;
+	mp_z_writer_init(&zw, MP_Z_LZ, &fd, my_flush, scratch, MP_Z_BOUND(4096));
+	mp_encode_stream_init(&enc, &zw, mp_z_flush, buf, 4096);
+
+	mp_z_reader_t zr;
+	mp_z_reader_init(&zr, &fd, my_fill, mem, 4096);
+	mp_decode_stream_init(&dec, &zr, mp_z_fill, buf, 8192);
+
+mp_z_fill decompresses straight into the decoder's
+buffer when the whole frame fits in the space the
+decoder offers (which it always does if the decoder's
+buffer is at least twice the encoder's); otherwise
+it goes through the reader's own memory.
+
+*/
+
+typedef enum {
+	MP_Z_STORED = 0,
+	MP_Z_LZ = 1,
+	MP_Z_ZLIB = 2,
+	MP_Z_ZSTD = 3,
+} mp_z_codec_t;
+
+#define MP_Z_HDR 9
+
+/* the scratch space needed to compress flushes of up to 'n' bytes */
+#define MP_Z_BOUND(n) (MP_Z_HDR + (n) + (n)/255 + 16)
+
+/* the memory an mp_z_reader_t needs for frames of up to 'n' bytes */
+#define MP_Z_READER_MEM(n) (MP_Z_BOUND(n) + (n))
+
+#define MP_Z_HASH_BITS 12
+
+typedef struct {
+	/*
+	 * NOTE: none of these fields
+	 * should be touched except by
+	 * the mp_z_ functions
+	 */
+	mp_z_codec_t   codec;
+	void          *ctx;
+	mp_flush_t     write;
+	unsigned char *scratch;
+	size_t         scratchsize;
+	uint32_t       base; // table entries below this are from older frames
+	uint32_t       table[1 << MP_Z_HASH_BITS];
+} mp_z_writer_t;
+
+typedef struct {
+	/*
+	 * NOTE: none of these fields
+	 * should be touched except by
+	 * the mp_z_ functions
+	 */
+	void          *ctx;
+	mp_fill_t      read;
+	unsigned char *in;    // compressed frame
+	size_t         insize;
+	unsigned char *out;   // a decompressed frame that didn't fit
+	size_t         outsize;
+	size_t         outlen;
+	size_t         outoff;
+} mp_z_reader_t;
+
+/*
+ * initializes a writer that compresses with 'codec'
+ * and writes frames through 'write'. 'scratch' must
+ * hold MP_Z_BOUND(n) bytes for flushes of up to 'n'
+ * bytes. returns ERR_MSGPACK_BAD_TYPE if 'codec'
+ * wasn't built in.
+ */
+int mp_z_writer_init(mp_z_writer_t *z, mp_z_codec_t codec, void *ctx, mp_flush_t write,
+	unsigned char *scratch, size_t scratchsize);
+
+/*
+ * initializes a reader for frames of up to 'maxframe'
+ * bytes; 'mem' must hold MP_Z_READER_MEM(maxframe) bytes
+ */
+void mp_z_reader_init(mp_z_reader_t *z, void *ctx, mp_fill_t read, unsigned char *mem, size_t maxframe);
+
+/* mp_flush_t and mp_fill_t callbacks; 'ctx' is the writer or reader */
+ssize_t mp_z_flush(void *ctx, const void *buf, size_t amt);
+ssize_t mp_z_fill(void *ctx, void *buf, size_t max);
+
+/*
+ * decodes the frame at the start of 'in' into 'out',
+ * setting 'used' to the size of the frame and 'len'
+ * to the number of bytes decompressed. returns
+ * ERR_MSGPACK_EOF if 'in' or 'out' is too short,
+ * and ERR_MSGPACK_BAD_TYPE if the frame is corrupt.
+ */
+int mp_z_decode_frame(const unsigned char *in, size_t inlen, unsigned char *out, size_t outcap,
+	size_t *used, size_t *len);
+
+#endif
@@ -0,0 +1,292 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "../msgpack_columnar.h"
+
+#define ROWS 1000
+#define STRCAP (16 * ROWS)
+#define SINKSIZE (1 << 20)
+
+typedef struct {
+	int64_t     delta;
+	uint64_t    ts;
+	double      load;
+	bool        ok;
+	mp_strref_t host;
+	mp_strref_t msg;
+} sample;
+
+static const mp_field_t fields[] = {
+	{ "delta", MP_FIELD_INT64, offsetof(sample, delta) },
+	{ "ts", MP_FIELD_UINT64, offsetof(sample, ts) },
+	{ "load", MP_FIELD_DOUBLE, offsetof(sample, load) },
+	{ "ok", MP_FIELD_BOOL, offsetof(sample, ok) },
+	{ "host", MP_FIELD_STR, offsetof(sample, host) },
+	{ "msg", MP_FIELD_STR, offsetof(sample, msg) },
+};
+#define NFIELDS (sizeof(fields)/sizeof(fields[0]))
+#define DICT (1 << 4) // "host"
+
+static const char *hosts[] = { "alpha", "beta", "gamma", "" };
+
+typedef struct {
+	unsigned char *mem;
+	size_t len;
+	size_t off;
+} sink_t;
+
+static ssize_t sink_flush(void *ctx, const void *buf, size_t amt) {
+	sink_t *s = (sink_t*)ctx;
+	assert(s->len + amt <= SINKSIZE);
+	memcpy(s->mem + s->len, buf, amt);
+	s->len += amt;
+	return (ssize_t)amt;
+}
+
+static ssize_t sink_fill(void *ctx, void *buf, size_t max) {
+	sink_t *s = (sink_t*)ctx;
+	size_t n = s->len - s->off;
+	if (n > max)
+		n = max;
+	// short reads
+	if (n > 100)
+		n = 100;
+	memcpy(buf, s->mem + s->off, n);
+	s->off += n;
+	return (ssize_t)n;
+}
+
+static void make_row(sample *s, size_t i, char *msg) {
+	const char *h = hosts[i % 4];
+	s->delta = (int64_t)i * ((i & 1) ? -1000 : 7);
+	s->ts = (uint64_t)1 << (i % 64);
+	s->load = (double)i / 8;
+	s->ok = (i % 3) == 0;
+	s->host.s = h;
+	s->host.sz = (uint32_t)strlen(h);
+	s->msg.sz = (uint32_t)snprintf(msg, 16, "m%d", (int)i);
+	s->msg.s = msg;
+}
+
+static int check_row(const sample *s, size_t i) {
+	sample want;
+	char msg[16];
+	make_row(&want, i, msg);
+	if (s->delta != want.delta || s->ts != want.ts || s->load != want.load || s->ok != want.ok ||
+	    s->host.sz != want.host.sz || memcmp(s->host.s, want.host.s, want.host.sz) != 0 ||
+	    s->msg.sz != want.msg.sz || memcmp(s->msg.s, want.msg.s, want.msg.sz) != 0) {
+		printf("FAIL: row %d doesn't match\n", (int)i);
+		return 1;
+	}
+	return 0;
+}
+
+static void fill_batch(mp_columnar_writer_t *w, size_t rows) {
+	for (size_t i=0; i<rows; ++i) {
+		sample s;
+		char msg[16];
+		make_row(&s, i, msg);
+		assert(mp_columnar_add(w, &s) == MSGPACK_OK);
+	}
+	assert(mp_columnar_rows(w) == rows);
+}
+
+static int read_batch(mp_decoder_t *d, size_t rows) {
+	static unsigned char mem[64 * ROWS];
+	static mp_column_t cols[NFIELDS];
+	mp_columnar_reader_t r;
+	assert(mp_columnar_reader_init(&r, fields, NFIELDS, cols, mem, sizeof(mem)) == MSGPACK_OK);
+	if (mp_columnar_read(d, &r) != MSGPACK_OK || r.rows != rows ||
+	    r.present != (1 << NFIELDS) - 1) {
+		printf("FAIL: couldn't read a batch of %d rows\n", (int)rows);
+		return 1;
+	}
+	// the columns, as vectors
+	assert(!cols[0].coded && !cols[5].coded && cols[4].coded && cols[4].ndict == (rows < 4 ? rows : 4));
+	for (size_t i=0; i<rows; ++i) {
+		if (cols[2].v.f[i] != (double)i / 8 || cols[1].v.u[i] != (uint64_t)1 << (i % 64) ||
+		    cols[4].dict[cols[4].v.codes[i]].sz != strlen(hosts[i % 4])) {
+			printf("FAIL: column values of row %d\n", (int)i);
+			return 1;
+		}
+	}
+	// and as rows
+	for (size_t i=0; i<rows; ++i) {
+		sample s;
+		if (mp_columnar_row(&r, i, &s) != MSGPACK_OK || check_row(&s, i))
+			return 1;
+	}
+	sample s;
+	assert(mp_columnar_row(&r, rows, &s) == ERR_MSGPACK_EOF);
+	return 0;
+}
+
+int main(void) {
+	printf("Running columnar tests...\n");
+	static unsigned char wmem[1 << 20];
+	static mp_column_t wcols[NFIELDS];
+	static unsigned char out[SINKSIZE];
+	mp_columnar_writer_t w;
+	mp_encoder_t enc;
+	mp_decoder_t dec;
+
+	assert(mp_columnar_memsize(fields, NFIELDS, DICT, ROWS, STRCAP) <= sizeof(wmem));
+	assert(mp_columnar_writer_init(&w, fields, NFIELDS, DICT, wcols, ROWS, STRCAP, wmem, 64) == ERR_MSGPACK_EOF);
+	// only string columns can use a dictionary
+	assert(mp_columnar_writer_init(&w, fields, NFIELDS, 1, wcols, ROWS, STRCAP, wmem, sizeof(wmem)) == ERR_MSGPACK_BAD_TYPE);
+	assert(mp_columnar_writer_init(&w, fields, NFIELDS, DICT, wcols, ROWS, STRCAP, wmem, sizeof(wmem)) == MSGPACK_OK);
+
+	// round trip in memory, with empty and tiny batches too
+	static const size_t sizes[] = { ROWS, 0, 1, 3 };
+	for (size_t k=0; k<sizeof(sizes)/sizeof(sizes[0]); ++k) {
+		fill_batch(&w, sizes[k]);
+		mp_encode_mem_init(&enc, out, sizeof(out));
+		assert(mp_columnar_write(&enc, &w) == MSGPACK_OK);
+		assert(mp_columnar_rows(&w) == 0);
+		mp_decode_mem_init(&dec, out, mp_enc_buffered(&enc));
+		if (read_batch(&dec, sizes[k]))
+			return 1;
+		assert(mp_skip(&dec) == ERR_MSGPACK_EOF);
+	}
+
+	// a plain decoder sees the dictionary as [strings, codes]
+	{
+		uint32_t sz;
+		char key[8];
+		fill_batch(&w, 8);
+		mp_encode_mem_init(&enc, out, sizeof(out));
+		assert(mp_columnar_write(&enc, &w) == MSGPACK_OK);
+		mp_decode_mem_init(&dec, out, mp_enc_buffered(&enc));
+		assert(mp_read_mapsize(&dec, &sz) == MSGPACK_OK && sz == NFIELDS);
+		for (size_t i=0; i<4; ++i) {
+			assert(mp_skip(&dec) == MSGPACK_OK && mp_skip(&dec) == MSGPACK_OK);
+		}
+		assert(mp_read_strsize(&dec, &sz) == MSGPACK_OK && sz == 4);
+		assert(mp_read(&dec, key, 4) == 4 && memcmp(key, "host", 4) == 0);
+		assert(mp_read_arraysize(&dec, &sz) == MSGPACK_OK && sz == 2);
+		assert(mp_read_arraysize(&dec, &sz) == MSGPACK_OK && sz == 4);
+		for (size_t i=0; i<4; ++i)
+			assert(mp_skip(&dec) == MSGPACK_OK);
+		assert(mp_read_arraysize(&dec, &sz) == MSGPACK_OK && sz == 8);
+		for (uint64_t i=0; i<8; ++i) {
+			uint64_t u;
+			assert(mp_read_uint(&dec, &u) == MSGPACK_OK && u == i % 4);
+		}
+	}
+
+	// streams, with buffers far smaller than a column
+	{
+		static unsigned char sinkmem[SINKSIZE];
+		sink_t s = { sinkmem, 0, 0 };
+		unsigned char ebuf[64], dbuf[64];
+		fill_batch(&w, ROWS);
+		mp_encode_stream_init(&enc, &s, sink_flush, ebuf, sizeof(ebuf));
+		assert(mp_columnar_write(&enc, &w) == MSGPACK_OK);
+		fill_batch(&w, 10);
+		assert(mp_columnar_write(&enc, &w) == MSGPACK_OK);
+		assert(mp_flush(&enc) == MSGPACK_OK);
+		mp_decode_stream_init(&dec, &s, sink_fill, dbuf, sizeof(dbuf));
+		if (read_batch(&dec, ROWS) || read_batch(&dec, 10))
+			return 1;
+	}
+
+	// a full batch (or string column) adds nothing
+	{
+		static unsigned char mem[4096];
+		static mp_column_t cols[NFIELDS];
+		mp_columnar_writer_t small;
+		sample row;
+		char msg[16];
+		assert(mp_columnar_writer_init(&small, fields, NFIELDS, DICT, cols, 4, 8, mem, sizeof(mem)) == MSGPACK_OK);
+		for (size_t i=0; i<4; ++i) {
+			make_row(&row, 0, msg);
+			assert(mp_columnar_add(&small, &row) == MSGPACK_OK);
+		}
+		assert(mp_columnar_add(&small, &row) == ERR_MSGPACK_EOF);
+		mp_columnar_reset(&small);
+		make_row(&row, 1, msg);  // "beta", "m1"
+		assert(mp_columnar_add(&small, &row) == MSGPACK_OK);
+		make_row(&row, 2, msg);  // "gamma" doesn't fit after "beta"
+		assert(mp_columnar_add(&small, &row) == ERR_MSGPACK_EOF);
+		assert(mp_columnar_rows(&small) == 1 && cols[4].ndict == 1 && cols[5].stroff == 2);
+	}
+
+	// an encoder too small for even one value
+	{
+		static unsigned char mem[256];
+		static mp_column_t cols[1];
+		unsigned char tiny[8];
+		mp_columnar_writer_t one;
+		sample row = { .delta = (int64_t)1 << 40, .ts = (uint64_t)1 << 40, .load = 0.5 };
+		for (size_t f=0; f<3; ++f) {
+			assert(mp_columnar_writer_init(&one, fields + f, 1, 0, cols, 4, 8, mem, sizeof(mem)) == MSGPACK_OK);
+			assert(mp_columnar_add(&one, &row) == MSGPACK_OK);
+			mp_encode_mem_init(&enc, tiny, sizeof(tiny));
+			assert(mp_columnar_write(&enc, &one) == ERR_MSGPACK_EOF);
+		}
+	}
+
+	// hand-written batches: unknown and missing columns, other encodings
+	{
+		static unsigned char mem[4096];
+		static mp_column_t cols[NFIELDS];
+		mp_columnar_reader_t r;
+		sample s;
+		assert(mp_columnar_reader_init(&r, fields, NFIELDS, cols, mem, sizeof(mem)) == MSGPACK_OK);
+
+		mp_encode_mem_init(&enc, out, sizeof(out));
+		assert(mp_write_mapsize(&enc, 3) == MSGPACK_OK);
+		assert(mp_write_str(&enc, "extra", 5) == MSGPACK_OK);
+		assert(mp_write_arraysize(&enc, 1) == MSGPACK_OK);
+		assert(mp_write_nil(&enc) == MSGPACK_OK);
+		assert(mp_write_str(&enc, "load", 4) == MSGPACK_OK);
+		assert(mp_write_arraysize(&enc, 2) == MSGPACK_OK);
+		assert(mp_write_int(&enc, -3) == MSGPACK_OK);
+		assert(mp_write_float(&enc, 0.5f) == MSGPACK_OK);
+		assert(mp_write_str(&enc, "msg", 3) == MSGPACK_OK);
+		assert(mp_write_arraysize(&enc, 2) == MSGPACK_OK);
+		assert(mp_write_str(&enc, "x", 1) == MSGPACK_OK);
+		assert(mp_write_str(&enc, "yz", 2) == MSGPACK_OK);
+		mp_decode_mem_init(&dec, out, mp_enc_buffered(&enc));
+		assert(mp_columnar_read(&dec, &r) == MSGPACK_OK);
+		assert(r.rows == 2 && r.present == ((1 << 2) | (1 << 5)) && !cols[5].coded);
+		s.ts = 77;
+		assert(mp_columnar_row(&r, 1, &s) == MSGPACK_OK);
+		assert(s.load == 0.5 && s.ts == 77 && s.msg.sz == 2 && memcmp(s.msg.s, "yz", 2) == 0);
+
+		// columns of different lengths
+		mp_encode_mem_init(&enc, out, sizeof(out));
+		assert(mp_write_mapsize(&enc, 2) == MSGPACK_OK);
+		assert(mp_write_str(&enc, "ok", 2) == MSGPACK_OK);
+		assert(mp_write_arraysize(&enc, 1) == MSGPACK_OK);
+		assert(mp_write_bool(&enc, true) == MSGPACK_OK);
+		assert(mp_write_str(&enc, "ts", 2) == MSGPACK_OK);
+		assert(mp_write_arraysize(&enc, 0) == MSGPACK_OK);
+		mp_decode_mem_init(&dec, out, mp_enc_buffered(&enc));
+		assert(mp_columnar_read(&dec, &r) == ERR_MSGPACK_BAD_TYPE);
+
+		// a dictionary code that's out of range
+		mp_encode_mem_init(&enc, out, sizeof(out));
+		assert(mp_write_mapsize(&enc, 1) == MSGPACK_OK);
+		assert(mp_write_str(&enc, "host", 4) == MSGPACK_OK);
+		assert(mp_write_arraysize(&enc, 2) == MSGPACK_OK);
+		assert(mp_write_arraysize(&enc, 1) == MSGPACK_OK);
+		assert(mp_write_str(&enc, "a", 1) == MSGPACK_OK);
+		assert(mp_write_arraysize(&enc, 2) == MSGPACK_OK);
+		assert(mp_write_uint(&enc, 0) == MSGPACK_OK);
+		assert(mp_write_uint(&enc, 1) == MSGPACK_OK);
+		mp_decode_mem_init(&dec, out, mp_enc_buffered(&enc));
+		assert(mp_columnar_read(&dec, &r) == ERR_MSGPACK_BAD_TYPE);
+
+		// a reader arena that's too small
+		fill_batch(&w, ROWS);
+		mp_encode_mem_init(&enc, out, sizeof(out));
+		assert(mp_columnar_write(&enc, &w) == MSGPACK_OK);
+		mp_decode_mem_init(&dec, out, mp_enc_buffered(&enc));
+		assert(mp_columnar_read(&dec, &r) == ERR_MSGPACK_EOF);
+	}
+
+	printf("Columnar tests OK.\n");
+	return 0;
+}
@@ -0,0 +1,76 @@
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <unistd.h>
+#include "../msgpack_file.h"
+
+#define RECORDS 100000
+
+static ssize_t fd_flush(void *ctx, const void *buf, size_t amt) {
+	return write(*(int*)ctx, buf, amt);
+}
+
+int main(void) {
+	printf("Running file tests...\n");
+	char path[] = "/tmp/msgc-filetest-XXXXXX";
+	int fd = mkstemp(path);
+	assert(fd >= 0);
+	mp_decoder_t dec;
+	mp_file_t f;
+
+	assert(mp_decode_file_init(&dec, &f, "/nonexistent/msgc") == ERR_MSGPACK_CHECK_ERRNO);
+	assert(errno == ENOENT);
+
+	// an empty file
+	assert(mp_decode_file_init(&dec, &f, path) == MSGPACK_OK);
+	assert(mp_skip(&dec) == ERR_MSGPACK_EOF);
+	mp_decode_file_close(&dec, &f);
+
+	static const char payload[64] = { 0 };
+	unsigned char buf[4096];
+	mp_encoder_t enc;
+	mp_encode_stream_init(&enc, &fd, fd_flush, buf, sizeof(buf));
+	for (uint64_t i=0; i<RECORDS; ++i) {
+		assert(mp_write_mapsize(&enc, 2) == MSGPACK_OK);
+		assert(mp_write_str(&enc, "seq", 3) == MSGPACK_OK);
+		assert(mp_write_uint(&enc, i) == MSGPACK_OK);
+		assert(mp_write_str(&enc, "pad", 3) == MSGPACK_OK);
+		assert(mp_write_bin(&enc, payload, (uint32_t)(i % 64)) == MSGPACK_OK);
+	}
+	assert(mp_flush(&enc) == MSGPACK_OK);
+	close(fd);
+
+	assert(mp_decode_file_init(&dec, &f, path) == MSGPACK_OK);
+	// the file is many windows long (MP_FILE_WINDOW is small here)
+	assert(f.len > 8*MP_FILE_WINDOW);
+	assert(f.ahead == MP_FILE_WINDOW);
+	for (uint64_t i=0; i<RECORDS; ++i) {
+		uint32_t sz;
+		uint64_t v;
+		char pad[64];
+		assert(mp_read_mapsize(&dec, &sz) == MSGPACK_OK && sz == 2);
+		assert(mp_skip(&dec) == MSGPACK_OK);
+		assert(mp_read_uint(&dec, &v) == MSGPACK_OK);
+		if (v != i) {
+			printf("FAIL: got record %d, want %d\n", (int)v, (int)i);
+			return 1;
+		}
+		assert(mp_skip(&dec) == MSGPACK_OK);
+		assert(mp_read_binsize(&dec, &sz) == MSGPACK_OK && sz == i % 64);
+		// mem mode reads never come up short
+		assert(mp_read(&dec, pad, sz) == (ssize_t)sz);
+		mp_decode_file_advance(&dec, &f);
+		assert(f.ahead >= dec.off && f.released <= dec.off);
+	}
+	assert(mp_skip(&dec) == ERR_MSGPACK_EOF);
+	assert(f.ahead == f.len);
+	assert(f.released > 0 && f.released % (size_t)sysconf(_SC_PAGESIZE) == 0);
+	mp_decode_file_close(&dec, &f);
+
+	unlink(path);
+	printf("File tests OK.\n");
+	return 0;
+}
@@ -0,0 +1,186 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "../msgpack_log.h"
+
+#define RECORDS 20000
+#define MAXBLOCKS 1024
+#define THREADS 4
+
+static mp_log_reader_t rd;
+
+static ssize_t fd_flush(void *ctx, const void *buf, size_t amt) {
+	return write(*(int*)ctx, buf, amt);
+}
+
+static ssize_t fd_fill(void *ctx, void *buf, size_t max) {
+	return read(*(int*)ctx, buf, max);
+}
+
+// record i is [i, <i%100 bytes>]
+static void write_log(int fd, mp_log_block_t *blocks, size_t maxblocks, size_t blocksize) {
+	static const char pad[100] = { 0 };
+	unsigned char buf[512];
+	mp_log_writer_t w;
+	assert(ftruncate(fd, 0) == 0 && lseek(fd, 0, SEEK_SET) == 0);
+	mp_log_writer_init(&w, &fd, fd_flush, buf, sizeof(buf), blocks, maxblocks, blocksize);
+	for (uint64_t i=0; i<RECORDS; ++i) {
+		assert(mp_write_arraysize(&w.enc, 2) == MSGPACK_OK);
+		assert(mp_write_uint(&w.enc, i) == MSGPACK_OK);
+		assert(mp_write_bin(&w.enc, pad, (uint32_t)(i % 100)) == MSGPACK_OK);
+		mp_log_commit(&w);
+	}
+	assert(mp_log_writer_finish(&w) == MSGPACK_OK);
+}
+
+static int check_record(mp_decoder_t *d, uint64_t want) {
+	uint32_t sz;
+	uint64_t v;
+	if (mp_read_arraysize(d, &sz) != MSGPACK_OK || sz != 2 ||
+	    mp_read_uint(d, &v) != MSGPACK_OK || v != want) {
+		printf("FAIL: expected record %d\n", (int)want);
+		return 1;
+	}
+	return mp_skip(d) == MSGPACK_OK ? 0 : 1;
+}
+
+// each thread reads a contiguous range of blocks
+static void *read_range(void *arg) {
+	size_t t = (size_t)(uintptr_t)arg;
+	size_t from = rd.nblocks * t / THREADS;
+	size_t to = rd.nblocks * (t+1) / THREADS;
+	unsigned char buf[256];
+	mp_log_range_t rg;
+	mp_decoder_t d;
+	mp_log_range(&rd, from, to, &rg);
+	mp_decode_stream_init(&d, &rg, mp_log_fill, buf, sizeof(buf));
+	uint64_t n = (from < rd.nblocks) ? rd.blocks[from].first : rd.records;
+	uint64_t end = (to < rd.nblocks) ? rd.blocks[to].first : rd.records;
+	for (; n < end; ++n) {
+		if (check_record(&d, n))
+			return (void*)1;
+	}
+	return mp_skip(&d) == ERR_MSGPACK_EOF ? NULL : (void*)1;
+}
+
+int main(void) {
+	printf("Running log tests...\n");
+	static mp_log_block_t blocks[MAXBLOCKS];
+	static mp_log_block_t got[MAXBLOCKS];
+	char path[] = "/tmp/msgc-logtest-XXXXXX";
+	int fd = mkstemp(path);
+	assert(fd >= 0);
+	unlink(path);
+	unsigned char buf[256];
+	mp_log_range_t rg;
+	mp_decoder_t d;
+
+	// not a log
+	assert(write(fd, "\x93\x01\x02\x03", 4) == 4);
+	assert(mp_log_reader_init(&rd, fd, got, MAXBLOCKS) == ERR_MSGPACK_BAD_TYPE);
+
+	write_log(fd, blocks, MAXBLOCKS, 4096);
+
+	// a plain decoder sees the records and two ext objects
+	{
+		int8_t tg;
+		uint32_t sz;
+		assert(lseek(fd, 0, SEEK_SET) == 0);
+		mp_decode_stream_init(&d, &fd, fd_fill, buf, sizeof(buf));
+		for (uint64_t i=0; i<RECORDS; ++i) {
+			if (check_record(&d, i))
+				return 1;
+		}
+		char trailer[16];
+		mp_typ_t ty;
+		assert(mp_next_type(&d, &ty) == MSGPACK_OK && ty == MSG_EXT);
+		assert(mp_skip(&d) == MSGPACK_OK);
+		assert(mp_read_extsize(&d, &tg, &sz) == MSGPACK_OK && tg == MP_LOG_EXT && sz == 16);
+		for (int i=0; i<16; ++i)
+			assert(mp_read_byte(&d, (unsigned char*)&trailer[i]) == MSGPACK_OK);
+		assert(memcmp(trailer, "msgclog1", 8) == 0);
+		assert(mp_skip(&d) == ERR_MSGPACK_EOF);
+	}
+
+	assert(mp_log_reader_init(&rd, fd, got, 4) == ERR_MSGPACK_EOF);
+	assert(mp_log_reader_init(&rd, fd, got, MAXBLOCKS) == MSGPACK_OK);
+	assert(rd.records == RECORDS);
+	assert(rd.nblocks > 100 && rd.nblocks < MAXBLOCKS);
+	assert(memcmp(got, blocks, rd.nblocks * sizeof(mp_log_block_t)) == 0);
+	for (size_t i=1; i<rd.nblocks; ++i) {
+		assert(got[i].first == got[i-1].first + got[i-1].count);
+		assert(got[i].offset - got[i-1].offset >= 4096);
+	}
+
+	// seeking
+	static const uint64_t targets[] = { 0, 1, 777, 12345, RECORDS-1 };
+	for (size_t i=0; i<sizeof(targets)/sizeof(targets[0]); ++i) {
+		assert(mp_log_seek(&rd, targets[i], &rg, &d, buf, sizeof(buf)) == MSGPACK_OK);
+		if (check_record(&d, targets[i]))
+			return 1;
+	}
+	assert(mp_log_seek(&rd, RECORDS, &rg, &d, buf, sizeof(buf)) == ERR_MSGPACK_EOF);
+	assert(mp_log_find_record(&rd, got[7].first) == 7);
+	assert(mp_log_find_record(&rd, got[7].first - 1) == 6);
+	assert(mp_log_find_offset(&rd, 0) == 0);
+	assert(mp_log_find_offset(&rd, got[9].offset) == 9);
+	assert(mp_log_find_offset(&rd, got[9].offset + 1) == 9);
+	assert(mp_log_find_offset(&rd, rd.end) == rd.nblocks);
+
+	// separate threads on separate ranges
+	pthread_t th[THREADS];
+	for (int i=0; i<THREADS; ++i)
+		assert(pthread_create(&th[i], NULL, read_range, (void*)(uintptr_t)i) == 0);
+	for (int i=0; i<THREADS; ++i) {
+		void *ret;
+		pthread_join(th[i], &ret);
+		if (ret != NULL) {
+			printf("FAIL: range %d\n", i);
+			return 1;
+		}
+	}
+
+	// a full index makes the last block bigger
+	write_log(fd, blocks, 5, 4096);
+	assert(mp_log_reader_init(&rd, fd, got, MAXBLOCKS) == MSGPACK_OK);
+	assert(rd.nblocks == 5 && rd.records == RECORDS);
+	assert(got[4].first + got[4].count == RECORDS);
+	assert(mp_log_seek(&rd, RECORDS-1, &rg, &d, buf, sizeof(buf)) == MSGPACK_OK);
+	if (check_record(&d, RECORDS-1))
+		return 1;
+	assert(mp_skip(&d) == ERR_MSGPACK_EOF);
+
+	// the caller's file offset is left alone
+	assert(lseek(fd, 5, SEEK_SET) == 5);
+	assert(mp_log_reader_init(&rd, fd, got, MAXBLOCKS) == MSGPACK_OK);
+	assert(lseek(fd, 0, SEEK_CUR) == 5);
+
+	// a corrupt index is rejected
+	{
+		static const struct { int block, field; uint64_t v; } bad[] = {
+			{ 2, 0, 1 },                  // first isn't the sum of the counts
+			{ 2, 1, 0 },                  // offsets go backwards
+			{ 4, 1, UINT64_MAX },         // offset past the records
+			{ 0, 2, UINT64_MAX },         // counts overflow
+		};
+		off_t ents = lseek(fd, 0, SEEK_END) - 18 - 5*24;
+		for (size_t i=0; i<sizeof(bad)/sizeof(bad[0]); ++i) {
+			unsigned char old[8], be[8];
+			off_t at = ents + bad[i].block*24 + bad[i].field*8;
+			for (int j=0; j<8; ++j)
+				be[j] = (unsigned char)(bad[i].v >> (56 - 8*j));
+			assert(pread(fd, old, 8, at) == 8 && pwrite(fd, be, 8, at) == 8);
+			assert(mp_log_reader_init(&rd, fd, got, MAXBLOCKS) == ERR_MSGPACK_BAD_TYPE);
+			assert(pwrite(fd, old, 8, at) == 8);
+		}
+		assert(mp_log_reader_init(&rd, fd, got, MAXBLOCKS) == MSGPACK_OK);
+	}
+
+	close(fd);
+	printf("Log tests OK.\n");
+	return 0;
+}
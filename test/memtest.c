@@ -2,6 +2,8 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdarg.h>
+#include <stddef.h>
 #include "../msgpack.h"
 
 /* WARNING: GROSS MACRO NONSENSE AHEAD */
@@ -126,6 +128,128 @@
 		} \
 	}
 
+// mp_write_X(e, args) and mp_put_X(p, args) must agree, and mp_sizeof_X must match
+#define ASSERT_PUT_EQ(typ, sizeexpr, ...) \
+	{ \
+		unsigned char wbuf[64]; \
+		unsigned char *p; \
+		mp_encode_mem_init(&enc, wbuf, sizeof(wbuf)); \
+		assert(mp_write_## typ (&enc, __VA_ARGS__) == MSGPACK_OK); \
+		size_t wlen = enc.off; \
+		mp_encode_mem_init(&enc, buf, BUFSIZE); \
+		assert(mp_reserve(&enc, sizeexpr, &p) == MSGPACK_OK); \
+		mp_commit(&enc, mp_put_## typ (p, __VA_ARGS__)); \
+		if (enc.off != wlen || wlen != (sizeexpr) || memcmp(wbuf, buf, wlen) != 0) { \
+			printf("FAIL: put_%s(%s) != write_%s\n", #typ, #__VA_ARGS__, #typ); \
+			failed = true; \
+		} \
+	}
+
+// mp_decode_project target
+typedef struct {
+	int64_t     id;
+	uint64_t    ts;
+	double      load;
+	bool        up;
+	mp_strref_t host;
+} sample;
+
+static const mp_field_t sample_fields[] = {
+	{ "id", MP_FIELD_INT64, offsetof(sample, id) },
+	{ "ts", MP_FIELD_UINT64, offsetof(sample, ts) },
+	{ "load", MP_FIELD_DOUBLE, offsetof(sample, load) },
+	{ "up", MP_FIELD_BOOL, offsetof(sample, up) },
+	{ "host", MP_FIELD_STR, offsetof(sample, host) },
+};
+
+// mp_walk events, appended to a string
+typedef struct {
+	char   out[256];
+	size_t len;
+	int    stop; // returned at a 'nil'
+} walklog;
+
+static int wl_put(void *ctx, const char *fmt, ...) {
+	walklog *w = (walklog*)ctx;
+	va_list ap;
+	va_start(ap, fmt);
+	int n = vsnprintf(w->out + w->len, sizeof(w->out) - w->len, fmt, ap);
+	va_end(ap);
+	assert(n >= 0 && (size_t)n < sizeof(w->out) - w->len);
+	w->len += (size_t)n;
+	return 0;
+}
+static int wl_begin_map(void *ctx, uint32_t n) { return wl_put(ctx, "{%u ", n); }
+static int wl_end_map(void *ctx) { return wl_put(ctx, "} "); }
+static int wl_begin_array(void *ctx, uint32_t n) { return wl_put(ctx, "[%u ", n); }
+static int wl_end_array(void *ctx) { return wl_put(ctx, "] "); }
+static int wl_key(void *ctx, const char *s, uint32_t sz) { return wl_put(ctx, "k:%.*s ", (int)sz, s); }
+static int wl_str(void *ctx, const char *s, uint32_t sz) { return wl_put(ctx, "s:%.*s ", (int)sz, s); }
+static int wl_int64(void *ctx, int64_t i) { return wl_put(ctx, "i%lld ", (long long)i); }
+static int wl_f64(void *ctx, double f) { return wl_put(ctx, "f%g ", f); }
+static int wl_nil(void *ctx) { return ((walklog*)ctx)->stop; }
+static int wl_int64_run(void *ctx, const int64_t *v, size_t n) {
+	wl_put(ctx, "I(");
+	for (size_t i=0; i<n; ++i)
+		wl_put(ctx, "%lld,", (long long)v[i]);
+	return wl_put(ctx, ") ");
+}
+
+// writes one of everything (with 'big' bytes of str, bin and ext) to 'e'
+static int write_everything(mp_encoder_t *e, const char *big, uint32_t bigsz) {
+	const int64_t ints[] = { 0, -1, -33, 128, -129, 32768, -32769, 2147483648, INT64_MIN };
+	const uint64_t uints[] = { 0, 128, 256, 65536, 4294967296ULL, UINT64_MAX };
+	unsigned char *p;
+	int r = mp_write_mapsize(e, 70000);
+	r |= mp_write_arraysize(e, 20);
+	for (size_t i=0; i<sizeof(ints)/sizeof(ints[0]); ++i)
+		r |= mp_write_int(e, ints[i]);
+	for (size_t i=0; i<sizeof(uints)/sizeof(uints[0]); ++i)
+		r |= mp_write_uint(e, uints[i]);
+	r |= mp_write_double(e, 2.5);
+	r |= mp_write_float(e, 1.5f);
+	r |= mp_write_bool(e, true);
+	r |= mp_write_nil(e);
+	r |= mp_write_str(e, "hello", 5);
+	r |= mp_write_str(e, big, bigsz);
+	r |= mp_write_bin(e, big, bigsz);
+	r |= mp_write_ext(e, 3, big, bigsz);
+	r |= mp_write_extsize(e, -3, 16);
+	r |= mp_write(e, big, 16) == 16 ? MSGPACK_OK : ERR_MSGPACK_EOF;
+	r |= mp_reserve(e, mp_sizeof_mapsize(1) + mp_sizeof_str(2) + mp_sizeof_int(-40000), &p);
+	if (r != MSGPACK_OK)
+		return r;
+	p = mp_put_mapsize(p, 1);
+	p = mp_put_str(p, "id", 2);
+	mp_commit(e, mp_put_int(p, -40000));
+
+	// a template with strings shorter than their slots
+	static unsigned char tmem[256];
+	static mp_slot_t slots[3];
+	static mp_template_t t;
+	static bool built;
+	if (!built) {
+		built = true;
+		mp_template_begin(&t, tmem, sizeof(tmem), slots, 3);
+		mp_encoder_t *te = mp_template_encoder(&t);
+		r = mp_write_mapsize(te, 3);
+		r |= mp_write_str(te, "id", 2);
+		r |= mp_template_int64(&t);
+		r |= mp_write_str(te, "name", 4);
+		r |= mp_template_str(&t, 64);
+		r |= mp_write_str(te, "note", 4);
+		r |= mp_template_str(&t, 200);
+		assert(r == MSGPACK_OK);
+	}
+	mp_slot_val_t vals[3];
+	vals[0].i = -7;
+	vals[1].s.ptr = "hello";
+	vals[1].s.len = 5;
+	vals[2].s.ptr = big;
+	vals[2].s.len = (bigsz < 200) ? bigsz : 200;
+	return mp_template_emit(e, &t, vals);
+}
+
 int main() {
 	printf("Running mem tests...\n");
 	mp_encoder_t enc;
@@ -141,6 +265,8 @@ int main() {
 	assert(mp_dec_capacity(&dec) == BUFSIZE);
 
 	assert(mp_type(0) == MSG_INT);
+	assert(mp_type(0x10) == MSG_INT);
+	assert(mp_type(0x7f) == MSG_INT);
 	assert(mp_type(255) == MSG_INT);
 	assert(mp_type(0xc1) == MSG_INVALID);
 	assert(mp_type(0xd6) == MSG_EXT);
@@ -167,6 +293,10 @@ int main() {
 	ASSERT_VAL_EQ(int, int64_t, 3908);   	  // int16
 	ASSERT_VAL_EQ(int, int64_t, 16600);  	  // int32
 	ASSERT_VAL_EQ(int, int64_t, 50000000000); // int64
+	ASSERT_VAL_EQ(int, int64_t, -32);         // nfixint
+	ASSERT_VAL_EQ(int, int64_t, 40000);       // int32
+	ASSERT_VAL_EQ(int, int64_t, 3000000000);  // int64
+	ASSERT_VAL_EQ(int, int64_t, INT64_MIN);   // int64
 
 	ASSERT_VAL_EQ(uint, uint64_t, 0); 		   // zero
 	ASSERT_VAL_EQ(uint, uint64_t, 1); 		   // fixint
@@ -175,6 +305,8 @@ int main() {
 	ASSERT_VAL_EQ(uint, uint64_t, 300); 	   // uint16
 	ASSERT_VAL_EQ(uint, uint64_t, 20000);      // uint32
 	ASSERT_VAL_EQ(uint, uint64_t, 5000000000); // uint64
+	ASSERT_VAL_EQ(uint, uint64_t, 127);        // fixint
+	ASSERT_VAL_EQ(uint, uint64_t, UINT64_MAX); // uint64
 
 	ASSERT_RAW_SIZE_EQ(5);
 	ASSERT_RAW_SIZE_EQ(2048);
@@ -182,6 +314,777 @@ int main() {
 	ASSERT_STR_EQ(str, "hello, world!");
 	ASSERT_STR_EQ(bin, "hello, world!");
 
+	/* reads past the end of the buffer */
+	{
+		// these used to fail with ERR_MSGPACK_CHECK_ERRNO
+		// (and mp_read with -1), which says to look at an
+		// errno that nothing set
+		unsigned char two[] = { 0x92, 0x01 };
+		char c;
+		int64_t i;
+		uint32_t sz;
+		mp_decode_mem_init(&dec, two, sizeof(two));
+		assert(mp_read_arraysize(&dec, &sz) == MSGPACK_OK && sz == 2);
+		assert(mp_read_int(&dec, &i) == MSGPACK_OK && i == 1);
+		assert(mp_read_int(&dec, &i) == ERR_MSGPACK_EOF);
+		assert(mp_skip(&dec) == ERR_MSGPACK_EOF);
+		assert(mp_read_strsize(&dec, &sz) == ERR_MSGPACK_EOF);
+		assert(mp_read(&dec, &c, 1) == 0);
+		mp_decode_mem_init(&dec, two, 1);
+		assert(mp_skip(&dec) == ERR_MSGPACK_EOF);
+	}
+
+	/* dynamic reads */
+	{
+		mp_value_t v;
+		mp_encode_mem_init(&enc, buf, BUFSIZE);
+		assert(mp_write_nil(&enc) == MSGPACK_OK);
+		assert(mp_write_bool(&enc, true) == MSGPACK_OK);
+		assert(mp_write_int(&enc, -3) == MSGPACK_OK);
+		assert(mp_write_int(&enc, -30000) == MSGPACK_OK);
+		assert(mp_write_int(&enc, INT64_MIN) == MSGPACK_OK);
+		assert(mp_write_uint(&enc, 100) == MSGPACK_OK);
+		assert(mp_write_uint(&enc, UINT64_MAX) == MSGPACK_OK);
+		assert(mp_write_float(&enc, 1.5f) == MSGPACK_OK);
+		assert(mp_write_double(&enc, -2.25) == MSGPACK_OK);
+		assert(mp_write_mapsize(&enc, 70000) == MSGPACK_OK);
+		assert(mp_write_arraysize(&enc, 3) == MSGPACK_OK);
+		assert(mp_write_str(&enc, "hi", 2) == MSGPACK_OK);
+		assert(mp_write_binsize(&enc, 300) == MSGPACK_OK);
+		assert(mp_write_extsize(&enc, -7, 4) == MSGPACK_OK);
+		assert(mp_write_extsize(&enc, 9, 1000) == MSGPACK_OK);
+		assert(mp_write_byte(&enc, 0xc1) == MSGPACK_OK);
+		size_t n = enc.off;
+
+		mp_decode_mem_init(&dec, buf, n);
+		assert(mp_read_any(&dec, &v) == MSGPACK_OK && v.type == MSG_NIL);
+		assert(mp_read_any(&dec, &v) == MSGPACK_OK && v.type == MSG_BOOL && v.v.b);
+		assert(mp_read_any(&dec, &v) == MSGPACK_OK && v.type == MSG_INT && v.v.i == -3);
+		assert(mp_read_any(&dec, &v) == MSGPACK_OK && v.type == MSG_INT && v.v.i == -30000);
+		assert(mp_read_any(&dec, &v) == MSGPACK_OK && v.type == MSG_INT && v.v.i == INT64_MIN);
+		assert(mp_read_any(&dec, &v) == MSGPACK_OK && v.type == MSG_INT && v.v.i == 100);
+		assert(mp_read_any(&dec, &v) == MSGPACK_OK && v.type == MSG_UINT && v.v.u == UINT64_MAX);
+		assert(mp_read_any(&dec, &v) == MSGPACK_OK && v.type == MSG_F32 && v.v.f == 1.5f);
+		assert(mp_read_any(&dec, &v) == MSGPACK_OK && v.type == MSG_F64 && v.v.d == -2.25);
+		assert(mp_read_any(&dec, &v) == MSGPACK_OK && v.type == MSG_MAP && v.v.size == 70000);
+		assert(mp_read_any(&dec, &v) == MSGPACK_OK && v.type == MSG_ARRAY && v.v.size == 3);
+		assert(mp_read_any(&dec, &v) == MSGPACK_OK && v.type == MSG_STR && v.v.size == 2);
+		dec.off += 2;
+		assert(mp_read_any(&dec, &v) == MSGPACK_OK && v.type == MSG_BIN && v.v.size == 300);
+		assert(mp_read_any(&dec, &v) == MSGPACK_OK && v.type == MSG_EXT);
+		assert(v.v.ext.type == -7 && v.v.ext.size == 4);
+		assert(mp_read_any(&dec, &v) == MSGPACK_OK && v.type == MSG_EXT);
+		assert(v.v.ext.type == 9 && v.v.ext.size == 1000);
+		assert(mp_read_any(&dec, &v) == ERR_MSGPACK_BAD_TYPE && dec.off == n - 1);
+
+		// a truncated body consumes nothing
+		mp_decode_mem_init(&dec, buf + 3, 2);
+		assert(mp_read_any(&dec, &v) == ERR_MSGPACK_EOF && dec.off == 0);
+
+		mp_encode_mem_init(&enc, buf, BUFSIZE);
+		assert(mp_write_int(&enc, -40000) == MSGPACK_OK);
+		assert(mp_write_uint(&enc, 1ULL << 40) == MSGPACK_OK);
+		assert(mp_write_float(&enc, 0.5f) == MSGPACK_OK);
+		assert(mp_write_double(&enc, -12.0) == MSGPACK_OK);
+		assert(mp_write_uint(&enc, UINT64_MAX) == MSGPACK_OK);
+		assert(mp_write_double(&enc, 9223372036854775808.0) == MSGPACK_OK);
+		assert(mp_write_str(&enc, "x", 1) == MSGPACK_OK);
+		double f;
+		int64_t i;
+		mp_decode_mem_init(&dec, buf, enc.off);
+		assert(mp_read_number_as_double(&dec, &f) == MSGPACK_OK && f == -40000.0);
+		assert(mp_read_number_as_double(&dec, &f) == MSGPACK_OK && f == 1099511627776.0);
+		assert(mp_read_number_as_int64(&dec, &i) == ERR_MSGPACK_BAD_TYPE);
+		assert(mp_read_number_as_double(&dec, &f) == MSGPACK_OK && f == 0.5);
+		assert(mp_read_number_as_int64(&dec, &i) == MSGPACK_OK && i == -12);
+		assert(mp_read_number_as_int64(&dec, &i) == ERR_MSGPACK_BAD_TYPE);
+		assert(mp_read_number_as_double(&dec, &f) == MSGPACK_OK && f == 18446744073709551615.0);
+		assert(mp_read_number_as_int64(&dec, &i) == ERR_MSGPACK_BAD_TYPE);
+		assert(mp_read_number_as_double(&dec, &f) == MSGPACK_OK);
+		assert(mp_read_number_as_double(&dec, &f) == ERR_MSGPACK_BAD_TYPE);
+		assert(mp_read_number_as_int64(&dec, &i) == ERR_MSGPACK_BAD_TYPE);
+		assert(mp_skip(&dec) == MSGPACK_OK);
+	}
+
+	/* visitors */
+	{
+		mp_visitor_t vis;
+		walklog wl;
+		memset(&vis, 0, sizeof(vis));
+		vis.begin_map = wl_begin_map;
+		vis.end_map = wl_end_map;
+		vis.begin_array = wl_begin_array;
+		vis.end_array = wl_end_array;
+		vis.key = wl_key;
+		vis.str = wl_str;
+		vis.int64 = wl_int64;
+		vis.f64 = wl_f64;
+		vis.nil = wl_nil;
+
+		mp_encode_mem_init(&enc, buf, BUFSIZE);
+		assert(mp_write_mapsize(&enc, 3) == MSGPACK_OK);
+		assert(mp_write_str(&enc, "a", 1) == MSGPACK_OK);
+		assert(mp_write_arraysize(&enc, 5) == MSGPACK_OK);
+		assert(mp_write_int(&enc, 1) == MSGPACK_OK);
+		assert(mp_write_int(&enc, -2000) == MSGPACK_OK);
+		assert(mp_write_str(&enc, "x", 1) == MSGPACK_OK);
+		assert(mp_write_int(&enc, 3) == MSGPACK_OK);
+		assert(mp_write_arraysize(&enc, 0) == MSGPACK_OK);
+		assert(mp_write_str(&enc, "b", 1) == MSGPACK_OK);
+		assert(mp_write_double(&enc, 1.5) == MSGPACK_OK);
+		assert(mp_write_str(&enc, "c", 1) == MSGPACK_OK);
+		assert(mp_write_mapsize(&enc, 1) == MSGPACK_OK);
+		assert(mp_write_str(&enc, "d", 1) == MSGPACK_OK);
+		assert(mp_write_nil(&enc) == MSGPACK_OK);
+		assert(mp_write_int(&enc, 7) == MSGPACK_OK); // not part of the object
+		size_t n = enc.off;
+
+		memset(&wl, 0, sizeof(wl));
+		mp_decode_mem_init(&dec, buf, n);
+		assert(mp_walk(&dec, &vis, &wl) == MSGPACK_OK);
+		assert(strcmp(wl.out, "{3 k:a [5 i1 i-2000 s:x i3 [0 ] ] k:b f1.5 k:c {1 k:d } } ") == 0);
+		assert(dec.off == n - 1);
+
+		vis.int64_run = wl_int64_run;
+		memset(&wl, 0, sizeof(wl));
+		mp_decode_mem_init(&dec, buf, n);
+		assert(mp_walk(&dec, &vis, &wl) == MSGPACK_OK);
+		assert(strcmp(wl.out, "{3 k:a [5 I(1,-2000,) s:x I(3,) [0 ] ] k:b f1.5 k:c {1 k:d } } ") == 0);
+
+		// callbacks can stop the walk
+		memset(&wl, 0, sizeof(wl));
+		wl.stop = 99;
+		mp_decode_mem_init(&dec, buf, n);
+		assert(mp_walk(&dec, &vis, &wl) == 99);
+
+		// truncated input
+		memset(&wl, 0, sizeof(wl));
+		mp_decode_mem_init(&dec, buf, n - 3);
+		assert(mp_walk(&dec, &vis, &wl) == ERR_MSGPACK_EOF);
+
+		// nesting limit
+		vis.begin_array = NULL;
+		vis.end_array = NULL;
+		mp_encode_mem_init(&enc, buf, BUFSIZE);
+		for (int i=0; i<MP_WALK_MAX_DEPTH+1; ++i)
+			assert(mp_write_arraysize(&enc, 1) == MSGPACK_OK);
+		assert(mp_write_nil(&enc) == MSGPACK_OK);
+		mp_decode_mem_init(&dec, buf, enc.off);
+		assert(mp_walk(&dec, &vis, &wl) == ERR_MSGPACK_TOO_DEEP);
+		mp_decode_mem_init(&dec, buf + 1, enc.off - 1);
+		assert(mp_walk(&dec, &vis, &wl) == MSGPACK_OK);
+	}
+
+	/* projections */
+	{
+		mp_projection_t proj;
+		mp_intern_slot_t slots[16];
+		char strs[32];
+		sample smp;
+		uint64_t found;
+		assert(mp_projection_init(&proj, sample_fields, 5, slots, 16, strs, sizeof(strs)) == MSGPACK_OK);
+
+		mp_encode_mem_init(&enc, buf, BUFSIZE);
+		assert(mp_write_mapsize(&enc, 8) == MSGPACK_OK);
+		assert(mp_write_str(&enc, "load", 4) == MSGPACK_OK);
+		assert(mp_write_int(&enc, 3) == MSGPACK_OK);
+		assert(mp_write_str(&enc, "tags", 4) == MSGPACK_OK);
+		assert(mp_write_arraysize(&enc, 2) == MSGPACK_OK);
+		assert(mp_write_str(&enc, "a", 1) == MSGPACK_OK);
+		assert(mp_write_mapsize(&enc, 0) == MSGPACK_OK);
+		assert(mp_write_int(&enc, 5) == MSGPACK_OK); // non-string key
+		assert(mp_write_str(&enc, "five", 4) == MSGPACK_OK);
+		assert(mp_write_str(&enc, "host", 4) == MSGPACK_OK);
+		assert(mp_write_str(&enc, "db-01", 5) == MSGPACK_OK);
+		assert(mp_write_str(&enc, "a_long_unwanted_key", 19) == MSGPACK_OK);
+		assert(mp_write_double(&enc, 1.0) == MSGPACK_OK);
+		assert(mp_write_str(&enc, "id", 2) == MSGPACK_OK);
+		assert(mp_write_int(&enc, -9) == MSGPACK_OK);
+		assert(mp_write_str(&enc, "ts", 2) == MSGPACK_OK);
+		assert(mp_write_nil(&enc) == MSGPACK_OK);
+		assert(mp_write_str(&enc, "up", 2) == MSGPACK_OK);
+		assert(mp_write_bool(&enc, true) == MSGPACK_OK);
+		size_t n = enc.off;
+
+		memset(&smp, 0, sizeof(smp));
+		smp.ts = 77;
+		mp_decode_mem_init(&dec, buf, n);
+		assert(mp_decode_project(&dec, &proj, &smp, &found) == MSGPACK_OK && dec.off == n);
+		assert(found == 0x1d); // all but 'ts'
+		assert(smp.id == -9 && smp.ts == 77 && smp.load == 3.0 && smp.up);
+		assert(smp.host.sz == 5 && memcmp(smp.host.s, "db-01", 5) == 0);
+
+		// wrong value type
+		mp_encode_mem_init(&enc, buf, BUFSIZE);
+		assert(mp_write_mapsize(&enc, 1) == MSGPACK_OK);
+		assert(mp_write_str(&enc, "up", 2) == MSGPACK_OK);
+		assert(mp_write_int(&enc, 1) == MSGPACK_OK);
+		mp_decode_mem_init(&dec, buf, enc.off);
+		assert(mp_decode_project(&dec, &proj, &smp, NULL) == ERR_MSGPACK_BAD_TYPE);
+		mp_decode_mem_init(&dec, buf + 1, enc.off - 1);
+		assert(mp_decode_project(&dec, &proj, &smp, NULL) == ERR_MSGPACK_BAD_TYPE);
+
+		// duplicate keys
+		const mp_field_t dup[] = { { "x", MP_FIELD_BOOL, 0 }, { "x", MP_FIELD_BOOL, 0 } };
+		assert(mp_projection_init(&proj, dup, 2, slots, 16, strs, sizeof(strs)) == ERR_MSGPACK_BAD_TYPE);
+	}
+
+	/* filters */
+	{
+		mp_filter_t flt;
+		const unsigned char *rec;
+		size_t len;
+		size_t offs[6];
+
+		// { level, code, msg } records, plus a stray int
+		const char *levels[] = { "info", "error", "error", "warn", "error" };
+		const int64_t codes[] = { 200, 500, 503, 404, 502 };
+		const char *msgs[] = { "ok", "db: timeout", "db: refused", "missing", "upstream" };
+		mp_encode_mem_init(&enc, buf, BUFSIZE);
+		for (int i=0; i<5; ++i) {
+			offs[i] = enc.off;
+			assert(mp_write_mapsize(&enc, i == 3 ? 2 : 4) == MSGPACK_OK);
+			assert(mp_write_str(&enc, "level", 5) == MSGPACK_OK);
+			assert(mp_write_str(&enc, levels[i], (uint32_t)strlen(levels[i])) == MSGPACK_OK);
+			assert(mp_write_str(&enc, "code", 4) == MSGPACK_OK);
+			assert(mp_write_uint(&enc, (uint64_t)codes[i]) == MSGPACK_OK);
+			if (i == 3)
+				continue;
+			assert(mp_write_str(&enc, "msg", 3) == MSGPACK_OK);
+			assert(mp_write_str(&enc, msgs[i], (uint32_t)strlen(msgs[i])) == MSGPACK_OK);
+			assert(mp_write_str(&enc, "lat", 3) == MSGPACK_OK);
+			assert(mp_write_double(&enc, 0.5 * i) == MSGPACK_OK);
+		}
+		offs[5] = enc.off;
+		assert(mp_write_int(&enc, 1) == MSGPACK_OK);
+		size_t n = enc.off;
+
+		mp_filter_init(&flt);
+		assert(mp_filter_str_eq(&flt, "level", "error", 5) == MSGPACK_OK);
+		assert(mp_filter_str_prefix(&flt, "msg", "db: ", 4) == MSGPACK_OK);
+		mp_decode_mem_init(&dec, buf, n);
+		assert(mp_filter_next(&flt, &dec, &rec, &len) == MSGPACK_OK);
+		assert(rec == buf + offs[1] && len == offs[2] - offs[1]);
+		assert(mp_filter_next(&flt, &dec, &rec, &len) == MSGPACK_OK);
+		assert(rec == buf + offs[2] && len == offs[3] - offs[2]);
+		assert(mp_filter_next(&flt, &dec, &rec, &len) == ERR_MSGPACK_EOF && dec.off == n);
+
+		mp_filter_init(&flt);
+		assert(mp_filter_int_range(&flt, "code", 500, 502) == MSGPACK_OK);
+		assert(mp_filter_double_range(&flt, "lat", 1.5, 10) == MSGPACK_OK);
+		mp_decode_mem_init(&dec, buf, n);
+		assert(mp_filter_next(&flt, &dec, &rec, &len) == MSGPACK_OK && rec == buf + offs[4]);
+		assert(mp_filter_next(&flt, &dec, &rec, &len) == ERR_MSGPACK_EOF);
+
+		mp_filter_init(&flt);
+		assert(mp_filter_int_eq(&flt, "code", 404) == MSGPACK_OK);
+		mp_decode_mem_init(&dec, buf, n);
+		assert(mp_filter_next(&flt, &dec, &rec, &len) == MSGPACK_OK && rec == buf + offs[3]);
+
+		// records without the field don't match
+		mp_filter_init(&flt);
+		assert(mp_filter_exists(&flt, "msg") == MSGPACK_OK);
+		mp_decode_mem_init(&dec, buf + offs[3], offs[4] - offs[3]);
+		assert(mp_filter_next(&flt, &dec, &rec, &len) == ERR_MSGPACK_EOF);
+
+		// an empty filter matches every map
+		mp_filter_init(&flt);
+		mp_decode_mem_init(&dec, buf, n);
+		for (int i=0; i<5; ++i)
+			assert(mp_filter_next(&flt, &dec, &rec, &len) == MSGPACK_OK && rec == buf + offs[i]);
+		assert(mp_filter_next(&flt, &dec, &rec, &len) == ERR_MSGPACK_EOF);
+
+		// truncated records are errors
+		mp_decode_mem_init(&dec, buf, offs[1] - 1);
+		assert(mp_filter_next(&flt, &dec, &rec, &len) == ERR_MSGPACK_EOF && dec.off == 0);
+
+		mp_filter_init(&flt);
+		for (int i=0; i<MP_FILTER_MAX; ++i)
+			assert(mp_filter_exists(&flt, "x") == MSGPACK_OK);
+		assert(mp_filter_exists(&flt, "x") == ERR_MSGPACK_EOF);
+	}
+
+	/* aggregation */
+	{
+		mp_agg_t agg;
+		double sum = 0;
+		mp_encode_mem_init(&enc, buf, BUFSIZE);
+		assert(mp_write_arraysize(&enc, 200) == MSGPACK_OK);
+		for (int i=0; i<200; ++i) {
+			int64_t v;
+			if (i < 70)
+				v = (i * 37) % 160 - 32; // fixints
+			else if (i < 100)
+				v = 100000 * (i - 85); // int32
+			else if (i == 150)
+				v = 300; // int16
+			else if (i == 151)
+				v = -1; // nfixint
+			else
+				v = i;
+			if (i >= 100 && i < 150 && i != 120) {
+				assert(mp_write_double(&enc, (double)v) == MSGPACK_OK);
+			} else if (i == 120) {
+				assert(mp_write_float(&enc, 120.0f) == MSGPACK_OK);
+			} else if (i >= 152 && i < 160) {
+				assert(mp_write_nil(&enc) == MSGPACK_OK);
+				continue;
+			} else {
+				assert(mp_write_int(&enc, v) == MSGPACK_OK);
+			}
+			sum += (double)v;
+		}
+		size_t n = enc.off;
+		assert(mp_write_str(&enc, "x", 1) == MSGPACK_OK);
+		mp_agg_init(&agg);
+		mp_decode_mem_init(&dec, buf, enc.off);
+		assert(mp_array_agg(&dec, &agg) == MSGPACK_OK && dec.off == n);
+		assert(agg.count == 192 && agg.sum == sum);
+		assert(agg.min == -1500000 && agg.max == 1400000);
+
+		// carried across calls
+		mp_decode_mem_init(&dec, buf, n);
+		assert(mp_array_agg(&dec, &agg) == MSGPACK_OK);
+		assert(agg.count == 384 && agg.sum == 2*sum);
+
+		mp_encode_mem_init(&enc, buf, BUFSIZE);
+		assert(mp_write_arraysize(&enc, 2) == MSGPACK_OK);
+		assert(mp_write_int(&enc, 1) == MSGPACK_OK);
+		assert(mp_write_str(&enc, "x", 1) == MSGPACK_OK);
+		mp_decode_mem_init(&dec, buf, enc.off);
+		assert(mp_array_agg(&dec, &agg) == ERR_MSGPACK_BAD_TYPE);
+
+		// one field across an array of maps
+		mp_encode_mem_init(&enc, buf, BUFSIZE);
+		assert(mp_write_arraysize(&enc, 4) == MSGPACK_OK);
+		for (int i=0; i<4; ++i) {
+			assert(mp_write_mapsize(&enc, i == 2 ? 1 : 2) == MSGPACK_OK);
+			assert(mp_write_str(&enc, "host", 4) == MSGPACK_OK);
+			assert(mp_write_str(&enc, "db-01", 5) == MSGPACK_OK);
+			if (i == 2)
+				continue;
+			assert(mp_write_str(&enc, "load", 4) == MSGPACK_OK);
+			assert(mp_write_double(&enc, 0.25 * i) == MSGPACK_OK);
+		}
+		mp_agg_init(&agg);
+		mp_decode_mem_init(&dec, buf, enc.off);
+		assert(mp_array_agg_field(&dec, "load", &agg) == MSGPACK_OK && dec.off == enc.off);
+		assert(agg.count == 3 && agg.sum == 1.0 && agg.min == 0 && agg.max == 0.75);
+		mp_decode_mem_init(&dec, buf, enc.off);
+		assert(mp_array_agg_field(&dec, "host", &agg) == ERR_MSGPACK_BAD_TYPE);
+	}
+
+	/* unchecked writes */
+	{
+		const int64_t ints[] = { 0, -1, -32, -33, 127, 128, -128, -129, 32767, 32768, 
+			-32768, -32769, 2147483647, 2147483648, -2147483648LL, -2147483649LL, INT64_MAX, INT64_MIN };
+		const uint64_t uints[] = { 0, 127, 128, 255, 256, 65535, 65536, 4294967295ULL, 4294967296ULL, UINT64_MAX };
+		const uint32_t sizes[] = { 0, 1, 2, 4, 8, 15, 16, 17, 31, 32, 255, 256, 65535, 65536 };
+		for (size_t i=0; i<sizeof(ints)/sizeof(ints[0]); ++i)
+			ASSERT_PUT_EQ(int, mp_sizeof_int(ints[i]), ints[i]);
+		for (size_t i=0; i<sizeof(uints)/sizeof(uints[0]); ++i)
+			ASSERT_PUT_EQ(uint, mp_sizeof_uint(uints[i]), uints[i]);
+		for (size_t i=0; i<sizeof(sizes)/sizeof(sizes[0]); ++i) {
+			ASSERT_PUT_EQ(mapsize, mp_sizeof_mapsize(sizes[i]), sizes[i]);
+			ASSERT_PUT_EQ(arraysize, mp_sizeof_arraysize(sizes[i]), sizes[i]);
+			ASSERT_PUT_EQ(strsize, mp_sizeof_strsize(sizes[i]), sizes[i]);
+			ASSERT_PUT_EQ(binsize, mp_sizeof_binsize(sizes[i]), sizes[i]);
+			ASSERT_PUT_EQ(extsize, mp_sizeof_extsize(sizes[i]), 7, sizes[i]);
+		}
+		unsigned char *p;
+		mp_encode_mem_init(&enc, buf, BUFSIZE);
+		assert(mp_reserve(&enc, mp_sizeof_nil(), &p) == MSGPACK_OK);
+		mp_commit(&enc, mp_put_nil(p));
+		assert(enc.off == 1 && buf[0] == 0xc0);
+		ASSERT_PUT_EQ(bool, mp_sizeof_bool(), true);
+		ASSERT_PUT_EQ(float, mp_sizeof_float(), 1.5f);
+		ASSERT_PUT_EQ(double, mp_sizeof_double(), 2.5);
+		ASSERT_PUT_EQ(str, mp_sizeof_str(5), "hello", 5);
+		ASSERT_PUT_EQ(bin, mp_sizeof_bin(5), "hello", 5);
+		ASSERT_PUT_EQ(ext, mp_sizeof_ext(5), 3, "hello", 5);
+
+		// mem-mode writes that don't fit fail instead of overrunning
+		unsigned char small[9];
+		mp_encode_mem_init(&enc, small, 5);
+		assert(mp_write_double(&enc, 1.0) == ERR_MSGPACK_EOF);
+		assert(mp_write_float(&enc, 1.0f) == MSGPACK_OK);
+		assert(mp_write_nil(&enc) == ERR_MSGPACK_EOF);
+		assert(mp_reserve(&enc, 1, &p) == ERR_MSGPACK_EOF);
+		mp_encode_mem_init(&enc, small, 5);
+		assert(mp_write_str(&enc, "hello", 5) == ERR_MSGPACK_EOF);
+
+		// ints near the end of the buffer take the exact path;
+		// it must agree with the wide-store path
+		for (int sh=0; sh<64; ++sh) {
+			for (int d=-1; d<=1; ++d) {
+				uint64_t u = ((uint64_t)1 << sh) + (uint64_t)d;
+				int64_t v[2] = { (int64_t)u, (int64_t)(0 - u) };
+				mp_encode_mem_init(&enc, buf, BUFSIZE);
+				assert(mp_write_uint(&enc, u) == MSGPACK_OK && enc.off == mp_sizeof_uint(u));
+				mp_encode_mem_init(&enc, small, mp_sizeof_uint(u));
+				assert(mp_write_uint(&enc, u) == MSGPACK_OK);
+				assert(memcmp(buf, small, enc.off) == 0);
+				for (int k=0; k<2; ++k) {
+					mp_encode_mem_init(&enc, buf, BUFSIZE);
+					assert(mp_write_int(&enc, v[k]) == MSGPACK_OK && enc.off == mp_sizeof_int(v[k]));
+					mp_encode_mem_init(&enc, small, mp_sizeof_int(v[k]));
+					assert(mp_write_int(&enc, v[k]) == MSGPACK_OK);
+					assert(memcmp(buf, small, enc.off) == 0);
+				}
+			}
+		}
+	}
+
+	/* runs of values */
+	{
+		static int64_t ints[1000];
+		static uint64_t uints[1000];
+		static double doubles[1000];
+		static bool bools[1000];
+		static unsigned char want[BUFSIZE * 8];
+		for (size_t i=0; i<1000; ++i) {
+			ints[i] = (int64_t)(i * 2654435761u) >> (i % 40);
+			uints[i] = (uint64_t)i << (i % 50);
+			doubles[i] = (double)i * 0.5;
+			bools[i] = (i % 3) == 0;
+		}
+		mp_encoder_t w;
+		mp_encode_mem_init(&w, want, sizeof(want));
+		for (size_t i=0; i<1000; i+=500) {
+			for (size_t j=i; j<i+500; ++j)
+				assert(mp_write_int(&w, ints[j]) == MSGPACK_OK);
+			for (size_t j=i; j<i+500; ++j)
+				assert(mp_write_uint(&w, uints[j]) == MSGPACK_OK);
+			for (size_t j=i; j<i+500; ++j)
+				assert(mp_write_double(&w, doubles[j]) == MSGPACK_OK);
+			for (size_t j=i; j<i+500; ++j)
+				assert(mp_write_bool(&w, bools[j]) == MSGPACK_OK);
+		}
+		static unsigned char got[BUFSIZE * 8];
+		// 500 values take more than one run
+		mp_encode_mem_init(&enc, got, sizeof(got));
+		for (size_t i=0; i<1000; i+=500) {
+			assert(mp_write_ints(&enc, ints + i, 500) == MSGPACK_OK);
+			assert(mp_write_uints(&enc, uints + i, 500) == MSGPACK_OK);
+			assert(mp_write_doubles(&enc, doubles + i, 500) == MSGPACK_OK);
+			assert(mp_write_bools(&enc, bools + i, 500) == MSGPACK_OK);
+		}
+		assert(enc.off == w.off && memcmp(got, want, w.off) == 0);
+
+		// values that fit no buffer at all
+		unsigned char tiny[8];
+		const int64_t wide = (int64_t)1 << 40;
+		const uint64_t uwide = (uint64_t)1 << 40;
+		const double d = 1.5;
+		mp_encode_mem_init(&enc, tiny, 6);
+		assert(mp_write_ints(&enc, &wide, 1) == ERR_MSGPACK_EOF);
+		assert(mp_write_uints(&enc, &uwide, 1) == ERR_MSGPACK_EOF);
+		assert(mp_write_doubles(&enc, &d, 1) == ERR_MSGPACK_EOF);
+		assert(mp_write_bools(&enc, bools, 6) == MSGPACK_OK);
+		assert(mp_write_bools(&enc, bools, 1) == ERR_MSGPACK_EOF);
+		mp_encode_mem_init(&enc, tiny, 6);
+		assert(mp_write_int_array(&enc, &wide, 1) == ERR_MSGPACK_EOF);
+	}
+
+	/* counting encoders */
+	{
+		static char big[1000];
+		unsigned char scratch[64];
+		const uint32_t bigs[] = { 0, 17, 63, 64, 65, 1000 };
+		memset(big, 'x', sizeof(big));
+		for (size_t i=0; i<sizeof(bigs)/sizeof(bigs[0]); ++i) {
+			mp_encode_mem_init(&enc, buf, BUFSIZE);
+			assert(write_everything(&enc, big, bigs[i]) == MSGPACK_OK);
+			size_t want = enc.off;
+			const size_t caps[] = { 18, 19, 64 };
+			for (size_t c=0; c<sizeof(caps)/sizeof(caps[0]); ++c) {
+				memset(scratch, 0, sizeof(scratch));
+				mp_encode_count_init(&enc, scratch, caps[c]);
+				assert(write_everything(&enc, big, bigs[i]) == MSGPACK_OK);
+				if (mp_enc_count(&enc) != want) {
+					printf("FAIL: counted %d bytes for %d, not %d\n", (int)mp_enc_count(&enc), (int)bigs[i], (int)want);
+					failed = true;
+				}
+				assert(mp_flush(&enc) == MSGPACK_OK && mp_enc_count(&enc) == want);
+			}
+			// the count is exactly enough room
+			mp_encode_mem_init(&enc, buf, want);
+			assert(write_everything(&enc, big, bigs[i]) == MSGPACK_OK && enc.off == want);
+			mp_encode_mem_init(&enc, buf, want - 1);
+			assert(write_everything(&enc, big, bigs[i]) == ERR_MSGPACK_EOF);
+		}
+		// reservations still have to fit in the scratch space
+		unsigned char *p;
+		mp_encode_count_init(&enc, scratch, sizeof(scratch));
+		assert(mp_reserve(&enc, sizeof(scratch) + 1, &p) == ERR_MSGPACK_EOF);
+		assert(mp_enc_count(&enc) == 0);
+	}
+
+	/* unchecked reads */
+	{
+		const unsigned char *p;
+		uint32_t sz;
+		int64_t i;
+		uint64_t u;
+		double f;
+		float g;
+		bool b;
+		int8_t tg;
+		const char *c;
+		mp_encode_mem_init(&enc, buf, BUFSIZE);
+		assert(mp_write_arraysize(&enc, 20) == MSGPACK_OK);
+		assert(mp_write_int(&enc, -40000) == MSGPACK_OK);
+		assert(mp_write_uint(&enc, 5000000000) == MSGPACK_OK);
+		assert(mp_write_double(&enc, 2.5) == MSGPACK_OK);
+		assert(mp_write_float(&enc, 1.5f) == MSGPACK_OK);
+		assert(mp_write_bool(&enc, true) == MSGPACK_OK);
+		assert(mp_write_nil(&enc) == MSGPACK_OK);
+		assert(mp_write_mapsize(&enc, 70000) == MSGPACK_OK);
+		assert(mp_write_str(&enc, "hello", 5) == MSGPACK_OK);
+		assert(mp_write_bin(&enc, "world", 5) == MSGPACK_OK);
+		assert(mp_write_extsize(&enc, -3, 300) == MSGPACK_OK);
+		size_t total = enc.off;
+
+		mp_decode_mem_init(&dec, buf, total);
+		assert(mp_ensure(&dec, total + 1, &p) == ERR_MSGPACK_EOF);
+		assert(mp_ensure(&dec, total, &p) == MSGPACK_OK);
+		assert(mp_get_mapsize(p, &sz) == NULL);
+		assert((p = mp_get_arraysize(p, &sz)) != NULL && sz == 20);
+		assert(mp_get_uint(p, &u) == NULL);
+		assert((p = mp_get_int(p, &i)) != NULL && i == -40000);
+		assert(mp_get_int(p, &i) == NULL);
+		assert((p = mp_get_uint(p, &u)) != NULL && u == 5000000000);
+		assert((p = mp_get_double(p, &f)) != NULL && f == 2.5);
+		assert((p = mp_get_float(p, &g)) != NULL && g == 1.5f);
+		assert((p = mp_get_bool(p, &b)) != NULL && b);
+		assert((p = mp_get_nil(p)) != NULL);
+		assert((p = mp_get_mapsize(p, &sz)) != NULL && sz == 70000);
+		assert((p = mp_get_str(p, &c, &sz)) != NULL && sz == 5 && memcmp(c, "hello", 5) == 0);
+		assert((p = mp_get_bin(p, &c, &sz)) != NULL && sz == 5 && memcmp(c, "world", 5) == 0);
+		assert((p = mp_get_extsize(p, &tg, &sz)) != NULL && tg == -3 && sz == 300);
+		mp_consume(&dec, p);
+		assert(mp_dec_buffered(&dec) == 0);
+	}
+
+	/* cursors */
+	{
+		mp_cursor_t cur;
+		mp_typ_t ty;
+		uint32_t sz;
+		int64_t i;
+		uint64_t u;
+		double f;
+		bool b;
+		int8_t tg;
+		const char *c;
+		mp_encode_mem_init(&enc, buf, BUFSIZE);
+		assert(mp_write_mapsize(&enc, 2) == MSGPACK_OK);
+		assert(mp_write_str(&enc, "nested", 6) == MSGPACK_OK);
+		assert(mp_write_arraysize(&enc, 3) == MSGPACK_OK);
+		assert(mp_write_int(&enc, -7) == MSGPACK_OK);
+		assert(mp_write_ext(&enc, 9, "abcd", 4) == MSGPACK_OK);
+		assert(mp_write_mapsize(&enc, 1) == MSGPACK_OK);
+		assert(mp_write_nil(&enc) == MSGPACK_OK);
+		assert(mp_write_bin(&enc, "xyz", 3) == MSGPACK_OK);
+		assert(mp_write_str(&enc, "flag", 4) == MSGPACK_OK);
+		assert(mp_write_bool(&enc, true) == MSGPACK_OK);
+		size_t first = enc.off;
+		assert(mp_write_uint(&enc, 5000000000) == MSGPACK_OK);
+		assert(mp_write_double(&enc, 0.5) == MSGPACK_OK);
+		assert(mp_write_int(&enc, 2) == MSGPACK_OK);
+
+		mp_cursor_init(&cur, buf, enc.off);
+		assert(mp_cursor_skip(&cur) == MSGPACK_OK);
+		assert(mp_cursor_remaining(&cur) == enc.off - first);
+		assert(mp_cursor_next_type(&cur, &ty) == MSGPACK_OK && ty == MSG_UINT);
+		assert(mp_cursor_read_int(&cur, &i) == ERR_MSGPACK_BAD_TYPE);
+		assert(mp_cursor_read_uint(&cur, &u) == MSGPACK_OK && u == 5000000000);
+		assert(mp_cursor_read_double(&cur, &f) == MSGPACK_OK && f == 0.5);
+		assert(mp_cursor_read_int(&cur, &i) == MSGPACK_OK && i == 2);
+		assert(mp_cursor_read_nil(&cur) == ERR_MSGPACK_EOF);
+		assert(mp_cursor_skip(&cur) == ERR_MSGPACK_EOF);
+
+		mp_cursor_init(&cur, buf, first);
+		assert(mp_cursor_read_mapsize(&cur, &sz) == MSGPACK_OK && sz == 2);
+		assert(mp_cursor_read_str(&cur, &c, &sz) == MSGPACK_OK && sz == 6 && memcmp(c, "nested", 6) == 0);
+		assert(mp_cursor_read_arraysize(&cur, &sz) == MSGPACK_OK && sz == 3);
+		assert(mp_cursor_read_int(&cur, &i) == MSGPACK_OK && i == -7);
+		assert(mp_cursor_read_ext(&cur, &tg, &c, &sz) == MSGPACK_OK && tg == 9 && sz == 4);
+		assert(mp_cursor_skip(&cur) == MSGPACK_OK);
+		assert(mp_cursor_read_strsize(&cur, &sz) == MSGPACK_OK && sz == 4);
+		assert(mp_cursor_read_raw(&cur, &c, sz) == MSGPACK_OK && memcmp(c, "flag", 4) == 0);
+		assert(mp_cursor_read_bool(&cur, &b) == MSGPACK_OK && b);
+		assert(mp_cursor_remaining(&cur) == 0);
+
+		// truncated objects leave the cursor where it was
+		mp_cursor_init(&cur, buf + first, 8);
+		assert(mp_cursor_read_uint(&cur, &u) == ERR_MSGPACK_EOF);
+		assert(mp_cursor_skip(&cur) == ERR_MSGPACK_EOF);
+		assert(mp_cursor_remaining(&cur) == 8);
+		mp_cursor_init(&cur, buf, first - 1);
+		assert(mp_cursor_skip(&cur) == ERR_MSGPACK_EOF);
+		mp_cursor_init(&cur, buf + 1, 5);
+		assert(mp_cursor_read_str(&cur, &c, &sz) == ERR_MSGPACK_EOF);
+		assert(mp_cursor_remaining(&cur) == 5);
+	}
+
+	/* padded buffers */
+	{
+		unsigned char *pad = malloc(64 + MP_PADDING);
+		uint32_t sz;
+		int64_t i;
+		uint64_t u;
+		double f;
+		bool b;
+		const char *c;
+		assert(pad);
+		memset(pad, 0xcf, 64 + MP_PADDING); // padding that looks like a uint64
+		mp_encode_mem_init(&enc, pad, 64);
+		assert(mp_write_arraysize(&enc, 5) == MSGPACK_OK);
+		assert(mp_write_int(&enc, -300) == MSGPACK_OK);
+		assert(mp_write_str(&enc, "padded", 6) == MSGPACK_OK);
+		assert(mp_write_double(&enc, 0.25) == MSGPACK_OK);
+		assert(mp_write_bool(&enc, false) == MSGPACK_OK);
+		assert(mp_write_uint(&enc, 4000000000) == MSGPACK_OK);
+		size_t len = enc.off;
+
+		mp_decode_mem_init_padded(&dec, pad, len);
+		assert(mp_skip_padded(&dec) == MSGPACK_OK && dec.off == len);
+		mp_decode_mem_init_padded(&dec, pad, len);
+		assert(mp_read_mapsize_padded(&dec, &sz) == ERR_MSGPACK_BAD_TYPE);
+		assert(mp_read_arraysize_padded(&dec, &sz) == MSGPACK_OK && sz == 5);
+		assert(mp_read_int_padded(&dec, &i) == MSGPACK_OK && i == -300);
+		assert(mp_read_str_padded(&dec, &c, &sz) == MSGPACK_OK && sz == 6 && memcmp(c, "padded", 6) == 0);
+		assert(mp_read_double_padded(&dec, &f) == MSGPACK_OK && f == 0.25);
+		assert(mp_read_bool_padded(&dec, &b) == MSGPACK_OK && !b);
+		assert(mp_read_uint_padded(&dec, &u) == MSGPACK_OK && u == 4000000000);
+		assert(mp_read_uint_padded(&dec, &u) == ERR_MSGPACK_EOF);
+		assert(mp_read_nil_padded(&dec) == ERR_MSGPACK_EOF);
+
+		// truncated: the uint32 runs into the padding
+		mp_decode_mem_init_padded(&dec, pad, len - 1);
+		dec.off = len - 5;
+		assert(mp_read_uint_padded(&dec, &u) == ERR_MSGPACK_EOF && dec.off == len - 5);
+		mp_decode_mem_init_padded(&dec, pad, len - 1);
+		assert(mp_skip_padded(&dec) == ERR_MSGPACK_EOF);
+		// truncated string payload
+		mp_decode_mem_init_padded(&dec, pad + 4, 4);
+		assert(mp_read_str_padded(&dec, &c, &sz) == ERR_MSGPACK_EOF && dec.off == 0);
+		free(pad);
+	}
+
+	/* pre-encoded keys */
+	{
+		static const mp_key_t key = MP_KEY("field_label_one");
+		static const mp_key_t empty = MP_KEY("");
+		unsigned char want[32];
+		mp_encoder_t ref;
+		mp_encode_mem_init(&ref, want, sizeof(want));
+		assert(mp_write_str(&ref, "field_label_one", 15) == MSGPACK_OK);
+		mp_encode_mem_init(&enc, buf, BUFSIZE);
+		assert(mp_write_key(&enc, &key) == MSGPACK_OK);
+		assert(mp_write_key(&enc, &empty) == MSGPACK_OK);
+		assert(enc.off == ref.off + 1);
+		assert(memcmp(buf, want, ref.off) == 0);
+		assert(buf[ref.off] == 0xa0);
+
+		// too close to the end of the buffer for the fixed-size copy
+		mp_encode_mem_init(&enc, buf, 17);
+		assert(mp_write_key(&enc, &key) == MSGPACK_OK);
+		assert(memcmp(buf, want, ref.off) == 0);
+		assert(mp_write_key(&enc, &empty) == MSGPACK_OK);
+		assert(mp_write_key(&enc, &empty) == ERR_MSGPACK_EOF);
+	}
+
+	/* templates */
+	{
+		mp_template_t tpl;
+		mp_slot_t slots[4];
+		unsigned char skel[128];
+		mp_slot_val_t vals[4];
+		mp_template_begin(&tpl, skel, sizeof(skel), slots, 4);
+		mp_encoder_t *te = mp_template_encoder(&tpl);
+		assert(mp_write_mapsize(te, 4) == MSGPACK_OK);
+		assert(mp_write_str(te, "i", 1) == MSGPACK_OK);
+		assert(mp_template_int64(&tpl) == MSGPACK_OK);
+		assert(mp_write_str(te, "s", 1) == MSGPACK_OK);
+		assert(mp_template_str(&tpl, 300) == MSGPACK_OK);
+		assert(mp_write_str(te, "f", 1) == MSGPACK_OK);
+		assert(mp_template_double(&tpl) == MSGPACK_OK);
+		assert(mp_write_str(te, "u", 1) == MSGPACK_OK);
+		assert(mp_template_uint32(&tpl) == MSGPACK_OK);
+		assert(mp_template_uint64(&tpl) == ERR_MSGPACK_EOF);
+
+		mp_encode_mem_init(&enc, buf, BUFSIZE);
+		for (int i=0; i<2; ++i) {
+			vals[0].i = -5000000000 + i;
+			vals[1].s.ptr = "hello, world!";
+			vals[1].s.len = (uint32_t)(5 + i);
+			vals[2].f = 3.25 * i;
+			vals[3].u = 70000 + (uint64_t)i;
+			assert(mp_template_emit(&enc, &tpl, vals) == MSGPACK_OK);
+		}
+		vals[3].u = (uint64_t)UINT32_MAX + 1;
+		assert(mp_template_emit(&enc, &tpl, vals) == ERR_MSGPACK_EOF);
+
+		mp_decode_mem_init(&dec, buf, enc.off);
+		for (int i=0; i<2; ++i) {
+			uint32_t sz;
+			int64_t iv;
+			double fv;
+			uint64_t uv;
+			char str[16];
+			assert(mp_read_mapsize(&dec, &sz) == MSGPACK_OK && sz == 4);
+			assert(mp_skip(&dec) == MSGPACK_OK);
+			assert(mp_read_int(&dec, &iv) == MSGPACK_OK && iv == -5000000000 + i);
+			assert(mp_skip(&dec) == MSGPACK_OK);
+			assert(mp_read_strsize(&dec, &sz) == MSGPACK_OK && sz == (uint32_t)(5 + i));
+			assert(mp_read(&dec, str, sz) == (ssize_t)sz && memcmp(str, "hello, world!", sz) == 0);
+			assert(mp_skip(&dec) == MSGPACK_OK);
+			assert(mp_read_double(&dec, &fv) == MSGPACK_OK && fv == 3.25 * i);
+			assert(mp_skip(&dec) == MSGPACK_OK);
+			assert(mp_read_uint(&dec, &uv) == MSGPACK_OK && uv == 70000 + (uint64_t)i);
+		}
+		assert(mp_dec_buffered(&dec) == 0);
+	}
+
+	/* key interning */
+	{
+		mp_intern_t tbl;
+		mp_intern_slot_t slots[8];
+		char strs[64];
+		uint32_t id;
+		mp_intern_init(&tbl, slots, 8, strs, sizeof(strs));
+		assert(mp_intern_add(&tbl, "alpha", 5, &id) == MSGPACK_OK && id == 0);
+		assert(mp_intern_add(&tbl, "beta", 4, &id) == MSGPACK_OK && id == 1);
+		assert(mp_intern_add(&tbl, "alpha", 5, &id) == MSGPACK_OK && id == 0);
+
+		mp_encode_mem_init(&enc, buf, BUFSIZE);
+		assert(mp_write_str(&enc, "beta", 4) == MSGPACK_OK);
+		assert(mp_write_str(&enc, "gamma", 5) == MSGPACK_OK);
+		assert(mp_write_str(&enc, "gamma", 5) == MSGPACK_OK);
+		assert(mp_write_str(&enc, "delta", 5) == MSGPACK_OK);
+		assert(mp_write_int(&enc, 3) == MSGPACK_OK);
+		mp_decode_mem_init(&dec, buf, enc.off);
+		assert(mp_read_key_id(&dec, &tbl, &id) == MSGPACK_OK && id == 1);
+		assert(mp_read_key_id(&dec, &tbl, &id) == MSGPACK_OK && id == 2);
+		assert(mp_read_key_id(&dec, &tbl, &id) == MSGPACK_OK && id == 2);
+		mp_intern_freeze(&tbl);
+		assert(mp_read_key_id(&dec, &tbl, &id) == MSGPACK_OK && id == MP_KEY_UNKNOWN);
+		assert(mp_read_key_id(&dec, &tbl, &id) == ERR_MSGPACK_BAD_TYPE);
+		assert(mp_intern_count(&tbl) == 3);
+		assert(mp_intern_find(&tbl, "gamma", 5) == 2);
+		assert(mp_intern_find(&tbl, "delta", 5) == MP_KEY_UNKNOWN);
+
+		// at most nslots/2 keys
+		mp_intern_init(&tbl, slots, 8, strs, sizeof(strs));
+		assert(mp_intern_add(&tbl, "a", 1, &id) == MSGPACK_OK);
+		assert(mp_intern_add(&tbl, "b", 1, &id) == MSGPACK_OK);
+		assert(mp_intern_add(&tbl, "c", 1, &id) == MSGPACK_OK);
+		assert(mp_intern_add(&tbl, "d", 1, &id) == MSGPACK_OK);
+		assert(mp_intern_add(&tbl, "e", 1, &id) == ERR_MSGPACK_EOF);
+	}
+
 	if (failed) {
 		printf("WARNING: Tests failed!\n");
 		return 1;
@@ -0,0 +1,175 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include "../msgpack_mpsc.h"
+
+#define PRODUCERS 4
+#define RECORDS 20000
+#define NSLOTS 8
+#define SLOTSIZE 256
+
+static mp_mpsc_t q;
+static atomic_int running;
+
+typedef struct {
+	uint64_t id;
+	uint64_t seq;
+} rec_t;
+
+static int encode_rec(mp_encoder_t *e, void *arg) {
+	rec_t *r = (rec_t*)arg;
+	int err = mp_write_arraysize(e, 2);
+	if (err) return err;
+	err = mp_write_uint(e, r->id);
+	if (err) return err;
+	return mp_write_uint(e, r->seq);
+}
+
+static int encode_big(mp_encoder_t *e, void *arg) {
+	(void)arg;
+	static const char big[SLOTSIZE] = { 0 };
+	return mp_write_bin(e, big, sizeof(big));
+}
+
+static void *producer(void *arg) {
+	mp_mpsc_producer_t p;
+	rec_t r;
+	mp_mpsc_producer_init(&p);
+	r.id = (uint64_t)(uintptr_t)arg;
+	for (r.seq=0; r.seq<RECORDS; ++r.seq) {
+		int err;
+		// the ring is small, so it is often full
+		while ((err = mp_mpsc_write(&q, &p, encode_rec, &r)) == ERR_MSGPACK_EOF) {
+			mp_mpsc_publish(&q, &p);
+			sched_yield();
+		}
+		assert(err == MSGPACK_OK);
+		if (r.seq % 100 == 99)
+			mp_mpsc_publish(&q, &p);
+	}
+	mp_mpsc_publish(&q, &p);
+	atomic_fetch_sub(&running, 1);
+	return NULL;
+}
+
+static ssize_t fd_fill(void *ctx, void *buf, size_t max) {
+	return read(*(int*)ctx, buf, max);
+}
+
+int main(void) {
+	printf("Running mpsc tests...\n");
+	static mp_mpsc_slot_t slots[NSLOTS];
+	static unsigned char mem[NSLOTS*SLOTSIZE];
+	char path[] = "/tmp/msgc-mpsctest-XXXXXX";
+	int fd = mkstemp(path);
+	assert(fd >= 0);
+	unlink(path);
+
+	// a record bigger than a slot is refused
+	{
+		mp_mpsc_producer_t p;
+		rec_t r = { 0, 0 };
+		mp_mpsc_init(&q, slots, NSLOTS, mem, SLOTSIZE);
+		mp_mpsc_producer_init(&p);
+		assert(mp_mpsc_write(&q, &p, encode_rec, &r) == MSGPACK_OK);
+		size_t one = mp_enc_buffered(&p.enc);
+		assert(mp_mpsc_write(&q, &p, encode_big, NULL) == ERR_MSGPACK_EOF);
+		mp_mpsc_publish(&q, &p);
+		assert(mp_mpsc_drain(&q, fd) == (ssize_t)one);
+		assert(mp_mpsc_drain(&q, fd) == 0);
+		for (int i=0; i<NSLOTS; ++i)
+			assert(mp_mpsc_claim(&q, &p) == MSGPACK_OK);
+		assert(mp_mpsc_claim(&q, &p) == ERR_MSGPACK_EOF);
+		assert(ftruncate(fd, 0) == 0 && lseek(fd, 0, SEEK_SET) == 0);
+	}
+
+	// an idle producer's open slot holds up neither the flusher nor other producers
+	{
+		mp_mpsc_producer_t idle, busy;
+		rec_t r = { 0, 0 };
+		mp_mpsc_init(&q, slots, NSLOTS, mem, SLOTSIZE);
+		mp_mpsc_producer_init(&idle);
+		mp_mpsc_producer_init(&busy);
+		assert(mp_mpsc_write(&q, &idle, encode_rec, &r) == MSGPACK_OK);
+		size_t one = mp_enc_buffered(&idle.enc);
+		// its finished record goes out without a publish
+		assert(mp_mpsc_drain(&q, fd) == (ssize_t)one);
+		r.id = 1;
+		for (r.seq=0; r.seq<NSLOTS*100; ++r.seq) {
+			int err;
+			while ((err = mp_mpsc_write(&q, &busy, encode_rec, &r)) == ERR_MSGPACK_EOF)
+				assert(mp_mpsc_drain(&q, fd) > 0);
+			assert(err == MSGPACK_OK);
+		}
+		// and it carries on in a fresh slot
+		r.id = 0;
+		r.seq = 1;
+		assert(mp_mpsc_write(&q, &idle, encode_rec, &r) == MSGPACK_OK);
+		mp_mpsc_publish(&q, &busy);
+		while (mp_mpsc_drain(&q, fd) > 0)
+			;
+
+		assert(lseek(fd, 0, SEEK_SET) == 0);
+		mp_decoder_t dec;
+		unsigned char rbuf[512];
+		uint64_t next[2] = { 0 };
+		mp_decode_stream_init(&dec, &fd, fd_fill, rbuf, sizeof(rbuf));
+		for (int i=0; i<2+NSLOTS*100; ++i) {
+			uint32_t sz;
+			uint64_t id, seq;
+			assert(mp_read_arraysize(&dec, &sz) == MSGPACK_OK && sz == 2);
+			assert(mp_read_uint(&dec, &id) == MSGPACK_OK && id < 2);
+			assert(mp_read_uint(&dec, &seq) == MSGPACK_OK && seq == next[id]);
+			next[id]++;
+		}
+		assert(mp_skip(&dec) == ERR_MSGPACK_EOF);
+		assert(ftruncate(fd, 0) == 0 && lseek(fd, 0, SEEK_SET) == 0);
+	}
+
+	mp_mpsc_init(&q, slots, NSLOTS, mem, SLOTSIZE);
+	atomic_init(&running, PRODUCERS);
+	pthread_t th[PRODUCERS];
+	for (int i=0; i<PRODUCERS; ++i)
+		assert(pthread_create(&th[i], NULL, producer, (void*)(uintptr_t)i) == 0);
+
+	// this thread is the flusher
+	for (;;) {
+		bool done = atomic_load(&running) == 0;
+		ssize_t w = mp_mpsc_drain(&q, fd);
+		assert(w >= 0);
+		if (w == 0 && done)
+			break;
+		if (w == 0)
+			sched_yield();
+	}
+	for (int i=0; i<PRODUCERS; ++i)
+		pthread_join(th[i], NULL);
+
+	// every record arrives once, in order per producer
+	assert(lseek(fd, 0, SEEK_SET) == 0);
+	mp_decoder_t dec;
+	unsigned char rbuf[512];
+	uint64_t next[PRODUCERS] = { 0 };
+	mp_decode_stream_init(&dec, &fd, fd_fill, rbuf, sizeof(rbuf));
+	for (int i=0; i<PRODUCERS*RECORDS; ++i) {
+		uint32_t sz;
+		uint64_t id, seq;
+		assert(mp_read_arraysize(&dec, &sz) == MSGPACK_OK && sz == 2);
+		assert(mp_read_uint(&dec, &id) == MSGPACK_OK && id < PRODUCERS);
+		assert(mp_read_uint(&dec, &seq) == MSGPACK_OK);
+		if (seq != next[id]) {
+			printf("FAIL: producer %d: got record %d, want %d\n", (int)id, (int)seq, (int)next[id]);
+			return 1;
+		}
+		next[id]++;
+	}
+	assert(mp_skip(&dec) == ERR_MSGPACK_EOF);
+	close(fd);
+	printf("MPSC tests OK.\n");
+	return 0;
+}
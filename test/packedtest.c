@@ -0,0 +1,286 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "../msgpack_packed.h"
+
+#define MAXN 5000
+#define SINKSIZE (1 << 20)
+
+typedef struct {
+	unsigned char *mem;
+	size_t len;
+	size_t off;
+} sink_t;
+
+static ssize_t sink_flush(void *ctx, const void *buf, size_t amt) {
+	sink_t *s = (sink_t*)ctx;
+	assert(s->len + amt <= SINKSIZE);
+	memcpy(s->mem + s->len, buf, amt);
+	s->len += amt;
+	return (ssize_t)amt;
+}
+
+static ssize_t sink_fill(void *ctx, void *buf, size_t max) {
+	sink_t *s = (sink_t*)ctx;
+	size_t n = s->len - s->off;
+	if (n > max)
+		n = max;
+	// short reads
+	if (n > 37)
+		n = 37;
+	memcpy(buf, s->mem + s->off, n);
+	s->off += n;
+	return (ssize_t)n;
+}
+
+static uint64_t rng = 88172645463325252u;
+
+static uint64_t next_rand(void) {
+	rng ^= rng << 13;
+	rng ^= rng >> 7;
+	rng ^= rng << 17;
+	return rng;
+}
+
+// kinds of series
+enum { STEADY, JITTER, COUNTER, WIDE, EXTREMES, SAWTOOTH, KINDS };
+
+static void make_series(int64_t *v, size_t n, int kind) {
+	int64_t x = 1700000000000;
+	for (size_t i=0; i<n; ++i) {
+		switch (kind) {
+		case STEADY:
+			v[i] = x + (int64_t)i * 10;
+			break;
+		case JITTER:
+			x += 1000 + (int64_t)(next_rand() % 7) - 3;
+			v[i] = x;
+			break;
+		case COUNTER:
+			v[i] = (int64_t)(i * i);
+			break;
+		case WIDE:
+			v[i] = (int64_t)next_rand();
+			break;
+		case EXTREMES:
+			v[i] = (i & 1) ? INT64_MAX : INT64_MIN;
+			break;
+		case SAWTOOTH:
+			v[i] = (int64_t)(i % 100) - 50 - (int64_t)((i / 100) << (i % 40));
+			break;
+		}
+	}
+}
+
+static int check_values(const int64_t *got, const int64_t *want, size_t n, const char *what) {
+	for (size_t i=0; i<n; ++i) {
+		if (got[i] != want[i]) {
+			printf("FAIL: %s: value %d is %lld, not %lld\n", what, (int)i, (long long)got[i], (long long)want[i]);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// reads an array (either kind) in pieces of 'chunk' values
+static int read_series(mp_decoder_t *d, const int64_t *want, uint32_t n, uint32_t chunk) {
+	static int64_t got[MAXN];
+	mp_packed_reader_t p;
+	uint32_t sz;
+	if (mp_read_packed_size(d, &p, &sz) != MSGPACK_OK || sz != n) {
+		printf("FAIL: couldn't read the size of a %d-value array\n", (int)n);
+		return 1;
+	}
+	for (uint32_t i=0; i<n; i+=chunk) {
+		uint32_t k = (n - i < chunk) ? n - i : chunk;
+		if (mp_read_packed(d, &p, got + i, k) != MSGPACK_OK) {
+			printf("FAIL: couldn't read values %d-%d of %d\n", (int)i, (int)(i+k), (int)n);
+			return 1;
+		}
+	}
+	assert(mp_read_packed(d, &p, got, 1) == ERR_MSGPACK_EOF);
+	return check_values(got, want, n, "read_series");
+}
+
+int main(void) {
+	printf("Running packed tests...\n");
+	static int64_t v[MAXN];
+	static unsigned char out[SINKSIZE], out2[SINKSIZE];
+	static const uint32_t lens[] = { 0, 1, 2, 3, 128, 129, 130, 257, 1000, MAXN };
+	mp_encoder_t enc;
+	mp_decoder_t dec;
+
+	// round trips in memory, read in various pieces
+	for (int kind=0; kind<KINDS; ++kind) {
+		for (size_t l=0; l<sizeof(lens)/sizeof(lens[0]); ++l) {
+			uint32_t n = lens[l];
+			make_series(v, n, kind);
+			mp_encode_mem_init(&enc, out, sizeof(out));
+			assert(mp_write_packed(&enc, v, n) == MSGPACK_OK);
+			assert(mp_enc_buffered(&enc) == mp_sizeof_packed(v, n));
+			static const uint32_t chunks[] = { 1, 7, 128, 300, MAXN };
+			for (size_t c=0; c<sizeof(chunks)/sizeof(chunks[0]); ++c) {
+				mp_decode_mem_init(&dec, out, mp_enc_buffered(&enc));
+				if (read_series(&dec, v, n, chunks[c]))
+					return 1;
+				assert(mp_skip(&dec) == ERR_MSGPACK_EOF);
+			}
+			// a plain decoder can skip it
+			mp_decode_mem_init(&dec, out, mp_enc_buffered(&enc));
+			assert(mp_skip(&dec) == MSGPACK_OK && mp_skip(&dec) == ERR_MSGPACK_EOF);
+		}
+	}
+
+	// how small do they get?
+	{
+		make_series(v, MAXN, STEADY);
+		size_t steady = mp_sizeof_packed(v, MAXN);
+		make_series(v, MAXN, JITTER);
+		size_t jitter = mp_sizeof_packed(v, MAXN);
+		make_series(v, MAXN, WIDE);
+		size_t wide = mp_sizeof_packed(v, MAXN);
+		assert(steady < 200);                   // nothing but block headers
+		assert(jitter < MAXN * 3 / 8 + 400);    // 3 bits a value
+		assert(wide < MAXN * 8 + 1000);         // no worse than raw
+	}
+
+	// streams, with buffers smaller than a block
+	{
+		static unsigned char sinkmem[SINKSIZE];
+		unsigned char ebuf[24], dbuf[16];
+		for (int kind=0; kind<KINDS; ++kind) {
+			sink_t s = { sinkmem, 0, 0 };
+			make_series(v, MAXN, kind);
+			mp_encode_stream_init(&enc, &s, sink_flush, ebuf, sizeof(ebuf));
+			assert(mp_write_packed(&enc, v, MAXN) == MSGPACK_OK);
+			assert(mp_write_packed(&enc, v, 300) == MSGPACK_OK);
+			assert(mp_flush(&enc) == MSGPACK_OK);
+			assert(s.len == mp_sizeof_packed(v, MAXN) + mp_sizeof_packed(v, 300));
+			mp_decode_stream_init(&dec, &s, sink_fill, dbuf, sizeof(dbuf));
+			if (read_series(&dec, v, MAXN, 100) || read_series(&dec, v, 300, 300))
+				return 1;
+		}
+	}
+
+	// counting encoders, with blocks bigger than the scratch space
+	{
+		static const size_t caps[] = { 18, 64 };
+		unsigned char scratch[64];
+		for (int kind=0; kind<KINDS; ++kind) {
+			make_series(v, MAXN, kind);
+			for (size_t c=0; c<sizeof(caps)/sizeof(caps[0]); ++c) {
+				mp_encode_count_init(&enc, scratch, caps[c]);
+				assert(mp_write_packed(&enc, v, MAXN) == MSGPACK_OK);
+				assert(mp_write_packed(&enc, v, 300) == MSGPACK_OK);
+				assert(mp_flush(&enc) == MSGPACK_OK);
+				assert(mp_enc_count(&enc) == mp_sizeof_packed(v, MAXN) + mp_sizeof_packed(v, 300));
+			}
+		}
+	}
+
+	// plain arrays read the same way, and packed ones expand to them
+	{
+		make_series(v, 1000, JITTER);
+		mp_encode_mem_init(&enc, out, sizeof(out));
+		assert(mp_write_int_array(&enc, v, 1000) == MSGPACK_OK);
+		size_t plain = mp_enc_buffered(&enc);
+		mp_decode_mem_init(&dec, out, plain);
+		if (read_series(&dec, v, 1000, 33))
+			return 1;
+
+		mp_encode_mem_init(&enc, out, sizeof(out));
+		assert(mp_write_packed(&enc, v, 1000) == MSGPACK_OK);
+		mp_decode_mem_init(&dec, out, mp_enc_buffered(&enc));
+		mp_encoder_t e2;
+		mp_encode_mem_init(&e2, out2, sizeof(out2));
+		assert(mp_packed_expand(&dec, &e2) == MSGPACK_OK);
+		assert(mp_enc_buffered(&e2) == plain);
+		mp_decode_mem_init(&dec, out2, plain);
+		uint32_t sz;
+		assert(mp_read_arraysize(&dec, &sz) == MSGPACK_OK && sz == 1000);
+		for (uint32_t i=0; i<sz; ++i) {
+			int64_t x;
+			assert(mp_read_int(&dec, &x) == MSGPACK_OK && x == v[i]);
+		}
+
+		// a plain array of something else
+		mp_packed_reader_t p;
+		int64_t x;
+		mp_encode_mem_init(&enc, out, sizeof(out));
+		assert(mp_write_arraysize(&enc, 1) == MSGPACK_OK);
+		assert(mp_write_str(&enc, "no", 2) == MSGPACK_OK);
+		mp_decode_mem_init(&dec, out, mp_enc_buffered(&enc));
+		assert(mp_read_packed_size(&dec, &p, &sz) == MSGPACK_OK && sz == 1);
+		assert(mp_read_packed(&dec, &p, &x, 1) == ERR_MSGPACK_BAD_TYPE);
+	}
+
+	// a full encoder buffer
+	{
+		make_series(v, 1000, WIDE);
+		mp_encode_mem_init(&enc, out, 500);
+		assert(mp_write_packed(&enc, v, 1000) == ERR_MSGPACK_EOF);
+		mp_encode_mem_init(&enc, out, 500);
+		assert(mp_write_int_array(&enc, v, 1000) == ERR_MSGPACK_EOF);
+
+		// ... or too small for even one value
+		v[0] = (int64_t)1 << 40;
+		mp_encode_mem_init(&enc, out, 6);
+		assert(mp_write_int_array(&enc, v, 1) == ERR_MSGPACK_EOF);
+		mp_encode_mem_init(&enc, out2, sizeof(out2));
+		assert(mp_write_packed(&enc, v, 1) == MSGPACK_OK);
+		mp_decode_mem_init(&dec, out2, mp_enc_buffered(&enc));
+		mp_encode_mem_init(&enc, out, 6);
+		assert(mp_packed_expand(&dec, &enc) == ERR_MSGPACK_EOF);
+	}
+
+	// corrupt and foreign payloads
+	{
+		mp_packed_reader_t p;
+		uint32_t sz;
+		int64_t got[300];
+		make_series(v, 300, JITTER);
+		mp_encode_mem_init(&enc, out, sizeof(out));
+		assert(mp_write_packed(&enc, v, 300) == MSGPACK_OK);
+		size_t len = mp_enc_buffered(&enc);
+
+		int8_t tg;
+		uint32_t esz;
+		mp_decode_mem_init(&dec, out, len);
+		assert(mp_read_extsize(&dec, &tg, &esz) == MSGPACK_OK && tg == MP_PACKED_EXT);
+		size_t hdr = dec.off;
+
+		// some other ext type (the type is the header's last byte)
+		out[hdr-1] = MP_PACKED_EXT + 1;
+		mp_decode_mem_init(&dec, out, len);
+		assert(mp_read_packed_size(&dec, &p, &sz) == ERR_MSGPACK_BAD_TYPE);
+		out[hdr-1] = MP_PACKED_EXT;
+
+		// a payload with a byte to spare
+		static unsigned char bad[SINKSIZE];
+		mp_encode_mem_init(&enc, bad, sizeof(bad));
+		assert(mp_write_extsize(&enc, MP_PACKED_EXT, esz + 1) == MSGPACK_OK);
+		assert(mp_write(&enc, (const char*)out + hdr, esz) == (ssize_t)esz);
+		assert(mp_write_byte(&enc, 0) == MSGPACK_OK);
+		mp_decode_mem_init(&dec, bad, mp_enc_buffered(&enc));
+		assert(mp_read_packed_size(&dec, &p, &sz) == MSGPACK_OK && sz == 300);
+		assert(mp_read_packed(&dec, &p, got, 300) == ERR_MSGPACK_BAD_TYPE);
+
+		// and one that's a byte short
+		mp_encode_mem_init(&enc, bad, sizeof(bad));
+		assert(mp_write_extsize(&enc, MP_PACKED_EXT, esz - 1) == MSGPACK_OK);
+		assert(mp_write(&enc, (const char*)out + hdr, esz - 1) == (ssize_t)(esz - 1));
+		mp_decode_mem_init(&dec, bad, mp_enc_buffered(&enc));
+		assert(mp_read_packed_size(&dec, &p, &sz) == MSGPACK_OK && sz == 300);
+		assert(mp_read_packed(&dec, &p, got, 300) == ERR_MSGPACK_BAD_TYPE);
+
+		// a width that can't be
+		mp_decode_mem_init(&dec, out, len);
+		assert(mp_read_packed_size(&dec, &p, &sz) == MSGPACK_OK);
+		out[dec.off] = 65;
+		assert(mp_read_packed(&dec, &p, got, 300) == ERR_MSGPACK_BAD_TYPE);
+	}
+
+	printf("Packed tests OK.\n");
+	return 0;
+}
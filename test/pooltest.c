@@ -0,0 +1,197 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <sched.h>
+#include <pthread.h>
+#include "../msgpack_pool.h"
+
+#define THREADS 4
+#define ROUNDS 20000
+#define HELD 8
+
+static mp_pool_t pool;
+static const uint32_t counts[MP_POOL_CLASSES] = { 4*MP_POOL_CACHE, 3*MP_POOL_CACHE, 2, 0 };
+
+/*
+ * each thread keeps a few buffers at a time and
+ * stamps both ends with its id, so a buffer
+ * handed to two threads at once is caught
+ */
+static void *worker(void *arg) {
+	unsigned char id = (unsigned char)(uintptr_t)arg;
+	mp_pool_cache_t c;
+	mp_encoder_t held[HELD];
+	int n = 0;
+	mp_pool_cache_init(&c, &pool);
+	for (int i=0; i<ROUNDS; ++i) {
+		for (int j=0; j<n; ++j)
+			assert(held[j].base[0] == id && held[j].base[held[j].cap-1] == id);
+		if (n == HELD || (n > 0 && (i*7+id) % 3 == 0)) {
+			mp_encoder_t *e = &held[--n];
+			e->base[0] = 0;
+			e->base[e->cap-1] = 0;
+			mp_encoder_release(e, &c);
+			continue;
+		}
+		mp_encoder_t *e = &held[n++];
+		size_t size = (i & 1) ? 4000 : 100;
+		int err;
+		while ((err = mp_encoder_acquire(e, &c, size, NULL, NULL)) == ERR_MSGPACK_EOF)
+			sched_yield();
+		assert(err == MSGPACK_OK && e->cap >= size);
+		e->base[0] = id;
+		e->base[e->cap-1] = id;
+	}
+	while (n > 0)
+		mp_encoder_release(&held[--n], &c);
+	mp_pool_cache_drain(&c);
+	return NULL;
+}
+
+static unsigned char got_foreign[1024];
+
+// a fill callback that reads from memory
+struct src {
+	const unsigned char *p;
+	size_t n;
+};
+
+static ssize_t src_fill(void *ctx, void *buf, size_t max) {
+	struct src *s = ctx;
+	size_t n = s->n < max ? s->n : max;
+	memcpy(buf, s->p, n);
+	s->p += n;
+	s->n -= n;
+	return (ssize_t)n;
+}
+
+// counts the buffers of class 'cls' by taking all of them
+static int count_free(int cls) {
+	static unsigned char *got[1024];
+	mp_pool_cache_t c;
+	unsigned char *b;
+	size_t cap;
+	int n = 0;
+	mp_pool_cache_init(&c, &pool);
+	while (mp_pool_get(&c, MP_POOL_CLASS_SIZE(cls), &b, &cap) == MSGPACK_OK) {
+		assert(cap == MP_POOL_CLASS_SIZE(cls));
+		got[n++] = b;
+	}
+	// no duplicates
+	for (int i=0; i<n; ++i)
+		for (int j=i+1; j<n; ++j)
+			assert(got[i] != got[j]);
+	for (int i=0; i<n; ++i)
+		mp_pool_put(&c, got[i]);
+	mp_pool_cache_drain(&c);
+	return n;
+}
+
+int main(void) {
+	printf("Running pool tests...\n");
+	size_t memsize = mp_pool_memsize(counts);
+	void *mem = aligned_alloc(64, memsize);
+	assert(mem != NULL);
+	assert(mp_pool_init(&pool, mem, memsize-1, counts) == ERR_MSGPACK_EOF);
+	assert(mp_pool_init(&pool, mem, memsize, counts) == MSGPACK_OK);
+
+	// size classes
+	{
+		mp_pool_cache_t c;
+		unsigned char *b;
+		size_t cap;
+		mp_pool_cache_init(&c, &pool);
+		assert(mp_pool_get(&c, 0, &b, &cap) == MSGPACK_OK && cap == 1024);
+		mp_pool_put(&c, b);
+		assert(mp_pool_get(&c, 1025, &b, &cap) == MSGPACK_OK && cap == 4096);
+		mp_pool_put(&c, b);
+		assert(mp_pool_get(&c, 16384, &b, &cap) == MSGPACK_OK && cap == 16384);
+		assert(mp_pool_put(&c, b) == MSGPACK_OK);
+		// not the pool's, or not the start of a buffer
+		assert(mp_pool_put(&c, got_foreign) == ERR_MSGPACK_BAD_TYPE);
+		assert(mp_pool_get(&c, 1, &b, &cap) == MSGPACK_OK);
+		assert(mp_pool_put(&c, b + 1) == ERR_MSGPACK_BAD_TYPE);
+		assert(mp_pool_put(&c, b) == MSGPACK_OK);
+		// there are no 64KB buffers, and nothing bigger
+		assert(mp_pool_get(&c, 65536, &b, &cap) == ERR_MSGPACK_EOF);
+		assert(mp_pool_get(&c, 65537, &b, &cap) == ERR_MSGPACK_EOF);
+		mp_pool_cache_drain(&c);
+	}
+
+	// exhaustion, and buffers released through another cache
+	{
+		mp_pool_cache_t a, b;
+		mp_encoder_t enc[3];
+		mp_pool_cache_init(&a, &pool);
+		mp_pool_cache_init(&b, &pool);
+		assert(mp_encoder_acquire(&enc[0], &a, 10000, NULL, NULL) == MSGPACK_OK);
+		assert(mp_encoder_acquire(&enc[1], &a, 10000, NULL, NULL) == MSGPACK_OK);
+		assert(enc[0].base != enc[1].base);
+		assert(mp_encoder_acquire(&enc[2], &b, 10000, NULL, NULL) == ERR_MSGPACK_EOF);
+		assert(mp_write_str(&enc[0], "hello", 5) == MSGPACK_OK);
+		assert(mp_enc_buffered(&enc[0]) == 6);
+		mp_encoder_release(&enc[0], &b);
+		mp_pool_cache_drain(&b);
+		assert(mp_encoder_acquire(&enc[2], &a, 10000, NULL, NULL) == MSGPACK_OK);
+		mp_encoder_release(&enc[1], &a);
+		mp_encoder_release(&enc[2], &a);
+		mp_pool_cache_drain(&a);
+		assert(count_free(2) == 2);
+	}
+
+	// decoders
+	{
+		mp_pool_cache_t c;
+		mp_decoder_t dec;
+		uint32_t sz;
+		mp_pool_cache_init(&c, &pool);
+		struct src in = { (const unsigned char *)"\xa5hello", 6 };
+		assert(mp_decoder_acquire(&dec, &c, 512, NULL, NULL) == ERR_MSGPACK_BAD_TYPE);
+		assert(mp_decoder_acquire(&dec, &c, 512, &in, src_fill) == MSGPACK_OK);
+		assert(mp_read_strsize(&dec, &sz) == MSGPACK_OK && sz == 5);
+		assert(mp_decoder_release(&dec, &c) == MSGPACK_OK);
+		mp_pool_cache_drain(&c);
+	}
+
+	// a cache spills when it fills, so another can refill
+	{
+		mp_pool_cache_t a, b;
+		static unsigned char *got[4*MP_POOL_CACHE];
+		unsigned char *buf;
+		size_t cap;
+		mp_pool_cache_init(&a, &pool);
+		mp_pool_cache_init(&b, &pool);
+		for (int i=0; i<4*MP_POOL_CACHE; ++i)
+			assert(mp_pool_get(&a, 1, &got[i], &cap) == MSGPACK_OK);
+		assert(mp_pool_get(&b, 1, &buf, &cap) == ERR_MSGPACK_EOF);
+		for (int i=0; i<4*MP_POOL_CACHE; ++i)
+			mp_pool_put(&a, got[i]);
+		assert(a.n[0] <= MP_POOL_CACHE);
+		for (int i=0; i<3*MP_POOL_CACHE; ++i)
+			assert(mp_pool_get(&b, 1, &got[i], &cap) == MSGPACK_OK);
+		for (int i=0; i<3*MP_POOL_CACHE; ++i)
+			mp_pool_put(&b, got[i]);
+		mp_pool_cache_drain(&a);
+		mp_pool_cache_drain(&b);
+	}
+
+	pthread_t th[THREADS];
+	for (int i=0; i<THREADS; ++i)
+		assert(pthread_create(&th[i], NULL, worker, (void*)(uintptr_t)(i+1)) == 0);
+	for (int i=0; i<THREADS; ++i)
+		pthread_join(th[i], NULL);
+
+	// nothing leaked
+	for (int i=0; i<MP_POOL_CLASSES; ++i) {
+		int n = count_free(i);
+		if (n != (int)counts[i]) {
+			printf("FAIL: class %d: %d buffers free, want %d\n", i, n, (int)counts[i]);
+			return 1;
+		}
+	}
+	free(mem);
+	printf("Pool tests OK.\n");
+	return 0;
+}
@@ -0,0 +1,138 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "../msgpack_shm.h"
+
+#define RECORDS 100000
+
+static const char *names[] = { "a", "bb", "a somewhat longer string", "" };
+
+/*
+ * the writer sends [i, names[i%4]] for every i,
+ * every third record straight into the ring
+ */
+static int writer(mp_shm_t *s) {
+	unsigned char buf[1024];
+	mp_encoder_t enc;
+	mp_encode_stream_init(&enc, s, mp_shm_flush, buf, sizeof(buf));
+	for (uint64_t i=0; i<RECORDS; ++i) {
+		const char *n = names[i%4];
+		mp_encoder_t *e = &enc;
+		mp_encoder_t zc;
+		if (i % 3 == 0) {
+			// whatever is buffered has to go first
+			assert(mp_flush(&enc) == MSGPACK_OK);
+			assert(mp_shm_encoder_begin(s, &zc, MP_MAXSIZE_HDR*3 + strlen(n)) == MSGPACK_OK);
+			e = &zc;
+		}
+		assert(mp_write_arraysize(e, 2) == MSGPACK_OK);
+		assert(mp_write_uint(e, i) == MSGPACK_OK);
+		assert(mp_write_str(e, n, (uint32_t)strlen(n)) == MSGPACK_OK);
+		if (e == &zc)
+			mp_shm_encoder_commit(s, &zc);
+	}
+	assert(mp_flush(&enc) == MSGPACK_OK);
+	mp_shm_close_write(s);
+	return 0;
+}
+
+// mp_read may come up short at a buffer boundary
+static bool read_full(mp_decoder_t *d, char *buf, uint32_t sz) {
+	while (sz > 0) {
+		ssize_t n = mp_read(d, buf, sz);
+		if (n <= 0)
+			return false;
+		buf += n;
+		sz -= (uint32_t)n;
+	}
+	return true;
+}
+
+static int reader(mp_shm_t *s) {
+	unsigned char buf[700];
+	char str[64];
+	mp_decoder_t dec;
+	mp_decode_stream_init(&dec, s, mp_shm_fill, buf, sizeof(buf));
+	for (uint64_t i=0; i<RECORDS; ++i) {
+		uint32_t sz;
+		uint64_t v;
+		if (mp_read_arraysize(&dec, &sz) != MSGPACK_OK || sz != 2 ||
+		    mp_read_uint(&dec, &v) != MSGPACK_OK || v != i) {
+			printf("FAIL: bad record %d\n", (int)i);
+			return 1;
+		}
+		if (mp_read_strsize(&dec, &sz) != MSGPACK_OK || sz != strlen(names[i%4]) ||
+		    !read_full(&dec, str, sz) || memcmp(str, names[i%4], sz) != 0) {
+			printf("FAIL: bad string in record %d\n", (int)i);
+			return 1;
+		}
+	}
+	if (mp_skip(&dec) != ERR_MSGPACK_EOF) {
+		printf("FAIL: expected EOF\n");
+		return 1;
+	}
+	return 0;
+}
+
+int main(void) {
+	printf("Running shm tests...\n");
+	mp_shm_t s;
+
+	// the smallest ring, so it wraps (and fills) often
+	assert(mp_shm_create(&s, 1) == MSGPACK_OK);
+	assert(s.cap == (size_t)sysconf(_SC_PAGESIZE));
+
+	// the ring is mapped twice, back to back
+	s.data[0] = 'x';
+	assert(s.data[s.cap] == 'x');
+	mp_encoder_t e;
+	assert(mp_shm_encoder_begin(&s, &e, s.cap+1) == ERR_MSGPACK_EOF);
+
+	// a ring that isn't a power of two (or whole pages) in size
+	{
+		size_t pg = s.cap;
+		const size_t sizes[] = { pg, pg + 3*pg, pg + pg + pg/2, pg + pg/2 }; // header page + ring
+		mp_shm_t r;
+		for (size_t i=0; i<sizeof(sizes)/sizeof(sizes[0]); ++i) {
+			int bad = memfd_create("shmtest", MFD_CLOEXEC);
+			assert(bad >= 0 && ftruncate(bad, (off_t)sizes[i]) == 0);
+			errno = 0;
+			assert(mp_shm_open(&r, bad) == ERR_MSGPACK_CHECK_ERRNO && errno == EINVAL);
+			close(bad);
+		}
+	}
+
+	int fd = dup(s.fd);
+	assert(fd >= 0);
+	fflush(stdout);
+	pid_t pid = fork();
+	assert(pid >= 0);
+	if (pid == 0) {
+		// the child maps the ring for itself
+		mp_shm_t r;
+		mp_shm_close(&s);
+		assert(mp_shm_open(&r, fd) == MSGPACK_OK);
+		assert(r.cap == s.cap);
+		int ret = reader(&r);
+		mp_shm_close(&r);
+		fflush(stdout);
+		_exit(ret);
+	}
+	close(fd);
+	writer(&s);
+	int status;
+	assert(waitpid(pid, &status, 0) == pid);
+	mp_shm_close(&s);
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		printf("FAIL: reader exited with status %d\n", status);
+		return 1;
+	}
+	printf("Shm tests OK.\n");
+	return 0;
+}
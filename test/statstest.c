@@ -0,0 +1,116 @@
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+#include <errno.h>
+#include "../msgpack.h"
+
+/* built with -DMSGPACK_STATS */
+
+#define BUFSIZE 4096
+
+typedef struct {
+	unsigned char mem[BUFSIZE];
+	size_t woff;
+	size_t roff;
+	size_t limit; // refuse writes past this offset
+} sink_t;
+
+static ssize_t sink_flush(void *ctx, const void *buf, size_t amt) {
+	sink_t *s = (sink_t*)ctx;
+	if (s->woff >= s->limit) {
+		errno = ENOSPC;
+		return -1;
+	}
+	if (amt > s->limit - s->woff)
+		amt = s->limit - s->woff;
+	memcpy(s->mem + s->woff, buf, amt);
+	s->woff += amt;
+	return (ssize_t)amt;
+}
+
+// hands out at most 3 bytes at a time
+static ssize_t sink_fill(void *ctx, void *buf, size_t max) {
+	sink_t *s = (sink_t*)ctx;
+	size_t amt = s->woff - s->roff;
+	if (amt > 3) amt = 3;
+	if (amt > max) amt = max;
+	memcpy(buf, s->mem + s->roff, amt);
+	s->roff += amt;
+	return (ssize_t)amt;
+}
+
+int main(void) {
+	printf("Running stats tests...\n");
+	sink_t sink;
+	mp_encoder_t enc;
+	mp_decoder_t dec;
+	mp_enc_stats_t es;
+	mp_dec_stats_t ds;
+	unsigned char ebuf[18];
+	unsigned char dbuf[18];
+	char big[64];
+
+	memset(&sink, 0, sizeof(sink));
+	memset(big, 'x', sizeof(big));
+	sink.limit = BUFSIZE;
+
+	mp_encode_stream_init(&enc, &sink, sink_flush, ebuf, sizeof(ebuf));
+	mp_enc_stats(&enc, &es);
+	assert(es.flushes == 0 && es.flush_bytes == 0);
+
+	// [[[1]], "xxx...x"]: the 1 is four levels deep, and the str is a bypass write
+	assert(mp_write_arraysize(&enc, 2) == MSGPACK_OK);
+	assert(mp_write_arraysize(&enc, 1) == MSGPACK_OK);
+	assert(mp_write_arraysize(&enc, 1) == MSGPACK_OK);
+	assert(mp_write_int(&enc, 1) == MSGPACK_OK);
+	assert(mp_write_str(&enc, big, sizeof(big)) == MSGPACK_OK);
+	assert(mp_flush(&enc) == MSGPACK_OK);
+	mp_enc_stats(&enc, &es);
+	assert(es.bypass_writes == 1);
+	assert(es.flushes >= 1);
+	assert(es.flush_bytes + sizeof(big) == sink.woff);
+	assert(es.partial_writes == 0);
+
+	// only part of the next flush fits in the sink
+	sink.limit = sink.woff + 2;
+	assert(mp_write_double(&enc, 3.14) == MSGPACK_OK);
+	assert(mp_flush(&enc) == ERR_MSGPACK_CHECK_ERRNO);
+	assert(mp_enc_buffered(&enc) == 7);
+	mp_enc_stats(&enc, &es);
+	assert(es.partial_writes == 1);
+
+	mp_decode_stream_init(&dec, &sink, sink_fill, dbuf, sizeof(dbuf));
+	assert(mp_read_nil(&dec) == ERR_MSGPACK_BAD_TYPE);
+	assert(mp_skip(&dec) == MSGPACK_OK);
+	mp_dec_stats(&dec, &ds);
+	assert(ds.type_mismatches == 1);
+	assert(ds.max_skip_depth == 4);
+	assert(ds.fill_bytes == sink.roff);
+	assert(ds.fills >= ds.fill_bytes / 3);
+	assert(ds.short_reads == ds.fills);
+
+	// aggregation
+	mp_dec_stats_t sum;
+	memset(&sum, 0, sizeof(sum));
+	mp_dec_stats_add(&sum, &ds);
+	mp_dec_stats_add(&sum, &ds);
+	assert(sum.fills == 2 * ds.fills);
+	assert(sum.max_skip_depth == 4);
+
+	mp_dec_stats_publish(&dec);
+	mp_enc_stats_publish(&enc);
+	mp_dec_stats(&dec, &sum);
+	assert(sum.fills == 0);
+
+	mp_dec_stats_t gd;
+	mp_enc_stats_t ge;
+	mp_dec_stats_global(&gd);
+	mp_enc_stats_global(&ge);
+	assert(gd.fills == ds.fills);
+	assert(gd.max_skip_depth == 4);
+	assert(ge.bypass_writes == 1);
+	assert(ge.partial_writes == 1);
+
+	printf("Stats tests OK.\n");
+	return 0;
+}
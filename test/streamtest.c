@@ -105,6 +105,109 @@ int main(void) {
 		failed = true;
 	}
 
+	/* walk the same object, with payloads passed in place */
+	{
+		mp_visitor_t vis;
+		memset(&vis, 0, sizeof(vis));
+		buf.roff = 0;
+		mp_decode_stream_init(&dec, &buf, buf_fill, stack, 18);
+		err = mp_walk(&dec, &vis, NULL);
+		if (err) {
+			printf("ERROR: mp_walk: %s\n", mp_strerror(err));
+			failed = true;
+		}
+	}
+
+	/* 
+	 * read more than the decoder's capacity
+	 * through typed reads (not mp_skip)
+	 */
+	buf_destroy(&buf);
+	buf_init(&buf, 256);
+	mp_encode_stream_init(&enc, &buf, buf_flush, stack, 18);
+	for (int i=0; i<64; ++i)
+		assert(mp_write_int(&enc, -5000000000 - i) == MSGPACK_OK);
+	mp_flush(&enc);
+
+	mp_decode_stream_init(&dec, &buf, buf_fill, stack, 18);
+	for (int i=0; i<64; ++i) {
+		int64_t v;
+		err = mp_read_int(&dec, &v);
+		if (err || v != -5000000000 - i) {
+			printf("ERROR: mp_read_int (value %d): %s\n", i, mp_strerror(err));
+			failed = true;
+			break;
+		}
+	}
+
+	/* dynamic reads straddling fills */
+	mp_decode_stream_init(&dec, &buf, buf_fill, stack, 18);
+	buf.roff = 0; // re-read the ints above
+	int64_t first;
+	assert(mp_read_int(&dec, &first) == MSGPACK_OK); // misalign the buffer
+	for (int i=1; i<64; ++i) {
+		mp_value_t v;
+		err = mp_read_any(&dec, &v);
+		if (err || v.type != MSG_INT || v.v.i != -5000000000 - i) {
+			printf("ERROR: mp_read_any (value %d): %s\n", i, mp_strerror(err));
+			failed = true;
+			break;
+		}
+	}
+
+	/* aggregation runs split across fills */
+	buf_destroy(&buf);
+	buf_init(&buf, 1024);
+	mp_encode_stream_init(&enc, &buf, buf_flush, stack, 18);
+	assert(mp_write_arraysize(&enc, 120) == MSGPACK_OK);
+	for (int i=0; i<40; ++i)
+		assert(mp_write_int(&enc, i - 20) == MSGPACK_OK);
+	for (int i=0; i<40; ++i)
+		assert(mp_write_double(&enc, 0.5) == MSGPACK_OK);
+	for (int i=0; i<40; ++i)
+		assert(mp_write_int(&enc, 70000) == MSGPACK_OK);
+	mp_flush(&enc);
+	mp_decode_stream_init(&dec, &buf, buf_fill, stack, 18);
+	{
+		mp_agg_t agg;
+		mp_agg_init(&agg);
+		err = mp_array_agg(&dec, &agg);
+		if (err || agg.count != 120 || agg.sum != -20 + 20 + 40*70000 || agg.min != -20 || agg.max != 70000) {
+			printf("ERROR: mp_array_agg: %s (count %llu, sum %g)\n", mp_strerror(err),
+				(unsigned long long)agg.count, agg.sum);
+			failed = true;
+		}
+	}
+
+	/* unchecked reads straddling fills */
+	buf_destroy(&buf);
+	buf_init(&buf, 256);
+	mp_encode_stream_init(&enc, &buf, buf_flush, stack, 18);
+	for (int i=0; i<16; ++i)
+		assert(mp_write_double(&enc, (double)i) == MSGPACK_OK);
+	mp_flush(&enc);
+
+	mp_decode_stream_init(&dec, &buf, buf_fill, stack, 18);
+	assert(mp_skip(&dec) == MSGPACK_OK); // misalign the buffer
+	for (int i=1; i<15; i += 2) {
+		const unsigned char *p;
+		double a, b;
+		assert(mp_ensure(&dec, 18, &p) == MSGPACK_OK);
+		assert((p = mp_get_double(p, &a)) != NULL);
+		assert((p = mp_get_double(p, &b)) != NULL);
+		mp_consume(&dec, p);
+		if (a != (double)i || b != (double)(i+1)) {
+			printf("ERROR: mp_get_double: got %g, %g\n", a, b);
+			failed = true;
+		}
+	}
+	{
+		const unsigned char *p;
+		assert(mp_ensure(&dec, 19, &p) == ERR_MSGPACK_EOF);
+		assert(mp_ensure(&dec, 18, &p) == ERR_MSGPACK_EOF);
+		assert(mp_ensure(&dec, 9, &p) == MSGPACK_OK);
+	}
+
 	buf_destroy(&buf);
 	if (failed) return 1;
 	printf("Stream tests OK.\n");
@@ -0,0 +1,138 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "../msgpack_uring.h"
+
+#define RECORDS 50000
+
+#define BIGBUF (1 << 20)
+
+static unsigned char stage[MP_URING_BUFS*BIGBUF];
+
+static void write_records(mp_uring_t *u, int fd, bool ring) {
+	unsigned char buf[4096];
+	mp_encoder_t enc;
+	assert(mp_uring_writer_init(u, fd, 0, stage, 4096) == MSGPACK_OK);
+	if (!ring)
+		mp_uring_close(u); // leaves it on pwrite
+	mp_encode_stream_init(&enc, u, mp_uring_flush, buf, sizeof(buf));
+	for (uint64_t i=0; i<RECORDS; ++i) {
+		assert(mp_write_arraysize(&enc, 2) == MSGPACK_OK);
+		assert(mp_write_uint(&enc, i) == MSGPACK_OK);
+		assert(mp_write_str(&enc, "some record", 11) == MSGPACK_OK);
+	}
+	assert(mp_flush(&enc) == MSGPACK_OK);
+	assert(mp_uring_finish(u) == MSGPACK_OK);
+	assert(mp_uring_close(u) == MSGPACK_OK);
+}
+
+// mp_read may come up short at a buffer boundary
+static bool read_full(mp_decoder_t *d, char *buf, uint32_t sz) {
+	while (sz > 0) {
+		ssize_t n = mp_read(d, buf, sz);
+		if (n <= 0)
+			return false;
+		buf += n;
+		sz -= (uint32_t)n;
+	}
+	return true;
+}
+
+static int read_records(mp_uring_t *u, int fd, size_t bufsize, bool ring) {
+	unsigned char buf[700];
+	mp_decoder_t dec;
+	assert(mp_uring_reader_init(u, fd, 0, stage, bufsize) == MSGPACK_OK);
+	if (!ring)
+		mp_uring_close(u); // leaves it on pread
+	mp_decode_stream_init(&dec, u, mp_uring_fill, buf, sizeof(buf));
+	for (uint64_t i=0; i<RECORDS; ++i) {
+		char str[16];
+		uint32_t sz;
+		uint64_t v;
+		if (mp_read_arraysize(&dec, &sz) != MSGPACK_OK || sz != 2 ||
+		    mp_read_uint(&dec, &v) != MSGPACK_OK || v != i ||
+		    mp_read_strsize(&dec, &sz) != MSGPACK_OK || sz != 11 ||
+		    !read_full(&dec, str, sz) || memcmp(str, "some record", sz) != 0) {
+			printf("FAIL: bad record %d (bufsize %d, ring %d)\n", (int)i, (int)bufsize, ring);
+			return 1;
+		}
+	}
+	if (mp_skip(&dec) != ERR_MSGPACK_EOF) {
+		printf("FAIL: expected EOF (bufsize %d)\n", (int)bufsize);
+		return 1;
+	}
+	mp_uring_close(u);
+	return 0;
+}
+
+int main(void) {
+	printf("Running uring tests...\n");
+	char path[] = "/tmp/msgc-uringtest-XXXXXX";
+	int fd = mkstemp(path);
+	assert(fd >= 0);
+	unlink(path);
+	mp_uring_t u;
+
+	// an empty file is EOF straight away
+	{
+		unsigned char buf[16];
+		assert(mp_uring_reader_init(&u, fd, 0, stage, 4096) == MSGPACK_OK);
+		assert(mp_uring_fill(&u, buf, sizeof(buf)) == 0);
+		assert(mp_uring_fill(&u, buf, sizeof(buf)) == 0);
+		mp_uring_close(&u);
+	}
+
+	write_records(&u, fd, true);
+	off_t size = lseek(fd, 0, SEEK_END);
+	assert(size > 4096*MP_URING_BUFS && size < BIGBUF);
+	if (read_records(&u, fd, 4096, true) ||
+	    read_records(&u, fd, 1000, true) ||
+	    read_records(&u, fd, BIGBUF, true) ||
+	    read_records(&u, fd, 4096, false))
+		return 1;
+
+	// the fallback writes the same bytes
+	{
+		unsigned char *a = malloc((size_t)size), *b = malloc((size_t)size);
+		assert(a != NULL && b != NULL);
+		assert(pread(fd, a, (size_t)size, 0) == size);
+		assert(ftruncate(fd, 0) == 0);
+		write_records(&u, fd, false);
+		assert(lseek(fd, 0, SEEK_END) == size);
+		assert(pread(fd, b, (size_t)size, 0) == size);
+		assert(memcmp(a, b, (size_t)size) == 0);
+		free(a);
+		free(b);
+	}
+	// a failed write is reported by close
+	{
+		char ro[sizeof(path)];
+		unsigned char buf[16] = { 0xc0 };
+		memcpy(ro, "/tmp/msgc-uringtest-XXXXXX", sizeof(ro));
+		int wfd = mkstemp(ro);
+		assert(wfd >= 0);
+		int rfd = open(ro, O_RDONLY);
+		assert(rfd >= 0);
+		unlink(ro);
+		close(wfd);
+		assert(mp_uring_writer_init(&u, rfd, 0, stage, 4096) == MSGPACK_OK);
+		errno = 0;
+		if (u.ring >= 0) {
+			assert(mp_uring_flush(&u, buf, sizeof(buf)) == sizeof(buf));
+			assert(mp_uring_close(&u) == ERR_MSGPACK_CHECK_ERRNO && errno == EBADF);
+		} else {
+			assert(mp_uring_flush(&u, buf, sizeof(buf)) < 0 && errno == EBADF);
+			assert(mp_uring_close(&u) == MSGPACK_OK);
+		}
+		close(rfd);
+	}
+
+	close(fd);
+	printf("Uring tests OK.\n");
+	return 0;
+}
@@ -0,0 +1,185 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "../msgpack_z.h"
+
+#define RECORDS 20000
+#define ENCBUF 4096
+#define SINKSIZE (4 << 20)
+
+// an in-memory file
+typedef struct {
+	unsigned char *mem;
+	size_t len;
+	size_t off;
+} sink_t;
+
+static ssize_t sink_flush(void *ctx, const void *buf, size_t amt) {
+	sink_t *s = (sink_t*)ctx;
+	// short writes, so frames go out in pieces
+	if (amt > 1000)
+		amt = 1000;
+	assert(s->len + amt <= SINKSIZE);
+	memcpy(s->mem + s->len, buf, amt);
+	s->len += amt;
+	return (ssize_t)amt;
+}
+
+static ssize_t sink_fill(void *ctx, void *buf, size_t max) {
+	sink_t *s = (sink_t*)ctx;
+	size_t n = s->len - s->off;
+	if (n > max)
+		n = max;
+	// short reads, too
+	if (n > 777)
+		n = 777;
+	memcpy(buf, s->mem + s->off, n);
+	s->off += n;
+	return (ssize_t)n;
+}
+
+static void write_records(sink_t *s, mp_z_codec_t codec) {
+	static unsigned char scratch[MP_Z_BOUND(ENCBUF)];
+	static mp_z_writer_t zw;
+	unsigned char buf[ENCBUF];
+	mp_encoder_t enc;
+	s->len = s->off = 0;
+	assert(mp_z_writer_init(&zw, codec, s, sink_flush, scratch, sizeof(scratch)) == MSGPACK_OK);
+	mp_encode_stream_init(&enc, &zw, mp_z_flush, buf, sizeof(buf));
+	for (uint64_t i=0; i<RECORDS; ++i) {
+		char msg[32];
+		int n = snprintf(msg, sizeof(msg), "request %d handled", (int)(i % 1000));
+		assert(mp_write_mapsize(&enc, 2) == MSGPACK_OK);
+		assert(mp_write_str(&enc, "seq", 3) == MSGPACK_OK);
+		assert(mp_write_uint(&enc, i) == MSGPACK_OK);
+		assert(mp_write_str(&enc, "msg", 3) == MSGPACK_OK);
+		assert(mp_write_str(&enc, msg, (uint32_t)n) == MSGPACK_OK);
+	}
+	assert(mp_flush(&enc) == MSGPACK_OK);
+}
+
+static int read_records(sink_t *s, size_t decbuf) {
+	static unsigned char mem[MP_Z_READER_MEM(ENCBUF)];
+	static unsigned char buf[2*ENCBUF];
+	mp_z_reader_t zr;
+	mp_decoder_t dec;
+	s->off = 0;
+	mp_z_reader_init(&zr, s, sink_fill, mem, ENCBUF);
+	mp_decode_stream_init(&dec, &zr, mp_z_fill, buf, decbuf);
+	for (uint64_t i=0; i<RECORDS; ++i) {
+		uint32_t sz;
+		uint64_t v;
+		if (mp_read_mapsize(&dec, &sz) != MSGPACK_OK || sz != 2 || mp_skip(&dec) != MSGPACK_OK ||
+		    mp_read_uint(&dec, &v) != MSGPACK_OK || v != i ||
+		    mp_skip(&dec) != MSGPACK_OK || mp_skip(&dec) != MSGPACK_OK) {
+			printf("FAIL: bad record %d (decoder buffer %d)\n", (int)i, (int)decbuf);
+			return 1;
+		}
+	}
+	if (mp_skip(&dec) != ERR_MSGPACK_EOF) {
+		printf("FAIL: expected EOF\n");
+		return 1;
+	}
+	return 0;
+}
+
+// decodes every frame on its own, as a parallel reader would
+static size_t count_frames(sink_t *s, size_t *raw) {
+	static unsigned char out[ENCBUF];
+	size_t off = 0, n = 0;
+	*raw = 0;
+	while (off < s->len) {
+		size_t used, len;
+		assert(mp_z_decode_frame(s->mem + off, s->len - off, out, sizeof(out), &used, &len) == MSGPACK_OK);
+		assert(len <= ENCBUF);
+		off += used;
+		*raw += len;
+		++n;
+	}
+	return n;
+}
+
+int main(void) {
+	printf("Running compression tests...\n");
+	sink_t s;
+	s.mem = malloc(SINKSIZE);
+	assert(s.mem != NULL);
+
+	static const mp_z_codec_t codecs[] = {
+		MP_Z_STORED, MP_Z_LZ,
+#ifdef MSGPACK_ZLIB
+		MP_Z_ZLIB,
+#endif
+#ifdef MSGPACK_ZSTD
+		MP_Z_ZSTD,
+#endif
+	};
+	for (size_t c=0; c<sizeof(codecs)/sizeof(codecs[0]); ++c) {
+		write_records(&s, codecs[c]);
+		size_t raw;
+		size_t frames = count_frames(&s, &raw);
+		// one flush is one frame
+		assert(frames == (raw + ENCBUF - 1) / ENCBUF);
+		if (codecs[c] != MP_Z_STORED)
+			assert(s.len < raw / 2);
+		// big enough to decompress in place, and not
+		if (read_records(&s, 2*ENCBUF) || read_records(&s, 1000))
+			return 1;
+	}
+
+	// codecs that aren't built in
+	{
+		static unsigned char scratch[MP_Z_BOUND(64)];
+		mp_z_writer_t zw;
+		assert(mp_z_writer_init(&zw, (mp_z_codec_t)4, &s, sink_flush, scratch, sizeof(scratch)) == ERR_MSGPACK_BAD_TYPE);
+#ifndef MSGPACK_ZLIB
+		assert(mp_z_writer_init(&zw, MP_Z_ZLIB, &s, sink_flush, scratch, sizeof(scratch)) == ERR_MSGPACK_BAD_TYPE);
+#endif
+#ifndef MSGPACK_ZSTD
+		assert(mp_z_writer_init(&zw, MP_Z_ZSTD, &s, sink_flush, scratch, sizeof(scratch)) == ERR_MSGPACK_BAD_TYPE);
+#endif
+	}
+
+	// data that doesn't compress is stored
+	{
+		static unsigned char scratch[MP_Z_BOUND(ENCBUF)];
+		static unsigned char noise[ENCBUF], out[ENCBUF];
+		mp_z_writer_t zw;
+		size_t used, len;
+		srand(7);
+		for (size_t i=0; i<sizeof(noise); ++i)
+			noise[i] = (unsigned char)rand();
+		s.len = 0;
+		assert(mp_z_writer_init(&zw, MP_Z_LZ, &s, sink_flush, scratch, sizeof(scratch)) == MSGPACK_OK);
+		assert(mp_z_flush(&zw, noise, sizeof(noise)) == (ssize_t)sizeof(noise));
+		assert(s.mem[0] == MP_Z_STORED && s.len == MP_Z_HDR + sizeof(noise));
+		assert(mp_z_decode_frame(s.mem, s.len, out, sizeof(out), &used, &len) == MSGPACK_OK);
+		assert(used == s.len && len == sizeof(noise) && memcmp(out, noise, len) == 0);
+		assert(mp_z_decode_frame(s.mem, s.len - 1, out, sizeof(out), &used, &len) == ERR_MSGPACK_EOF);
+		assert(mp_z_decode_frame(s.mem, s.len, out, sizeof(out) - 1, &used, &len) == ERR_MSGPACK_EOF);
+	}
+
+	// corrupt frames are rejected, never overrun
+	{
+		static unsigned char frame[MP_Z_BOUND(ENCBUF)], out[ENCBUF];
+		write_records(&s, MP_Z_LZ);
+		size_t used, len, flen;
+		assert(mp_z_decode_frame(s.mem, s.len, out, sizeof(out), &flen, &len) == MSGPACK_OK);
+		assert(s.mem[0] == MP_Z_LZ);
+		srand(11);
+		for (int i=0; i<20000; ++i) {
+			memcpy(frame, s.mem, flen);
+			for (int j=0; j<1 + i%4; ++j)
+				frame[MP_Z_HDR + (size_t)rand() % (flen - MP_Z_HDR)] ^= (unsigned char)(1 + rand() % 255);
+			int r = mp_z_decode_frame(frame, flen, out, sizeof(out), &used, &len);
+			assert(r == MSGPACK_OK || r == ERR_MSGPACK_BAD_TYPE);
+		}
+		frame[0] = 9;
+		assert(mp_z_decode_frame(frame, flen, out, sizeof(out), &used, &len) == ERR_MSGPACK_BAD_TYPE);
+	}
+
+	free(s.mem);
+	printf("Compression tests OK.\n");
+	return 0;
+}